@@ -0,0 +1,385 @@
+/**
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "ffmv_accum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FFMV_ACCUM_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__arm__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+void ffmv_accum_scalar(uint16_t *dst, const uint16_t *src, size_t n)
+{
+    size_t i;
+    uint32_t val;
+
+    for (i = 0; i < n; ++i) {
+        val = (uint32_t) dst[i] + ntohs(src[i]);
+        dst[i] = val > 0xFFFF ? 0xFFFF : val;
+    }
+}
+
+void ffmv_accum8_scalar(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t i;
+    uint32_t val;
+
+    for (i = 0; i < n; ++i) {
+        val = (uint32_t) dst[i] + src[i];
+        dst[i] = val > 0xFF ? 0xFF : val;
+    }
+}
+
+#ifdef FFMV_ACCUM_X86
+__attribute__((target("sse2")))
+static void ffmv_accum_sse2(uint16_t *dst, const uint16_t *src, size_t n)
+{
+    size_t i;
+    __m128i s, d;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        s = _mm_loadu_si128((const __m128i *) (src + i));
+        /* Byte swap each 16 bit lane */
+        s = _mm_or_si128(_mm_slli_epi16(s, 8), _mm_srli_epi16(s, 8));
+        d = _mm_loadu_si128((const __m128i *) (dst + i));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_adds_epu16(d, s));
+    }
+    ffmv_accum_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void ffmv_accum8_sse2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t i;
+    __m128i s, d;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        s = _mm_loadu_si128((const __m128i *) (src + i));
+        d = _mm_loadu_si128((const __m128i *) (dst + i));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_adds_epu8(d, s));
+    }
+    ffmv_accum8_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void ffmv_accum_avx2(uint16_t *dst, const uint16_t *src, size_t n)
+{
+    size_t i;
+    __m256i s, d;
+    const __m256i swap = _mm256_setr_epi8(
+            1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+            1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        s = _mm256_loadu_si256((const __m256i *) (src + i));
+        s = _mm256_shuffle_epi8(s, swap);
+        d = _mm256_loadu_si256((const __m256i *) (dst + i));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_adds_epu16(d, s));
+    }
+    ffmv_accum_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void ffmv_accum8_avx2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t i;
+    __m256i s, d;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        s = _mm256_loadu_si256((const __m256i *) (src + i));
+        d = _mm256_loadu_si256((const __m256i *) (dst + i));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_adds_epu8(d, s));
+    }
+    ffmv_accum8_scalar(dst + i, src + i, n - i);
+}
+#endif
+
+/**
+ * Load one source row and add each group of BX pixels into rowsum.
+ * Both the pixel format and BX are template parameters, so the inner loop is
+ * specialized and unrolled for each combination.
+ */
+template <class Pixel, int BX>
+static void ffmv_bin_row(uint32_t *rowsum, const typename Pixel::sample *src, int out_w)
+{
+    int x, k;
+    uint32_t sum;
+
+    for (x = 0; x < out_w; ++x) {
+        sum = 0;
+        for (k = 0; k < BX; ++k) {
+            sum += Pixel::load(src[x * BX + k]);
+        }
+        rowsum[x] += sum;
+    }
+}
+
+template <class Pixel>
+static void ffmv_bin_row_n(uint32_t *rowsum, const typename Pixel::sample *src, int out_w, int binx)
+{
+    int x, k;
+    uint32_t sum;
+
+    for (x = 0; x < out_w; ++x) {
+        sum = 0;
+        for (k = 0; k < binx; ++k) {
+            sum += Pixel::load(src[x * binx + k]);
+        }
+        rowsum[x] += sum;
+    }
+}
+
+/**
+ * Sum the source rows that make up binned row y into rowsum.
+ */
+template <class Pixel>
+static void ffmv_bin_rows(uint32_t *rowsum, const typename Pixel::sample *src, int width,
+        int y, int binx, int biny)
+{
+    int out_w = width / binx;
+    int k;
+    const typename Pixel::sample *row;
+
+    memset(rowsum, 0, out_w * sizeof(uint32_t));
+    for (k = 0; k < biny; ++k) {
+        row = src + (size_t) (y * biny + k) * width;
+        switch (binx) {
+            case 1: ffmv_bin_row<Pixel, 1>(rowsum, row, out_w); break;
+            case 2: ffmv_bin_row<Pixel, 2>(rowsum, row, out_w); break;
+            case 3: ffmv_bin_row<Pixel, 3>(rowsum, row, out_w); break;
+            case 4: ffmv_bin_row<Pixel, 4>(rowsum, row, out_w); break;
+            default: ffmv_bin_row_n<Pixel>(rowsum, row, out_w, binx); break;
+        }
+    }
+}
+
+template <class Pixel>
+static void ffmv_add_row(typename Pixel::sample *dst, const uint32_t *rowsum, int n)
+{
+    int x;
+    uint32_t val;
+
+    for (x = 0; x < n; ++x) {
+        val = dst[x] + rowsum[x];
+        dst[x] = val > Pixel::max ? Pixel::max : val;
+    }
+}
+
+template <class Pixel>
+static void ffmv_accum_binned(typename Pixel::sample *dst, const typename Pixel::sample *src,
+        int width, int height, int binx, int biny, uint32_t *rowsum)
+{
+    int out_w = width / binx;
+    int out_h = height / biny;
+    int y;
+
+    for (y = 0; y < out_h; ++y) {
+        ffmv_bin_rows<Pixel>(rowsum, src, width, y, binx, biny);
+        ffmv_add_row<Pixel>(dst, rowsum, out_w);
+        dst += out_w;
+    }
+}
+
+void ffmv_accum_bin_row(enum ffmv_pixel_format fmt, uint32_t *rowsum, const void *src, int width,
+        int y, int binx, int biny)
+{
+    if (fmt == FFMV_MONO8) {
+        ffmv_bin_rows<ffmv_mono8>(rowsum, (const uint8_t *) src, width, y, binx, biny);
+    } else {
+        ffmv_bin_rows<ffmv_mono16>(rowsum, (const uint16_t *) src, width, y, binx, biny);
+    }
+}
+
+void ffmv_accum_add_row(enum ffmv_pixel_format fmt, void *dst, const uint32_t *rowsum, int n)
+{
+    if (fmt == FFMV_MONO8) {
+        ffmv_add_row<ffmv_mono8>((uint8_t *) dst, rowsum, n);
+    } else {
+        ffmv_add_row<ffmv_mono16>((uint16_t *) dst, rowsum, n);
+    }
+}
+
+void ffmv_accum_add_row32(uint32_t *dst, const uint32_t *rowsum, int n)
+{
+    int x;
+    uint32_t val;
+
+    /* Branch free, so the compiler can vectorize it */
+    for (x = 0; x < n; ++x) {
+        val = dst[x] + rowsum[x];
+        dst[x] = val | -(uint32_t) (val < rowsum[x]);
+    }
+}
+
+template <class Pixel>
+static void ffmv_accum_wide(uint32_t *dst, const typename Pixel::sample *src,
+        int width, int height, int binx, int biny, uint32_t *rowsum)
+{
+    int out_w = width / binx;
+    int out_h = height / biny;
+    size_t i, n;
+    uint32_t s, val;
+    int y;
+
+    if (binx == 1 && biny == 1) {
+        n = (size_t) width * height;
+        for (i = 0; i < n; ++i) {
+            s = Pixel::load(src[i]);
+            val = dst[i] + s;
+            dst[i] = val | -(uint32_t) (val < s);
+        }
+        return;
+    }
+
+    for (y = 0; y < out_h; ++y) {
+        ffmv_bin_rows<Pixel>(rowsum, src, width, y, binx, biny);
+        ffmv_accum_add_row32(dst, rowsum, out_w);
+        dst += out_w;
+    }
+}
+
+void ffmv_accum_frame32(enum ffmv_pixel_format fmt, uint32_t *dst, const void *src, int width,
+        int height, int binx, int biny, uint32_t *rowsum)
+{
+    if (fmt == FFMV_MONO8) {
+        ffmv_accum_wide<ffmv_mono8>(dst, (const uint8_t *) src, width, height, binx, biny, rowsum);
+    } else {
+        ffmv_accum_wide<ffmv_mono16>(dst, (const uint16_t *) src, width, height, binx, biny, rowsum);
+    }
+}
+
+void ffmv_accum_frame(enum ffmv_pixel_format fmt, void *dst, const void *src, int width, int height,
+        int binx, int biny, uint32_t *rowsum)
+{
+    const struct ffmv_accum_kernel *kernel;
+
+    if (binx == 1 && biny == 1) {
+        kernel = ffmv_accum_select();
+        if (fmt == FFMV_MONO8) {
+            kernel->accum8((uint8_t *) dst, (const uint8_t *) src, (size_t) width * height);
+        } else {
+            kernel->accum((uint16_t *) dst, (const uint16_t *) src, (size_t) width * height);
+        }
+        return;
+    }
+
+    if (fmt == FFMV_MONO8) {
+        ffmv_accum_binned<ffmv_mono8>((uint8_t *) dst, (const uint8_t *) src,
+                width, height, binx, biny, rowsum);
+    } else {
+        ffmv_accum_binned<ffmv_mono16>((uint16_t *) dst, (const uint16_t *) src,
+                width, height, binx, biny, rowsum);
+    }
+}
+
+static const struct ffmv_accum_kernel scalar_kernel = { "scalar", ffmv_accum_scalar, ffmv_accum8_scalar };
+
+/**
+ * Run a kernel against the scalar reference on a synthetic frame.
+ * The length is deliberately not a multiple of any vector width so that the
+ * scalar tails get exercised too. The stack is seeded near saturation so that
+ * the clamp is hit as well.
+ */
+static bool ffmv_accum_verify(const struct ffmv_accum_kernel *kernel)
+{
+    enum { N = 263 };
+    uint16_t src[N], ref[N], out[N];
+    uint8_t src8[N], ref8[N], out8[N];
+    uint32_t seed = 0x1234567;
+    int i;
+
+    for (i = 0; i < N; ++i) {
+        seed = seed * 1103515245 + 12345;
+        src[i] = htons(seed >> 16);
+        ref[i] = out[i] = (i % 3) ? (uint16_t) (seed & 0xFFFF) : (uint16_t) i;
+        src8[i] = seed >> 24;
+        ref8[i] = out8[i] = seed >> 8;
+    }
+    src[0] = 0;
+    src[1] = 0xFFFF;
+
+    ffmv_accum_scalar(ref, src, N);
+    kernel->accum(out, src, N);
+    ffmv_accum8_scalar(ref8, src8, N);
+    kernel->accum8(out8, src8, N);
+
+    return !memcmp(ref, out, sizeof(ref)) && !memcmp(ref8, out8, sizeof(ref8));
+}
+
+int ffmv_accum_kernels(const struct ffmv_accum_kernel **candidates)
+{
+    int ncandidates = 0;
+
+#ifdef FFMV_ACCUM_X86
+    static const struct ffmv_accum_kernel avx2_kernel = { "avx2", ffmv_accum_avx2, ffmv_accum8_avx2 };
+    static const struct ffmv_accum_kernel sse2_kernel = { "sse2", ffmv_accum_sse2, ffmv_accum8_sse2 };
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        candidates[ncandidates++] = &avx2_kernel;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        candidates[ncandidates++] = &sse2_kernel;
+    }
+#endif
+#ifdef FFMV_ACCUM_NEON
+    static const struct ffmv_accum_kernel neon_kernel = { "neon", ffmv_accum_neon, ffmv_accum8_neon };
+
+#if defined(__aarch64__)
+    candidates[ncandidates++] = &neon_kernel;
+#else
+    if (getauxval(AT_HWCAP) & HWCAP_NEON) {
+        candidates[ncandidates++] = &neon_kernel;
+    }
+#endif
+#endif
+
+    return ncandidates;
+}
+
+static pthread_once_t accum_once = PTHREAD_ONCE_INIT;
+static const struct ffmv_accum_kernel *accum_selected = &scalar_kernel;
+
+static void ffmv_accum_init()
+{
+    const struct ffmv_accum_kernel *candidates[FFMV_ACCUM_MAX_KERNELS];
+    int ncandidates = ffmv_accum_kernels(candidates);
+    int i;
+
+    for (i = 0; i < ncandidates; ++i) {
+        if (ffmv_accum_verify(candidates[i])) {
+            accum_selected = candidates[i];
+            return;
+        }
+    }
+}
+
+const struct ffmv_accum_kernel *ffmv_accum_select(void)
+{
+    pthread_once(&accum_once, ffmv_accum_init);
+    return accum_selected;
+}
@@ -0,0 +1,144 @@
+/**
+ * Sub-frame accumulation kernels for the Point Grey FireFly MV driver.
+ *
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef FFMV_ACCUM_H
+#define FFMV_ACCUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+enum ffmv_pixel_format {
+    FFMV_MONO8,
+    FFMV_MONO16
+};
+
+static inline int ffmv_pixel_bytes(enum ffmv_pixel_format fmt)
+{
+    return fmt == FFMV_MONO8 ? 1 : 2;
+}
+
+/**
+ * Pixel format traits. The camera sends MONO8 or big-endian MONO16 and the
+ * stack is kept native-endian at the same width, so the per-pixel code can be
+ * specialized at compile time instead of branching on the format.
+ */
+struct ffmv_mono8 {
+    typedef uint8_t sample;
+    static const uint32_t max = 0xFF;
+    /* Brightest pixel the camera sends */
+    static const uint32_t full = 0xFF;
+    static inline uint32_t load(sample v) { return v; }
+};
+
+struct ffmv_mono16 {
+    typedef uint16_t sample;
+    static const uint32_t max = 0xFFFF;
+    /* 10 bits, MSB aligned */
+    static const uint32_t full = 0xFFC0;
+    static inline uint32_t load(sample v) { return ntohs(v); }
+};
+
+/**
+ * Add n big-endian MONO16 pixels from src to the native-endian stack in dst,
+ * saturating at 0xFFFF.
+ */
+typedef void (*ffmv_accum_fn)(uint16_t *dst, const uint16_t *src, size_t n);
+
+/**
+ * Add n MONO8 pixels from src to the stack in dst, saturating at 0xFF.
+ */
+typedef void (*ffmv_accum8_fn)(uint8_t *dst, const uint8_t *src, size_t n);
+
+struct ffmv_accum_kernel {
+    const char *name;
+    ffmv_accum_fn accum;
+    ffmv_accum8_fn accum8;
+};
+
+/**
+ * Reference implementations. All of the vectorized kernels must produce
+ * exactly the same output as these.
+ */
+void ffmv_accum_scalar(uint16_t *dst, const uint16_t *src, size_t n);
+void ffmv_accum8_scalar(uint8_t *dst, const uint8_t *src, size_t n);
+
+#if defined(__aarch64__) || defined(__arm__)
+#define FFMV_ACCUM_NEON
+/**
+ * NEON kernels, from ffmv_accum_neon.cpp. On 32 bit ARM only call them once
+ * the CPU is known to have NEON.
+ */
+void ffmv_accum_neon(uint16_t *dst, const uint16_t *src, size_t n);
+void ffmv_accum8_neon(uint8_t *dst, const uint8_t *src, size_t n);
+#endif
+
+/**
+ * Add a sub of width x height pixels to a stack binned by binx x biny,
+ * saturating at the format's maximum. The byte swap, the binning and the add
+ * happen in one pass over src. dst holds (width / binx) x (height / biny)
+ * pixels of the same format and rowsum is scratch space for width / binx
+ * sums. Pixels left over at the right and bottom edges are dropped.
+ */
+void ffmv_accum_frame(enum ffmv_pixel_format fmt, void *dst, const void *src, int width, int height,
+        int binx, int biny, uint32_t *rowsum);
+
+/**
+ * Sum the binx x biny blocks that make up row y of the binned sub into rowsum,
+ * which holds width / binx entries. This is the first half of
+ * ffmv_accum_frame(), for callers that do something other than add.
+ */
+void ffmv_accum_bin_row(enum ffmv_pixel_format fmt, uint32_t *rowsum, const void *src, int width,
+        int y, int binx, int biny);
+
+/**
+ * Add n bin sums to a stack row, saturating at the format's maximum.
+ */
+void ffmv_accum_add_row(enum ffmv_pixel_format fmt, void *dst, const uint32_t *rowsum, int n);
+
+/**
+ * Add n bin sums to a row of a 32 bit stack, saturating at 0xFFFFFFFF.
+ */
+void ffmv_accum_add_row32(uint32_t *dst, const uint32_t *rowsum, int n);
+
+/**
+ * ffmv_accum_frame() for a 32 bit stack, which holds (width / binx) x
+ * (height / biny) sums whatever the pixel format.
+ */
+void ffmv_accum_frame32(enum ffmv_pixel_format fmt, uint32_t *dst, const void *src, int width,
+        int height, int binx, int biny, uint32_t *rowsum);
+
+/* Most vectorized kernels built for any one CPU */
+const int FFMV_ACCUM_MAX_KERNELS = 4;
+
+/**
+ * List the vectorized kernels that the running CPU supports, fastest first,
+ * whether or not they pass the self check. Returns how many there are.
+ */
+int ffmv_accum_kernels(const struct ffmv_accum_kernel **kernels);
+
+/**
+ * Pick the fastest kernel that the running CPU supports.
+ * Each candidate is checked against the scalar kernel on a synthetic frame
+ * before it is used; a kernel that disagrees is skipped. The choice is made
+ * once, so this is cheap and safe to call from any thread.
+ */
+const struct ffmv_accum_kernel *ffmv_accum_select(void);
+
+#endif // FFMV_ACCUM_H
@@ -0,0 +1,52 @@
+/**
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* NEON accumulation kernels. On 32 bit ARM this is the only file built with
+ * NEON enabled, so that nothing else picks up NEON instructions and
+ * ffmv_accum_kernels() can leave these out on CPUs without it. */
+
+#include "ffmv_accum.h"
+
+#if defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+
+void ffmv_accum_neon(uint16_t *dst, const uint16_t *src, size_t n)
+{
+    size_t i;
+    uint16x8_t s, d;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        s = vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8((const uint8_t *) (src + i))));
+        d = vld1q_u16(dst + i);
+        vst1q_u16(dst + i, vqaddq_u16(d, s));
+    }
+    ffmv_accum_scalar(dst + i, src + i, n - i);
+}
+
+void ffmv_accum8_neon(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        vst1q_u8(dst + i, vqaddq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+    }
+    ffmv_accum8_scalar(dst + i, src + i, n - i);
+}
+#elif defined(FFMV_ACCUM_NEON)
+#error "ffmv_accum_neon.cpp has to be built with NEON enabled (-mfpu=neon)"
+#endif
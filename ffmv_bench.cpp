@@ -0,0 +1,423 @@
+/**
+ * Frame path benchmark for the Point Grey FireFly MV driver.
+ *
+ * Feeds synthetic camera frames through the same stacking, binning and
+ * calibration code the driver runs on its capture thread, and reports
+ * throughput and per-stage latency. Needs neither INDI nor a camera.
+ *
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include "ffmv_accum.h"
+#include "ffmv_calib.h"
+#include "ffmv_lucky.h"
+#include "ffmv_stack.h"
+#include "ffmv_stats.h"
+#include "ffmv_time.h"
+#include "ffmv_workpool.h"
+
+/* Frames in the synthetic DMA ring, as set up by the driver */
+const int RING_FRAMES = 10;
+
+struct BenchSize {
+    int width;
+    int height;
+};
+
+struct BenchConfig {
+    enum ffmv_pixel_format format;
+    BenchSize size;
+    int subs;
+    int bin;
+    enum ffmv_stack_mode mode;
+    enum ffmv_stack_output output;
+    bool calibrate;
+    /* Preview downsampling factor, 0 for none */
+    int preview;
+    /* Percentage of subs kept by lucky imaging, 0 for none */
+    int lucky;
+};
+
+static const char *mode_names[] = { "sum", "sigma", "winsor", "median" };
+static const char *output_names[] = { "native", "u32", "mean16" };
+
+static double now_us()
+{
+    return ffmv_time_us();
+}
+
+/**
+ * A cheap deterministic generator, so every run sees the same frames.
+ */
+static uint32_t xorshift(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+
+    return x;
+}
+
+/**
+ * Fill a ring of frames the way the camera delivers them: a sky background
+ * with read noise, a few stars and the odd hot pixel. MONO16 samples are
+ * big endian with the 10 significant bits at the top, like the MT9V022's.
+ */
+static void *make_ring(enum ffmv_pixel_format fmt, int width, int height)
+{
+    size_t npix = (size_t) width * height;
+    size_t bpp = ffmv_pixel_bytes(fmt);
+    uint32_t seed = 0x2545F491;
+    unsigned char *ring;
+    uint32_t v;
+    size_t f, i;
+    int s, x, y, sx, sy;
+
+    ring = (unsigned char *) malloc(npix * bpp * RING_FRAMES);
+    if (!ring) {
+        return NULL;
+    }
+
+    for (f = 0; f < RING_FRAMES; ++f) {
+        unsigned char *frame = ring + f * npix * bpp;
+        std::vector<uint32_t> sky(npix);
+
+        for (i = 0; i < npix; ++i) {
+            sky[i] = 40 + xorshift(&seed) % 16;
+            if (xorshift(&seed) % 5000 == 0) {
+                sky[i] = 1023;
+            }
+        }
+        for (s = 0; s < 20; ++s) {
+            sx = xorshift(&seed) % width;
+            sy = xorshift(&seed) % height;
+            for (y = sy - 2; y <= sy + 2; ++y) {
+                for (x = sx - 2; x <= sx + 2; ++x) {
+                    if (x >= 0 && y >= 0 && x < width && y < height) {
+                        sky[(size_t) y * width + x] += 600 >> (abs(x - sx) + abs(y - sy));
+                    }
+                }
+            }
+        }
+
+        for (i = 0; i < npix; ++i) {
+            v = std::min(sky[i], (uint32_t) 1023);
+            if (fmt == FFMV_MONO8) {
+                frame[i] = v >> 2;
+            } else {
+                frame[2 * i] = v >> 2;
+                frame[2 * i + 1] = (v & 3) << 6;
+            }
+        }
+    }
+
+    return ring;
+}
+
+static double percentile(std::vector<double> &v, double p)
+{
+    size_t i;
+
+    if (v.empty()) {
+        return 0;
+    }
+    std::sort(v.begin(), v.end());
+    i = (size_t) (p * (v.size() - 1) + 0.5);
+
+    return v[i];
+}
+
+/**
+ * Stack reps exposures of cfg.subs subs each, then copy the result out as
+ * grabImage() does, and print one line of results.
+ */
+static bool run_config(FFMVWorkPool *pool, const BenchConfig &cfg, int reps)
+{
+    int w = cfg.size.width;
+    int h = cfg.size.height;
+    size_t bpp = ffmv_pixel_bytes(cfg.format);
+    size_t frame_bytes = (size_t) w * h * bpp;
+    size_t out_bytes = (size_t) (w / cfg.bin) * (h / cfg.bin) * ffmv_output_bytes(cfg.format, cfg.output);
+    FFMVStacker stacker(pool);
+    FFMVLucky lucky(pool);
+    FFMVStackParams params;
+    FFMVCalibFrames calib;
+    std::vector<float> dark, flat;
+    std::vector<uint8_t> preview;
+    FFMVStretch stretch;
+    std::vector<double> sub_us, finish_us, copy_us;
+    std::vector<uint32_t> stats_scratch;
+    FFMVStats stats;
+    int out_pixel = ffmv_output_bytes(cfg.format, cfg.output);
+    unsigned char *ring;
+    const void *sub;
+    void *out, *image;
+    double t0, t1, start, total;
+    int r, s, n = 0;
+
+    ring = (unsigned char *) make_ring(cfg.format, w, h);
+    if (!ring || posix_memalign(&out, 32, out_bytes)) {
+        free(ring);
+        return false;
+    }
+    image = malloc(out_bytes);
+
+    if (cfg.preview) {
+        preview.resize((size_t) (w / cfg.preview) * (h / cfg.preview) + 1);
+    }
+    stacker.setPreview(cfg.preview);
+
+    params.mode = cfg.mode;
+    params.kappa = 3;
+    params.output = cfg.output;
+    memset(&calib, 0, sizeof(calib));
+    if (cfg.calibrate) {
+        dark.assign((size_t) w * h, cfg.format == FFMV_MONO8 ? 10.0f : 2560.0f);
+        flat.assign((size_t) w * h, 1.02f);
+        calib.dark = &dark[0];
+        calib.dark_stride = w;
+        calib.flat = &flat[0];
+        calib.flat_stride = w;
+    }
+
+    start = now_us();
+    for (r = 0; r < reps; ++r) {
+        if (!stacker.reset(cfg.format, w, h, cfg.bin, cfg.bin, params, cfg.calibrate ? &calib : NULL, out)) {
+            free(ring);
+            free(out);
+            free(image);
+            return false;
+        }
+        if (cfg.lucky && !lucky.reset(cfg.format, w, h, FFMV_LUCKY_LAPLACIAN,
+                    (cfg.subs * cfg.lucky + 99) / 100)) {
+            free(ring);
+            free(out);
+            free(image);
+            return false;
+        }
+        for (s = 0; s < cfg.subs; ++s, ++n) {
+            t0 = now_us();
+            sub = ring + (size_t) (n % RING_FRAMES) * frame_bytes;
+            if (cfg.lucky) {
+                lucky.offer(sub, lucky.score(sub));
+            } else {
+                stacker.add(sub);
+            }
+            if (cfg.preview && !cfg.lucky) {
+                stacker.renderPreview(&preview[0], &stretch);
+            }
+            sub_us.push_back(now_us() - t0);
+        }
+        t0 = now_us();
+        if (cfg.lucky) {
+            lucky.sort();
+            for (s = 0; s < lucky.getKept(); ++s) {
+                stacker.add(lucky.getSub(s));
+            }
+        }
+        stacker.finish();
+        t1 = now_us();
+        finish_us.push_back(t1 - t0);
+        ffmv_copy_stats(image, out, out_bytes / out_pixel, out_pixel,
+                out_pixel == 1 ? 0xFF : out_pixel == 2 ? 0xFFFF : 0xFFFFFFFF, &stats, stats_scratch);
+        copy_us.push_back(now_us() - t1);
+    }
+    total = now_us() - start;
+
+    printf("%-6s %4dx%-4d %4d %3d %-7s %-6s %-3s %2d %3d %9.1f %9.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+            cfg.format == FFMV_MONO8 ? "mono8" : "mono16", w, h, cfg.subs, cfg.bin,
+            mode_names[cfg.mode], output_names[cfg.output], cfg.calibrate ? "yes" : "no",
+            cfg.preview, cfg.lucky, n / (total / 1e6), n * frame_bytes / total,
+            percentile(sub_us, 0.5), percentile(sub_us, 0.9), percentile(sub_us, 0.99),
+            percentile(finish_us, 0.5), percentile(copy_us, 0.5));
+    fflush(stdout);
+
+    free(ring);
+    free(out);
+    free(image);
+
+    return true;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -f WxH     frame size, may be repeated (default 752x480, 640x480, 320x240)\n"
+            "  -s N       subs per exposure, may be repeated (default 1, 8, 32)\n"
+            "  -b N       software bin, may be repeated (default 1, 2)\n"
+            "  -m MODE    sum, sigma, winsor, median or all (default sum)\n"
+            "  -o OUTPUT  native, u32 or mean16 stack output (default native)\n"
+            "  -8         MONO8 frames instead of MONO16\n"
+            "  -c         also run with calibration\n"
+            "  -p N       render a preview downsampled N times after each sub\n"
+            "  -l PCT     score each sub and only stack the best PCT percent\n"
+            "  -t N       stacking threads (default one per CPU)\n"
+            "  -r N       exposures per configuration (default 20)\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<BenchSize> sizes;
+    std::vector<int> subs, bins;
+    std::vector<int> modes;
+    enum ffmv_pixel_format fmt = FFMV_MONO16;
+    enum ffmv_stack_output output = FFMV_OUTPUT_NATIVE;
+    bool calib = false;
+    int threads = 0;
+    int preview = 0;
+    int lucky = 0;
+    int reps = 20;
+    BenchSize size;
+    BenchConfig cfg;
+    size_t fi, si, bi, mi;
+    int c, m;
+
+    while ((c = getopt(argc, argv, "f:s:b:m:o:8cp:l:t:r:h")) != -1) {
+        switch (c) {
+        case 'f':
+            if (sscanf(optarg, "%dx%d", &size.width, &size.height) != 2 ||
+                    size.width <= 0 || size.height <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            sizes.push_back(size);
+            break;
+        case 's':
+            subs.push_back(atoi(optarg) > 0 ? atoi(optarg) : 1);
+            break;
+        case 'b':
+            bins.push_back(atoi(optarg) >= 1 && atoi(optarg) <= 4 ? atoi(optarg) : 1);
+            break;
+        case 'm':
+            if (!strcmp(optarg, "all")) {
+                for (m = FFMV_STACK_SUM; m <= FFMV_STACK_MEDIAN; ++m) {
+                    modes.push_back(m);
+                }
+                break;
+            }
+            for (m = FFMV_STACK_MEDIAN; m >= 0 && strcmp(optarg, mode_names[m]); --m)
+                ;
+            if (m < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            modes.push_back(m);
+            break;
+        case 'o':
+            for (m = FFMV_OUTPUT_MEAN16; m >= 0 && strcmp(optarg, output_names[m]); --m)
+                ;
+            if (m < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            output = (enum ffmv_stack_output) m;
+            break;
+        case '8':
+            fmt = FFMV_MONO8;
+            break;
+        case 'c':
+            calib = true;
+            break;
+        case 'p':
+            preview = atoi(optarg) > 0 ? atoi(optarg) : 0;
+            break;
+        case 'l':
+            lucky = atoi(optarg) > 0 && atoi(optarg) <= 100 ? atoi(optarg) : 0;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'r':
+            reps = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (sizes.empty()) {
+        size.width = 752;
+        size.height = 480;
+        sizes.push_back(size);
+        size.width = 640;
+        sizes.push_back(size);
+        size.width = 320;
+        size.height = 240;
+        sizes.push_back(size);
+    }
+    if (subs.empty()) {
+        subs.push_back(1);
+        subs.push_back(8);
+        subs.push_back(32);
+    }
+    if (bins.empty()) {
+        bins.push_back(1);
+        bins.push_back(2);
+    }
+    if (modes.empty()) {
+        modes.push_back(FFMV_STACK_SUM);
+    }
+
+    FFMVWorkPool pool(threads);
+
+    printf("# accumulation kernel %s, %d stacking threads, %d exposures per line\n",
+            ffmv_accum_select()->name, pool.size(), reps);
+    printf("# sub, finish and copy columns are latencies in us; copy includes the frame statistics\n");
+    printf("# with lucky imaging (lk), sub is scoring and finish includes stacking the kept subs\n");
+    printf("%-6s %9s %4s %3s %-7s %-6s %-3s %2s %3s %9s %9s %8s %8s %8s %8s %8s\n",
+            "format", "size", "subs", "bin", "mode", "output", "cal", "pv", "lk", "frames/s", "MB/s",
+            "sub p50", "sub p90", "sub p99", "finish", "copy");
+
+    cfg.format = fmt;
+    cfg.output = output;
+    cfg.preview = preview;
+    cfg.lucky = lucky;
+    for (fi = 0; fi < sizes.size(); ++fi) {
+        for (si = 0; si < subs.size(); ++si) {
+            for (bi = 0; bi < bins.size(); ++bi) {
+                for (mi = 0; mi < modes.size(); ++mi) {
+                    for (c = 0; c < (calib ? 2 : 1); ++c) {
+                        cfg.size = sizes[fi];
+                        cfg.subs = subs[si];
+                        cfg.bin = bins[bi];
+                        cfg.mode = (enum ffmv_stack_mode) modes[mi];
+                        cfg.calibrate = c;
+                        if (!run_config(&pool, cfg, reps)) {
+                            fprintf(stderr, "Out of memory\n");
+                            return 1;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,449 @@
+/**
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ffmv_calib.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FFMV_CALIB_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__aarch64__) || defined(__ARM_NEON)
+#define FFMV_CALIB_NEON
+#include <arm_neon.h>
+#endif
+
+#define CALIB_MAGIC "FFMVCAL1"
+
+/**
+ * On-disk header. The pixels follow at data_offset, which keeps them aligned
+ * for vector loads once the file is mapped.
+ */
+struct ffmv_calib_header {
+    char magic[8];
+    uint32_t type;
+    uint32_t bpp;
+    uint32_t sub_us;
+    uint32_t gain_vref;
+    uint32_t gain_2x;
+    uint32_t x, y;
+    uint32_t width, height;
+    uint32_t nframes;
+    uint32_t data_offset;
+    uint32_t reserved[3];
+};
+
+template <class Pixel>
+static void ffmv_calib_row_t(float *out, const typename Pixel::sample *src,
+        const float *dark, const float *flat, int n)
+{
+    int i;
+    float v;
+
+    for (i = 0; i < n; ++i) {
+        v = Pixel::load(src[i]);
+        if (dark) {
+            v -= dark[i];
+        }
+        if (flat) {
+            v *= flat[i];
+        }
+        out[i] = v > 0 ? v : 0;
+    }
+}
+
+#ifdef FFMV_CALIB_SSE2
+__attribute__((target("sse2")))
+static int ffmv_calib_row_sse2(float *out, const uint16_t *src, const float *dark, const float *flat, int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 fzero = _mm_setzero_ps();
+    __m128i s;
+    __m128 lo, hi;
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        s = _mm_loadu_si128((const __m128i *) (src + i));
+        s = _mm_or_si128(_mm_slli_epi16(s, 8), _mm_srli_epi16(s, 8));
+        lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(s, zero));
+        hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(s, zero));
+        if (dark) {
+            lo = _mm_sub_ps(lo, _mm_loadu_ps(dark + i));
+            hi = _mm_sub_ps(hi, _mm_loadu_ps(dark + i + 4));
+        }
+        if (flat) {
+            lo = _mm_mul_ps(lo, _mm_loadu_ps(flat + i));
+            hi = _mm_mul_ps(hi, _mm_loadu_ps(flat + i + 4));
+        }
+        _mm_storeu_ps(out + i, _mm_max_ps(lo, fzero));
+        _mm_storeu_ps(out + i + 4, _mm_max_ps(hi, fzero));
+    }
+
+    return i;
+}
+#endif
+
+#ifdef FFMV_CALIB_NEON
+static int ffmv_calib_row_neon(float *out, const uint16_t *src, const float *dark, const float *flat, int n)
+{
+    const float32x4_t fzero = vdupq_n_f32(0);
+    uint16x8_t s;
+    float32x4_t lo, hi;
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        s = vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8((const uint8_t *) (src + i))));
+        lo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(s)));
+        hi = vcvtq_f32_u32(vmovl_u16(vget_high_u16(s)));
+        if (dark) {
+            lo = vsubq_f32(lo, vld1q_f32(dark + i));
+            hi = vsubq_f32(hi, vld1q_f32(dark + i + 4));
+        }
+        if (flat) {
+            lo = vmulq_f32(lo, vld1q_f32(flat + i));
+            hi = vmulq_f32(hi, vld1q_f32(flat + i + 4));
+        }
+        vst1q_f32(out + i, vmaxq_f32(lo, fzero));
+        vst1q_f32(out + i + 4, vmaxq_f32(hi, fzero));
+    }
+
+    return i;
+}
+#endif
+
+void ffmv_calib_row(enum ffmv_pixel_format fmt, float *out, const void *src,
+        const float *dark, const float *flat, int n)
+{
+    int i = 0;
+
+    if (fmt == FFMV_MONO8) {
+        ffmv_calib_row_t<ffmv_mono8>(out, (const uint8_t *) src, dark, flat, n);
+        return;
+    }
+
+#if defined(FFMV_CALIB_SSE2)
+    i = ffmv_calib_row_sse2(out, (const uint16_t *) src, dark, flat, n);
+#elif defined(FFMV_CALIB_NEON)
+    i = ffmv_calib_row_neon(out, (const uint16_t *) src, dark, flat, n);
+#endif
+    ffmv_calib_row_t<ffmv_mono16>(out + i, (const uint16_t *) src + i,
+            dark ? dark + i : NULL, flat ? flat + i : NULL, n - i);
+}
+
+FFMVCalibLibrary::FFMVCalibLibrary()
+{
+    const char *home = getenv("HOME");
+
+    directory = home ? home : "/tmp";
+    directory += "/.indi/ffmv_calibration";
+}
+
+FFMVCalibLibrary::~FFMVCalibLibrary()
+{
+    unmapAll();
+}
+
+void FFMVCalibLibrary::setDirectory(const char *dir)
+{
+    if (directory == dir) {
+        return;
+    }
+    unmapAll();
+    directory = dir;
+}
+
+void FFMVCalibLibrary::unmapAll()
+{
+    size_t i;
+
+    for (i = 0; i < mappings.size(); ++i) {
+        munmap(mappings[i].addr, mappings[i].size);
+    }
+    mappings.clear();
+}
+
+std::string FFMVCalibLibrary::pathFor(const FFMVCalibKey &key) const
+{
+    static const char *names[] = { "bias", "dark", "flat" };
+    char name[128];
+
+    snprintf(name, sizeof(name), "/%016llx_%s_%ubit_%uus_v%u_g%u_%u_%u_%ux%u.fmv",
+            (unsigned long long) key.camera, names[key.type], key.bpp, key.sub_us, key.gain_vref,
+            key.gain_2x, key.x, key.y, key.width, key.height);
+
+    return directory + name;
+}
+
+/**
+ * Map a master and check that it is what its name says it is.
+ */
+const FFMVCalibLibrary::Mapping *FFMVCalibLibrary::map(const std::string &path, const FFMVCalibKey &key)
+{
+    const struct ffmv_calib_header *hdr;
+    Mapping m;
+    struct stat st;
+    size_t i;
+    int fd;
+
+    for (i = 0; i < mappings.size(); ++i) {
+        if (mappings[i].path == path) {
+            return &mappings[i];
+        }
+    }
+
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(*hdr)) {
+        close(fd);
+        return NULL;
+    }
+    m.size = st.st_size;
+    m.addr = mmap(NULL, m.size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m.addr == MAP_FAILED) {
+        return NULL;
+    }
+
+    hdr = (const struct ffmv_calib_header *) m.addr;
+    if (memcmp(hdr->magic, CALIB_MAGIC, sizeof(hdr->magic)) ||
+            hdr->type != (uint32_t) key.type || hdr->bpp != key.bpp ||
+            hdr->width != key.width || hdr->height != key.height ||
+            hdr->data_offset + (size_t) hdr->width * hdr->height * sizeof(float) > m.size) {
+        munmap(m.addr, m.size);
+        return NULL;
+    }
+
+    m.path = path;
+    m.data = (const float *) ((const char *) m.addr + hdr->data_offset);
+    m.width = hdr->width;
+    mappings.push_back(m);
+
+    return &mappings.back();
+}
+
+const float *FFMVCalibLibrary::find(const FFMVCalibKey &key, uint32_t sensor_w, uint32_t sensor_h, int *stride)
+{
+    const Mapping *m;
+    FFMVCalibKey full = key;
+
+    m = map(pathFor(key), key);
+    if (m) {
+        *stride = m->width;
+        return m->data;
+    }
+
+    /* A full frame master covers every ROI */
+    full.x = 0;
+    full.y = 0;
+    full.width = sensor_w;
+    full.height = sensor_h;
+    if (key.x + key.width > sensor_w || key.y + key.height > sensor_h) {
+        return NULL;
+    }
+    m = map(pathFor(full), full);
+    if (m) {
+        *stride = m->width;
+        return m->data + (size_t) key.y * m->width + key.x;
+    }
+
+    return NULL;
+}
+
+/**
+ * Write a master. It goes to a temporary file that is renamed into place, so
+ * a mapping of the old master stays valid until it is dropped here.
+ */
+bool FFMVCalibLibrary::save(const FFMVCalibKey &key, const float *data, uint32_t nframes)
+{
+    struct ffmv_calib_header hdr;
+    std::string path = pathFor(key);
+    std::string tmp = path + ".tmp";
+    size_t len = (size_t) key.width * key.height * sizeof(float);
+    std::string parent;
+    size_t i;
+    FILE *fp;
+    bool ok;
+
+    /* Make sure the library directory exists */
+    for (i = 1; i <= directory.size(); ++i) {
+        if (i == directory.size() || directory[i] == '/') {
+            parent = directory.substr(0, i);
+            if (mkdir(parent.c_str(), 0755) < 0 && errno != EEXIST) {
+                return false;
+            }
+        }
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CALIB_MAGIC, sizeof(hdr.magic));
+    hdr.type = key.type;
+    hdr.bpp = key.bpp;
+    hdr.sub_us = key.sub_us;
+    hdr.gain_vref = key.gain_vref;
+    hdr.gain_2x = key.gain_2x;
+    hdr.x = key.x;
+    hdr.y = key.y;
+    hdr.width = key.width;
+    hdr.height = key.height;
+    hdr.nframes = nframes;
+    hdr.data_offset = sizeof(hdr);
+
+    fp = fopen(tmp.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+    ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 && fwrite(data, len, 1, fp) == 1;
+    ok = !fclose(fp) && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    /* Drop any stale mapping of this master */
+    for (i = 0; i < mappings.size(); ++i) {
+        if (mappings[i].path == path) {
+            munmap(mappings[i].addr, mappings[i].size);
+            mappings.erase(mappings.begin() + i);
+            break;
+        }
+    }
+
+    return true;
+}
+
+FFMVCalibBuilder::FFMVCalibBuilder()
+{
+    format = FFMV_MONO16;
+    width = height = 0;
+    nframes = 0;
+    sum = NULL;
+    result = NULL;
+    size = 0;
+}
+
+FFMVCalibBuilder::~FFMVCalibBuilder()
+{
+    free(sum);
+    free(result);
+}
+
+bool FFMVCalibBuilder::reset(enum ffmv_pixel_format fmt, int width, int height)
+{
+    size_t npix = (size_t) width * height;
+
+    if (npix > size) {
+        free(sum);
+        free(result);
+        sum = (double *) malloc(npix * sizeof(double));
+        result = (float *) malloc(npix * sizeof(float));
+        if (!sum || !result) {
+            free(sum);
+            free(result);
+            sum = NULL;
+            result = NULL;
+            size = 0;
+            return false;
+        }
+        size = npix;
+    }
+
+    format = fmt;
+    this->width = width;
+    this->height = height;
+    nframes = 0;
+    memset(sum, 0, npix * sizeof(double));
+
+    return true;
+}
+
+void FFMVCalibBuilder::add(const void *src)
+{
+    size_t npix = (size_t) width * height;
+    size_t i;
+
+    if (format == FFMV_MONO8) {
+        for (i = 0; i < npix; ++i) {
+            sum[i] += ffmv_mono8::load(((const uint8_t *) src)[i]);
+        }
+    } else {
+        for (i = 0; i < npix; ++i) {
+            sum[i] += ffmv_mono16::load(((const uint16_t *) src)[i]);
+        }
+    }
+    ++nframes;
+}
+
+const float *FFMVCalibBuilder::average(const float *dark, int dark_stride)
+{
+    int x, y;
+    size_t i = 0;
+
+    if (!nframes) {
+        return NULL;
+    }
+
+    for (y = 0; y < height; ++y) {
+        for (x = 0; x < width; ++x, ++i) {
+            result[i] = sum[i] / nframes;
+            if (dark) {
+                result[i] -= dark[(size_t) y * dark_stride + x];
+            }
+        }
+    }
+
+    return result;
+}
+
+const float *FFMVCalibBuilder::flat(const float *dark, int dark_stride)
+{
+    size_t npix = (size_t) width * height;
+    double total = 0;
+    float mean;
+    size_t i;
+
+    if (!average(dark, dark_stride)) {
+        return NULL;
+    }
+
+    for (i = 0; i < npix; ++i) {
+        total += result[i];
+    }
+    mean = total / npix;
+    if (mean <= 0) {
+        return NULL;
+    }
+
+    /* Store the reciprocal so calibration is a multiply. Dead pixels are
+     * left alone rather than blown up. */
+    for (i = 0; i < npix; ++i) {
+        result[i] = result[i] > mean * 0.05f ? mean / result[i] : 1.0f;
+    }
+
+    return result;
+}
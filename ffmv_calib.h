@@ -0,0 +1,139 @@
+/**
+ * Calibration frame library for the Point Grey FireFly MV driver.
+ *
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef FFMV_CALIB_H
+#define FFMV_CALIB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "ffmv_accum.h"
+
+enum ffmv_calib_type {
+    FFMV_CALIB_BIAS,
+    FFMV_CALIB_DARK,
+    FFMV_CALIB_FLAT
+};
+
+/**
+ * What a master frame was taken with. Masters belong to one camera. Darks
+ * depend on the sub length and the sensor gain settings, bias frames only
+ * on the gain, and flats on neither. All masters are at sensor resolution
+ * for the given ROI and in ADU of the given bit depth.
+ */
+struct FFMVCalibKey {
+    uint64_t camera;
+    enum ffmv_calib_type type;
+    uint32_t bpp;
+    uint32_t sub_us;
+    uint32_t gain_vref;
+    uint32_t gain_2x;
+    uint32_t x, y;
+    uint32_t width, height;
+};
+
+/**
+ * Masters to apply to each sub of an exposure. A master may cover more
+ * than the exposure's ROI, so each one comes with its own row stride and
+ * already points at the ROI's top left pixel. Either pointer may be NULL.
+ */
+struct FFMVCalibFrames {
+    /* Dark current plus bias, in ADU per sub */
+    const float *dark;
+    int dark_stride;
+    /* Reciprocal of the normalized flat field */
+    const float *flat;
+    int flat_stride;
+};
+
+/**
+ * Calibrate n raw samples: out = max((src - dark) * flat, 0).
+ * dark and flat may be NULL.
+ */
+void ffmv_calib_row(enum ffmv_pixel_format fmt, float *out, const void *src,
+        const float *dark, const float *flat, int n);
+
+/**
+ * Master frames on disk. Each master is a small header followed by float
+ * pixels, and is memory mapped on first use and kept mapped, so applying it
+ * to every sub costs no copies or reads.
+ */
+class FFMVCalibLibrary
+{
+public:
+    FFMVCalibLibrary();
+    ~FFMVCalibLibrary();
+
+    void setDirectory(const char *dir);
+    const char *getDirectory() const { return directory.c_str(); }
+
+    /* Find a master covering the key's ROI, either an exact match or a
+     * full frame master of sensor_w x sensor_h */
+    const float *find(const FFMVCalibKey &key, uint32_t sensor_w, uint32_t sensor_h, int *stride);
+
+    bool save(const FFMVCalibKey &key, const float *data, uint32_t nframes);
+
+    void unmapAll();
+
+private:
+    struct Mapping {
+        std::string path;
+        void *addr;
+        size_t size;
+        const float *data;
+        uint32_t width;
+    };
+
+    std::string pathFor(const FFMVCalibKey &key) const;
+    const Mapping *map(const std::string &path, const FFMVCalibKey &key);
+
+    std::string directory;
+    std::vector<Mapping> mappings;
+};
+
+/**
+ * Averages frames at sensor resolution into a master.
+ */
+class FFMVCalibBuilder
+{
+public:
+    FFMVCalibBuilder();
+    ~FFMVCalibBuilder();
+
+    bool reset(enum ffmv_pixel_format fmt, int width, int height);
+    void add(const void *src);
+    int getFrames() const { return nframes; }
+
+    /* Mean of the frames, minus dark if it isn't NULL */
+    const float *average(const float *dark, int dark_stride);
+    /* Reciprocal flat normalized to the mean, minus dark if it isn't NULL */
+    const float *flat(const float *dark, int dark_stride);
+
+private:
+    enum ffmv_pixel_format format;
+    int width, height;
+    int nframes;
+    double *sum;
+    float *result;
+    size_t size;
+};
+
+#endif // FFMV_CALIB_H
@@ -0,0 +1,156 @@
+/**
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "ffmv_camera.h"
+
+FFMVDC1394Camera::~FFMVDC1394Camera()
+{
+    dc1394_camera_free(cam);
+}
+
+dc1394error_t FFMVDC1394Camera::reset()
+{
+    return dc1394_camera_reset(cam);
+}
+
+dc1394error_t FFMVDC1394Camera::setVideoMode(dc1394video_mode_t mode)
+{
+    return dc1394_video_set_mode(cam, mode);
+}
+
+dc1394error_t FFMVDC1394Camera::getVideoMode(dc1394video_mode_t *mode)
+{
+    return dc1394_video_get_mode(cam, mode);
+}
+
+dc1394error_t FFMVDC1394Camera::setFramerate(dc1394framerate_t rate)
+{
+    return dc1394_video_set_framerate(cam, rate);
+}
+
+dc1394error_t FFMVDC1394Camera::getFramerate(dc1394framerate_t *rate)
+{
+    return dc1394_video_get_framerate(cam, rate);
+}
+
+dc1394error_t FFMVDC1394Camera::setTransmission(dc1394switch_t on)
+{
+    return dc1394_video_set_transmission(cam, on);
+}
+
+dc1394error_t FFMVDC1394Camera::getMaxImageSize(dc1394video_mode_t mode, uint32_t *width, uint32_t *height)
+{
+    return dc1394_format7_get_max_image_size(cam, mode, width, height);
+}
+
+dc1394error_t FFMVDC1394Camera::getUnitSize(dc1394video_mode_t mode, uint32_t *width, uint32_t *height)
+{
+    return dc1394_format7_get_unit_size(cam, mode, width, height);
+}
+
+dc1394error_t FFMVDC1394Camera::getUnitPosition(dc1394video_mode_t mode, uint32_t *left, uint32_t *top)
+{
+    return dc1394_format7_get_unit_position(cam, mode, left, top);
+}
+
+dc1394error_t FFMVDC1394Camera::setROI(dc1394video_mode_t mode, dc1394color_coding_t coding, int32_t packet,
+        int32_t left, int32_t top, int32_t width, int32_t height)
+{
+    return dc1394_format7_set_roi(cam, mode, coding, packet, left, top, width, height);
+}
+
+dc1394error_t FFMVDC1394Camera::getROI(dc1394video_mode_t mode, dc1394color_coding_t *coding, uint32_t *packet,
+        uint32_t *left, uint32_t *top, uint32_t *width, uint32_t *height)
+{
+    return dc1394_format7_get_roi(cam, mode, coding, packet, left, top, width, height);
+}
+
+dc1394error_t FFMVDC1394Camera::getFeature(dc1394feature_info_t *feature)
+{
+    return dc1394_feature_get(cam, feature);
+}
+
+dc1394error_t FFMVDC1394Camera::setFeaturePower(dc1394feature_t id, dc1394switch_t on)
+{
+    return dc1394_feature_set_power(cam, id, on);
+}
+
+dc1394error_t FFMVDC1394Camera::setFeatureMode(dc1394feature_t id, dc1394feature_mode_t mode)
+{
+    return dc1394_feature_set_mode(cam, id, mode);
+}
+
+dc1394error_t FFMVDC1394Camera::setAbsoluteControl(dc1394feature_t id, dc1394switch_t on)
+{
+    return dc1394_feature_set_absolute_control(cam, id, on);
+}
+
+dc1394error_t FFMVDC1394Camera::getAbsoluteBoundaries(dc1394feature_t id, float *min, float *max)
+{
+    return dc1394_feature_get_absolute_boundaries(cam, id, min, max);
+}
+
+dc1394error_t FFMVDC1394Camera::setAbsoluteValue(dc1394feature_t id, float value)
+{
+    return dc1394_feature_set_absolute_value(cam, id, value);
+}
+
+dc1394error_t FFMVDC1394Camera::getAbsoluteValue(dc1394feature_t id, float *value)
+{
+    return dc1394_feature_get_absolute_value(cam, id, value);
+}
+
+dc1394error_t FFMVDC1394Camera::setControlRegister(uint64_t offset, uint32_t value)
+{
+    return dc1394_set_control_register(cam, offset, value);
+}
+
+dc1394error_t FFMVDC1394Camera::getControlRegister(uint64_t offset, uint32_t *value)
+{
+    return dc1394_get_control_register(cam, offset, value);
+}
+
+dc1394error_t FFMVDC1394Camera::captureSetup(uint32_t buffers, uint32_t flags)
+{
+    return dc1394_capture_setup(cam, buffers, flags);
+}
+
+dc1394error_t FFMVDC1394Camera::captureStop()
+{
+    return dc1394_capture_stop(cam);
+}
+
+int FFMVDC1394Camera::captureFileno()
+{
+    return dc1394_capture_get_fileno(cam);
+}
+
+dc1394error_t FFMVDC1394Camera::dequeue(dc1394capture_policy_t policy, dc1394video_frame_t **frame)
+{
+    return dc1394_capture_dequeue(cam, policy, frame);
+}
+
+dc1394error_t FFMVDC1394Camera::enqueue(dc1394video_frame_t *frame)
+{
+    return dc1394_capture_enqueue(cam, frame);
+}
+
+bool FFMVDC1394Camera::isFrameCorrupt(dc1394video_frame_t *frame)
+{
+    return dc1394_capture_is_frame_corrupt(cam, frame) == DC1394_TRUE;
+}
@@ -0,0 +1,127 @@
+/**
+ * Camera backends for the Point Grey FireFly MV driver.
+ *
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef FFMV_CAMERA_H
+#define FFMV_CAMERA_H
+
+#include <stdint.h>
+#include <dc1394/dc1394.h>
+
+/**
+ * Everything the driver does to a camera. Each call has the meaning, and
+ * the dc1394 types and error codes, of the libdc1394 call of the same name,
+ * so the driver reads the same whether it has a FireFly MV on the bus or a
+ * simulated one.
+ *
+ * Like libdc1394, a backend may be called from the main loop, the capture
+ * thread and the control thread at once; the capture calls are only made
+ * by the capture thread, and the ring is only set up or torn down while it
+ * is idle.
+ */
+class FFMVCamera
+{
+public:
+    virtual ~FFMVCamera() {}
+
+    virtual uint64_t getGuid() const = 0;
+    virtual dc1394error_t reset() = 0;
+
+    virtual dc1394error_t setVideoMode(dc1394video_mode_t mode) = 0;
+    virtual dc1394error_t getVideoMode(dc1394video_mode_t *mode) = 0;
+    virtual dc1394error_t setFramerate(dc1394framerate_t rate) = 0;
+    virtual dc1394error_t getFramerate(dc1394framerate_t *rate) = 0;
+    virtual dc1394error_t setTransmission(dc1394switch_t on) = 0;
+
+    virtual dc1394error_t getMaxImageSize(dc1394video_mode_t mode, uint32_t *width, uint32_t *height) = 0;
+    virtual dc1394error_t getUnitSize(dc1394video_mode_t mode, uint32_t *width, uint32_t *height) = 0;
+    virtual dc1394error_t getUnitPosition(dc1394video_mode_t mode, uint32_t *left, uint32_t *top) = 0;
+    virtual dc1394error_t setROI(dc1394video_mode_t mode, dc1394color_coding_t coding, int32_t packet,
+            int32_t left, int32_t top, int32_t width, int32_t height) = 0;
+    virtual dc1394error_t getROI(dc1394video_mode_t mode, dc1394color_coding_t *coding, uint32_t *packet,
+            uint32_t *left, uint32_t *top, uint32_t *width, uint32_t *height) = 0;
+
+    virtual dc1394error_t getFeature(dc1394feature_info_t *feature) = 0;
+    virtual dc1394error_t setFeaturePower(dc1394feature_t id, dc1394switch_t on) = 0;
+    virtual dc1394error_t setFeatureMode(dc1394feature_t id, dc1394feature_mode_t mode) = 0;
+    virtual dc1394error_t setAbsoluteControl(dc1394feature_t id, dc1394switch_t on) = 0;
+    virtual dc1394error_t getAbsoluteBoundaries(dc1394feature_t id, float *min, float *max) = 0;
+    virtual dc1394error_t setAbsoluteValue(dc1394feature_t id, float value) = 0;
+    virtual dc1394error_t getAbsoluteValue(dc1394feature_t id, float *value) = 0;
+
+    virtual dc1394error_t setControlRegister(uint64_t offset, uint32_t value) = 0;
+    virtual dc1394error_t getControlRegister(uint64_t offset, uint32_t *value) = 0;
+
+    virtual dc1394error_t captureSetup(uint32_t buffers, uint32_t flags) = 0;
+    virtual dc1394error_t captureStop() = 0;
+    /* Readable when a frame can be dequeued */
+    virtual int captureFileno() = 0;
+    virtual dc1394error_t dequeue(dc1394capture_policy_t policy, dc1394video_frame_t **frame) = 0;
+    virtual dc1394error_t enqueue(dc1394video_frame_t *frame) = 0;
+    virtual bool isFrameCorrupt(dc1394video_frame_t *frame) = 0;
+};
+
+/**
+ * A camera on the 1394 bus, through libdc1394. Takes ownership of cam.
+ */
+class FFMVDC1394Camera : public FFMVCamera
+{
+public:
+    explicit FFMVDC1394Camera(dc1394camera_t *cam) : cam(cam) {}
+    ~FFMVDC1394Camera();
+
+    uint64_t getGuid() const { return cam->guid; }
+    dc1394error_t reset();
+
+    dc1394error_t setVideoMode(dc1394video_mode_t mode);
+    dc1394error_t getVideoMode(dc1394video_mode_t *mode);
+    dc1394error_t setFramerate(dc1394framerate_t rate);
+    dc1394error_t getFramerate(dc1394framerate_t *rate);
+    dc1394error_t setTransmission(dc1394switch_t on);
+
+    dc1394error_t getMaxImageSize(dc1394video_mode_t mode, uint32_t *width, uint32_t *height);
+    dc1394error_t getUnitSize(dc1394video_mode_t mode, uint32_t *width, uint32_t *height);
+    dc1394error_t getUnitPosition(dc1394video_mode_t mode, uint32_t *left, uint32_t *top);
+    dc1394error_t setROI(dc1394video_mode_t mode, dc1394color_coding_t coding, int32_t packet,
+            int32_t left, int32_t top, int32_t width, int32_t height);
+    dc1394error_t getROI(dc1394video_mode_t mode, dc1394color_coding_t *coding, uint32_t *packet,
+            uint32_t *left, uint32_t *top, uint32_t *width, uint32_t *height);
+
+    dc1394error_t getFeature(dc1394feature_info_t *feature);
+    dc1394error_t setFeaturePower(dc1394feature_t id, dc1394switch_t on);
+    dc1394error_t setFeatureMode(dc1394feature_t id, dc1394feature_mode_t mode);
+    dc1394error_t setAbsoluteControl(dc1394feature_t id, dc1394switch_t on);
+    dc1394error_t getAbsoluteBoundaries(dc1394feature_t id, float *min, float *max);
+    dc1394error_t setAbsoluteValue(dc1394feature_t id, float value);
+    dc1394error_t getAbsoluteValue(dc1394feature_t id, float *value);
+
+    dc1394error_t setControlRegister(uint64_t offset, uint32_t value);
+    dc1394error_t getControlRegister(uint64_t offset, uint32_t *value);
+
+    dc1394error_t captureSetup(uint32_t buffers, uint32_t flags);
+    dc1394error_t captureStop();
+    int captureFileno();
+    dc1394error_t dequeue(dc1394capture_policy_t policy, dc1394video_frame_t **frame);
+    dc1394error_t enqueue(dc1394video_frame_t *frame);
+    bool isFrameCorrupt(dc1394video_frame_t *frame);
+
+private:
+    dc1394camera_t *cam;
+};
+
+#endif // FFMV_CAMERA_H
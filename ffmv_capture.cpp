@@ -0,0 +1,825 @@
+/**
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "ffmv_capture.h"
+#include "ffmv_time.h"
+
+/* How often a thread waiting on the DMA ring checks for an abort */
+const int CAPTURE_POLL_MS = 100;
+
+FFMVCapture::FFMVCapture(int first_cpu, int ncpus) : pool(ncpus, first_cpu), stacker(&pool),
+    focus_pool(ncpus), focus_meter(&focus_pool), registrar(&pool), lucky(&pool)
+{
+    camera = NULL;
+    cpu = first_cpu;
+    running = false;
+    quit = false;
+    pending = false;
+    busy = false;
+    abort_requested = 0;
+    subs_done = 0;
+    stack[0] = stack[1] = NULL;
+    stack_size[0] = stack_size[1] = 0;
+    star_locked = false;
+    star_x = star_y = 0;
+    memset(&result, 0, sizeof(result));
+    result_ready = 0;
+    notify_fd[0] = notify_fd[1] = -1;
+    preview_buf = NULL;
+    preview_buf_size = 0;
+    memset(&preview, 0, sizeof(preview));
+    preview_ready = 0;
+    focus_queued = false;
+    focus_busy = false;
+    memset(&focus_result, 0, sizeof(focus_result));
+    focus_ready = 0;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+FFMVCapture::~FFMVCapture()
+{
+    stop();
+    free(stack[0]);
+    free(stack[1]);
+    free(preview_buf);
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+}
+
+/**
+ * Spawn the capture thread for a camera whose DMA ring has been set up.
+ */
+bool FFMVCapture::start(FFMVCamera *cam)
+{
+    if (running) {
+        return true;
+    }
+
+    if (pipe(notify_fd) < 0) {
+        return false;
+    }
+    fcntl(notify_fd[0], F_SETFL, O_NONBLOCK);
+
+    camera = cam;
+    quit = false;
+    pending = false;
+    busy = false;
+    result_ready = 0;
+    focus_queued = false;
+    focus_busy = false;
+    focus_ready = 0;
+
+    if (pthread_create(&focus_thread, NULL, focusThreadEntry, this)) {
+        close(notify_fd[0]);
+        close(notify_fd[1]);
+        notify_fd[0] = notify_fd[1] = -1;
+        return false;
+    }
+    if (pthread_create(&thread, NULL, threadEntry, this)) {
+        pthread_mutex_lock(&lock);
+        quit = true;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+        pthread_join(focus_thread, NULL);
+        close(notify_fd[0]);
+        close(notify_fd[1]);
+        notify_fd[0] = notify_fd[1] = -1;
+        return false;
+    }
+    running = true;
+    ffmv_pin_thread(thread, cpu);
+
+    return true;
+}
+
+/**
+ * Abort any exposure in progress and join the capture and focus threads.
+ */
+void FFMVCapture::stop()
+{
+    if (!running) {
+        return;
+    }
+
+    __atomic_store_n(&abort_requested, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&lock);
+    quit = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+
+    pthread_join(thread, NULL);
+    pthread_join(focus_thread, NULL);
+    running = false;
+
+    close(notify_fd[0]);
+    close(notify_fd[1]);
+    notify_fd[0] = notify_fd[1] = -1;
+}
+
+/**
+ * Arm the capture thread for one exposure. The thread flushes the DMA ring
+ * and turns transmission on itself, so that it never races a previous
+ * exposure that is still being torn down after an abort. If there is one,
+ * this waits for the thread to go idle first.
+ */
+bool FFMVCapture::begin(const FFMVCaptureRequest &req)
+{
+    size_t out_w = req.width / req.binx;
+    size_t size = out_w * (req.height / req.biny) * ffmv_output_bytes(req.format, req.stack.output);
+    size_t preview_size = 0;
+    int i;
+    char c;
+
+    if (!running) {
+        return false;
+    }
+
+    pthread_mutex_lock(&lock);
+    while (busy) {
+        pthread_cond_wait(&cond, &lock);
+    }
+
+    /* Drop a result the main loop never collected, e.g. an aborted one */
+    __atomic_store_n(&result_ready, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&preview_ready, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&focus_ready, 0, __ATOMIC_RELAXED);
+    while (read(notify_fd[0], &c, 1) > 0)
+        ;
+
+    /* The second stack is only needed for a sequence */
+    for (i = 0; i < (req.exposures != 1 ? 2 : 1); ++i) {
+        if (size <= stack_size[i]) {
+            continue;
+        }
+        free(stack[i]);
+        if (posix_memalign(&stack[i], 32, size)) {
+            stack[i] = NULL;
+            stack_size[i] = 0;
+            pthread_mutex_unlock(&lock);
+            return false;
+        }
+        stack_size[i] = size;
+    }
+
+    if (req.preview > 0 && !req.build && !req.record && !req.lucky.enabled) {
+        preview_size = (size_t) (req.width / req.preview) * (req.height / req.preview);
+    }
+    if (preview_size > preview_buf_size) {
+        free(preview_buf);
+        preview_buf = (uint8_t *) malloc(preview_size);
+        preview_buf_size = preview_buf ? preview_size : 0;
+        if (!preview_buf) {
+            pthread_mutex_unlock(&lock);
+            return false;
+        }
+    }
+
+    request = req;
+    __atomic_store_n(&abort_requested, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&subs_done, 0, __ATOMIC_RELAXED);
+    pending = true;
+    busy = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+
+    return true;
+}
+
+/**
+ * Ask the capture thread to give up on the current exposure, and on the
+ * rest of its sequence. This does not wait; the thread notices within
+ * CAPTURE_POLL_MS.
+ */
+void FFMVCapture::abort()
+{
+    pthread_mutex_lock(&lock);
+    __atomic_store_n(&abort_requested, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Block until the capture thread is not touching the camera, e.g. before
+ * the DMA ring is torn down.
+ */
+void FFMVCapture::waitIdle()
+{
+    pthread_mutex_lock(&lock);
+    while (busy) {
+        pthread_cond_wait(&cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Called from the main loop once the notify fd is readable. Returns false if
+ * there is nothing to collect. The stack in res stays valid until
+ * releaseResult().
+ */
+bool FFMVCapture::takeResult(FFMVCaptureResult *res)
+{
+    char buf[16];
+
+    while (read(notify_fd[0], buf, sizeof(buf)) > 0)
+        ;
+
+    if (!__atomic_load_n(&result_ready, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *res = result;
+
+    return true;
+}
+
+void FFMVCapture::releaseResult()
+{
+    pthread_mutex_lock(&lock);
+    __atomic_store_n(&result_ready, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Collect the latest preview, if there is one. It stays valid until
+ * releasePreview().
+ */
+bool FFMVCapture::takePreview(FFMVCapturePreview *p)
+{
+    char buf[16];
+
+    while (read(notify_fd[0], buf, sizeof(buf)) > 0)
+        ;
+
+    if (!__atomic_load_n(&preview_ready, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *p = preview;
+
+    return true;
+}
+
+void FFMVCapture::releasePreview()
+{
+    __atomic_store_n(&preview_ready, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Collect the focus metrics of the frame the main loop holds, if they are
+ * in, and fill them into res.
+ */
+bool FFMVCapture::takeFocus(FFMVCaptureResult *res)
+{
+    char buf[16];
+
+    while (read(notify_fd[0], buf, sizeof(buf)) > 0)
+        ;
+
+    if (!__atomic_load_n(&focus_ready, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    res->focus_measured = focus_result.focus_measured;
+    res->focus = focus_result.focus;
+    res->focus_us = focus_result.focus_us;
+    __atomic_store_n(&focus_ready, 0, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+void *FFMVCapture::threadEntry(void *arg)
+{
+    ((FFMVCapture *) arg)->run();
+    return NULL;
+}
+
+void *FFMVCapture::focusThreadEntry(void *arg)
+{
+    ((FFMVCapture *) arg)->runFocus();
+    return NULL;
+}
+
+void FFMVCapture::run()
+{
+    FFMVCaptureRequest req;
+
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (!pending && !quit) {
+            pthread_cond_wait(&cond, &lock);
+        }
+        if (quit) {
+            break;
+        }
+        req = request;
+        pending = false;
+        pthread_mutex_unlock(&lock);
+
+        capture(req);
+
+        pthread_mutex_lock(&lock);
+        busy = false;
+        pthread_cond_broadcast(&cond);
+    }
+    busy = false;
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Measure each frame queueFocus() hands over and pass the metrics on to the
+ * main loop. A frame is measured even if its exposure has since been
+ * aborted: the main loop may already be waiting for it.
+ */
+void FFMVCapture::runFocus()
+{
+    FFMVCaptureRequest req;
+    FFMVCaptureResult res;
+    char c = 0;
+
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (!focus_queued && !quit) {
+            pthread_cond_wait(&cond, &lock);
+        }
+        if (quit) {
+            break;
+        }
+        req = focus_req;
+        res = focus_job;
+        focus_queued = false;
+        pthread_mutex_unlock(&lock);
+
+        measureFocus(req, &res);
+        focus_result = res;
+        __atomic_store_n(&focus_ready, 1, __ATOMIC_RELEASE);
+        if (write(notify_fd[1], &c, 1) < 0) {
+            /* The pipe is only full if the main loop is already due to wake */
+        }
+
+        pthread_mutex_lock(&lock);
+        focus_busy = false;
+        pthread_cond_broadcast(&cond);
+    }
+    focus_busy = false;
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Wait for the next frame in the DMA ring without blocking past an abort.
+ * Returns false on abort or on a capture error, in which case *frame is NULL.
+ */
+bool FFMVCapture::waitFrame(dc1394video_frame_t **frame)
+{
+    struct pollfd pfd;
+    dc1394error_t err;
+
+    *frame = NULL;
+    pfd.fd = camera->captureFileno();
+    pfd.events = POLLIN;
+
+    while (!__atomic_load_n(&abort_requested, __ATOMIC_RELAXED)) {
+        if (poll(&pfd, 1, CAPTURE_POLL_MS) < 0 && errno != EINTR) {
+            return false;
+        }
+        err = camera->dequeue(DC1394_CAPTURE_POLICY_POLL, frame);
+        if (err != DC1394_SUCCESS) {
+            return false;
+        }
+        if (*frame) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Capture req.exposures exposures back to back, leaving the camera
+ * transmitting from the first sub of the first to the last sub of the last.
+ */
+void FFMVCapture::capture(const FFMVCaptureRequest &req)
+{
+    FFMVCaptureResult res;
+    dc1394video_frame_t *frame;
+    dc1394error_t err;
+    struct timeval tv;
+    int64_t t;
+    uint64_t on_us;
+    long flush_us;
+    int i;
+
+    /* Flush the DMA buffer */
+    t = ffmv_time_us();
+    while (1) {
+        err = camera->dequeue(DC1394_CAPTURE_POLICY_POLL, &frame);
+        if (err != DC1394_SUCCESS || !frame) {
+            break;
+        }
+        camera->enqueue(frame);
+    }
+    flush_us = ffmv_time_us() - t;
+
+    /* Have the camera start sending us data. Frame timestamps come from
+     * the wall clock, so that is what stale frames are judged against. */
+    gettimeofday(&tv, NULL);
+    on_us = (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+    err = camera->setTransmission(DC1394_ON);
+    if (err != DC1394_SUCCESS) {
+        memset(&res, 0, sizeof(res));
+        res.stack = stack[0];
+        res.built = req.build != NULL;
+        res.recorded = req.record != NULL;
+        res.error = true;
+        publish(res);
+        return;
+    }
+
+    star_locked = false;
+    for (i = 0; req.exposures <= 0 || i < req.exposures; ++i) {
+        /* Frames keep coming while the last exposure is finished and
+         * published; the DMA ring holds them for this one */
+        if (!exposure(req, stack[i % 2], on_us, &res)) {
+            break;
+        }
+        if (i == 0) {
+            res.flush_us = flush_us;
+        }
+        if (req.guide.enabled) {
+            track(req.guide, &res);
+        }
+        res.focus_pending = req.focus && !req.build && !req.record;
+        if (req.exposures <= 0 || i < req.exposures - 1) {
+            res.more = true;
+            publish(res);
+            if (res.focus_pending) {
+                queueFocus(req, res);
+            }
+        }
+    }
+    camera->setTransmission(DC1394_OFF);
+
+    publish(res);
+    if (res.focus_pending) {
+        queueFocus(req, res);
+    }
+    /* The stack is not free for the next request until it is measured */
+    waitFocus();
+}
+
+/**
+ * Stack req.sub_count subs into out as they land in the DMA ring. Returns
+ * false if the exposure was aborted or failed, and so ends the sequence.
+ */
+bool FFMVCapture::exposure(const FFMVCaptureRequest &req, void *out, uint64_t on_us,
+        FFMVCaptureResult *res)
+{
+    FFMVCaptureResult &result = *res;
+    dc1394video_frame_t *frame;
+    int64_t start, t;
+    uint64_t last_ts = 0;
+    uint64_t gap, period = req.frame_us;
+    long us;
+    int frames = 0, max_frames;
+    bool stacking, selecting;
+    int64_t score_start;
+
+    __atomic_store_n(&subs_done, 0, __ATOMIC_RELAXED);
+    memset(&result, 0, sizeof(result));
+    result.stack = out;
+    result.format = req.format;
+    result.output = req.stack.output;
+    result.width = req.width / req.binx;
+    result.height = req.height / req.biny;
+    result.built = req.build != NULL;
+    result.recorded = req.record != NULL;
+    if (req.build && !req.build->reset(req.format, req.width, req.height)) {
+        result.error = true;
+        return false;
+    }
+    stacking = !req.build && !req.record;
+    selecting = stacking && req.lucky.enabled;
+    /* Selected subs are only stacked once all of them are in */
+    stacker.setPreview(stacking && !selecting ? req.preview : 0);
+    stacker.setRegistration(req.reg.enabled && stacking);
+    if (stacking && !stacker.reset(req.format, req.width, req.height, req.binx, req.biny,
+                req.stack, &req.calib, out)) {
+        result.error = true;
+        return false;
+    }
+    if (selecting && !lucky.reset(req.format, req.width, req.height, req.lucky.metric,
+                req.lucky.keep)) {
+        result.error = true;
+        return false;
+    }
+
+    /* Bad frames are replaced by taking more, up to a limit so that a
+     * camera sending nothing but garbage still ends the exposure */
+    max_frames = req.sub_count + (req.sub_count / 4 > 2 ? req.sub_count / 4 : 2);
+
+    start = ffmv_time_us();
+    t = start;
+    while (result.subs_stacked < req.sub_count) {
+        if (frames == max_frames) {
+            result.error = true;
+            break;
+        }
+        if (!waitFrame(&frame)) {
+            if (__atomic_load_n(&abort_requested, __ATOMIC_RELAXED)) {
+                result.aborted = true;
+            } else {
+                result.error = true;
+            }
+            break;
+        }
+        ++frames;
+        start = ffmv_time_us();
+        us = start - t;
+        result.wait_us += us;
+        if (us > result.wait_max_us) {
+            result.wait_max_us = us;
+        }
+        if ((int) frame->frames_behind + 1 > result.ring_used) {
+            result.ring_used = frame->frames_behind + 1;
+        }
+
+        if (frame->timestamp && frame->timestamp < on_us) {
+            /* Exposed before this exposure started; it slipped past the
+             * flush while transmission was being turned on */
+            ++result.stale;
+        } else if (camera->isFrameCorrupt(frame) ||
+                frame->size[0] != (uint32_t) req.width || frame->size[1] != (uint32_t) req.height) {
+            ++result.corrupt;
+        } else {
+            /* A gap of more than one frame period between subs means the
+             * camera had frames with nowhere to put them. The period starts
+             * out as programmed, and comes down if frames arrive faster. */
+            if (frame->timestamp && last_ts) {
+                gap = frame->timestamp - last_ts;
+                if (!period || gap < period) {
+                    period = gap > (uint64_t) req.sub_us ? gap : req.sub_us;
+                }
+                if (period && gap > period + period / 2) {
+                    result.dropped += (gap + period / 2) / period - 1;
+                }
+            }
+            last_ts = frame->timestamp;
+
+            if (req.build) {
+                req.build->add(frame->image);
+            } else if (req.record) {
+                /* Copied into the recorder's queue, or dropped if its
+                 * writer is behind; it never waits for the disk */
+                req.record->push(frame->image, frame->timestamp);
+            } else if (selecting) {
+                score_start = ffmv_time_us();
+                lucky.offer(frame->image, lucky.score(frame->image));
+                result.score_us += ffmv_time_us() - score_start;
+            } else {
+                if (req.reg.enabled) {
+                    registerSub(req, frame->image, &result);
+                }
+                /* Byte swap and bin the sub and add it to the stack */
+                stacker.add(frame->image);
+            }
+            ++result.subs_stacked;
+            if (stacking && !selecting && req.preview > 0) {
+                publishPreview(result.subs_stacked);
+            }
+        }
+        t = ffmv_time_us();
+        us = t - start;
+        result.stack_us += us;
+        if (us > result.stack_max_us) {
+            result.stack_max_us = us;
+        }
+
+        camera->enqueue(frame);
+        __atomic_store_n(&subs_done, result.subs_stacked, __ATOMIC_RELAXED);
+    }
+    if (selecting && !result.error && !result.aborted) {
+        stackLucky(req, &result);
+    }
+    if (stacking) {
+        stacker.finish();
+        result.rejected = stacker.getRejected();
+    }
+    result.download_us = ffmv_time_us() - start;
+
+    return !result.error && !result.aborted;
+}
+
+/**
+ * Stack the subs lucky imaging kept, best first, so that the sharpest one
+ * is the registration reference.
+ */
+void FFMVCapture::stackLucky(const FFMVCaptureRequest &req, FFMVCaptureResult *res)
+{
+    int i;
+
+    lucky.sort();
+    res->lucky_scored = res->subs_stacked;
+    res->subs_stacked = 0;
+    if (lucky.getKept()) {
+        res->lucky_best = lucky.getScore(0);
+        res->lucky_cutoff = lucky.getScore(lucky.getKept() - 1);
+    }
+    for (i = 0; i < lucky.getKept(); ++i) {
+        if (req.reg.enabled) {
+            registerSub(req, lucky.getSub(i), res);
+        }
+        stacker.add(lucky.getSub(i));
+        ++res->subs_stacked;
+    }
+}
+
+/**
+ * Work out how far a sub has moved against the first one of the exposure,
+ * and have the stacker shift it back. A sub whose stars can't be found is
+ * shifted as the one before it.
+ */
+void FFMVCapture::registerSub(const FFMVCaptureRequest &req, const void *sub,
+        FFMVCaptureResult *res)
+{
+    int64_t t = ffmv_time_us();
+    FFMVShift shift;
+
+    if (!res->subs_stacked) {
+        res->reg_stars = registrar.reference(req.format, sub, req.width, req.height);
+    } else if (res->reg_stars) {
+        if (!registrar.measure(sub, req.reg.search, &shift)) {
+            ++res->reg_failed;
+        }
+        res->reg_dx = shift.dx;
+        res->reg_dy = shift.dy;
+        res->reg_max = std::max(res->reg_max, sqrtf(shift.dx * shift.dx + shift.dy * shift.dy));
+        stacker.setShift(lroundf(shift.dx), lroundf(shift.dy));
+    }
+    res->register_us += ffmv_time_us() - t;
+}
+
+/**
+ * Centroid the guide star in a finished frame, near where it was last time.
+ */
+void FFMVCapture::track(const FFMVGuideParams &guide, FFMVCaptureResult *res)
+{
+    FFMVImage img;
+    int64_t t = ffmv_time_us();
+
+    img.pixels = res->stack;
+    img.bytes = ffmv_output_bytes(res->format, res->output);
+    img.width = res->width;
+    img.height = res->height;
+
+    res->star_found = ffmv_find_guide_star(img, star_x, star_y, star_locked ? guide.search : 0,
+            guide.radius, guide.min_snr, &res->star, star_scratch);
+    star_locked = res->star_found;
+    if (star_locked) {
+        star_x = res->star.x;
+        star_y = res->star.y;
+    }
+    res->centroid_us = ffmv_time_us() - t;
+}
+
+/**
+ * Find the stars in a finished frame and measure their size. This runs on
+ * the focus thread, with its own pool, while the next exposure is stacked.
+ */
+void FFMVCapture::measureFocus(const FFMVCaptureRequest &req, FFMVCaptureResult *res)
+{
+    FFMVImage img;
+    double full = req.format == FFMV_MONO8 ? ffmv_mono8::full : ffmv_mono16::full;
+    double max = req.format == FFMV_MONO8 ? ffmv_mono8::max : ffmv_mono16::max;
+    double sat;
+    int64_t t = ffmv_time_us();
+
+    img.pixels = res->stack;
+    img.bytes = ffmv_output_bytes(res->format, res->output);
+    img.width = res->width;
+    img.height = res->height;
+
+    /* Where a pixel clips, given how the stack was summed. A saturated
+     * MONO16 pixel reads 0xFFC0, not 0xFFFF, so the clip point of a sum is
+     * that many times the pixels summed, up to what the output holds. */
+    full *= req.binx * req.biny;
+    if (res->output == FFMV_OUTPUT_U32) {
+        sat = std::min(full * std::max(res->subs_stacked, 1), 4294967295.0);
+    } else if (res->output == FFMV_OUTPUT_MEAN16) {
+        /* MONO8 means are scaled up by 257 */
+        sat = std::min(req.format == FFMV_MONO8 ? full * 257 : full, 65535.0);
+    } else {
+        sat = std::min(full * std::max(res->subs_stacked, 1), max);
+    }
+
+    focus_meter.measure(img, sat, &res->focus);
+    res->focus_measured = true;
+    res->focus_us = ffmv_time_us() - t;
+}
+
+/**
+ * Hand a published frame to the focus thread. The stack it is in is only
+ * stacked into again two exposures on, and the last frame was queued a
+ * whole exposure ago, so this seldom has to wait.
+ */
+void FFMVCapture::queueFocus(const FFMVCaptureRequest &req, const FFMVCaptureResult &res)
+{
+    pthread_mutex_lock(&lock);
+    while (focus_busy && !quit) {
+        pthread_cond_wait(&cond, &lock);
+    }
+    focus_req = req;
+    focus_job = res;
+    focus_queued = true;
+    focus_busy = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Block until the focus thread is done with the last frame queued.
+ */
+void FFMVCapture::waitFocus()
+{
+    pthread_mutex_lock(&lock);
+    while (focus_busy && !quit) {
+        pthread_cond_wait(&cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Hand a finished frame to the main loop and wake it up. If the main loop
+ * still holds the last one, wait for it, unless the sequence is being
+ * aborted, in which case nobody wants this frame.
+ */
+void FFMVCapture::publish(const FFMVCaptureResult &res)
+{
+    char c = 0;
+
+    pthread_mutex_lock(&lock);
+    while (__atomic_load_n(&result_ready, __ATOMIC_ACQUIRE) && !quit &&
+            !__atomic_load_n(&abort_requested, __ATOMIC_RELAXED)) {
+        pthread_cond_wait(&cond, &lock);
+    }
+    if (__atomic_load_n(&result_ready, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    result = res;
+    __atomic_store_n(&result_ready, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lock);
+
+    if (write(notify_fd[1], &c, 1) < 0) {
+        /* The pipe is only full if the main loop is already due to wake */
+    }
+}
+
+/**
+ * Stretch the thumbnail of the sub just stacked and hand it to the main
+ * loop, unless the main loop is still busy with the last one.
+ */
+void FFMVCapture::publishPreview(int sub)
+{
+    int64_t t = ffmv_time_us();
+    char c = 0;
+
+    if (__atomic_load_n(&preview_ready, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    if (!stacker.renderPreview(preview_buf, &preview.stretch)) {
+        return;
+    }
+    preview.pixels = preview_buf;
+    preview.width = stacker.getPreviewWidth();
+    preview.height = stacker.getPreviewHeight();
+    preview.sub = sub;
+    preview.render_us = ffmv_time_us() - t;
+    __atomic_store_n(&preview_ready, 1, __ATOMIC_RELEASE);
+
+    if (write(notify_fd[1], &c, 1) < 0) {
+        /* The pipe is only full if the main loop is already due to wake */
+    }
+}
@@ -0,0 +1,305 @@
+/**
+ * Capture worker for the Point Grey FireFly MV driver.
+ *
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef FFMV_CAPTURE_H
+#define FFMV_CAPTURE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+#include <dc1394/dc1394.h>
+
+#include "ffmv_accum.h"
+#include "ffmv_camera.h"
+#include "ffmv_focus.h"
+#include "ffmv_lucky.h"
+#include "ffmv_record.h"
+#include "ffmv_register.h"
+#include "ffmv_stack.h"
+#include "ffmv_star.h"
+#include "ffmv_workpool.h"
+
+/**
+ * Guide star tracking, done on each frame as soon as it is stacked.
+ */
+struct FFMVGuideParams {
+    bool enabled;
+    /* How far the star may move between frames; it is looked for across
+     * the whole frame until it is first found, and after it is lost */
+    int search;
+    /* Centroid aperture radius */
+    int radius;
+    float min_snr;
+};
+
+/**
+ * What the capture thread should do for one exposure.
+ */
+struct FFMVCaptureRequest {
+    /* Exposures to take back to back, leaving transmission on in between.
+     * 0 keeps going until abort(). */
+    int exposures;
+    int sub_count;
+    /* Shutter time of each sub; frames can't come any closer together */
+    long sub_us;
+    /* Time from one frame to the next the camera is programmed for, which
+     * gaps between subs are judged against */
+    long frame_us;
+    enum ffmv_pixel_format format;
+    /* Size of the frames the camera sends */
+    int width;
+    int height;
+    /* Software binning applied while stacking */
+    int binx;
+    int biny;
+    FFMVStackParams stack;
+    /* Masters applied to each sub */
+    FFMVCalibFrames calib;
+    /* If set, average the raw subs into this instead of stacking */
+    FFMVCalibBuilder *build;
+    /* If set, queue the raw subs on this recorder instead of stacking;
+     * sub_count is then the number of frames to record */
+    FFMVRecorder *record;
+    FFMVGuideParams guide;
+    /* Shift each sub onto the first before stacking it */
+    FFMVRegisterParams reg;
+    /* Only stack the sharpest subs, once the exposure is over */
+    FFMVLuckyParams lucky;
+    /* Downsampling factor of the per sub preview, 0 for none */
+    int preview;
+    /* Measure focus on each finished exposure */
+    bool focus;
+};
+
+/**
+ * A finished exposure, handed from the capture thread to the main loop.
+ */
+struct FFMVCaptureResult {
+    /* Binned stack, in the request's pixel format and stack output */
+    const void *stack;
+    enum ffmv_pixel_format format;
+    enum ffmv_stack_output output;
+    int width;
+    int height;
+    int subs_stacked;
+    /* Frames thrown away and replaced: damaged in transfer, or exposed
+     * before the exposure started */
+    int corrupt;
+    int stale;
+    /* Frames the camera took but that never reached us */
+    int dropped;
+    /* Most DMA ring buffers that were full at once */
+    int ring_used;
+    /* Pixel samples thrown out or clamped by the stack mode */
+    unsigned long rejected;
+    bool error;
+    bool aborted;
+    /* The subs went to the request's calibration builder */
+    bool built;
+    /* The subs went to the request's recorder; subs_stacked is how many
+     * were queued, and there is no stack */
+    bool recorded;
+    /* The capture thread has gone on to the next exposure of a sequence */
+    bool more;
+    /* Guide star, if the request asked for one */
+    bool star_found;
+    FFMVStar star;
+    long centroid_us;
+    /* Registration, if the request asked for it: stars picked in the
+     * first sub, subs whose stars could not be found again and were
+     * stacked with the last shift, and the shift of the last sub and the
+     * largest one, in raw pixels */
+    int reg_stars;
+    int reg_failed;
+    float reg_dx, reg_dy;
+    float reg_max;
+    long register_us;
+    /* Lucky imaging, if the request asked for it: subs scored, of which
+     * subs_stacked were kept, the scores of the best and worst kept, and
+     * the time spent scoring and keeping them */
+    int lucky_scored;
+    double lucky_best;
+    double lucky_cutoff;
+    long score_us;
+    /* Focus metrics, if the request asked for them. The frame is published
+     * with focus_pending set and the metrics come later, from takeFocus(). */
+    bool focus_pending;
+    bool focus_measured;
+    FFMVFocus focus;
+    long focus_us;
+    /* Time from dequeueing the last sub to the frame being ready */
+    long download_us;
+    /* Time spent emptying the DMA ring before the first sub */
+    long flush_us;
+    /* Time spent waiting for subs to arrive, in total and the longest wait */
+    long wait_us;
+    long wait_max_us;
+    /* Time spent adding subs to the stack, in total and the slowest sub */
+    long stack_us;
+    long stack_max_us;
+};
+
+/**
+ * An 8 bit stretched thumbnail of the latest sub.
+ */
+struct FFMVCapturePreview {
+    const uint8_t *pixels;
+    int width;
+    int height;
+    /* Which sub of the exposure it shows, from 1 */
+    int sub;
+    FFMVStretch stretch;
+    /* Time taken to stretch it, on top of stacking the sub */
+    long render_us;
+};
+
+/**
+ * Dequeues subs from the DMA ring on a dedicated thread and stacks each one
+ * as soon as it arrives.
+ *
+ * The main loop arms an exposure with begin() and then goes back to serving
+ * clients. When the last sub has been stacked the finished frame is
+ * published through a single-slot lock-free handoff and a byte is written
+ * to getNotifyFd(), which the main loop watches with IEAddCallback(). The
+ * main loop then picks the frame up with takeResult() and hands the slot
+ * back with releaseResult().
+ *
+ * A request for several exposures is captured as a sequence: the camera
+ * keeps transmitting, and the next exposure is stacked into a second buffer
+ * while the main loop is still encoding and sending the last one. Only
+ * publishing waits for the main loop, if it has not released the slot by
+ * the time the next exposure is finished.
+ *
+ * Previews of single subs go through a second slot, collected with
+ * takePreview() and releasePreview(). They never hold up capture: while the
+ * main loop still has the last one, new ones are simply not made.
+ *
+ * Focus is measured on a thread and pool of its own, once the frame has
+ * been published, while the capture thread goes on with the next exposure.
+ * The metrics go through a third slot, collected with takeFocus(). The main
+ * loop holds on to the frame until then, so the slot is free again by the
+ * time the next frame is measured.
+ */
+class FFMVCapture
+{
+public:
+    /* The capture thread and its stacking pool use ncpus CPUs from
+     * first_cpu on, or float freely if first_cpu < 0 */
+    FFMVCapture(int first_cpu = -1, int ncpus = 0);
+    ~FFMVCapture();
+
+    bool start(FFMVCamera *cam);
+    void stop();
+
+    bool begin(const FFMVCaptureRequest &req);
+    void abort();
+    void waitIdle();
+
+    int getNotifyFd() const { return notify_fd[0]; }
+    int getSubsDone() const { return __atomic_load_n(&subs_done, __ATOMIC_RELAXED); }
+
+    bool takeResult(FFMVCaptureResult *res);
+    void releaseResult();
+
+    bool takePreview(FFMVCapturePreview *p);
+    void releasePreview();
+
+    bool takeFocus(FFMVCaptureResult *res);
+
+private:
+    static void *threadEntry(void *arg);
+    static void *focusThreadEntry(void *arg);
+    void run();
+    void runFocus();
+    void capture(const FFMVCaptureRequest &req);
+    bool exposure(const FFMVCaptureRequest &req, void *out, uint64_t on_us, FFMVCaptureResult *res);
+    void track(const FFMVGuideParams &guide, FFMVCaptureResult *res);
+    void measureFocus(const FFMVCaptureRequest &req, FFMVCaptureResult *res);
+    void queueFocus(const FFMVCaptureRequest &req, const FFMVCaptureResult &res);
+    void waitFocus();
+    void registerSub(const FFMVCaptureRequest &req, const void *sub, FFMVCaptureResult *res);
+    void stackLucky(const FFMVCaptureRequest &req, FFMVCaptureResult *res);
+    bool waitFrame(dc1394video_frame_t **frame);
+    void publish(const FFMVCaptureResult &res);
+    void publishPreview(int sub);
+
+    FFMVCamera *camera;
+
+    pthread_t thread;
+    pthread_t focus_thread;
+    int cpu;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool running;
+
+    /* Protected by lock */
+    bool quit;
+    bool pending;
+    bool busy;
+    FFMVCaptureRequest request;
+
+    /* Written by the main loop, read by the capture thread */
+    int abort_requested;
+    /* Written by the capture thread, read by the main loop */
+    int subs_done;
+
+    /* Stacks are filled in turn, so the main loop can read one while the
+     * next exposure of a sequence goes into the other */
+    void *stack[2];
+    size_t stack_size[2];
+
+    FFMVWorkPool pool;
+    FFMVStacker stacker;
+    /* Not pinned, so the scheduler fits it around the stacking pool */
+    FFMVWorkPool focus_pool;
+    FFMVFocusMeter focus_meter;
+    FFMVRegister registrar;
+    FFMVLucky lucky;
+
+    /* Guide star position from the last frame, used by the capture thread */
+    bool star_locked;
+    float star_x, star_y;
+    std::vector<float> star_scratch;
+
+    /* Single slot handoff. The capture thread fills result and then sets
+     * result_ready; the main loop clears it once it is done with the stack
+     * and signals cond. */
+    FFMVCaptureResult result;
+    int result_ready;
+    int notify_fd[2];
+
+    /* The same for previews, which share the notify fd */
+    uint8_t *preview_buf;
+    size_t preview_buf_size;
+    FFMVCapturePreview preview;
+    int preview_ready;
+
+    /* The frame waiting to be measured, queued by the capture thread and
+     * taken by the focus thread; focus_busy stays set until its metrics
+     * are in focus_result. Protected by lock. */
+    FFMVCaptureRequest focus_req;
+    FFMVCaptureResult focus_job;
+    bool focus_queued;
+    bool focus_busy;
+    /* And for the main loop, sharing the notify fd */
+    FFMVCaptureResult focus_result;
+    int focus_ready;
+};
+
+#endif // FFMV_CAPTURE_H
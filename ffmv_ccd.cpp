@@ -17,6 +17,8 @@
  */
 
 #include <sys/time.h>
+#include <time.h>
+#include <limits.h>
 #include <memory>
 #include <stdint.h>
 #include <arpa/inet.h>
@@ -24,86 +26,146 @@
 #include <sys/time.h>
 
 #include <indiapi.h>
+#include <eventloop.h>
 #include <iostream>
 #include "ffmv_ccd.h"
+#include "ffmv_accum.h"
+#include "ffmv_sim.h"
+#include "ffmv_time.h"
 #include <dc1394/dc1394.h>
 
 const int POLLMS = 250;
-
-std::auto_ptr<FFMVCCD> ffmvCCD(0);
-
-/**
- * Write to registers in the MT9V022 chip.
- * This can be done by programming the address in 0x1A00 and writing to 0x1A04.
- */
-dc1394error_t FFMVCCD::writeMicronReg(unsigned int offset, unsigned int val)
-{
-        dc1394error_t err;
-        err = dc1394_set_control_register(dcam, 0x1A00, offset);
-        if (err != DC1394_SUCCESS) {
-            return err;
-        }
-
-        err = dc1394_set_control_register(dcam, 0x1A04, val);
-        if (err != DC1394_SUCCESS) {
-            return err;
-        }
-
-        return DC1394_SUCCESS;
-}
-
-/**
- * Read a register from the MT9V022 sensor.
- * This writes the MT9V022 register address to 0x1A00 and then reads from 0x1A04
- */
-dc1394error_t FFMVCCD::readMicronReg(unsigned int offset, unsigned int *val)
+/* Bounds on the DMA ring, in frames */
+const int RING_MIN = 3;
+const int RING_MAX = 32;
+const char *CALIBRATION_TAB = "Calibration";
+const char *DIAGNOSTICS_TAB = "Diagnostics";
+const char *GUIDING_TAB = "Guiding";
+const char *RECORDING_TAB = "Recording";
+
+/* Tags for batches queued on the control thread */
+enum {
+    CONTROL_GAIN
+};
+
+/* One INDI device per camera on the bus */
+const int MAX_CAMERAS = 8;
+static FFMVCCD *cameras[MAX_CAMERAS];
+static int camera_count;
+
+static void cleanup()
 {
-        dc1394error_t err;
-        err = dc1394_set_control_register(dcam, 0x1A00, offset);
-        if (err != DC1394_SUCCESS) {
-            return err;
-        }
-
-        err = dc1394_get_control_register(dcam, 0x1A04, val);
-        if (err != DC1394_SUCCESS) {
-            return err;
-        }
+    int i;
 
-        return DC1394_SUCCESS;
+    for (i = 0; i < camera_count; ++i) {
+        delete cameras[i];
+    }
+    camera_count = 0;
 }
 
 void ISInit()
 {
     static int isInit =0;
+    dc1394_t *dc1394;
+    dc1394camera_list_t *list = NULL;
+    char name[MAXINDIDEVICE];
+    int ncpus, per_camera;
+    int i, n = 0;
+
     if (isInit == 1)
         return;
 
-     isInit = 1;
-     if(ffmvCCD.get() == 0) ffmvCCD.reset(new FFMVCCD());
+    isInit = 1;
+
+    dc1394 = dc1394_new();
+    if (dc1394 && dc1394_camera_enumerate(dc1394, &list) == DC1394_SUCCESS) {
+        n = list->num < (uint32_t) MAX_CAMERAS ? list->num : MAX_CAMERAS;
+    }
+
+    if (n <= 1) {
+        /* Keep the old name, and let Connect() find the camera if it is
+         * plugged in later */
+        cameras[0] = new FFMVCCD(n ? list->ids[0].guid : 0, "Point Grey FireFly MV", -1, 0);
+        camera_count = 1;
+    } else {
+        /* Give each camera its own share of the CPUs for its capture thread
+         * and stacking pool, so cameras don't contend with each other */
+        ncpus = ffmv_cpu_count();
+        per_camera = ncpus / n > 0 ? ncpus / n : 1;
+        for (i = 0; i < n; ++i) {
+            snprintf(name, sizeof(name), "Point Grey FireFly MV %016llx", (unsigned long long) list->ids[i].guid);
+            cameras[i] = new FFMVCCD(list->ids[i].guid, name, (i * per_camera) % ncpus, per_camera);
+        }
+        camera_count = n;
+    }
+
+    if (list) {
+        dc1394_camera_free_list(list);
+    }
+    if (dc1394) {
+        dc1394_free(dc1394);
+    }
+    atexit(cleanup);
 }
 
 void ISGetProperties(const char *dev)
 {
-         ISInit();
-         ffmvCCD->ISGetProperties(dev);
+    int i;
+
+    ISInit();
+    for (i = 0; i < camera_count; ++i) {
+        if (dev == NULL || !strcmp(dev, cameras[i]->getDeviceName())) {
+            cameras[i]->ISGetProperties(dev);
+            if (dev != NULL) {
+                break;
+            }
+        }
+    }
 }
 
 void ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int num)
 {
-         ISInit();
-         ffmvCCD->ISNewSwitch(dev, name, states, names, num);
+    int i;
+
+    ISInit();
+    for (i = 0; i < camera_count; ++i) {
+        if (dev == NULL || !strcmp(dev, cameras[i]->getDeviceName())) {
+            cameras[i]->ISNewSwitch(dev, name, states, names, num);
+            if (dev != NULL) {
+                break;
+            }
+        }
+    }
 }
 
 void ISNewText(	const char *dev, const char *name, char *texts[], char *names[], int num)
 {
-         ISInit();
-         ffmvCCD->ISNewText(dev, name, texts, names, num);
+    int i;
+
+    ISInit();
+    for (i = 0; i < camera_count; ++i) {
+        if (dev == NULL || !strcmp(dev, cameras[i]->getDeviceName())) {
+            cameras[i]->ISNewText(dev, name, texts, names, num);
+            if (dev != NULL) {
+                break;
+            }
+        }
+    }
 }
 
 void ISNewNumber(const char *dev, const char *name, double values[], char *names[], int num)
 {
-         ISInit();
-         ffmvCCD->ISNewNumber(dev, name, values, names, num);
+    int i;
+
+    ISInit();
+    for (i = 0; i < camera_count; ++i) {
+        if (dev == NULL || !strcmp(dev, cameras[i]->getDeviceName())) {
+            cameras[i]->ISNewNumber(dev, name, values, names, num);
+            if (dev != NULL) {
+                break;
+            }
+        }
+    }
 }
 
 void ISNewBLOB (const char *dev, const char *name, int sizes[], int blobsizes[], char *blobs[], char *formats[], char *names[], int n)
@@ -120,120 +182,442 @@ void ISNewBLOB (const char *dev, const char *name, int sizes[], int blobsizes[],
 
 void ISSnoopDevice (XMLEle *root)
 {
-     ISInit();
-     ffmvCCD->ISSnoopDevice(root);
+    int i;
+
+    ISInit();
+    for (i = 0; i < camera_count; ++i) {
+        cameras[i]->ISSnoopDevice(root);
+    }
 }
 
 
-FFMVCCD::FFMVCCD()
+FFMVCCD::FFMVCCD(uint64_t guid, const char *name, int first_cpu, int ncpus) :
+    capture(first_cpu, ncpus), encode_pool(ncpus), compressor(&encode_pool)
 {
+    this->guid = guid;
+    strncpy(this->name, name, sizeof(this->name) - 1);
+    this->name[sizeof(this->name) - 1] = '\0';
+    setDeviceName(this->name);
+
     InExposure = false;
     capturing = false;
+    captureCB = -1;
+    controlCB = -1;
+    subs_reported = 0;
+    sequence_left = 0;
+    sequence_next = false;
+    frame_waiting = false;
+    guiding = false;
+    guide_frames = 0;
+    recording = false;
+    pixel_format = FFMV_MONO16;
+    calib_building = -1;
+    calib_sub_length = 0;
+    min_exposure = 0;
+    dc1394 = NULL;
+    camera = NULL;
+    memset(&known_config, 0, sizeof(known_config));
+    trace_file = NULL;
+    fits_bytes = 0;
+    compress_us = 0;
+    compress_ratio = 0;
+    focus_valid = false;
+    memset(&focus, 0, sizeof(focus));
+    stats_valid = false;
+    memset(&frame_stats, 0, sizeof(frame_stats));
+    timerID = -1;
+    ring_depth = RING_MIN + 1;
+    last_stack_max_us = 0;
+    last_ring_used = 0;
 }
 
 /**************************************************************************************
 ** Client is asking us to establish connection to the device
 ***************************************************************************************/
 bool FFMVCCD::Connect()
+{
+    dc1394error_t err;
+    int64_t start, t;
+    bool warm;
+
+    start = ffmv_time_us();
+    t = start;
+    memset(connect_ms, 0, sizeof(connect_ms));
+
+    /* A warm connect goes straight to the camera we had last time and
+     * leaves its settings alone where they already match. */
+    warm = ConnectModeS[1].s == ISS_ON && known_config.valid;
+    camera = isSimulation() ? openSimulator() : openCamera(&warm);
+    if (!camera) {
+        return false;
+    }
+    if (camera->getGuid() != known_config.guid) {
+        warm = false;
+    }
+    connectPhase(CONNECT_OPEN, &t);
+    snprintf(guid_text, sizeof(guid_text), "%016llx", (unsigned long long) camera->getGuid());
+    IUSaveText(&GuidT[0], guid_text);
+    IDSetText(&GuidTP, NULL);
+
+    /* Register writes go through the control thread from here on. A
+     * previous connect attempt may have failed after starting it. */
+    if (controlCB >= 0) {
+        IERmCallback(controlCB);
+        controlCB = -1;
+    }
+    control.stop();
+    if (!control.start(camera)) {
+        IDMessage(getDeviceName(), "Unable to start control thread!");
+        goto fail;
+    }
+    controlCB = IEAddCallback(control.getNotifyFd(), controlReadyCB, this);
+
+    /* Always come up in deep mode */
+    pixel_format = FFMV_MONO16;
+    IUResetSwitch(&CaptureModeSP);
+    CaptureModeS[0].s = ISS_ON;
+
+    if (warm && configureCamera(true) != DC1394_SUCCESS) {
+        DEBUG(INDI::Logger::DBG_WARNING, "Warm connect failed, doing a full connect.");
+        control.invalidate();
+        warm = false;
+    }
+    if (!warm) {
+        known_config.valid = false;
+
+        /* Reset camera */
+        err = camera->reset();
+        if (err != DC1394_SUCCESS) {
+            IDMessage(getDeviceName(), "Unable to reset camera!");
+            goto fail;
+        }
+        connectPhase(CONNECT_RESET, &t);
+
+        if (configureCamera(false) != DC1394_SUCCESS) {
+            goto fail;
+        }
+    }
+    t = ffmv_time_us();
+
+    err=camera->captureSetup(ring_depth, DC1394_CAPTURE_FLAGS_DEFAULT);
+    if (err != DC1394_SUCCESS) {
+        IDMessage(getDeviceName(), "Unable to set up capture!");
+        goto fail;
+    }
+    connectPhase(CONNECT_CAPTURE, &t);
+
+    /* Subs are dequeued and stacked on their own thread */
+    if (!capture.start(camera)) {
+        IDMessage(getDeviceName(), "Unable to start capture thread!");
+        goto fail;
+    }
+    captureCB = IEAddCallback(capture.getNotifyFd(), captureReadyCB, this);
+    connectPhase(CONNECT_THREADS, &t);
+
+    /* Remember what a good configuration looks like for the next connect */
+    known_config.valid = true;
+    known_config.guid = camera->getGuid();
+    known_config.video_mode = video_mode;
+    known_config.max_width = max_width;
+    known_config.max_height = max_height;
+    known_config.unit_width = unit_width;
+    known_config.unit_height = unit_height;
+    known_config.unit_left = unit_left;
+    known_config.unit_top = unit_top;
+
+    t = start;
+    connectPhase(CONNECT_TOTAL, &t);
+    DEBUGF(INDI::Logger::DBG_SESSION, "%s connect took %.1f ms (open %.1f, reset %.1f, mode %.1f, "
+            "features %.1f, capture %.1f, threads %.1f)", warm ? "Warm" : "Full",
+            connect_ms[CONNECT_TOTAL], connect_ms[CONNECT_OPEN], connect_ms[CONNECT_RESET],
+            connect_ms[CONNECT_MODE], connect_ms[CONNECT_FEATURES], connect_ms[CONNECT_CAPTURE],
+            connect_ms[CONNECT_THREADS]);
+
+    IDMessage(getDeviceName(), "Using %s sub accumulation kernel", ffmv_accum_select()->name);
+
+    return true;
+
+fail:
+    /* Nothing may be left bound to the camera, since the next connect
+     * opens a new one */
+    if (controlCB >= 0) {
+        IERmCallback(controlCB);
+        controlCB = -1;
+    }
+    control.stop();
+    camera->captureStop();
+    delete camera;
+    camera = NULL;
+    return false;
+}
+
+/**
+ * Open the camera on the bus: the one from the last connection on a warm
+ * connect, else the one this device is bound to, else the first found.
+ * Clears *warm if the last one is gone.
+ */
+FFMVCamera *FFMVCCD::openCamera(bool *warm)
 {
     dc1394camera_list_t *list;
+    dc1394camera_t *dcam = NULL;
     dc1394error_t err;
-    bool supported;
-    bool settings_valid;
-    uint32_t val;
-    dc1394format7mode_t fm7;
-    dc1394feature_info_t feature;
-    float min, max;
 
-    dc1394 = dc1394_new();
     if (!dc1394) {
-        return false;
+        dc1394 = dc1394_new();
+        if (!dc1394) {
+            return NULL;
+        }
     }
 
-    err = dc1394_camera_enumerate(dc1394, &list);
-    if (err != DC1394_SUCCESS) {
-        IDMessage(getDeviceName(), "Could not find DC1394 cameras!");
-        return false;
+    *warm = *warm && (!guid || guid == known_config.guid);
+    if (*warm) {
+        dcam = dc1394_camera_new(dc1394, known_config.guid);
+        if (!dcam) {
+            DEBUG(INDI::Logger::DBG_WARNING, "Camera from last connection not found, doing a full connect.");
+            *warm = false;
+        }
     }
-    if (!list->num) {
-        IDMessage(getDeviceName(), "No DC1394 cameras found!");
-        return false;
+    if (!dcam && guid) {
+        /* This device is bound to one camera; don't pick up another */
+        dcam = dc1394_camera_new(dc1394, guid);
+        if (!dcam) {
+            DEBUGF(INDI::Logger::DBG_ERROR, "Camera %016llx not found!", (unsigned long long) guid);
+            return NULL;
+        }
     }
-    dcam = dc1394_camera_new(dc1394, list->ids[0].guid);
     if (!dcam) {
-        IDMessage(getDeviceName(), "Unable to connect to camera!");
-        return false;
+        err = dc1394_camera_enumerate(dc1394, &list);
+        if (err != DC1394_SUCCESS) {
+            IDMessage(getDeviceName(), "Could not find DC1394 cameras!");
+            return NULL;
+        }
+        if (!list->num) {
+            IDMessage(getDeviceName(), "No DC1394 cameras found!");
+            dc1394_camera_free_list(list);
+            return NULL;
+        }
+        dcam = dc1394_camera_new(dc1394, list->ids[0].guid);
+        dc1394_camera_free_list(list);
+        if (!dcam) {
+            IDMessage(getDeviceName(), "Unable to connect to camera!");
+            return NULL;
+        }
     }
 
-    /* Reset camera */
-    err = dc1394_camera_reset(dcam);
-    if (err != DC1394_SUCCESS) {
-        IDMessage(getDeviceName(), "Unable to reset camera!");
-        return false;
+    return new FFMVDC1394Camera(dcam);
+}
+
+/**
+ * Make the camera for simulation mode: a replay of SIMULATOR_REPLAY if it
+ * names a file, else a simulated star field.
+ */
+FFMVCamera *FFMVCCD::openSimulator()
+{
+    FFMVSimParams params;
+    FFMVReplayCamera *replay;
+
+    ffmv_sim_defaults(&params);
+    params.stars = SimulatorN[0].value;
+    params.fwhm = SimulatorN[1].value;
+    params.seeing = SimulatorN[2].value;
+    params.star_flux = SimulatorN[3].value;
+    params.sky = SimulatorN[4].value;
+    params.read_noise = SimulatorN[5].value;
+    params.drift_x = SimulatorN[6].value;
+    params.drift_y = SimulatorN[7].value;
+    params.seed = SimulatorN[8].value;
+
+    if (!SimulatorReplayT[0].text || !SimulatorReplayT[0].text[0]) {
+        DEBUG(INDI::Logger::DBG_SESSION, "Simulating a camera.");
+        return new FFMVSimCamera(params);
     }
 
-    /* Set mode */
-    err = dc1394_video_set_mode(dcam, DC1394_VIDEO_MODE_640x480_MONO16);
-    if (err != DC1394_SUCCESS) {
-        IDMessage(getDeviceName(), "Unable to connect to set videomode!");
-        return false;
+    replay = new FFMVReplayCamera(params);
+    if (!replay->open(SimulatorReplayT[0].text)) {
+        DEBUGF(INDI::Logger::DBG_ERROR, "Unable to replay %s.", SimulatorReplayT[0].text);
+        delete replay;
+        return NULL;
+    }
+    DEBUGF(INDI::Logger::DBG_SESSION, "Replaying %d frames from %s.", replay->getFrameCount(),
+            SimulatorReplayT[0].text);
+
+    return replay;
+}
+
+/**
+ * Add the time since *t to connect phase i and restart *t.
+ */
+void FFMVCCD::connectPhase(int i, int64_t *t)
+{
+    int64_t now = ffmv_time_us();
+
+    connect_ms[i] += (now - *t) / 1000.0;
+    *t = now;
+}
+
+/**
+ * Read a feature's current state. Returns false if it can't be read, in
+ * which case the caller should just set it.
+ */
+static bool getFeature(FFMVCamera *camera, dc1394feature_t id, dc1394feature_info_t *feature)
+{
+    memset(feature, 0, sizeof(*feature));
+    feature->id = id;
+    return camera->getFeature(feature) == DC1394_SUCCESS;
+}
+
+/**
+ * Put the camera into the state the driver runs it in. On a warm connect
+ * each setting is read back first and only written if it differs, and the
+ * mode and shutter limits come from the last connection.
+ */
+dc1394error_t FFMVCCD::configureCamera(bool warm)
+{
+    dc1394error_t err;
+    dc1394video_mode_t mode;
+    dc1394framerate_t rate;
+    dc1394feature_info_t feature;
+    dc1394color_coding_t coding;
+    uint32_t packet, left, top, width, height;
+    uint32_t reg;
+    float min, max;
+    FFMVRegWrite gain_reg;
+    int64_t t;
+
+    t = ffmv_time_us();
+
+    /* Set mode. Format7 lets subframes be cropped by the camera, so only the
+     * requested window crosses the bus. Fall back to the fixed 640x480 mode
+     * if the camera won't do it.
+     */
+    if (warm) {
+        err = camera->getVideoMode(&mode);
+        if (err != DC1394_SUCCESS || mode != known_config.video_mode) {
+            return DC1394_FAILURE;
+        }
+        video_mode = known_config.video_mode;
+        max_width = known_config.max_width;
+        max_height = known_config.max_height;
+        unit_width = known_config.unit_width;
+        unit_height = known_config.unit_height;
+        unit_left = known_config.unit_left;
+        unit_top = known_config.unit_top;
+        if (video_mode == DC1394_VIDEO_MODE_FORMAT7_0) {
+            err = camera->getROI(video_mode, &coding, &packet, &left, &top, &width, &height);
+            if (err != DC1394_SUCCESS || coding != DC1394_COLOR_CODING_MONO16 ||
+                    left || top || width != max_width || height != max_height) {
+                err = setROI(0, 0, max_width, max_height);
+                if (err != DC1394_SUCCESS) {
+                    return err;
+                }
+            }
+        } else if (video_mode != DC1394_VIDEO_MODE_640x480_MONO16) {
+            return DC1394_FAILURE;
+        }
+    } else {
+        err = setupFormat7();
+        if (err != DC1394_SUCCESS) {
+            IDMessage(getDeviceName(), "Format7 unavailable, subframes will not be supported.");
+            video_mode = DC1394_VIDEO_MODE_640x480_MONO16;
+            max_width = 640;
+            max_height = 480;
+            err = camera->setVideoMode(video_mode);
+            if (err != DC1394_SUCCESS) {
+                IDMessage(getDeviceName(), "Unable to connect to set videomode!");
+                return err;
+            }
+        }
     }
+    connectPhase(CONNECT_MODE, &t);
+
     /* Disable Auto exposure control */
-    err = dc1394_feature_set_power(dcam, DC1394_FEATURE_EXPOSURE, DC1394_OFF);
-    if (err != DC1394_SUCCESS) {
-        IDMessage(getDeviceName(), "Unable to disable auto exposure control");
-        return false;
+    if (!warm || !getFeature(camera, DC1394_FEATURE_EXPOSURE, &feature) || feature.is_on) {
+        err = camera->setFeaturePower(DC1394_FEATURE_EXPOSURE, DC1394_OFF);
+        if (err != DC1394_SUCCESS) {
+            IDMessage(getDeviceName(), "Unable to disable auto exposure control");
+            return err;
+        }
     }
 
-    /* Set frame rate to the lowest possible */
-    err = dc1394_video_set_framerate(dcam, DC1394_FRAMERATE_7_5);
-    if (err != DC1394_SUCCESS) {
-        IDMessage(getDeviceName(), "Unable to connect to set framerate!");
-        return false;
+    /* Set frame rate to the lowest possible. Format7 modes have no fixed
+     * frame rates; there the rate follows from the packet size and ROI. */
+    if (video_mode != DC1394_VIDEO_MODE_FORMAT7_0 &&
+            (!warm || camera->getFramerate(&rate) != DC1394_SUCCESS ||
+             rate != DC1394_FRAMERATE_7_5)) {
+        err = camera->setFramerate(DC1394_FRAMERATE_7_5);
+        if (err != DC1394_SUCCESS) {
+            IDMessage(getDeviceName(), "Unable to connect to set framerate!");
+            return err;
+        }
     }
     /* Turn frame rate control off to enable extended exposure (subs of 512ms) */
-    err = dc1394_feature_set_power(dcam, DC1394_FEATURE_FRAME_RATE, DC1394_OFF);
-    if (err != DC1394_SUCCESS) {
-        IDMessage(getDeviceName(), "Unable to disable framerate!");
-        return false;
+    if (!warm || !getFeature(camera, DC1394_FEATURE_FRAME_RATE, &feature) || feature.is_on) {
+        err = camera->setFeaturePower(DC1394_FEATURE_FRAME_RATE, DC1394_OFF);
+        if (err != DC1394_SUCCESS) {
+            IDMessage(getDeviceName(), "Unable to disable framerate!");
+            return err;
+        }
     }
 
     /* Get the longest possible exposure length */
-    err = dc1394_feature_set_mode(dcam, DC1394_FEATURE_SHUTTER, DC1394_FEATURE_MODE_MANUAL);
-    if (err != DC1394_SUCCESS) {
-        IDMessage(getDeviceName(), "Failed to enable manual shutter control.");
-    } 
-    err = dc1394_feature_set_absolute_control(dcam, DC1394_FEATURE_SHUTTER, DC1394_ON);
-    if (err != DC1394_SUCCESS) {
-        IDMessage(getDeviceName(), "Failed to enable absolute shutter control.");
-    } 
-    err = dc1394_feature_get_absolute_boundaries(dcam, DC1394_FEATURE_SHUTTER, &min, &max);
-    if (err != DC1394_SUCCESS) {
-        IDMessage(getDeviceName(), "Could not get max shutter length");
+    if (!warm || !getFeature(camera, DC1394_FEATURE_SHUTTER, &feature)) {
+        memset(&feature, 0, sizeof(feature));
+        feature.current_mode = DC1394_FEATURE_MODE_AUTO;
+        feature.abs_control = DC1394_OFF;
+    }
+    if (feature.current_mode != DC1394_FEATURE_MODE_MANUAL) {
+        err = camera->setFeatureMode(DC1394_FEATURE_SHUTTER, DC1394_FEATURE_MODE_MANUAL);
+        if (err != DC1394_SUCCESS) {
+            IDMessage(getDeviceName(), "Failed to enable manual shutter control.");
+        }
+    }
+    if (feature.abs_control != DC1394_ON) {
+        err = camera->setAbsoluteControl(DC1394_FEATURE_SHUTTER, DC1394_ON);
+        if (err != DC1394_SUCCESS) {
+            IDMessage(getDeviceName(), "Failed to enable absolute shutter control.");
+        }
+    }
+    if (warm && feature.abs_control == DC1394_ON && feature.abs_max > 0) {
+        /* getFeature() already read the limits */
+        min_exposure = feature.abs_min;
+        max_exposure = feature.abs_max;
     } else {
-        max_exposure = max;
+        err = camera->getAbsoluteBoundaries(DC1394_FEATURE_SHUTTER, &min, &max);
+        if (err != DC1394_SUCCESS) {
+            IDMessage(getDeviceName(), "Could not get max shutter length");
+        } else {
+            min_exposure = min;
+            max_exposure = max;
+        }
     }
 
     /* Set gain to max. By setting the register directly, we can achieve a
      * gain of 24 dB...compared to a gain of 12 dB which is reported as the
-     * max
+     * max. On a warm connect, seeding the shadow with what the camera holds
+     * lets the control thread skip the write.
      */
-    err = dc1394_set_control_register(dcam, 0x820, 0x40);
-    //err = dc1394_set_control_register(dcam, 0x820, 0x7f);
+    if (warm && camera->getControlRegister(0x820, &reg) == DC1394_SUCCESS) {
+        control.seed(FFMV_REG_CAMERA, 0x820, reg);
+    }
+    gain_reg.space = FFMV_REG_CAMERA;
+    gain_reg.offset = 0x820;
+    gain_reg.value = 0x40;
+    //gain_reg.value = 0x7f;
+    err = control.apply(&gain_reg, 1);
     if (err != DC1394_SUCCESS) {
             return err;
     }
 #if 0
     /* Set absolute gain to max */
-    err = dc1394_feature_set_absolute_control(dcam, DC1394_FEATURE_GAIN, DC1394_ON);
+    err = camera->setAbsoluteControl(DC1394_FEATURE_GAIN, DC1394_ON);
     if (err != DC1394_SUCCESS) {
         IDMessage(getDeviceName(), "Failed to enable ansolute gain control.");
     } 
-    err = dc1394_feature_get_absolute_boundaries(dcam, DC1394_FEATURE_GAIN, &min, &max);
+    err = camera->getAbsoluteBoundaries(DC1394_FEATURE_GAIN, &min, &max);
     if (err != DC1394_SUCCESS) {
         IDMessage(getDeviceName(), "Could not get max gain value");
     } else {
-        err = dc1394_feature_set_absolute_value(dcam, DC1394_FEATURE_GAIN, max);
+        err = camera->setAbsoluteValue(DC1394_FEATURE_GAIN, max);
         if (err != DC1394_SUCCESS) {
             IDMessage(getDeviceName(), "Could not set max gain value");
         }
@@ -241,40 +625,60 @@ bool FFMVCCD::Connect()
 #endif
 
     /* Set brightness */
-    err = dc1394_feature_set_mode(dcam, DC1394_FEATURE_BRIGHTNESS, DC1394_FEATURE_MODE_MANUAL);
-    if (err != DC1394_SUCCESS) {
-        IDMessage(getDeviceName(), "Failed to enable manual brightness control.");
-    } 
-    err = dc1394_feature_set_absolute_control(dcam, DC1394_FEATURE_BRIGHTNESS, DC1394_ON);
-    if (err != DC1394_SUCCESS) {
-        IDMessage(getDeviceName(), "Failed to enable ansolute brightness control.");
-    } 
-    err = dc1394_feature_set_absolute_value(dcam, DC1394_FEATURE_BRIGHTNESS, 1);
-    if (err != DC1394_SUCCESS) {
-            IDMessage(getDeviceName(), "Could not set max brightness value");
+    if (!warm || !getFeature(camera, DC1394_FEATURE_BRIGHTNESS, &feature)) {
+        memset(&feature, 0, sizeof(feature));
+        feature.current_mode = DC1394_FEATURE_MODE_AUTO;
+        feature.abs_control = DC1394_OFF;
+    }
+    if (feature.current_mode != DC1394_FEATURE_MODE_MANUAL) {
+        err = camera->setFeatureMode(DC1394_FEATURE_BRIGHTNESS, DC1394_FEATURE_MODE_MANUAL);
+        if (err != DC1394_SUCCESS) {
+            IDMessage(getDeviceName(), "Failed to enable manual brightness control.");
+        }
+    }
+    if (feature.abs_control != DC1394_ON) {
+        err = camera->setAbsoluteControl(DC1394_FEATURE_BRIGHTNESS, DC1394_ON);
+        if (err != DC1394_SUCCESS) {
+            IDMessage(getDeviceName(), "Failed to enable ansolute brightness control.");
+        }
+    }
+    if (feature.abs_control != DC1394_ON || feature.abs_value != 1) {
+        err = camera->setAbsoluteValue(DC1394_FEATURE_BRIGHTNESS, 1);
+        if (err != DC1394_SUCCESS) {
+                IDMessage(getDeviceName(), "Could not set max brightness value");
+        }
     }
 
     /* Turn gamma control off */
-    err = dc1394_feature_set_absolute_value(dcam, DC1394_FEATURE_GAMMA, 1);
-    if (err != DC1394_SUCCESS) {
-            IDMessage(getDeviceName(), "Could not set gamma value");
+    if (!warm || !getFeature(camera, DC1394_FEATURE_GAMMA, &feature)) {
+        memset(&feature, 0, sizeof(feature));
+        feature.is_on = DC1394_ON;
     }
-    err = dc1394_feature_set_power(dcam, DC1394_FEATURE_GAMMA, DC1394_OFF);
-    if (err != DC1394_SUCCESS) {
-        IDMessage(getDeviceName(), "Unable to disable gamma!");
-        return false;
+    if (feature.abs_value != 1) {
+        err = camera->setAbsoluteValue(DC1394_FEATURE_GAMMA, 1);
+        if (err != DC1394_SUCCESS) {
+                IDMessage(getDeviceName(), "Could not set gamma value");
+        }
+    }
+    if (feature.is_on) {
+        err = camera->setFeaturePower(DC1394_FEATURE_GAMMA, DC1394_OFF);
+        if (err != DC1394_SUCCESS) {
+            IDMessage(getDeviceName(), "Unable to disable gamma!");
+            return err;
+        }
     }
 
     /* Turn off white balance */
-    err = dc1394_feature_set_power(dcam, DC1394_FEATURE_WHITE_BALANCE, DC1394_OFF);
-    if (err != DC1394_SUCCESS) {
-        IDMessage(getDeviceName(), "Unable to disable white balance!");
-        return false;
+    if (!warm || !getFeature(camera, DC1394_FEATURE_WHITE_BALANCE, &feature) || feature.is_on) {
+        err = camera->setFeaturePower(DC1394_FEATURE_WHITE_BALANCE, DC1394_OFF);
+        if (err != DC1394_SUCCESS) {
+            IDMessage(getDeviceName(), "Unable to disable white balance!");
+            return err;
+        }
     }
+    connectPhase(CONNECT_FEATURES, &t);
 
-    err=dc1394_capture_setup(dcam,10, DC1394_CAPTURE_FLAGS_DEFAULT);
-
-    return true;
+    return DC1394_SUCCESS;
 }
 
 /**************************************************************************************
@@ -282,9 +686,35 @@ bool FFMVCCD::Connect()
 ***************************************************************************************/
 bool FFMVCCD::Disconnect()
 {
-    if (dcam) {
-        dc1394_capture_stop(dcam);
-        dc1394_camera_free(dcam);
+    if (captureCB >= 0) {
+        IERmCallback(captureCB);
+        captureCB = -1;
+    }
+    capture.stop();
+    frame_waiting = false;
+    if (recording) {
+        recording = false;
+        recorder.close();
+        IUResetSwitch(&RecordSP);
+        RecordS[1].s = ISS_ON;
+        RecordSP.s = IPS_IDLE;
+    }
+    if (controlCB >= 0) {
+        IERmCallback(controlCB);
+        controlCB = -1;
+    }
+    control.stop();
+    calib_building = -1;
+    guiding = false;
+    IUResetSwitch(&GuideSP);
+    GuideS[1].s = ISS_ON;
+    GuideSP.s = IPS_IDLE;
+    calib_library.unmapAll();
+
+    if (camera) {
+        camera->captureStop();
+        delete camera;
+        camera = NULL;
     }
 
     IDMessage(getDeviceName(), "Point Grey FireFly MV disconnected successfully!");
@@ -296,7 +726,7 @@ bool FFMVCCD::Disconnect()
 ***************************************************************************************/
 const char * FFMVCCD::getDefaultName()
 {
-    return "Point Grey FireFly MV";
+    return name;
 }
 
 /**************************************************************************************
@@ -304,6 +734,8 @@ const char * FFMVCCD::getDefaultName()
 ***************************************************************************************/
 bool FFMVCCD::initProperties()
 {
+    FFMVSimParams sim;
+
     // Must init parent properties first!
     INDI::CCD::initProperties();
 
@@ -315,6 +747,226 @@ bool FFMVCCD::initProperties()
     IUFillSwitch(&GainS[1], "GAIN2X", "2x Digital Boost", ISS_OFF);
     IUFillSwitchVector(&GainSP, GainS, 2, getDeviceName(), "GAIN", "Gain", IMAGE_SETTINGS_TAB, IP_WO, ISR_NOFMANY, 0, IPS_IDLE);
 
+    /* Deep mode stacks 16 bit subs; fast mode runs 8 bit at the highest frame rate */
+    IUFillSwitch(&CaptureModeS[0], "MODE_DEEP", "Deep (16 bit)", ISS_ON);
+    IUFillSwitch(&CaptureModeS[1], "MODE_FAST", "Fast (8 bit)", ISS_OFF);
+    IUFillSwitchVector(&CaptureModeSP, CaptureModeS, 2, getDeviceName(), "CAPTURE_MODE", "Capture Mode", IMAGE_SETTINGS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+    /* How subs are combined into the final frame */
+    IUFillSwitch(&StackModeS[FFMV_STACK_SUM], "STACK_SUM", "Sum", ISS_ON);
+    IUFillSwitch(&StackModeS[FFMV_STACK_SIGMA_CLIP], "STACK_SIGMA_CLIP", "Sigma Clip", ISS_OFF);
+    IUFillSwitch(&StackModeS[FFMV_STACK_WINSOR], "STACK_WINSOR", "Winsorized Mean", ISS_OFF);
+    IUFillSwitch(&StackModeS[FFMV_STACK_MEDIAN], "STACK_MEDIAN", "Median", ISS_OFF);
+    IUFillSwitchVector(&StackModeSP, StackModeS, 4, getDeviceName(), "STACK_MODE", "Stack Mode", IMAGE_SETTINGS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+    /* Depth of the stacked frame */
+    IUFillSwitch(&StackOutputS[FFMV_OUTPUT_NATIVE], "OUTPUT_NATIVE", "Sum (camera depth)", ISS_ON);
+    IUFillSwitch(&StackOutputS[FFMV_OUTPUT_U32], "OUTPUT_U32", "Sum (32 bit)", ISS_OFF);
+    IUFillSwitch(&StackOutputS[FFMV_OUTPUT_MEAN16], "OUTPUT_MEAN16", "Mean (16 bit)", ISS_OFF);
+    IUFillSwitchVector(&StackOutputSP, StackOutputS, 3, getDeviceName(), "STACK_OUTPUT", "Stack Output", IMAGE_SETTINGS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+    IUFillNumber(&StackN[0], "KAPPA", "Kappa (sigma)", "%.1f", 1.0, 10.0, 0.5, 3.0);
+    IUFillNumberVector(&StackNP, StackN, 1, getDeviceName(), "STACK_SETTINGS", "Stack Settings", IMAGE_SETTINGS_TAB, IP_RW, 0, IPS_IDLE);
+
+    /* Shift-and-add: each sub is moved back onto the first one's stars
+     * before it is stacked, so drift during an exposure does not smear */
+    IUFillSwitch(&RegisterS[0], "REGISTER_ON", "On", ISS_OFF);
+    IUFillSwitch(&RegisterS[1], "REGISTER_OFF", "Off", ISS_ON);
+    IUFillSwitchVector(&RegisterSP, RegisterS, 2, getDeviceName(), "STACK_REGISTER", "Register Subs", IMAGE_SETTINGS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+    IUFillNumber(&RegisterN[0], "SEARCH", "Max drift per sub (px)", "%.0f", 2, 200, 1, 20);
+    IUFillNumberVector(&RegisterNP, RegisterN, 1, getDeviceName(), "REGISTER_SETTINGS", "Registration", IMAGE_SETTINGS_TAB, IP_RW, 0, IPS_IDLE);
+    IUFillNumber(&RegisterInfoN[0], "STARS", "Reference stars", "%.0f", 0, 1000, 0, 0);
+    IUFillNumber(&RegisterInfoN[1], "DRIFT_X", "Drift X (px)", "%.2f", -1e4, 1e4, 0, 0);
+    IUFillNumber(&RegisterInfoN[2], "DRIFT_Y", "Drift Y (px)", "%.2f", -1e4, 1e4, 0, 0);
+    IUFillNumber(&RegisterInfoN[3], "MAX_SHIFT", "Largest shift (px)", "%.2f", 0, 1e4, 0, 0);
+    IUFillNumber(&RegisterInfoN[4], "FAILED", "Subs not registered", "%.0f", 0, 1e9, 0, 0);
+    IUFillNumber(&RegisterInfoN[5], "SUB_MS", "Per sub (ms)", "%.3f", 0, 1e9, 0, 0);
+    IUFillNumberVector(&RegisterInfoNP, RegisterInfoN, 6, getDeviceName(), "REGISTER_INFO", "Registration", IMAGE_INFO_TAB, IP_RO, 0, IPS_IDLE);
+
+    /* Lucky imaging: the exposure is taken as many short subs, each scored
+     * for sharpness as it arrives, and only the best are stacked */
+    IUFillSwitch(&LuckyS[0], "LUCKY_ON", "On", ISS_OFF);
+    IUFillSwitch(&LuckyS[1], "LUCKY_OFF", "Off", ISS_ON);
+    IUFillSwitchVector(&LuckySP, LuckyS, 2, getDeviceName(), "STACK_LUCKY", "Lucky Imaging", IMAGE_SETTINGS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+    IUFillNumber(&LuckyN[0], "KEEP_PERCENT", "Keep best (%)", "%.1f", 0.1, 100, 1, 10);
+    IUFillNumber(&LuckyN[1], "SUB_EXPOSURE", "Sub exposure (s)", "%.3f", 0.001, 60, 0.01, 0.02);
+    IUFillNumber(&LuckyN[2], "BUFFER_MB", "Kept subs (MB)", "%.0f", 16, 4096, 16, 256);
+    IUFillNumberVector(&LuckyNP, LuckyN, 3, getDeviceName(), "LUCKY_SETTINGS", "Lucky Imaging", IMAGE_SETTINGS_TAB, IP_RW, 0, IPS_IDLE);
+    IUFillSwitch(&LuckyMetricS[FFMV_LUCKY_LAPLACIAN], "METRIC_LAPLACIAN", "Laplacian variance", ISS_ON);
+    IUFillSwitch(&LuckyMetricS[FFMV_LUCKY_PEAK], "METRIC_PEAK", "Peak brightness", ISS_OFF);
+    IUFillSwitchVector(&LuckyMetricSP, LuckyMetricS, 2, getDeviceName(), "LUCKY_METRIC", "Sharpness", IMAGE_SETTINGS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+    IUFillNumber(&LuckyInfoN[0], "SCORED", "Subs scored", "%.0f", 0, 1e9, 0, 0);
+    IUFillNumber(&LuckyInfoN[1], "KEPT", "Subs kept", "%.0f", 0, 1e9, 0, 0);
+    IUFillNumber(&LuckyInfoN[2], "BEST", "Best score", "%.1f", 0, 1e18, 0, 0);
+    IUFillNumber(&LuckyInfoN[3], "CUTOFF", "Worst kept score", "%.1f", 0, 1e18, 0, 0);
+    IUFillNumber(&LuckyInfoN[4], "SCORE_MS", "Per sub (ms)", "%.3f", 0, 1e9, 0, 0);
+    IUFillNumberVector(&LuckyInfoNP, LuckyInfoN, 5, getDeviceName(), "LUCKY_INFO", "Lucky Imaging", IMAGE_INFO_TAB, IP_RO, 0, IPS_IDLE);
+
+    /* Calibration library */
+    IUFillSwitch(&CalibS[0], "CALIB_ON", "On", ISS_OFF);
+    IUFillSwitch(&CalibS[1], "CALIB_OFF", "Off", ISS_ON);
+    IUFillSwitchVector(&CalibSP, CalibS, 2, getDeviceName(), "CALIBRATION", "Calibrate", CALIBRATION_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+    IUFillText(&CalibDirT[0], "DIR", "Directory", calib_library.getDirectory());
+    IUFillTextVector(&CalibDirTP, CalibDirT, 1, getDeviceName(), "CALIB_DIR", "Library", CALIBRATION_TAB, IP_RW, 0, IPS_IDLE);
+    IUFillSwitch(&CalibBuildS[FFMV_CALIB_BIAS], "BUILD_BIAS", "Bias", ISS_OFF);
+    IUFillSwitch(&CalibBuildS[FFMV_CALIB_DARK], "BUILD_DARK", "Dark", ISS_OFF);
+    IUFillSwitch(&CalibBuildS[FFMV_CALIB_FLAT], "BUILD_FLAT", "Flat", ISS_OFF);
+    IUFillSwitchVector(&CalibBuildSP, CalibBuildS, 3, getDeviceName(), "CALIB_BUILD", "Build Master", CALIBRATION_TAB, IP_RW, ISR_ATMOST1, 0, IPS_IDLE);
+    IUFillNumber(&CalibBuildN[0], "FRAMES", "Frames", "%.0f", 1, 256, 1, 16);
+    IUFillNumber(&CalibBuildN[1], "EXPOSURE", "Exposure (s)", "%.3f", 0, 3600, 1, 1);
+    IUFillNumberVector(&CalibBuildNP, CalibBuildN, 2, getDeviceName(), "CALIB_BUILD_SETTINGS", "Master Settings", CALIBRATION_TAB, IP_RW, 0, IPS_IDLE);
+
+    /* Which camera this device drives; empty for the first one found */
+    if (guid) {
+        snprintf(guid_text, sizeof(guid_text), "%016llx", (unsigned long long) guid);
+    } else {
+        guid_text[0] = '\0';
+    }
+    IUFillText(&GuidT[0], "GUID", "GUID", guid_text);
+    IUFillTextVector(&GuidTP, GuidT, 1, getDeviceName(), "CAMERA_GUID", "Camera", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);
+
+    /* Per exposure telemetry */
+    IUFillNumber(&TelemetryN[TELEMETRY_FLUSH], "FLUSH", "DMA flush (ms)", "%.3f", 0, 1e9, 0, 0);
+    IUFillNumber(&TelemetryN[TELEMETRY_WAIT], "SUB_WAIT", "Wait per sub (ms)", "%.3f", 0, 1e9, 0, 0);
+    IUFillNumber(&TelemetryN[TELEMETRY_WAIT_MAX], "SUB_WAIT_MAX", "Longest wait (ms)", "%.3f", 0, 1e9, 0, 0);
+    IUFillNumber(&TelemetryN[TELEMETRY_STACK], "SUB_STACK", "Stack per sub (ms)", "%.3f", 0, 1e9, 0, 0);
+    IUFillNumber(&TelemetryN[TELEMETRY_STACK_MAX], "SUB_STACK_MAX", "Slowest stack (ms)", "%.3f", 0, 1e9, 0, 0);
+    IUFillNumber(&TelemetryN[TELEMETRY_DOWNLOAD], "DOWNLOAD", "Download (ms)", "%.3f", 0, 1e9, 0, 0);
+    IUFillNumber(&TelemetryN[TELEMETRY_DROPPED], "SUBS_DROPPED", "Subs dropped", "%.0f", 0, 1e9, 0, 0);
+    IUFillNumber(&TelemetryN[TELEMETRY_REPLACED], "SUBS_REPLACED", "Subs replaced", "%.0f", 0, 1e9, 0, 0);
+    IUFillNumber(&TelemetryN[TELEMETRY_RING_USED], "RING_USED", "DMA ring used", "%.0f", 0, 1e9, 0, 0);
+    IUFillNumber(&TelemetryN[TELEMETRY_RING_DEPTH], "RING_DEPTH", "DMA ring depth", "%.0f", 0, 1e9, 0, 0);
+    IUFillNumber(&TelemetryN[TELEMETRY_FITS], "FITS", "FITS encode (ms)", "%.3f", 0, 1e9, 0, 0);
+    IUFillNumber(&TelemetryN[TELEMETRY_BLOB], "BLOB_SIZE", "BLOB size (bytes)", "%.0f", 0, 1e12, 0, 0);
+    IUFillNumber(&TelemetryN[TELEMETRY_LATENCY], "LATENCY", "End to end (ms)", "%.3f", 0, 1e9, 0, 0);
+    IUFillNumber(&TelemetryN[TELEMETRY_COMPRESS], "COMPRESS", "Compress (ms)", "%.3f", 0, 1e9, 0, 0);
+    IUFillNumber(&TelemetryN[TELEMETRY_RATIO], "COMPRESS_RATIO", "Compression ratio", "%.2f", 0, 1e9, 0, 0);
+    IUFillNumberVector(&TelemetryNP, TelemetryN, TELEMETRY_N, getDeviceName(), "EXPOSURE_TELEMETRY", "Last Exposure", DIAGNOSTICS_TAB, IP_RO, 0, IPS_IDLE);
+    IUFillText(&TraceT[0], "FILE", "File", "");
+    IUFillTextVector(&TraceTP, TraceT, 1, getDeviceName(), "TELEMETRY_TRACE", "Trace", DIAGNOSTICS_TAB, IP_RW, 0, IPS_IDLE);
+
+    /* Optional zlib compressed copy of each frame. Clients pick which of
+     * CCD1 and CCD_COMPRESSED they want with enableBLOB. */
+    IUFillSwitch(&CompressS[0], "COMPRESS_OFF", "Off", ISS_ON);
+    IUFillSwitch(&CompressS[1], "COMPRESS_ZLIB", "Zlib", ISS_OFF);
+    IUFillSwitchVector(&CompressSP, CompressS, 2, getDeviceName(), "BLOB_COMPRESSION", "Compressed BLOB", IMAGE_SETTINGS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+    IUFillNumber(&CompressN[0], "LEVEL", "Level", "%.0f", 1, 9, 1, 1);
+    IUFillNumberVector(&CompressNP, CompressN, 1, getDeviceName(), "COMPRESSION_SETTINGS", "Compression", IMAGE_SETTINGS_TAB, IP_RW, 0, IPS_IDLE);
+    IUFillBLOB(&CompressedB[0], "IMAGE", "Image", "");
+    IUFillBLOBVector(&CompressedBP, CompressedB, 1, getDeviceName(), "CCD_COMPRESSED", "Compressed Image", IMAGE_SETTINGS_TAB, IP_RO, 60, IPS_IDLE);
+
+    /* Star size in each finished exposure, so focusers don't have to
+     * download frames to measure it */
+    IUFillSwitch(&FocusS[0], "FOCUS_ON", "On", ISS_ON);
+    IUFillSwitch(&FocusS[1], "FOCUS_OFF", "Off", ISS_OFF);
+    IUFillSwitchVector(&FocusSP, FocusS, 2, getDeviceName(), "FOCUS_MEASURE", "Measure Focus", IMAGE_INFO_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+    IUFillNumber(&FocusN[0], "HFR", "Half flux radius (px)", "%.2f", 0, 1e4, 0, 0);
+    IUFillNumber(&FocusN[1], "FWHM", "FWHM (px)", "%.2f", 0, 1e4, 0, 0);
+    IUFillNumber(&FocusN[2], "STARS", "Stars", "%.0f", 0, 1e9, 0, 0);
+    IUFillNumber(&FocusN[3], "MEASURE_MS", "Measure (ms)", "%.3f", 0, 1e9, 0, 0);
+    IUFillNumberVector(&FocusNP, FocusN, 4, getDeviceName(), "FOCUS_METRICS", "Focus", IMAGE_INFO_TAB, IP_RO, 0, IPS_IDLE);
+
+    /* Exposure check on every frame; SATURATED counts pixels at the top of
+     * the frame's range */
+    IUFillNumber(&FrameStatsN[0], "MIN", "Min", "%.0f", 0, 4294967295.0, 0, 0);
+    IUFillNumber(&FrameStatsN[1], "MAX", "Max", "%.0f", 0, 4294967295.0, 0, 0);
+    IUFillNumber(&FrameStatsN[2], "MEAN", "Mean", "%.2f", 0, 4294967295.0, 0, 0);
+    IUFillNumber(&FrameStatsN[3], "STDDEV", "Std dev", "%.2f", 0, 4294967295.0, 0, 0);
+    IUFillNumber(&FrameStatsN[4], "MEDIAN", "Median", "%.0f", 0, 4294967295.0, 0, 0);
+    IUFillNumber(&FrameStatsN[5], "SATURATED", "Saturated pixels", "%.0f", 0, 1e9, 0, 0);
+    IUFillNumberVector(&FrameStatsNP, FrameStatsN, 6, getDeviceName(), "FRAME_STATS", "Frame Statistics", IMAGE_INFO_TAB, IP_RO, 0, IPS_IDLE);
+
+    /* A small auto stretched 8 bit thumbnail of every sub, for framing and
+     * focusing over slow links */
+    IUFillSwitch(&PreviewS[0], "PREVIEW_ON", "On", ISS_OFF);
+    IUFillSwitch(&PreviewS[1], "PREVIEW_OFF", "Off", ISS_ON);
+    IUFillSwitchVector(&PreviewSP, PreviewS, 2, getDeviceName(), "PREVIEW_STREAM", "Sub Preview", IMAGE_SETTINGS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+    IUFillNumber(&PreviewN[0], "FACTOR", "Downsample", "%.0f", 1, 16, 1, 4);
+    IUFillNumberVector(&PreviewNP, PreviewN, 1, getDeviceName(), "PREVIEW_SETTINGS", "Preview", IMAGE_SETTINGS_TAB, IP_RW, 0, IPS_IDLE);
+    IUFillBLOB(&PreviewB[0], "PREVIEW", "Preview", "");
+    IUFillBLOBVector(&PreviewBP, PreviewB, 1, getDeviceName(), "CCD_PREVIEW", "Preview Image", IMAGE_SETTINGS_TAB, IP_RO, 60, IPS_IDLE);
+
+    /* Raw frames straight to disk for lucky imaging, as fast as the camera
+     * sends them; nothing is stacked or sent to clients */
+    IUFillSwitch(&RecordS[0], "RECORD_ON", "Start", ISS_OFF);
+    IUFillSwitch(&RecordS[1], "RECORD_OFF", "Stop", ISS_ON);
+    IUFillSwitchVector(&RecordSP, RecordS, 2, getDeviceName(), "RECORD_STREAM", "Record", RECORDING_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+    IUFillNumber(&RecordN[0], "EXPOSURE", "Frame exposure (s)", "%.4f", 0.0001, 60, 0.001, 0.01);
+    IUFillNumber(&RecordN[1], "FRAMES", "Frames", "%.0f", 1, 1e7, 100, 1000);
+    IUFillNumber(&RecordN[2], "BUFFER_MB", "Queue (MB)", "%.0f", 16, 4096, 16, 256);
+    IUFillNumberVector(&RecordNP, RecordN, 3, getDeviceName(), "RECORD_SETTINGS", "Settings", RECORDING_TAB, IP_RW, 0, IPS_IDLE);
+    IUFillText(&RecordFileT[0], "DIR", "Directory", "/tmp");
+    IUFillText(&RecordFileT[1], "PREFIX", "Prefix", "ffmv");
+    IUFillTextVector(&RecordFileTP, RecordFileT, 2, getDeviceName(), "RECORD_FILE", "File", RECORDING_TAB, IP_RW, 0, IPS_IDLE);
+    IUFillSwitch(&RecordDirectS[0], "DIRECT_ON", "On", ISS_OFF);
+    IUFillSwitch(&RecordDirectS[1], "DIRECT_OFF", "Off", ISS_ON);
+    IUFillSwitchVector(&RecordDirectSP, RecordDirectS, 2, getDeviceName(), "RECORD_DIRECT_IO", "Direct I/O", RECORDING_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+    IUFillNumber(&RecordStatusN[0], "QUEUED", "Frames captured", "%.0f", 0, 1e12, 0, 0);
+    IUFillNumber(&RecordStatusN[1], "WRITTEN", "Frames written", "%.0f", 0, 1e12, 0, 0);
+    IUFillNumber(&RecordStatusN[2], "DROPPED", "Dropped (queue full)", "%.0f", 0, 1e12, 0, 0);
+    IUFillNumber(&RecordStatusN[3], "CAMERA_DROPPED", "Dropped by camera", "%.0f", 0, 1e12, 0, 0);
+    IUFillNumber(&RecordStatusN[4], "QUEUE_MAX", "Queue high water", "%.0f", 0, 1e9, 0, 0);
+    IUFillNumber(&RecordStatusN[5], "WRITE_MBS", "Write rate (MB/s)", "%.1f", 0, 1e6, 0, 0);
+    IUFillNumber(&RecordStatusN[6], "AVG_MBS", "Average rate (MB/s)", "%.1f", 0, 1e6, 0, 0);
+    IUFillNumberVector(&RecordStatusNP, RecordStatusN, 7, getDeviceName(), "RECORD_STATUS", "Status", RECORDING_TAB, IP_RO, 0, IPS_IDLE);
+
+    /* Back to back exposures, with the camera left running in between */
+    IUFillSwitch(&FastS[0], "INDI_ENABLED", "Enabled", ISS_OFF);
+    IUFillSwitch(&FastS[1], "INDI_DISABLED", "Disabled", ISS_ON);
+    IUFillSwitchVector(&FastSP, FastS, 2, getDeviceName(), "CCD_FAST_TOGGLE", "Sequence", MAIN_CONTROL_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+    IUFillNumber(&FastCountN[0], "FRAMES", "Frames", "%.0f", 1, 100000, 1, 1);
+    IUFillNumberVector(&FastCountNP, FastCountN, 1, getDeviceName(), "CCD_FAST_COUNT", "Sequence", MAIN_CONTROL_TAB, IP_RW, 0, IPS_IDLE);
+
+    /* Guide mode: frames stream continuously and only the guide star's
+     * centroid is sent for each, with a full frame now and then */
+    IUFillSwitch(&GuideS[0], "GUIDE_ON", "Start", ISS_OFF);
+    IUFillSwitch(&GuideS[1], "GUIDE_OFF", "Stop", ISS_ON);
+    IUFillSwitchVector(&GuideSP, GuideS, 2, getDeviceName(), "GUIDE_STREAM", "Guide Stream", GUIDING_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+    IUFillNumber(&GuideN[0], "EXPOSURE", "Exposure (s)", "%.3f", 0.001, 60, 0.1, 1);
+    IUFillNumber(&GuideN[1], "FRAME_EVERY", "Full frame every", "%.0f", 0, 10000, 1, 0);
+    IUFillNumber(&GuideN[2], "SEARCH", "Search radius (px)", "%.0f", 2, 200, 1, 20);
+    IUFillNumber(&GuideN[3], "APERTURE", "Aperture radius (px)", "%.0f", 2, 32, 1, 8);
+    IUFillNumber(&GuideN[4], "MIN_SNR", "Minimum SNR", "%.1f", 1, 1000, 1, 6);
+    IUFillNumberVector(&GuideNP, GuideN, 5, getDeviceName(), "GUIDE_SETTINGS", "Guide Settings", GUIDING_TAB, IP_RW, 0, IPS_IDLE);
+    IUFillSwitch(&GuideFrameS[0], "SEND", "Send next frame", ISS_OFF);
+    IUFillSwitchVector(&GuideFrameSP, GuideFrameS, 1, getDeviceName(), "GUIDE_FRAME", "Full Frame", GUIDING_TAB, IP_RW, ISR_ATMOST1, 0, IPS_IDLE);
+    IUFillNumber(&GuideStarN[0], "X", "X (px)", "%.3f", 0, 1e5, 0, 0);
+    IUFillNumber(&GuideStarN[1], "Y", "Y (px)", "%.3f", 0, 1e5, 0, 0);
+    IUFillNumber(&GuideStarN[2], "FLUX", "Flux (ADU)", "%.0f", 0, 1e12, 0, 0);
+    IUFillNumber(&GuideStarN[3], "SNR", "SNR", "%.1f", 0, 1e9, 0, 0);
+    IUFillNumber(&GuideStarN[4], "PEAK", "Peak (ADU)", "%.0f", 0, 1e10, 0, 0);
+    IUFillNumber(&GuideStarN[5], "FRAME", "Frame", "%.0f", 0, 1e12, 0, 0);
+    IUFillNumber(&GuideStarN[6], "CENTROID_MS", "Centroid (ms)", "%.3f", 0, 1e9, 0, 0);
+    IUFillNumberVector(&GuideStarNP, GuideStarN, 7, getDeviceName(), "GUIDE_STAR", "Guide Star", GUIDING_TAB, IP_RO, 0, IPS_IDLE);
+
+    /* How often clients hear about exposure progress */
+    IUFillNumber(&ProgressN[0], "INTERVAL", "Interval (ms)", "%.0f", 50, 10000, 50, POLLMS);
+    IUFillNumberVector(&ProgressNP, ProgressN, 1, getDeviceName(), "PROGRESS_SETTINGS", "Progress", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);
+
+    /* How to bring the camera up on connect */
+    IUFillSwitch(&ConnectModeS[0], "CONNECT_FULL", "Full", ISS_OFF);
+    IUFillSwitch(&ConnectModeS[1], "CONNECT_WARM", "Warm", ISS_ON);
+    IUFillSwitchVector(&ConnectModeSP, ConnectModeS, 2, getDeviceName(), "CONNECT_MODE", "Connect", OPTIONS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+    /* The camera connected to in simulation mode */
+    ffmv_sim_defaults(&sim);
+    IUFillNumber(&SimulatorN[0], "STARS", "Stars", "%.0f", 0, 1000, 1, sim.stars);
+    IUFillNumber(&SimulatorN[1], "FWHM", "FWHM (px)", "%.2f", 0.8, 20, 0.1, sim.fwhm);
+    IUFillNumber(&SimulatorN[2], "SEEING", "Seeing jitter (px)", "%.2f", 0, 10, 0.1, sim.seeing);
+    IUFillNumber(&SimulatorN[3], "STAR_FLUX", "Brightest star (ADU/s)", "%.0f", 0, 1e7, 100, sim.star_flux);
+    IUFillNumber(&SimulatorN[4], "SKY", "Sky (ADU/s)", "%.0f", 0, 1e6, 10, sim.sky);
+    IUFillNumber(&SimulatorN[5], "READ_NOISE", "Read noise (ADU)", "%.2f", 0, 100, 0.1, sim.read_noise);
+    IUFillNumber(&SimulatorN[6], "DRIFT_X", "Drift X (px/s)", "%.3f", -100, 100, 0.01, sim.drift_x);
+    IUFillNumber(&SimulatorN[7], "DRIFT_Y", "Drift Y (px/s)", "%.3f", -100, 100, 0.01, sim.drift_y);
+    IUFillNumber(&SimulatorN[8], "SEED", "Seed", "%.0f", 0, 4294967295.0, 1, sim.seed);
+    IUFillNumberVector(&SimulatorNP, SimulatorN, 9, getDeviceName(), "SIMULATOR_SETTINGS", "Simulator", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);
+    IUFillText(&SimulatorReplayT[0], "FILE", "SER file", "");
+    IUFillTextVector(&SimulatorReplayTP, SimulatorReplayT, 1, getDeviceName(), "SIMULATOR_REPLAY", "Replay", OPTIONS_TAB, IP_RW, 0, IPS_IDLE);
+
+    /* Register traffic */
+    IUFillNumber(&ControlStatsN[0], "BUS_WRITES", "Bus writes", "%.0f", 0, 1e9, 0, 0);
+    IUFillNumber(&ControlStatsN[1], "BUS_SAVED", "Writes saved", "%.0f", 0, 1e9, 0, 0);
+    IUFillNumber(&ControlStatsN[2], "BATCHES", "Batches", "%.0f", 0, 1e9, 0, 0);
+    IUFillNumberVector(&ControlStatsNP, ControlStatsN, 3, getDeviceName(), "CONTROL_STATS", "Registers", DIAGNOSTICS_TAB, IP_RO, 0, IPS_IDLE);
+
     return true;
 
 }
@@ -326,6 +978,11 @@ void FFMVCCD::ISGetProperties(const char *dev)
 {
     INDI::CCD::ISGetProperties(dev);
 
+    defineText(&GuidTP);
+    defineSwitch(&ConnectModeSP);
+    defineNumber(&SimulatorNP);
+    defineText(&SimulatorReplayTP);
+
 }
 
 /********************************************************************************************
@@ -343,369 +1000,2019 @@ bool FFMVCCD::updateProperties()
         // Let's get parameters now from CCD
         setupParams();
 
-        // Start the timer
-        SetTimer(POLLMS);
         defineSwitch(&GainSP);
+        defineSwitch(&CaptureModeSP);
+        defineSwitch(&StackModeSP);
+        defineSwitch(&StackOutputSP);
+        defineNumber(&StackNP);
+        defineSwitch(&RegisterSP);
+        defineNumber(&RegisterNP);
+        defineNumber(&RegisterInfoNP);
+        defineSwitch(&LuckySP);
+        defineNumber(&LuckyNP);
+        defineSwitch(&LuckyMetricSP);
+        defineNumber(&LuckyInfoNP);
+        defineNumber(&ProgressNP);
+        defineSwitch(&FastSP);
+        defineNumber(&FastCountNP);
+        defineSwitch(&GuideSP);
+        defineNumber(&GuideNP);
+        defineSwitch(&GuideFrameSP);
+        defineNumber(&GuideStarNP);
+        defineSwitch(&RecordSP);
+        defineNumber(&RecordNP);
+        defineText(&RecordFileTP);
+        defineSwitch(&RecordDirectSP);
+        defineNumber(&RecordStatusNP);
+        defineSwitch(&CompressSP);
+        defineNumber(&CompressNP);
+        defineBLOB(&CompressedBP);
+        defineSwitch(&FocusSP);
+        defineNumber(&FocusNP);
+        defineNumber(&FrameStatsNP);
+        defineSwitch(&PreviewSP);
+        defineNumber(&PreviewNP);
+        defineBLOB(&PreviewBP);
+        defineSwitch(&CalibSP);
+        defineText(&CalibDirTP);
+        defineSwitch(&CalibBuildSP);
+        defineNumber(&CalibBuildNP);
+        defineNumber(&ControlStatsNP);
+        defineNumber(&TelemetryNP);
+        defineText(&TraceTP);
     } else {
         deleteProperty(GainSP.name);
+        deleteProperty(CaptureModeSP.name);
+        deleteProperty(StackModeSP.name);
+        deleteProperty(StackOutputSP.name);
+        deleteProperty(StackNP.name);
+        deleteProperty(RegisterSP.name);
+        deleteProperty(RegisterNP.name);
+        deleteProperty(RegisterInfoNP.name);
+        deleteProperty(LuckySP.name);
+        deleteProperty(LuckyNP.name);
+        deleteProperty(LuckyMetricSP.name);
+        deleteProperty(LuckyInfoNP.name);
+        deleteProperty(ProgressNP.name);
+        deleteProperty(FastSP.name);
+        deleteProperty(FastCountNP.name);
+        deleteProperty(GuideSP.name);
+        deleteProperty(GuideNP.name);
+        deleteProperty(GuideFrameSP.name);
+        deleteProperty(GuideStarNP.name);
+        deleteProperty(RecordSP.name);
+        deleteProperty(RecordNP.name);
+        deleteProperty(RecordFileTP.name);
+        deleteProperty(RecordDirectSP.name);
+        deleteProperty(RecordStatusNP.name);
+        deleteProperty(CompressSP.name);
+        deleteProperty(CompressNP.name);
+        deleteProperty(CompressedBP.name);
+        deleteProperty(FocusSP.name);
+        deleteProperty(FocusNP.name);
+        deleteProperty(FrameStatsNP.name);
+        deleteProperty(PreviewSP.name);
+        deleteProperty(PreviewNP.name);
+        deleteProperty(PreviewBP.name);
+        deleteProperty(CalibSP.name);
+        deleteProperty(CalibDirTP.name);
+        deleteProperty(CalibBuildSP.name);
+        deleteProperty(CalibBuildNP.name);
+        deleteProperty(ControlStatsNP.name);
+        deleteProperty(TelemetryNP.name);
+        deleteProperty(TraceTP.name);
     }
 
     return true;
 }
 
-bool FFMVCCD::UpdateCCDBin(int binx, int biny)
+/**
+ * Switch the camera to Format7 mode 0 at its full sensor size and look up
+ * the ROI granularity.
+ */
+dc1394error_t FFMVCCD::setupFormat7()
 {
-        if (binx != 1 || biny !=1)
-        {
-                DEBUG(INDI::Logger::DBG_ERROR, "Camera currently does not support binning.");
-                return false;
-        }
+    dc1394error_t err;
 
-        return true;
+    video_mode = DC1394_VIDEO_MODE_FORMAT7_0;
+
+    err = camera->setVideoMode(video_mode);
+    if (err != DC1394_SUCCESS) {
+        return err;
+    }
+    err = camera->getMaxImageSize(video_mode, &max_width, &max_height);
+    if (err != DC1394_SUCCESS) {
+        return err;
+    }
+    err = camera->getUnitSize(video_mode, &unit_width, &unit_height);
+    if (err != DC1394_SUCCESS) {
+        return err;
+    }
+    err = camera->getUnitPosition(video_mode, &unit_left, &unit_top);
+    if (err != DC1394_SUCCESS) {
+        return err;
+    }
+    if (!unit_width || !unit_height || !unit_left || !unit_top) {
+        return DC1394_FAILURE;
+    }
+
+    return setROI(0, 0, max_width, max_height);
 }
 
-/**************************************************************************************
-** Setting up CCD parameters
-***************************************************************************************/
-void FFMVCCD::setupParams()
+/**
+ * Program the camera's Format7 window. The largest packet size the bus
+ * allows is used, which gives the highest frame rate for the window.
+ */
+dc1394error_t FFMVCCD::setROI(int x, int y, int w, int h)
 {
-    // The FireFly MV has a Micron MT9V022 CMOS sensor
-    SetCCDParams(640, 480, 16, 6.0, 6.0);
+    dc1394color_coding_t coding;
 
-    // Let's calculate how much memory we need for the primary CCD buffer
-    int nbuf;
-    nbuf=PrimaryCCD.getXRes()*PrimaryCCD.getYRes() * PrimaryCCD.getBPP()/8;
-    PrimaryCCD.setFrameBufferSize(nbuf);
+    coding = pixel_format == FFMV_MONO8 ? DC1394_COLOR_CODING_MONO8 : DC1394_COLOR_CODING_MONO16;
+    return camera->setROI(video_mode, coding, DC1394_USE_MAX_AVAIL, x, y, w, h);
 }
 
-#define IMAGE_FILE_NAME "testimage.pgm"
-/**************************************************************************************
-** Client is asking us to start an exposure
-***************************************************************************************/
-bool FFMVCCD::StartExposure(float duration)
+/**
+ * Switch between deep (MONO16, extended shutter) and fast (MONO8, highest
+ * frame rate) capture. The DMA ring is rebuilt since the frame size changes.
+ */
+dc1394error_t FFMVCCD::setCaptureMode(enum ffmv_pixel_format fmt)
 {
-    FILE *imagefile;
     dc1394error_t err;
-    dc1394video_frame_t *frame;
-    int i;
-    int ms;
-    unsigned int val;
-    float gain = 1.0;
-    uint32_t uwidth, uheight;
-    float sub_length;
-    float fval;
-
-    ms = duration* 1000;
+    enum ffmv_pixel_format old_fmt = pixel_format;
+    float min, max;
 
-    //IDMessage(getDeviceName(), "Doing %d sub exposures at %f %s each", sub_count, absShutter, prop_info.pUnits);
+    capture.waitIdle();
+    camera->captureStop();
 
-    ExposureRequest=duration;
+    pixel_format = fmt;
+    if (video_mode == DC1394_VIDEO_MODE_FORMAT7_0) {
+        err = setROI(PrimaryCCD.getSubX(), PrimaryCCD.getSubY(), PrimaryCCD.getSubW(), PrimaryCCD.getSubH());
+    } else {
+        video_mode = fmt == FFMV_MONO8 ? DC1394_VIDEO_MODE_640x480_MONO8 : DC1394_VIDEO_MODE_640x480_MONO16;
+        err = camera->setVideoMode(video_mode);
+        if (err == DC1394_SUCCESS) {
+            err = camera->setFramerate(fmt == FFMV_MONO8 ? DC1394_FRAMERATE_60 : DC1394_FRAMERATE_7_5);
+        }
+    }
+    if (err != DC1394_SUCCESS) {
+        DEBUG(INDI::Logger::DBG_ERROR, "Unable to change pixel format.");
+        pixel_format = old_fmt;
+        if (video_mode == DC1394_VIDEO_MODE_FORMAT7_0) {
+            setROI(PrimaryCCD.getSubX(), PrimaryCCD.getSubY(), PrimaryCCD.getSubW(), PrimaryCCD.getSubH());
+        }
+        camera->captureSetup(ring_depth, DC1394_CAPTURE_FLAGS_DEFAULT);
+        return err;
+    }
 
-    // Since we have only have one CCD with one chip, we set the exposure duration of the primary CCD
-    PrimaryCCD.setBPP(16);
-    PrimaryCCD.setExposureDuration(duration);
+    if (fmt == FFMV_MONO8) {
+        /* Run the camera as fast as it will go */
+        camera->setFeaturePower(DC1394_FEATURE_FRAME_RATE, DC1394_ON);
+        camera->setFeatureMode(DC1394_FEATURE_FRAME_RATE, DC1394_FEATURE_MODE_MANUAL);
+        camera->setAbsoluteControl(DC1394_FEATURE_FRAME_RATE, DC1394_ON);
+        err = camera->getAbsoluteBoundaries(DC1394_FEATURE_FRAME_RATE, &min, &max);
+        if (err == DC1394_SUCCESS) {
+            camera->setAbsoluteValue(DC1394_FEATURE_FRAME_RATE, max);
+            DEBUGF(INDI::Logger::DBG_SESSION, "Frame rate set to %.1f fps.", max);
+        }
+    } else {
+        /* Turn frame rate control off to enable extended exposure */
+        camera->setFeaturePower(DC1394_FEATURE_FRAME_RATE, DC1394_OFF);
+    }
 
-    gettimeofday(&ExpStart,NULL);
+    /* The longest sub depends on the frame rate */
+    err = camera->getAbsoluteBoundaries(DC1394_FEATURE_SHUTTER, &min, &max);
+    if (err == DC1394_SUCCESS) {
+        max_exposure = max;
+    }
 
-    InExposure=true;
-    IDMessage(getDeviceName(), "Exposure has begun.");
+    err = camera->captureSetup(ring_depth, DC1394_CAPTURE_FLAGS_DEFAULT);
+    if (err != DC1394_SUCCESS) {
+        DEBUG(INDI::Logger::DBG_ERROR, "Unable to set up capture!");
+        return err;
+    }
 
-    // Let's get a pointer to the frame buffer
-    char * image = PrimaryCCD.getFrameBuffer();
+    PrimaryCCD.setBPP(ffmv_output_bytes(fmt, stackOutput()) * 8);
+    updateFrameBuffer();
 
-    // Get width and height
-    int width = PrimaryCCD.getSubW() / PrimaryCCD.getBinX();
-    int height = PrimaryCCD.getSubH() / PrimaryCCD.getBinY();
+    return DC1394_SUCCESS;
+}
 
-    memset(image, 0, PrimaryCCD.getFrameBufferSize());
+/**
+ * Map the CCD_FRAME subframe onto the camera's hardware ROI.
+ * The window is snapped to the units the camera supports and the DMA ring is
+ * rebuilt, since the frame size changes.
+ */
+bool FFMVCCD::UpdateCCDFrame(int x, int y, int w, int h)
+{
+    dc1394error_t err;
 
-    if (duration != last_exposure_length) {
-        /* Calculate the number of exposures needed */
-        sub_count = duration / max_exposure;
-        if (ms % ((int) (max_exposure * 1000))) {
-            ++sub_count;
-        }
-        sub_length = duration / sub_count;
+    if (InExposure || guiding || recording) {
+        DEBUG(INDI::Logger::DBG_ERROR, "Cannot change the subframe during an exposure.");
+        return false;
+    }
 
-        IDMessage(getDeviceName(), "Triggering a %f second exposure using %d subs of %f seconds",
-                duration, sub_count, sub_length);
-        /* Set sub length */
-        #if 0
-    err = dc1394_feature_set_absolute_control(dcam, DC1394_FEATURE_SHUTTER, DC1394_ON);
-    if (err != DC1394_SUCCESS) {
-        IDMessage(getDeviceName(), "Failed to enable ansolute shutter control.");
-    } 
-    #endif
-        err = dc1394_feature_set_absolute_value(dcam, DC1394_FEATURE_SHUTTER, sub_length);
-        if (err != DC1394_SUCCESS) {
-            IDMessage(getDeviceName(), "Unable to set shutter value.");
-        }
-        err = dc1394_feature_get_absolute_value(dcam, DC1394_FEATURE_SHUTTER, &fval);
-        if (err != DC1394_SUCCESS) {
-            IDMessage(getDeviceName(), "Unable to get shutter value.");
+    if (video_mode != DC1394_VIDEO_MODE_FORMAT7_0) {
+        if (x != 0 || y != 0 || w != (int) max_width || h != (int) max_height) {
+            DEBUG(INDI::Logger::DBG_ERROR, "Camera does not support subframes in this video mode.");
+            return false;
         }
-        IDMessage(getDeviceName(), "Shutter value is %f.", fval);
+        PrimaryCCD.setFrame(x, y, w, h);
+        updateFrameBuffer();
+        return true;
+    }
 
+    /* Snap the window to the camera's ROI granularity */
+    x -= x % unit_left;
+    y -= y % unit_top;
+    w -= w % unit_width;
+    h -= h % unit_height;
+    if (w < (int) unit_width) {
+        w = unit_width;
+    }
+    if (h < (int) unit_height) {
+        h = unit_height;
+    }
+    if (x + w > (int) max_width) {
+        x = max_width - w;
+        x -= x % unit_left;
+    }
+    if (y + h > (int) max_height) {
+        y = max_height - h;
+        y -= y % unit_top;
+    }
+    if (x < 0 || y < 0) {
+        DEBUGF(INDI::Logger::DBG_ERROR, "Invalid subframe %dx%d.", w, h);
+        return false;
     }
 
-    /* Flush the DMA buffer */
-    while (1) {
-       err=dc1394_capture_dequeue(dcam, DC1394_CAPTURE_POLICY_POLL, &frame);
-       if (err != DC1394_SUCCESS) {
-            IDMessage(getDeviceName(), "Flushing DMA buffer failed!");
-            break;
-       }
-       if (!frame) {
-           break;
-       }
-       dc1394_capture_enqueue(dcam, frame);
+    /* The capture thread must not be touching the ring while it's rebuilt */
+    capture.waitIdle();
+    camera->captureStop();
+
+    err = setROI(x, y, w, h);
+    if (err != DC1394_SUCCESS) {
+        DEBUGF(INDI::Logger::DBG_ERROR, "Unable to set ROI %dx%d at (%d, %d).", w, h, x, y);
+        setROI(PrimaryCCD.getSubX(), PrimaryCCD.getSubY(), PrimaryCCD.getSubW(), PrimaryCCD.getSubH());
+        camera->captureSetup(ring_depth, DC1394_CAPTURE_FLAGS_DEFAULT);
+        return false;
     }
 
-    /*-----------------------------------------------------------------------
-     *  have the camera start sending us data
-     *-----------------------------------------------------------------------*/
-    IDMessage(getDeviceName(), "start transmission");
-    err=dc1394_video_set_transmission(dcam, DC1394_ON);
+    err = camera->captureSetup(ring_depth, DC1394_CAPTURE_FLAGS_DEFAULT);
     if (err != DC1394_SUCCESS) {
-            IDMessage(getDeviceName(), "Unable to start transmission");
-            return false;
+        DEBUG(INDI::Logger::DBG_ERROR, "Unable to set up capture!");
+        return false;
     }
 
-    // We're done
+    DEBUGF(INDI::Logger::DBG_SESSION, "Hardware ROI set to %dx%d at (%d, %d).", w, h, x, y);
+    PrimaryCCD.setFrame(x, y, w, h);
+    updateFrameBuffer();
+
     return true;
 }
 
-/**************************************************************************************
-** Client is asking us to abort an exposure
-***************************************************************************************/
-bool FFMVCCD::AbortExposure()
+/**
+ * Binning is done in software while the subs are stacked, so any bin up to
+ * 4x4 is fine. The frame buffer and the BLOB shrink to match.
+ */
+bool FFMVCCD::UpdateCCDBin(int binx, int biny)
 {
-    InExposure = false;
-    return true;
+        if (binx < 1 || binx > 4 || biny < 1 || biny > 4)
+        {
+                DEBUG(INDI::Logger::DBG_ERROR, "Only binning up to 4x4 is supported.");
+                return false;
+        }
+        if (InExposure || guiding || recording)
+        {
+                DEBUG(INDI::Logger::DBG_ERROR, "Cannot change binning during an exposure.");
+                return false;
+        }
+
+        PrimaryCCD.setBin(binx, biny);
+        updateFrameBuffer();
+
+        return true;
+}
+
+/**
+ * Size the primary CCD buffer for the current subframe and binning.
+ */
+void FFMVCCD::updateFrameBuffer()
+{
+    int nbuf;
+
+    nbuf = (PrimaryCCD.getSubW() / PrimaryCCD.getBinX()) * (PrimaryCCD.getSubH() / PrimaryCCD.getBinY()) *
+        PrimaryCCD.getBPP() / 8;
+    PrimaryCCD.setFrameBufferSize(nbuf);
 }
 
 /**************************************************************************************
-** How much longer until exposure is done?
+** Setting up CCD parameters
 ***************************************************************************************/
-float FFMVCCD::CalcTimeLeft()
+void FFMVCCD::setupParams()
 {
-    double timesince;
-    double timeleft;
-    struct timeval now;
-    gettimeofday(&now,NULL);
-
-    timesince=(double)(now.tv_sec * 1000.0 + now.tv_usec/1000) - (double)(ExpStart.tv_sec * 1000.0 + ExpStart.tv_usec/1000);
-    timesince=timesince/1000;
+    // The FireFly MV has a Micron MT9V022 CMOS sensor
+    SetCCDParams(max_width, max_height, 16, 6.0, 6.0);
 
-    timeleft=ExposureRequest-timesince;
-    return timeleft;
+    // Let's calculate how much memory we need for the primary CCD buffer
+    int nbuf;
+    nbuf=PrimaryCCD.getXRes()*PrimaryCCD.getYRes() * PrimaryCCD.getBPP()/8;
+    PrimaryCCD.setFrameBufferSize(nbuf);
 }
 
 /**************************************************************************************
-** Client is asking us to set a new number
+** Client is asking us to start an exposure
 ***************************************************************************************/
-bool FFMVCCD::ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n)
+bool FFMVCCD::StartExposure(float duration)
 {
-    INumber *np;
+    float sub_length;
 
-    if(strcmp(dev,getDeviceName())==0)
-    {
+    /* The next exposure of a sequence is already under way on the capture
+     * thread; it only needs to be tracked again */
+    if (sequence_next) {
+        --sequence_left;
+        PrimaryCCD.setExposureDuration(duration);
+        subs_reported = 0;
+        InExposure = true;
+        DEBUGF(INDI::Logger::DBG_SESSION, "Exposure has begun, %d more to go.", sequence_left);
+        if (timerID < 0) {
+            timerID = SetTimer(ProgressN[0].value);
+        }
+        return true;
+    }
 
+    if (calib_building >= 0) {
+        DEBUG(INDI::Logger::DBG_ERROR, "Cannot expose while a master is being built.");
+        return false;
+    }
+    if (guiding) {
+        DEBUG(INDI::Logger::DBG_ERROR, "Stop the guide stream before exposing.");
+        return false;
+    }
+    if (recording) {
+        DEBUG(INDI::Logger::DBG_ERROR, "Stop recording before exposing.");
+        return false;
     }
 
-    // If we didn't process anything above, let the parent handle it.
-    return INDI::CCD::ISNewNumber(dev,name,values,names,n);
+    //IDMessage(getDeviceName(), "Doing %d sub exposures at %f %s each", sub_count, absShutter, prop_info.pUnits);
+
+    ExposureRequest=duration;
+
+    // Since we have only have one CCD with one chip, we set the exposure duration of the primary CCD
+    PrimaryCCD.setBPP(ffmv_output_bytes(pixel_format, stackOutput()) * 8);
+    updateFrameBuffer();
+    PrimaryCCD.setExposureDuration(duration);
+
+    /* A new exposure replaces the one in progress and the rest of a
+     * sequence. The capture thread has to let go of it first, or begin()
+     * would wait for it to finish stacking. A frame still waiting for its
+     * focus metrics is dropped too. */
+    if (InExposure || sequence_left > 0) {
+        capture.abort();
+        sequence_left = 0;
+    }
+    if (frame_waiting) {
+        frame_waiting = false;
+        capture.releaseResult();
+    }
+
+    exp_start_us = ffmv_time_us();
+
+    InExposure=true;
+    IDMessage(getDeviceName(), "Exposure has begun.");
+
+    sub_length = setupSubs(duration, LuckyS[0].s == ISS_ON ? LuckyN[1].value : 0);
+
+    /* Hand the exposure to the capture thread. It flushes the DMA ring and
+     * has the camera start sending us data. */
+    FFMVCaptureRequest req;
+    fillRequest(&req, sub_length);
+    req.exposures = FastS[0].s == ISS_ON ? (int) FastCountN[0].value : 1;
+    subs_reported = 0;
+    sizeRing(sub_length, req.sub_count);
+    if (!capture.begin(req)) {
+            IDMessage(getDeviceName(), "Unable to start capture");
+            InExposure = false;
+            return false;
+    }
+    sequence_left = req.exposures - 1;
+    if (timerID < 0) {
+        timerID = SetTimer(ProgressN[0].value);
+    }
+
+    // We're done
+    return true;
 }
 
+/**
+ * Set up a capture request for the current frame, stack and calibration
+ * settings, with subs of sub_length as programmed by setupSubs().
+ */
+void FFMVCCD::fillRequest(FFMVCaptureRequest *req, float sub_length)
+{
+    req->exposures = 1;
+    req->sub_count = sub_count;
+    req->sub_us = sub_length * 1000000;
+    req->frame_us = framePeriod(sub_length);
+    req->format = pixel_format;
+    req->width = PrimaryCCD.getSubW();
+    req->height = PrimaryCCD.getSubH();
+    req->binx = PrimaryCCD.getBinX();
+    req->biny = PrimaryCCD.getBinY();
+    req->stack.mode = (enum ffmv_stack_mode) IUFindOnSwitchIndex(&StackModeSP);
+    req->stack.kappa = StackN[0].value;
+    req->stack.output = stackOutput();
+    req->build = NULL;
+    req->record = NULL;
+    memset(&req->calib, 0, sizeof(req->calib));
+    if (CalibS[0].s == ISS_ON) {
+        findCalibration(sub_length, &req->calib);
+    }
+    memset(&req->guide, 0, sizeof(req->guide));
+    req->reg.enabled = RegisterS[0].s == ISS_ON;
+    req->reg.search = RegisterN[0].value;
+    req->lucky.enabled = LuckyS[0].s == ISS_ON;
+    req->lucky.metric = (enum ffmv_lucky_metric) IUFindOnSwitchIndex(&LuckyMetricSP);
+    req->lucky.keep = (int) ceil(sub_count * LuckyN[0].value / 100);
+    if (req->lucky.enabled) {
+        limitLucky(req);
+    }
+    req->preview = PreviewS[0].s == ISS_ON ? (int) PreviewN[0].value : 0;
+    req->focus = FocusS[0].s == ISS_ON;
+}
 
 /**
- * Set the digital gain in the MT9V022.
- * Sets the tiled digital gain to 2x what the default is.
+ * The time from one frame to the next the camera is set up for, in us. With
+ * frame rate control on that is one frame at the frame rate; with it off the
+ * shutter sets the pace, down to the time the ROI takes to read out, which
+ * is what the highest frame rate reflects.
  */
-dc1394error_t FFMVCCD::setDigitalGain(ISState state)
+long FFMVCCD::framePeriod(float sub_length)
 {
-    dc1394error_t err;
-    unsigned int val;
+    dc1394feature_info_t feature;
+    float min, max, fps;
+    double period = sub_length;
 
-    if (state == ISS_OFF) {
-        err = writeMicronReg(0x80, 0xF4);
-        err = readMicronReg(0x80, &val);
-        if (err == DC1394_SUCCESS) { 
-            IDMessage(getDeviceName(), "Turned off digital gain boost. Tiled Digital Gain = 0x%x", val);
-        } else {
-            IDMessage(getDeviceName(), "readMicronReg failed!");
-        }
-    } else {
-        err = writeMicronReg(0x80, 0xF8);
-        err = readMicronReg(0x80, &val);
-        if (err == DC1394_SUCCESS) { 
-            IDMessage(getDeviceName(), "Turned on digital gain boost. Tiled Digital Gain = 0x%x", val);
-        } else {
-            IDMessage(getDeviceName(), "readMicronReg failed!");
+    if (getFeature(camera, DC1394_FEATURE_FRAME_RATE, &feature) && feature.is_on) {
+        if (camera->getAbsoluteValue(DC1394_FEATURE_FRAME_RATE, &fps) == DC1394_SUCCESS && fps > 0) {
+            period = std::max(period, 1.0 / fps);
         }
+    } else if (camera->getAbsoluteBoundaries(DC1394_FEATURE_FRAME_RATE, &min, &max) == DC1394_SUCCESS &&
+            max > 0) {
+        period = std::max(period, 1.0 / max);
     }
-    return DC1394_SUCCESS;
+
+    return period * 1000000;
 }
 
 /**
- * Set the ADC reference voltage for the MT9V022.
- * Decreasing the reference voltage will, in effect, increase the gain.
- * The default Vref_ADC is 1.4V (4). We will bump it down to 1.0V (0).
+ * Keep no more lucky subs than fit in LUCKY_SETTINGS BUFFER_MB, and say so
+ * when that is fewer than KEEP_PERCENT asked for.
  */
-dc1394error_t FFMVCCD::setGainVref(ISState state)
+void FFMVCCD::limitLucky(FFMVCaptureRequest *req)
 {
-    dc1394error_t err;
-    unsigned int val;
+    uint64_t budget = std::min((uint64_t) LuckyN[2].value << 20, (uint64_t) SIZE_MAX);
+    uint64_t fit = budget / ffmv_lucky_frame_stride(req->format, req->width, req->height);
 
-    if (state == ISS_OFF) {
-        err = writeMicronReg(0x2C, 4);
-        err = readMicronReg(0x2C, &val);
-        if (err == DC1394_SUCCESS) { 
-            IDMessage(getDeviceName(), "Turned off Gain boost. VREF_ADC = 0x%x", val);
-        } else {
-            IDMessage(getDeviceName(), "readMicronReg failed!");
-        }
-    } else {
-        err = writeMicronReg(0x2C, 0);
-        err = readMicronReg(0x2C, &val);
-        if (err == DC1394_SUCCESS) { 
-            IDMessage(getDeviceName(), "Turned on Gain boost. VREF_ADC = 0x%x", val);
-        } else {
-            IDMessage(getDeviceName(), "readMicronReg failed!");
-        }
+    if ((uint64_t) req->lucky.keep <= fit) {
+        return;
     }
-    return DC1394_SUCCESS;
+    if (fit < 1) {
+        fit = 1;
+    }
+    DEBUGF(INDI::Logger::DBG_WARNING, "Only %d subs fit in %.0f MB, keeping %d instead of %d.",
+            (int) fit, LuckyN[2].value, (int) fit, req->lucky.keep);
+    req->lucky.keep = (int) fit;
 }
 
-bool FFMVCCD::ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n)
+/**
+ * Start streaming guide frames. The capture thread takes them back to back
+ * until stopGuiding(), and centroids the guide star in each as soon as it
+ * is stacked.
+ */
+bool FFMVCCD::startGuiding()
 {
-    if (strcmp(dev, getDeviceName()) == 0) {
-        /* Reset */
-        if (!strcmp(name, GainSP.name)) {
-            if (IUUpdateSwitch(&GainSP, states, names, n) < 0) {
-                return false;
-            }
-            setGainVref(GainS[0].s);
-            setDigitalGain(GainS[1].s);
-            return true;
-        }
+    FFMVCaptureRequest req;
+    float duration = GuideN[0].value;
+    float sub_length;
 
+    if (InExposure || recording || calib_building >= 0) {
+        DEBUG(INDI::Logger::DBG_ERROR, "Cannot guide during an exposure.");
+        return false;
     }
 
-    //  Nobody has claimed this, so, ignore it
-    return INDI::CCD::ISNewSwitch(dev, name, states, names, n);
-}
+    ExposureRequest = duration;
+    PrimaryCCD.setBPP(ffmv_output_bytes(pixel_format, stackOutput()) * 8);
+    updateFrameBuffer();
+    PrimaryCCD.setExposureDuration(duration);
 
+    sub_length = setupSubs(duration);
+    fillRequest(&req, sub_length);
+    req.exposures = 0;
+    req.guide.enabled = true;
+    req.guide.search = GuideN[2].value;
+    req.guide.radius = GuideN[3].value;
+    req.guide.min_snr = GuideN[4].value;
+    /* The guide star says all there is to know about these frames, and
+     * how far it drifts is the point */
+    req.focus = false;
+    req.reg.enabled = false;
+    req.lucky.enabled = false;
+    sizeRing(sub_length, req.sub_count);
+    if (!capture.begin(req)) {
+        DEBUG(INDI::Logger::DBG_ERROR, "Unable to start capture");
+        return false;
+    }
 
-/**************************************************************************************
-** INDI is asking us to add any FITS keywords to the FITS header
-***************************************************************************************/
-void FFMVCCD::addFITSKeywords(fitsfile *fptr, CCDChip *targetChip)
-{
-    // Let's first add parent keywords
-    INDI::CCD::addFITSKeywords(fptr, targetChip);
+    guiding = true;
+    guide_frames = 0;
+    exp_start_us = ffmv_time_us();
+    DEBUG(INDI::Logger::DBG_SESSION, "Guide stream started.");
 
+    return true;
 }
 
-/**************************************************************************************
-** Main device loop. We check for exposure progress
-***************************************************************************************/
-void FFMVCCD::TimerHit()
+void FFMVCCD::stopGuiding()
 {
-    long timeleft;
+    if (!guiding) {
+        return;
+    }
+    capture.abort();
+    guiding = false;
+    DEBUG(INDI::Logger::DBG_SESSION, "Guide stream stopped.");
+}
 
-    if(isConnected() == false) {
-        return;  //  No need to reset timer if we are not connected anymore
+/**
+ * Publish the guide star from a streamed frame, and send the frame itself
+ * if it was asked for or is due.
+ */
+void FFMVCCD::guideFrame(const FFMVCaptureResult &res)
+{
+    int every = GuideN[1].value;
+    bool send;
+
+    if (res.aborted || !res.more) {
+        capture.releaseResult();
+        if (!res.aborted) {
+            DEBUG(INDI::Logger::DBG_ERROR, "Guide stream failed.");
+            guiding = false;
+            IUResetSwitch(&GuideSP);
+            GuideS[1].s = ISS_ON;
+            GuideSP.s = IPS_ALERT;
+            IDSetSwitch(&GuideSP, NULL);
+        }
+        return;
     }
 
-    if (InExposure) {
-        timeleft=CalcTimeLeft();
+    ++guide_frames;
+    GuideStarN[5].value = guide_frames;
+    GuideStarN[6].value = res.centroid_us / 1000.0;
+    if (res.star_found) {
+        GuideStarN[0].value = res.star.x;
+        GuideStarN[1].value = res.star.y;
+        GuideStarN[2].value = res.star.flux;
+        GuideStarN[3].value = res.star.snr;
+        GuideStarN[4].value = res.star.peak;
+        GuideStarNP.s = IPS_OK;
+    } else {
+        /* Keep the last position, so clients can tell a lost star from
+         * one that moved */
+        GuideStarN[3].value = 0;
+        GuideStarNP.s = IPS_ALERT;
+    }
+    IDSetNumber(&GuideStarNP, NULL);
 
-        // Less than a 0.1 second away from exposure completion
-        // This is an over simplified timing method, check CCDSimulator and ffmvCCD for better timing checks
-        if (timeleft < 0.1) {
-            /* We're done exposing */
-            IDMessage(getDeviceName(), "Exposure done, downloading image...");
+    send = GuideFrameS[0].s == ISS_ON || (every > 0 && guide_frames % every == 0);
+    if (!send) {
+        capture.releaseResult();
+        return;
+    }
 
-            // Set exposure left to zero
-            PrimaryCCD.setExposureLeft(0);
+    copyFrame(res);
+    capture.releaseResult();
+    focus_valid = false;
+    PrimaryCCD.setExposureDuration(ExposureRequest);
+    sendFrame();
 
-            // We're no longer exposing...
-            InExposure = false;
+    if (GuideFrameS[0].s == ISS_ON) {
+        GuideFrameS[0].s = ISS_OFF;
+        GuideFrameSP.s = IPS_OK;
+        IDSetSwitch(&GuideFrameSP, NULL);
+    }
+}
 
-            /* grab and save image */
-            grabImage();
-        } else {
-            // Just update time left in client
-            PrimaryCCD.setExposureLeft(timeleft);
-        }
+/**
+ * Split an exposure into the fewest subs the shutter allows, or that are no
+ * longer than max_sub if it is set, and program the sub length. Returns the
+ * sub length.
+ */
+float FFMVCCD::setupSubs(float duration, float max_sub)
+{
+    dc1394error_t err;
+    int ms = duration * 1000;
+    float longest = max_sub > 0 && max_sub < max_exposure ? max_sub : max_exposure;
+    float sub_length;
+    float fval;
+
+    /* Calculate the number of exposures needed */
+    sub_count = duration / longest;
+    if (ms % ((int) (longest * 1000))) {
+        ++sub_count;
+    }
+    if (sub_count < 1) {
+        sub_count = 1;
+    }
+    sub_length = duration / sub_count;
+
+    IDMessage(getDeviceName(), "Triggering a %f second exposure using %d subs of %f seconds",
+            duration, sub_count, sub_length);
+    /* Set sub length */
+    err = camera->setAbsoluteValue(DC1394_FEATURE_SHUTTER, sub_length);
+    if (err != DC1394_SUCCESS) {
+        IDMessage(getDeviceName(), "Unable to set shutter value.");
+    }
+    err = camera->getAbsoluteValue(DC1394_FEATURE_SHUTTER, &fval);
+    if (err != DC1394_SUCCESS) {
+        IDMessage(getDeviceName(), "Unable to get shutter value.");
     }
+    DEBUGF(INDI::Logger::DBG_DEBUG, "Shutter value is %f.", fval);
 
-    SetTimer(POLLMS);
-    return;
+    return sub_length;
+}
+
+enum ffmv_stack_output FFMVCCD::stackOutput()
+{
+    int i = IUFindOnSwitchIndex(&StackOutputSP);
+
+    return i < 0 ? FFMV_OUTPUT_NATIVE : (enum ffmv_stack_output) i;
 }
 
 /**
- * Download image from FireFly
+ * Resize the DMA ring for an exposure of subs subs of sub_length seconds.
+ *
+ * The ring only has to absorb the difference between how fast frames
+ * arrive and how fast the capture thread stacks them. If stacking keeps up,
+ * a few buffers do; if not, the backlog grows over the exposure. The last
+ * exposure's slowest sub and ring high water mark are the measure of the
+ * consumer. The ring is grown as soon as it is short, but only shrunk once
+ * it is more than twice what is needed, as rebuilding it costs a capture
+ * stop and setup.
  */
-void FFMVCCD::grabImage()
+void FFMVCCD::sizeRing(float sub_length, int subs)
 {
-   unsigned char *myimage;
-   dc1394error_t err;
-   dc1394video_frame_t *frame;
-   uint32_t uheight, uwidth;
-   int sub;
-   uint16_t val;
-   struct timeval start, end;
+    double period_us = sub_length * 1000000;
+    dc1394error_t err;
+    int need;
 
-   // Let's get a pointer to the frame buffer
-   char * image = PrimaryCCD.getFrameBuffer();
+    if (period_us < 1) {
+        period_us = 1;
+    }
+    if (last_stack_max_us <= period_us) {
+        need = 2 + (int) ceil(last_stack_max_us / period_us);
+    } else {
+        need = 2 + (int) ceil(subs * (1 - period_us / last_stack_max_us));
+    }
+    if (last_ring_used >= ring_depth) {
+        /* The ring filled up last time */
+        need = need > 2 * ring_depth ? need : 2 * ring_depth;
+    } else if (last_ring_used + 1 > need) {
+        need = last_ring_used + 1;
+    }
+    if (need > subs + 1) {
+        need = subs + 1;
+    }
+    need = need < RING_MIN ? RING_MIN : need > RING_MAX ? RING_MAX : need;
 
-   // Get width and height
-   int width = PrimaryCCD.getSubW() / PrimaryCCD.getBinX();
-   int height = PrimaryCCD.getSubH() / PrimaryCCD.getBinY();
+    if (need <= ring_depth && need * 2 > ring_depth) {
+        return;
+    }
 
-   memset(image, 0, PrimaryCCD.getFrameBufferSize());
+    capture.waitIdle();
+    camera->captureStop();
+    err = camera->captureSetup(need, DC1394_CAPTURE_FLAGS_DEFAULT);
+    if (err != DC1394_SUCCESS) {
+        DEBUGF(INDI::Logger::DBG_WARNING, "Unable to resize DMA ring to %d frames.", need);
+        camera->captureSetup(ring_depth, DC1394_CAPTURE_FLAGS_DEFAULT);
+        return;
+    }
+    DEBUGF(INDI::Logger::DBG_DEBUG, "DMA ring resized from %d to %d frames.", ring_depth, need);
+    ring_depth = need;
+    last_ring_used = 0;
+}
 
+/**
+ * Describe a master for the current ROI, pixel format and gain settings.
+ */
+FFMVCalibKey FFMVCCD::calibKey(enum ffmv_calib_type type, float sub_length)
+{
+    FFMVCalibKey key;
+
+    key.camera = known_config.guid;
+    key.type = type;
+    key.bpp = ffmv_pixel_bytes(pixel_format) * 8;
+    key.sub_us = type == FFMV_CALIB_DARK ? (uint32_t) (sub_length * 1000000 + 0.5) : 0;
+    key.gain_vref = type != FFMV_CALIB_FLAT && GainS[0].s == ISS_ON;
+    key.gain_2x = type != FFMV_CALIB_FLAT && GainS[1].s == ISS_ON;
+    key.x = PrimaryCCD.getSubX();
+    key.y = PrimaryCCD.getSubY();
+    key.width = PrimaryCCD.getSubW();
+    key.height = PrimaryCCD.getSubH();
+
+    return key;
+}
 
-   /*-----------------------------------------------------------------------
-    *  stop data transmission
-    *-----------------------------------------------------------------------*/
+/**
+ * Look up the dark (or failing that, bias) and flat masters for subs of
+ * sub_length. Returns false if there are none.
+ */
+bool FFMVCCD::findDark(float sub_length, const float **dark, int *stride)
+{
+    *dark = calib_library.find(calibKey(FFMV_CALIB_DARK, sub_length), max_width, max_height, stride);
+    if (!*dark) {
+        *dark = calib_library.find(calibKey(FFMV_CALIB_BIAS, 0), max_width, max_height, stride);
+    }
+    return *dark != NULL;
+}
 
+bool FFMVCCD::findCalibration(float sub_length, FFMVCalibFrames *calib)
+{
+    findDark(sub_length, &calib->dark, &calib->dark_stride);
+    calib->flat = calib_library.find(calibKey(FFMV_CALIB_FLAT, 0), max_width, max_height, &calib->flat_stride);
 
-   gettimeofday(&start, NULL);
-   for (sub = 0; sub < sub_count; ++sub) {
-       IDMessage(getDeviceName(), "Getting sub %d of %d", sub, sub_count);
-       err=dc1394_capture_dequeue(dcam, DC1394_CAPTURE_POLICY_WAIT, &frame);
-       if (err != DC1394_SUCCESS) {
-              IDMessage(getDeviceName(), "Could not capture frame");
-       }
-       dc1394_get_image_size_from_video_mode(dcam,DC1394_VIDEO_MODE_640x480_MONO16, &uwidth, &uheight);
+    if (!calib->dark && !calib->flat) {
+        DEBUG(INDI::Logger::DBG_WARNING, "No calibration masters match this exposure.");
+        return false;
+    }
+    DEBUGF(INDI::Logger::DBG_SESSION, "Calibrating with %s%s.", calib->dark ? "dark " : "",
+            calib->flat ? "flat" : "");
 
-       if (DC1394_TRUE == dc1394_capture_is_frame_corrupt(dcam, frame)) {
-              IDMessage(getDeviceName(), "Corrupt frame!");
-              continue;
-       }
-       // Fill buffer with random pattern
-       for (int i=0; i < height ; i++) {
-           for (int j=0; j < width; j++) {
-               /* Detect unsigned overflow */
-               val = ((uint16_t *) image)[i*width+j] + ntohs(((uint16_t*) (frame->image))[i*width+j]);
-               if (val > ((uint16_t *) image)[i*width+j]) {
-                   ((uint16_t *) image)[i*width+j] = val;
-               } else {
-                   ((uint16_t *) image)[i*width+j] = 0xFFFF;
-               }
-           }
-       }
+    return true;
+}
 
-       dc1394_capture_enqueue(dcam, frame);
-   }
-   err=dc1394_video_set_transmission(dcam,DC1394_OFF);
-   IDMessage(getDeviceName(), "Download complete.");
-   gettimeofday(&end, NULL);
-   IDMessage(getDeviceName(), "Download took %d uS", (int) ((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec)));
+/**
+ * Capture frames for a new master. Darks and flats are taken at the sub
+ * length used for an exposure of CALIB_EXPOSURE seconds, bias frames at the
+ * shortest shutter.
+ */
+bool FFMVCCD::buildMaster(enum ffmv_calib_type type)
+{
+    FFMVCaptureRequest req;
+    int frames = CalibBuildN[0].value;
 
-   // Let INDI::CCD know we're done filling the image buffer
-   ExposureComplete(&PrimaryCCD);
+    if (InExposure || guiding || recording || calib_building >= 0) {
+        DEBUG(INDI::Logger::DBG_ERROR, "Cannot build a master during an exposure.");
+        return false;
+    }
+
+    if (type == FFMV_CALIB_BIAS) {
+        setupSubs(min_exposure);
+        calib_sub_length = min_exposure;
+    } else {
+        calib_sub_length = setupSubs(CalibBuildN[1].value);
+    }
+
+    req.exposures = 1;
+    req.sub_count = frames * sub_count;
+    req.sub_us = calib_sub_length * 1000000;
+    req.frame_us = framePeriod(calib_sub_length);
+    req.format = pixel_format;
+    req.width = PrimaryCCD.getSubW();
+    req.height = PrimaryCCD.getSubH();
+    req.binx = 1;
+    req.biny = 1;
+    req.stack.mode = FFMV_STACK_SUM;
+    req.stack.kappa = 0;
+    req.stack.output = FFMV_OUTPUT_NATIVE;
+    memset(&req.calib, 0, sizeof(req.calib));
+    req.build = &calib_builder;
+    req.record = NULL;
+    memset(&req.guide, 0, sizeof(req.guide));
+    memset(&req.reg, 0, sizeof(req.reg));
+    memset(&req.lucky, 0, sizeof(req.lucky));
+    sizeRing(calib_sub_length, req.sub_count);
+    if (!capture.begin(req)) {
+        DEBUG(INDI::Logger::DBG_ERROR, "Unable to start capture");
+        return false;
+    }
+
+    calib_building = type;
+    DEBUGF(INDI::Logger::DBG_SESSION, "Building master from %d frames...", req.sub_count);
+
+    return true;
+}
+
+/**
+ * The frames for a master are in; average them and add it to the library.
+ */
+void FFMVCCD::saveMaster()
+{
+    enum ffmv_calib_type type = (enum ffmv_calib_type) calib_building;
+    const float *dark = NULL;
+    const float *data;
+    int stride = 0;
+
+    calib_building = -1;
+
+    if (type == FFMV_CALIB_DARK) {
+        data = calib_builder.average(NULL, 0);
+    } else if (type == FFMV_CALIB_FLAT) {
+        findDark(calib_sub_length, &dark, &stride);
+        data = calib_builder.flat(dark, stride);
+    } else {
+        data = calib_builder.average(NULL, 0);
+    }
+
+    IUResetSwitch(&CalibBuildSP);
+    if (!data || !calib_library.save(calibKey(type, calib_sub_length), data, calib_builder.getFrames())) {
+        DEBUG(INDI::Logger::DBG_ERROR, "Unable to save master.");
+        CalibBuildSP.s = IPS_ALERT;
+    } else {
+        DEBUGF(INDI::Logger::DBG_SESSION, "Saved master from %d frames to %s.", calib_builder.getFrames(),
+                calib_library.getDirectory());
+        CalibBuildSP.s = IPS_OK;
+    }
+    IDSetSwitch(&CalibBuildSP, NULL);
+}
+
+/**************************************************************************************
+** Client is asking us to abort an exposure
+***************************************************************************************/
+bool FFMVCCD::AbortExposure()
+{
+    if (guiding) {
+        stopGuiding();
+        IUResetSwitch(&GuideSP);
+        GuideS[1].s = ISS_ON;
+        GuideSP.s = IPS_IDLE;
+        IDSetSwitch(&GuideSP, NULL);
+    }
+    if (recording) {
+        /* The file is finished once the capture thread lets go of it */
+        stopRecording();
+    }
+    capture.abort();
+    if (frame_waiting) {
+        frame_waiting = false;
+        capture.releaseResult();
+    }
+    sequence_left = 0;
+    InExposure = false;
+    return true;
+}
+
+/**************************************************************************************
+** How much longer until exposure is done?
+***************************************************************************************/
+float FFMVCCD::CalcTimeLeft()
+{
+    double timesince;
+
+    timesince = (ffmv_time_us() - exp_start_us) / 1000000.0;
+
+    return ExposureRequest - timesince;
+}
+
+/**************************************************************************************
+** Client is asking us to set a new number
+***************************************************************************************/
+bool FFMVCCD::ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n)
+{
+    INumber *np;
+
+    if(strcmp(dev,getDeviceName())==0)
+    {
+        if (!strcmp(name, StackNP.name)) {
+            if (IUUpdateNumber(&StackNP, values, names, n) < 0) {
+                return false;
+            }
+            StackNP.s = IPS_OK;
+            IDSetNumber(&StackNP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, ProgressNP.name)) {
+            if (IUUpdateNumber(&ProgressNP, values, names, n) < 0) {
+                return false;
+            }
+            ProgressNP.s = IPS_OK;
+            IDSetNumber(&ProgressNP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, GuideNP.name)) {
+            if (IUUpdateNumber(&GuideNP, values, names, n) < 0) {
+                return false;
+            }
+            GuideNP.s = IPS_OK;
+            IDSetNumber(&GuideNP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, FastCountNP.name)) {
+            if (IUUpdateNumber(&FastCountNP, values, names, n) < 0) {
+                return false;
+            }
+            FastCountNP.s = IPS_OK;
+            IDSetNumber(&FastCountNP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, CompressNP.name)) {
+            if (IUUpdateNumber(&CompressNP, values, names, n) < 0) {
+                return false;
+            }
+            CompressNP.s = IPS_OK;
+            IDSetNumber(&CompressNP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, RegisterNP.name)) {
+            if (IUUpdateNumber(&RegisterNP, values, names, n) < 0) {
+                return false;
+            }
+            RegisterNP.s = IPS_OK;
+            IDSetNumber(&RegisterNP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, LuckyNP.name)) {
+            if (IUUpdateNumber(&LuckyNP, values, names, n) < 0) {
+                return false;
+            }
+            LuckyNP.s = IPS_OK;
+            IDSetNumber(&LuckyNP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, PreviewNP.name)) {
+            if (IUUpdateNumber(&PreviewNP, values, names, n) < 0) {
+                return false;
+            }
+            PreviewNP.s = IPS_OK;
+            IDSetNumber(&PreviewNP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, CalibBuildNP.name)) {
+            if (IUUpdateNumber(&CalibBuildNP, values, names, n) < 0) {
+                return false;
+            }
+            CalibBuildNP.s = IPS_OK;
+            IDSetNumber(&CalibBuildNP, NULL);
+            return true;
+        }
+
+        /* Simulator settings apply from the next connect on */
+        if (!strcmp(name, SimulatorNP.name)) {
+            if (IUUpdateNumber(&SimulatorNP, values, names, n) < 0) {
+                return false;
+            }
+            SimulatorNP.s = IPS_OK;
+            IDSetNumber(&SimulatorNP, NULL);
+            return true;
+        }
+
+        /* Recording settings apply from the next recording on */
+        if (!strcmp(name, RecordNP.name)) {
+            if (IUUpdateNumber(&RecordNP, values, names, n) < 0) {
+                return false;
+            }
+            RecordNP.s = IPS_OK;
+            IDSetNumber(&RecordNP, NULL);
+            return true;
+        }
+    }
+
+    // If we didn't process anything above, let the parent handle it.
+    return INDI::CCD::ISNewNumber(dev,name,values,names,n);
+}
+
+
+/**
+ * Queue the MT9V022 gain settings from GainS on the control thread.
+ *
+ * Gain boost lowers the ADC reference voltage from the default 1.4V (4) to
+ * 1.0V (0), which in effect increases the gain. Digital gain boost sets the
+ * tiled digital gain to 2x what the default is.
+ */
+bool FFMVCCD::setGain()
+{
+    FFMVRegWrite ops[2];
+
+    ops[0].space = FFMV_REG_SENSOR;
+    ops[0].offset = 0x2C;
+    ops[0].value = GainS[0].s == ISS_ON ? 0 : 4;
+    ops[1].space = FFMV_REG_SENSOR;
+    ops[1].offset = 0x80;
+    ops[1].value = GainS[1].s == ISS_ON ? 0xF8 : 0xF4;
+
+    return control.submit(ops, 2, CONTROL_GAIN);
+}
+
+/**
+ * Report control batches the control thread has finished with.
+ */
+void FFMVCCD::controlDone()
+{
+    FFMVControlDone done;
+    FFMVControlStats stats;
+    uint32_t vref, digital;
+
+    while (control.takeDone(&done)) {
+        if (done.tag == CONTROL_GAIN) {
+            if (done.err != DC1394_SUCCESS) {
+                DEBUG(INDI::Logger::DBG_ERROR, "Unable to set sensor gain.");
+                GainSP.s = IPS_ALERT;
+            } else {
+                if (control.getShadow(FFMV_REG_SENSOR, 0x2C, &vref) &&
+                        control.getShadow(FFMV_REG_SENSOR, 0x80, &digital)) {
+                    DEBUGF(INDI::Logger::DBG_SESSION, "VREF_ADC = 0x%x, Tiled Digital Gain = 0x%x", vref, digital);
+                }
+                GainSP.s = IPS_OK;
+            }
+            IDSetSwitch(&GainSP, NULL);
+        }
+    }
+
+    control.getStats(&stats);
+    ControlStatsN[0].value = stats.bus_writes;
+    ControlStatsN[1].value = stats.saved;
+    ControlStatsN[2].value = stats.batches;
+    ControlStatsNP.s = stats.errors ? IPS_ALERT : IPS_OK;
+    IDSetNumber(&ControlStatsNP, NULL);
+}
+
+void FFMVCCD::controlReadyCB(int fd, void *arg)
+{
+    INDI_UNUSED(fd);
+    ((FFMVCCD *) arg)->controlDone();
+}
+
+bool FFMVCCD::ISNewText(const char *dev, const char *name, char *texts[], char *names[], int n)
+{
+    if (strcmp(dev, getDeviceName()) == 0) {
+        if (!strcmp(name, GuidTP.name)) {
+            uint64_t val;
+            char *end;
+
+            if (isConnected()) {
+                DEBUG(INDI::Logger::DBG_ERROR, "Disconnect before choosing another camera.");
+                GuidTP.s = IPS_ALERT;
+                IDSetText(&GuidTP, NULL);
+                return false;
+            }
+            val = n > 0 ? strtoull(texts[0], &end, 16) : 0;
+            if (n > 0 && *texts[0] && *end) {
+                DEBUGF(INDI::Logger::DBG_ERROR, "Invalid GUID %s", texts[0]);
+                GuidTP.s = IPS_ALERT;
+                IDSetText(&GuidTP, NULL);
+                return false;
+            }
+            guid = val;
+            if (guid) {
+                snprintf(guid_text, sizeof(guid_text), "%016llx", (unsigned long long) guid);
+            } else {
+                guid_text[0] = '\0';
+            }
+            IUSaveText(&GuidT[0], guid_text);
+            GuidTP.s = IPS_OK;
+            IDSetText(&GuidTP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, TraceTP.name)) {
+            if (IUUpdateText(&TraceTP, texts, names, n) < 0) {
+                return false;
+            }
+            TraceTP.s = openTrace(TraceT[0].text) ? IPS_OK : IPS_ALERT;
+            IDSetText(&TraceTP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, CalibDirTP.name)) {
+            if (InExposure || guiding || calib_building >= 0) {
+                DEBUG(INDI::Logger::DBG_ERROR, "Cannot change the library during an exposure.");
+                CalibDirTP.s = IPS_ALERT;
+                IDSetText(&CalibDirTP, NULL);
+                return false;
+            }
+            if (IUUpdateText(&CalibDirTP, texts, names, n) < 0) {
+                return false;
+            }
+            calib_library.setDirectory(CalibDirT[0].text);
+            CalibDirTP.s = IPS_OK;
+            IDSetText(&CalibDirTP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, SimulatorReplayTP.name)) {
+            if (IUUpdateText(&SimulatorReplayTP, texts, names, n) < 0) {
+                return false;
+            }
+            SimulatorReplayTP.s = IPS_OK;
+            IDSetText(&SimulatorReplayTP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, RecordFileTP.name)) {
+            if (IUUpdateText(&RecordFileTP, texts, names, n) < 0) {
+                return false;
+            }
+            RecordFileTP.s = IPS_OK;
+            IDSetText(&RecordFileTP, NULL);
+            return true;
+        }
+    }
+
+    return INDI::CCD::ISNewText(dev, name, texts, names, n);
+}
+
+bool FFMVCCD::ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n)
+{
+    if (strcmp(dev, getDeviceName()) == 0) {
+        /* Reset */
+        if (!strcmp(name, GainSP.name)) {
+            if (IUUpdateSwitch(&GainSP, states, names, n) < 0) {
+                return false;
+            }
+            GainSP.s = setGain() ? IPS_BUSY : IPS_ALERT;
+            IDSetSwitch(&GainSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, ConnectModeSP.name)) {
+            if (IUUpdateSwitch(&ConnectModeSP, states, names, n) < 0) {
+                return false;
+            }
+            ConnectModeSP.s = IPS_OK;
+            IDSetSwitch(&ConnectModeSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, StackModeSP.name)) {
+            if (IUUpdateSwitch(&StackModeSP, states, names, n) < 0) {
+                return false;
+            }
+            StackModeSP.s = IPS_OK;
+            IDSetSwitch(&StackModeSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, GuideSP.name)) {
+            if (IUUpdateSwitch(&GuideSP, states, names, n) < 0) {
+                return false;
+            }
+            if (GuideS[0].s == ISS_ON) {
+                if (guiding || startGuiding()) {
+                    GuideSP.s = IPS_BUSY;
+                } else {
+                    IUResetSwitch(&GuideSP);
+                    GuideS[1].s = ISS_ON;
+                    GuideSP.s = IPS_ALERT;
+                }
+            } else {
+                stopGuiding();
+                GuideSP.s = IPS_IDLE;
+            }
+            IDSetSwitch(&GuideSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, RecordSP.name)) {
+            if (IUUpdateSwitch(&RecordSP, states, names, n) < 0) {
+                return false;
+            }
+            if (RecordS[0].s == ISS_ON) {
+                if (recording || startRecording()) {
+                    RecordSP.s = IPS_BUSY;
+                } else {
+                    IUResetSwitch(&RecordSP);
+                    RecordS[1].s = ISS_ON;
+                    RecordSP.s = IPS_ALERT;
+                }
+                IDSetSwitch(&RecordSP, NULL);
+            } else if (recording) {
+                /* Stays busy until the file is finished */
+                stopRecording();
+                IUResetSwitch(&RecordSP);
+                RecordS[0].s = ISS_ON;
+                IDSetSwitch(&RecordSP, NULL);
+            } else {
+                RecordSP.s = IPS_IDLE;
+                IDSetSwitch(&RecordSP, NULL);
+            }
+            return true;
+        }
+
+        if (!strcmp(name, RecordDirectSP.name)) {
+            if (IUUpdateSwitch(&RecordDirectSP, states, names, n) < 0) {
+                return false;
+            }
+            RecordDirectSP.s = RecordDirectS[0].s == ISS_ON ? IPS_OK : IPS_IDLE;
+            IDSetSwitch(&RecordDirectSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, GuideFrameSP.name)) {
+            if (IUUpdateSwitch(&GuideFrameSP, states, names, n) < 0) {
+                return false;
+            }
+            GuideFrameSP.s = GuideFrameS[0].s == ISS_ON ? IPS_BUSY : IPS_IDLE;
+            IDSetSwitch(&GuideFrameSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, FastSP.name)) {
+            if (IUUpdateSwitch(&FastSP, states, names, n) < 0) {
+                return false;
+            }
+            FastSP.s = IPS_OK;
+            IDSetSwitch(&FastSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, CompressSP.name)) {
+            if (IUUpdateSwitch(&CompressSP, states, names, n) < 0) {
+                return false;
+            }
+            CompressSP.s = IPS_OK;
+            IDSetSwitch(&CompressSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, FocusSP.name)) {
+            if (IUUpdateSwitch(&FocusSP, states, names, n) < 0) {
+                return false;
+            }
+            FocusSP.s = IPS_OK;
+            IDSetSwitch(&FocusSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, RegisterSP.name)) {
+            if (IUUpdateSwitch(&RegisterSP, states, names, n) < 0) {
+                return false;
+            }
+            RegisterSP.s = RegisterS[0].s == ISS_ON ? IPS_OK : IPS_IDLE;
+            IDSetSwitch(&RegisterSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, LuckySP.name)) {
+            if (IUUpdateSwitch(&LuckySP, states, names, n) < 0) {
+                return false;
+            }
+            LuckySP.s = LuckyS[0].s == ISS_ON ? IPS_OK : IPS_IDLE;
+            IDSetSwitch(&LuckySP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, LuckyMetricSP.name)) {
+            if (IUUpdateSwitch(&LuckyMetricSP, states, names, n) < 0) {
+                return false;
+            }
+            LuckyMetricSP.s = IPS_OK;
+            IDSetSwitch(&LuckyMetricSP, NULL);
+            return true;
+        }
+
+        /* Both preview properties apply from the next exposure on */
+        if (!strcmp(name, PreviewSP.name)) {
+            if (IUUpdateSwitch(&PreviewSP, states, names, n) < 0) {
+                return false;
+            }
+            PreviewSP.s = PreviewS[0].s == ISS_ON ? IPS_OK : IPS_IDLE;
+            IDSetSwitch(&PreviewSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, StackOutputSP.name)) {
+            if (InExposure || guiding) {
+                DEBUG(INDI::Logger::DBG_ERROR, "Cannot change the stack output during an exposure.");
+                StackOutputSP.s = IPS_ALERT;
+                IDSetSwitch(&StackOutputSP, NULL);
+                return false;
+            }
+            if (IUUpdateSwitch(&StackOutputSP, states, names, n) < 0) {
+                return false;
+            }
+            PrimaryCCD.setBPP(ffmv_output_bytes(pixel_format, stackOutput()) * 8);
+            updateFrameBuffer();
+            StackOutputSP.s = IPS_OK;
+            IDSetSwitch(&StackOutputSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, CalibSP.name)) {
+            if (IUUpdateSwitch(&CalibSP, states, names, n) < 0) {
+                return false;
+            }
+            CalibSP.s = IPS_OK;
+            IDSetSwitch(&CalibSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, CalibBuildSP.name)) {
+            int type;
+
+            if (IUUpdateSwitch(&CalibBuildSP, states, names, n) < 0) {
+                return false;
+            }
+            type = IUFindOnSwitchIndex(&CalibBuildSP);
+            if (type < 0) {
+                return true;
+            }
+            if (buildMaster((enum ffmv_calib_type) type)) {
+                CalibBuildSP.s = IPS_BUSY;
+            } else {
+                IUResetSwitch(&CalibBuildSP);
+                CalibBuildSP.s = IPS_ALERT;
+            }
+            IDSetSwitch(&CalibBuildSP, NULL);
+            return true;
+        }
+
+        if (!strcmp(name, CaptureModeSP.name)) {
+            enum ffmv_pixel_format fmt = pixel_format;
+
+            if (InExposure || guiding || recording) {
+                DEBUG(INDI::Logger::DBG_ERROR, "Cannot change capture mode during an exposure.");
+                CaptureModeSP.s = IPS_ALERT;
+                IDSetSwitch(&CaptureModeSP, NULL);
+                return false;
+            }
+            if (IUUpdateSwitch(&CaptureModeSP, states, names, n) < 0) {
+                return false;
+            }
+            fmt = CaptureModeS[1].s == ISS_ON ? FFMV_MONO8 : FFMV_MONO16;
+            if (setCaptureMode(fmt) != DC1394_SUCCESS) {
+                CaptureModeSP.s = IPS_ALERT;
+            } else {
+                CaptureModeSP.s = IPS_OK;
+            }
+            IDSetSwitch(&CaptureModeSP, NULL);
+            return true;
+        }
+
+    }
+
+    //  Nobody has claimed this, so, ignore it
+    return INDI::CCD::ISNewSwitch(dev, name, states, names, n);
+}
+
+
+/**************************************************************************************
+** INDI is asking us to add any FITS keywords to the FITS header
+***************************************************************************************/
+void FFMVCCD::addFITSKeywords(fitsfile *fptr, CCDChip *targetChip)
+{
+    int status = 0;
+    int nkeys, nmore;
+    size_t data;
+
+    // Let's first add parent keywords
+    INDI::CCD::addFITSKeywords(fptr, targetChip);
+
+    if (focus_valid && focus.measured) {
+        fits_update_key_dbl(fptr, "HFR", focus.hfr, 3, "Median half flux radius (pixels)", &status);
+        fits_update_key_dbl(fptr, "FWHM", focus.fwhm, 3, "Median star FWHM (pixels)", &status);
+    }
+    if (focus_valid) {
+        fits_update_key(fptr, TINT, "STARS", &focus.stars, "Stars detected", &status);
+    }
+    if (stats_valid) {
+        fits_update_key(fptr, TUINT, "DATAMIN", &frame_stats.min, "Minimum pixel value", &status);
+        fits_update_key(fptr, TUINT, "DATAMAX", &frame_stats.max, "Maximum pixel value", &status);
+        fits_update_key_dbl(fptr, "MEAN", frame_stats.mean, 6, "Mean pixel value", &status);
+        fits_update_key_dbl(fptr, "STDDEV", frame_stats.stddev, 6, "Pixel standard deviation", &status);
+        fits_update_key_dbl(fptr, "MEDIAN", frame_stats.median, 6, "Median pixel value, sampled", &status);
+        fits_update_key(fptr, TULONG, "SATPIX", &frame_stats.saturated, "Pixels at the clamp value", &status);
+    }
+
+    /* Ours are the last keywords, so the size of the FITS file is known
+     * from here: header and data, each padded to 2880 byte blocks */
+    if (!fits_get_hdrspace(fptr, &nkeys, &nmore, &status)) {
+        data = (size_t) targetChip->getSubW() / targetChip->getBinX() *
+                (targetChip->getSubH() / targetChip->getBinY()) * (targetChip->getBPP() / 8);
+        fits_bytes = ((nkeys + 1) * 80 + 2879) / 2880 * 2880 + (data + 2879) / 2880 * 2880;
+    }
+
+}
+
+/**************************************************************************************
+** Main device loop. We update clients on exposure progress
+***************************************************************************************/
+void FFMVCCD::TimerHit()
+{
+    float timeleft;
+    int subs_done;
+
+    timerID = -1;
+    if(isConnected() == false) {
+        return;  //  No need to reset timer if we are not connected anymore
+    }
+
+    /* Completion comes from the capture thread; this only reports
+     * progress, so it stops once the exposure is done */
+    if (InExposure) {
+        timeleft=CalcTimeLeft();
+        if (timeleft < 0) {
+            timeleft = 0;
+        }
+        PrimaryCCD.setExposureLeft(timeleft);
+
+        subs_done = capture.getSubsDone();
+        while (subs_reported < subs_done) {
+            DEBUGF(INDI::Logger::DBG_DEBUG, "Got sub %d of %d", ++subs_reported, sub_count);
+        }
+    }
+    if (recording) {
+        publishRecordStatus();
+    }
+    if (InExposure || recording) {
+        timerID = SetTimer(ProgressN[0].value);
+    }
+}
+
+/**
+ * The capture thread has finished stacking an exposure
+ */
+void FFMVCCD::captureReadyCB(int fd, void *arg)
+{
+    FFMVCCD *ccd = (FFMVCCD *) arg;
+
+    INDI_UNUSED(fd);
+    /* Previews are small and go first, ahead of a whole frame */
+    ccd->sendPreview();
+    ccd->focusReady();
+    ccd->grabImage();
+}
+
+/**
+ * Collect the stacked image from the capture thread
+ */
+void FFMVCCD::grabImage()
+{
+   FFMVCaptureResult res;
+   int64_t next_start;
+
+   /* The capture thread's slot still holds the frame being measured */
+   if (frame_waiting || !capture.takeResult(&res)) {
+       return;
+   }
+   /* In a sequence, the next exposure started as this one finished */
+   next_start = ffmv_time_us();
+
+   last_stack_max_us = res.stack_max_us;
+   last_ring_used = res.ring_used;
+
+   if (res.recorded) {
+       capture.releaseResult();
+       finishRecording(res);
+       return;
+   }
+
+   if (res.built) {
+       capture.releaseResult();
+       if (res.aborted || res.error || !res.subs_stacked) {
+           calib_building = -1;
+           DEBUG(INDI::Logger::DBG_ERROR, "Building master failed.");
+           IUResetSwitch(&CalibBuildSP);
+           CalibBuildSP.s = IPS_ALERT;
+           IDSetSwitch(&CalibBuildSP, NULL);
+           return;
+       }
+       saveMaster();
+       return;
+   }
+
+   if (guiding) {
+       guideFrame(res);
+       return;
+   }
+
+   if (res.aborted || !InExposure) {
+       capture.releaseResult();
+       return;
+   }
+
+   PrimaryCCD.setExposureLeft(0);
+
+   if (res.error) {
+       IDMessage(getDeviceName(), "Could not capture frame");
+   }
+   if (res.corrupt || res.stale) {
+       DEBUGF(INDI::Logger::DBG_WARNING, "Replaced %d corrupt and %d stale frame(s).", res.corrupt, res.stale);
+   }
+   if (res.dropped) {
+       DEBUGF(INDI::Logger::DBG_WARNING, "Camera dropped %d frame(s) during the exposure.", res.dropped);
+   }
+   if (res.rejected) {
+       IDMessage(getDeviceName(), "Stacking rejected %lu outlier pixel samples.", res.rejected);
+   }
+
+   copyFrame(res);
+
+   DEBUGF(INDI::Logger::DBG_DEBUG, "Download took %d uS", (int) res.download_us);
+
+   publishRegistration(res);
+   publishLucky(res);
+
+   /* The focus metrics go in the FITS header, so the frame waits for the
+    * focus thread. The exposure stays Busy meanwhile, which keeps the
+    * frame buffer from being resized under it. */
+   if (res.focus_pending) {
+       frame_waiting = true;
+       waiting_res = res;
+       waiting_next_start = next_start;
+       focusReady();
+       return;
+   }
+
+   capture.releaseResult();
+   finishFrame(res, next_start);
+}
+
+/**
+ * Finish the frame held by grabImage() once its focus metrics are in.
+ */
+void FFMVCCD::focusReady()
+{
+   if (!frame_waiting || !capture.takeFocus(&waiting_res)) {
+       return;
+   }
+   frame_waiting = false;
+   capture.releaseResult();
+   finishFrame(waiting_res, waiting_next_start);
+}
+
+/**
+ * Send a frame that has been copied into the frame buffer, and re-arm the
+ * next exposure of a sequence.
+ */
+void FFMVCCD::finishFrame(const FFMVCaptureResult &res, int64_t next_start)
+{
+   int64_t done;
+
+   // We're no longer exposing...
+   InExposure = false;
+
+   /* Ahead of the image, so a focuser can move on before it arrives */
+   publishFocus(res);
+
+   sendFrame();
+   done = ffmv_time_us();
+
+   publishTelemetry(res, done);
+
+   if (res.more && sequence_left > 0) {
+       /* The capture thread went straight on to the next exposure while
+        * this one was being sent. ExposureComplete() has set CCD_EXPOSURE
+        * to Ok, so it goes back through INDI::CCD, which marks it Busy
+        * again and calls StartExposure(). */
+       double value = ExposureRequest;
+       char value_name[] = "CCD_EXPOSURE_VALUE";
+       char *names[] = { value_name };
+
+       exp_start_us = next_start;
+       sequence_next = true;
+       INDI::CCD::ISNewNumber(getDeviceName(), "CCD_EXPOSURE", &value, names, 1);
+       sequence_next = false;
+   } else {
+       sequence_left = 0;
+   }
+}
+
+/**
+ * Publish how long each stage of an exposure took, and append it to the
+ * trace file if there is one.
+ */
+void FFMVCCD::publishTelemetry(const FFMVCaptureResult &res, int64_t done)
+{
+    int subs = res.subs_stacked + res.corrupt + res.stale;
+    struct timeval now;
+
+    TelemetryN[TELEMETRY_FLUSH].value = res.flush_us / 1000.0;
+    TelemetryN[TELEMETRY_WAIT].value = subs ? res.wait_us / 1000.0 / subs : 0;
+    TelemetryN[TELEMETRY_WAIT_MAX].value = res.wait_max_us / 1000.0;
+    TelemetryN[TELEMETRY_STACK].value = subs ? res.stack_us / 1000.0 / subs : 0;
+    TelemetryN[TELEMETRY_STACK_MAX].value = res.stack_max_us / 1000.0;
+    TelemetryN[TELEMETRY_DOWNLOAD].value = res.download_us / 1000.0;
+    TelemetryN[TELEMETRY_DROPPED].value = res.dropped;
+    TelemetryN[TELEMETRY_REPLACED].value = res.corrupt + res.stale;
+    TelemetryN[TELEMETRY_RING_USED].value = res.ring_used;
+    TelemetryN[TELEMETRY_RING_DEPTH].value = ring_depth;
+    TelemetryN[TELEMETRY_FITS].value = (done - fits_start_us) / 1000.0;
+    TelemetryN[TELEMETRY_BLOB].value = fits_bytes;
+    TelemetryN[TELEMETRY_LATENCY].value = (done - exp_start_us) / 1000.0;
+    TelemetryN[TELEMETRY_COMPRESS].value = compress_us / 1000.0;
+    TelemetryN[TELEMETRY_RATIO].value = compress_ratio;
+    TelemetryNP.s = res.dropped || res.corrupt || res.error ? IPS_ALERT : IPS_OK;
+    IDSetNumber(&TelemetryNP, NULL);
+
+    if (!trace_file) {
+        return;
+    }
+    gettimeofday(&now, NULL);
+    fprintf(trace_file, "%ld.%06ld\t%s\t%.3f\t%d", (long) now.tv_sec, (long) now.tv_usec,
+            getDeviceName(), ExposureRequest, subs);
+    for (int i = 0; i < TELEMETRY_N; ++i) {
+        fprintf(trace_file, "\t%.3f", TelemetryN[i].value);
+    }
+    fprintf(trace_file, "\n");
+    fflush(trace_file);
+}
+
+/**
+ * Start appending telemetry to path, or stop if it is empty.
+ */
+bool FFMVCCD::openTrace(const char *path)
+{
+    if (trace_file) {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    if (!path || !*path) {
+        return true;
+    }
+
+    trace_file = fopen(path, "a");
+    if (!trace_file) {
+        DEBUGF(INDI::Logger::DBG_ERROR, "Unable to open trace file %s", path);
+        return false;
+    }
+    if (ftell(trace_file) == 0) {
+        fprintf(trace_file, "# time\tdevice\texposure_s\tsubs");
+        for (int i = 0; i < TELEMETRY_N; ++i) {
+            fprintf(trace_file, "\t%s", TelemetryN[i].name);
+        }
+        fprintf(trace_file, "\n");
+    }
+
+    return true;
+}
+
+/**
+ * Copy a finished frame into the frame buffer, gathering its statistics on
+ * the way so the pixels are only read once, and publish them.
+ */
+void FFMVCCD::copyFrame(const FFMVCaptureResult &res)
+{
+    int bytes = ffmv_output_bytes(res.format, res.output);
+    /* The stacks saturate at the top of their type */
+    uint32_t clamp = bytes == 1 ? 0xFF : bytes == 2 ? 0xFFFF : 0xFFFFFFFF;
+    int64_t t = ffmv_time_us();
+
+    ffmv_copy_stats(PrimaryCCD.getFrameBuffer(), res.stack, (size_t) res.width * res.height,
+            bytes, clamp, &frame_stats, stats_scratch);
+    stats_valid = !res.error;
+
+    FrameStatsN[0].value = frame_stats.min;
+    FrameStatsN[1].value = frame_stats.max;
+    FrameStatsN[2].value = frame_stats.mean;
+    FrameStatsN[3].value = frame_stats.stddev;
+    FrameStatsN[4].value = frame_stats.median;
+    FrameStatsN[5].value = frame_stats.saturated;
+    FrameStatsNP.s = frame_stats.saturated ? IPS_ALERT : IPS_OK;
+    IDSetNumber(&FrameStatsNP, NULL);
+
+    DEBUGF(INDI::Logger::DBG_DEBUG, "Frame copied with statistics in %d uS: mean %.1f, %lu saturated.",
+            (int) (ffmv_time_us() - t), frame_stats.mean, frame_stats.saturated);
+}
+
+/**
+ * Start streaming raw frames to a new SER file. The capture thread only
+ * copies each frame into the recorder's queue; the recorder's own thread
+ * writes them out.
+ */
+bool FFMVCCD::startRecording()
+{
+    FFMVCaptureRequest req;
+    char path[PATH_MAX];
+    char stamp[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    float duration = RecordN[0].value;
+    float sub_length;
+    int frames = RecordN[1].value;
+
+    if (InExposure || guiding || calib_building >= 0) {
+        DEBUG(INDI::Logger::DBG_ERROR, "Cannot record during an exposure.");
+        return false;
+    }
+
+    /* One sub per frame */
+    if (duration > max_exposure) {
+        duration = max_exposure;
+    }
+    if (duration < min_exposure) {
+        duration = min_exposure;
+    }
+
+    localtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", &tm);
+    snprintf(path, sizeof(path), "%s/%s_%s.ser", RecordFileT[0].text, RecordFileT[1].text, stamp);
+
+    sub_length = setupSubs(duration);
+    fillRequest(&req, sub_length);
+    req.sub_count = frames;
+    req.binx = 1;
+    req.biny = 1;
+    req.stack.output = FFMV_OUTPUT_NATIVE;
+    memset(&req.calib, 0, sizeof(req.calib));
+    memset(&req.reg, 0, sizeof(req.reg));
+    memset(&req.lucky, 0, sizeof(req.lucky));
+    req.preview = 0;
+    req.focus = false;
+    req.record = &recorder;
+    sizeRing(sub_length, frames);
+
+    if (!recorder.open(path, pixel_format, req.width, req.height, frames,
+                (size_t) std::min((uint64_t) RecordN[2].value << 20, (uint64_t) SIZE_MAX),
+                RecordDirectS[0].s == ISS_ON, "Point Grey FireFly MV")) {
+        DEBUGF(INDI::Logger::DBG_ERROR, "Unable to create %s: %s", path, strerror(errno));
+        return false;
+    }
+    if (!capture.begin(req)) {
+        recorder.close();
+        unlink(path);
+        DEBUG(INDI::Logger::DBG_ERROR, "Unable to start capture");
+        return false;
+    }
+
+    recording = true;
+    exp_start_us = ffmv_time_us();
+    for (int i = 0; i < RecordStatusNP.nnp; ++i) {
+        RecordStatusN[i].value = 0;
+    }
+    RecordStatusNP.s = IPS_BUSY;
+    IDSetNumber(&RecordStatusNP, NULL);
+    DEBUGF(INDI::Logger::DBG_SESSION, "Recording %d frames of %.4f s to %s.", frames, sub_length, path);
+    if (timerID < 0) {
+        timerID = SetTimer(ProgressN[0].value);
+    }
+
+    return true;
+}
+
+/**
+ * Cut a recording short. The capture thread hands back an aborted result,
+ * and the file is finished in finishRecording().
+ */
+void FFMVCCD::stopRecording()
+{
+    if (recording) {
+        capture.abort();
+    }
+}
+
+/**
+ * The capture thread is done with a recording: wait for the writer to
+ * empty its queue, finish the file and report how it went.
+ */
+void FFMVCCD::finishRecording(const FFMVCaptureResult &res)
+{
+    FFMVRecordStats st;
+    bool ok;
+
+    if (!recording) {
+        return;
+    }
+    recording = false;
+    ok = recorder.close();
+    recorder.getStats(&st);
+
+    RecordStatusN[0].value = res.subs_stacked;
+    RecordStatusN[3].value = res.dropped;
+    publishRecordStatus();
+
+    if (res.error) {
+        DEBUG(INDI::Logger::DBG_ERROR, "Recording stopped: capture failed.");
+    }
+    if (!ok) {
+        DEBUGF(INDI::Logger::DBG_ERROR, "Error writing %s.", recorder.getPath().c_str());
+    }
+    if (st.dropped || res.dropped) {
+        DEBUGF(INDI::Logger::DBG_WARNING, "%lu frame(s) dropped for lack of queue space, %d by the camera.",
+                st.dropped, res.dropped);
+    }
+    DEBUGF(INDI::Logger::DBG_SESSION, "Recorded %lu frames to %s at %.1f MB/s.", st.written,
+            recorder.getPath().c_str(), st.avg_mb_s);
+
+    IUResetSwitch(&RecordSP);
+    RecordS[1].s = ISS_ON;
+    RecordSP.s = ok && !res.error ? IPS_OK : IPS_ALERT;
+    IDSetSwitch(&RecordSP, NULL);
+}
+
+/**
+ * Publish the recorder's counters; while recording, from the timer.
+ */
+void FFMVCCD::publishRecordStatus()
+{
+    FFMVRecordStats st;
+
+    recorder.getStats(&st);
+    if (recording) {
+        RecordStatusN[0].value = capture.getSubsDone();
+    }
+    RecordStatusN[1].value = st.written;
+    RecordStatusN[2].value = st.dropped;
+    RecordStatusN[4].value = st.queue_max;
+    RecordStatusN[5].value = st.write_mb_s;
+    RecordStatusN[6].value = st.avg_mb_s;
+    if (st.error || st.dropped || RecordStatusN[3].value > 0) {
+        RecordStatusNP.s = IPS_ALERT;
+    } else {
+        RecordStatusNP.s = recording ? IPS_BUSY : IPS_OK;
+    }
+    IDSetNumber(&RecordStatusNP, NULL);
+}
+
+/**
+ * Publish how the subs of a finished exposure were selected, if lucky
+ * imaging was on.
+ */
+void FFMVCCD::publishLucky(const FFMVCaptureResult &res)
+{
+    if (!res.lucky_scored) {
+        return;
+    }
+
+    LuckyInfoN[0].value = res.lucky_scored;
+    LuckyInfoN[1].value = res.subs_stacked;
+    LuckyInfoN[2].value = res.lucky_best;
+    LuckyInfoN[3].value = res.lucky_cutoff;
+    LuckyInfoN[4].value = res.score_us / 1000.0 / res.lucky_scored;
+    LuckyInfoNP.s = IPS_OK;
+    IDSetNumber(&LuckyInfoNP, NULL);
+
+    DEBUGF(INDI::Logger::DBG_SESSION, "Stacked the best %d of %d subs.", res.subs_stacked, res.lucky_scored);
+}
+
+/**
+ * Publish how far the subs of a finished exposure drifted, if they were
+ * registered.
+ */
+void FFMVCCD::publishRegistration(const FFMVCaptureResult &res)
+{
+    if (RegisterS[0].s != ISS_ON || res.built) {
+        return;
+    }
+
+    RegisterInfoN[0].value = res.reg_stars;
+    RegisterInfoN[1].value = res.reg_dx;
+    RegisterInfoN[2].value = res.reg_dy;
+    RegisterInfoN[3].value = res.reg_max;
+    RegisterInfoN[4].value = res.reg_failed;
+    RegisterInfoN[5].value = res.subs_stacked ? res.register_us / 1000.0 / res.subs_stacked : 0;
+    RegisterInfoNP.s = res.reg_stars && !res.reg_failed ? IPS_OK : IPS_ALERT;
+    IDSetNumber(&RegisterInfoNP, NULL);
+
+    if (!res.reg_stars) {
+        DEBUG(INDI::Logger::DBG_WARNING, "No stars to register the subs on; they were stacked as they came.");
+    } else if (res.reg_failed) {
+        DEBUGF(INDI::Logger::DBG_WARNING, "%d sub(s) could not be registered and were stacked with the previous shift.",
+                res.reg_failed);
+    }
+    DEBUGF(INDI::Logger::DBG_DEBUG, "Registered on %d stars: drift %.2f, %.2f px, largest shift %.2f px.",
+            res.reg_stars, res.reg_dx, res.reg_dy, res.reg_max);
+}
+
+/**
+ * Publish the focus metrics of a finished exposure, and keep them for its
+ * FITS header.
+ */
+void FFMVCCD::publishFocus(const FFMVCaptureResult &res)
+{
+    focus_valid = res.focus_measured && !res.error;
+    if (!res.focus_measured) {
+        return;
+    }
+    focus = res.focus;
+
+    FocusN[0].value = focus.hfr;
+    FocusN[1].value = focus.fwhm;
+    FocusN[2].value = focus.stars;
+    FocusN[3].value = res.focus_us / 1000.0;
+    FocusNP.s = focus.measured ? IPS_OK : IPS_ALERT;
+    IDSetNumber(&FocusNP, NULL);
+
+    DEBUGF(INDI::Logger::DBG_DEBUG, "Focus: %d stars, %d measured, HFR %.2f, FWHM %.2f, in %.3f ms.",
+            focus.stars, focus.measured, focus.hfr, focus.fwhm, res.focus_us / 1000.0);
+}
+
+/**
+ * Send the capture thread's latest sub preview, if there is one, as a
+ * binary PGM, which any client can show without a FITS reader.
+ */
+void FFMVCCD::sendPreview()
+{
+    FFMVCapturePreview p;
+    char header[32];
+    size_t hlen, npix;
+
+    if (!capture.takePreview(&p)) {
+        return;
+    }
+
+    hlen = snprintf(header, sizeof(header), "P5\n%d %d\n255\n", p.width, p.height);
+    npix = (size_t) p.width * p.height;
+    preview_pgm.resize(hlen + npix);
+    memcpy(&preview_pgm[0], header, hlen);
+    memcpy(&preview_pgm[hlen], p.pixels, npix);
+    capture.releasePreview();
+
+    DEBUGF(INDI::Logger::DBG_DEBUG, "Preview of sub %d: black %d, median %d, white %d of %d, %.3f ms.",
+            p.sub, p.stretch.black, p.stretch.median, p.stretch.white, FFMV_PREVIEW_BINS,
+            p.render_us / 1000.0);
+
+    PreviewB[0].blob = &preview_pgm[0];
+    PreviewB[0].bloblen = preview_pgm.size();
+    PreviewB[0].size = preview_pgm.size();
+    strcpy(PreviewB[0].format, ".pgm");
+    PreviewBP.s = IPS_OK;
+    IDSetBLOB(&PreviewBP, NULL);
+}
+
+/**
+ * Send the frame buffer and finish the exposure. With compression on, the
+ * deflated copy goes out first on CCD_COMPRESSED, so it is there by the time
+ * clients see the exposure finish; the plain frame always goes through
+ * ExposureComplete().
+ */
+void FFMVCCD::sendFrame()
+{
+    fits_bytes = 0;
+    compress_us = 0;
+    compress_ratio = 0;
+    if (CompressS[1].s == ISS_ON && !sendCompressed()) {
+        CompressedBP.s = IPS_ALERT;
+        IDSetBLOB(&CompressedBP, NULL);
+    }
+
+    // Let INDI::CCD know we're done filling the image buffer
+    fits_start_us = ffmv_time_us();
+    ExposureComplete(&PrimaryCCD);
+}
+
+/**
+ * Encode the frame buffer as FITS, deflate it on the encode pool and send it
+ * as a ".fits.z" BLOB on CCD_COMPRESSED.
+ */
+bool FFMVCCD::sendCompressed()
+{
+    fitsfile *fptr = NULL;
+    void *memptr;
+    size_t memsize;
+    const void *z;
+    size_t zlen;
+    int status = 0;
+    long naxes[2];
+    int64_t start;
+    int bpp = PrimaryCCD.getBPP();
+
+    naxes[0] = PrimaryCCD.getSubW() / PrimaryCCD.getBinX();
+    naxes[1] = PrimaryCCD.getSubH() / PrimaryCCD.getBinY();
+
+    memsize = 5760;
+    memptr = malloc(memsize);
+    if (!memptr) {
+        DEBUG(INDI::Logger::DBG_ERROR, "Out of memory for the compressed image.");
+        return false;
+    }
+
+    fits_create_memfile(&fptr, &memptr, &memsize, 2880, realloc, &status);
+    fits_create_img(fptr, bpp == 8 ? BYTE_IMG : bpp == 16 ? USHORT_IMG : ULONG_IMG, 2, naxes, &status);
+    if (!status) {
+        addFITSKeywords(fptr, &PrimaryCCD);
+    }
+    fits_write_img(fptr, bpp == 8 ? TBYTE : bpp == 16 ? TUSHORT : TUINT, 1, naxes[0] * naxes[1], PrimaryCCD.getFrameBuffer(), &status);
+    if (fptr) {
+        fits_close_file(fptr, &status);
+    }
+    if (status) {
+        DEBUGF(INDI::Logger::DBG_ERROR, "Unable to encode the compressed image (FITS error %d).", status);
+        free(memptr);
+        return false;
+    }
+
+    start = ffmv_time_us();
+    z = compressor.compress(memptr, memsize, (int) CompressN[0].value, &zlen);
+    compress_us = ffmv_time_us() - start;
+    if (!z) {
+        DEBUG(INDI::Logger::DBG_ERROR, "Unable to compress the image.");
+        free(memptr);
+        return false;
+    }
+    compress_ratio = zlen ? (double) memsize / zlen : 0;
+
+    CompressedB[0].blob = (void *) z;
+    CompressedB[0].bloblen = zlen;
+    CompressedB[0].size = memsize;
+    strcpy(CompressedB[0].format, ".fits.z");
+    CompressedBP.s = IPS_OK;
+    IDSetBLOB(&CompressedBP, NULL);
+
+    free(memptr);
+    return true;
 }
@@ -23,15 +23,25 @@
 #include <indiccd.h>
 #include <dc1394/dc1394.h>
 
+#include "ffmv_calib.h"
+#include "ffmv_camera.h"
+#include "ffmv_capture.h"
+#include "ffmv_compress.h"
+#include "ffmv_control.h"
+#include "ffmv_record.h"
+#include "ffmv_stats.h"
+#include "ffmv_workpool.h"
+
 using namespace std;
 
 class FFMVCCD : public INDI::CCD
 {
 public:
-    FFMVCCD();
+    FFMVCCD(uint64_t guid, const char *name, int first_cpu, int ncpus);
 
     bool ISNewNumber (const char *dev, const char *name, double values[], char *names[], int n);
     virtual bool ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n);
+    virtual bool ISNewText(const char *dev, const char *name, char *texts[], char *names[], int n);
 
     void ISGetProperties(const char *dev);
 
@@ -48,43 +58,285 @@ protected:
     bool AbortExposure();
     void TimerHit();
     void addFITSKeywords(fitsfile *fptr, CCDChip *targetChip);
+    bool UpdateCCDFrame(int x, int y, int w, int h);
     bool UpdateCCDBin(int binx, int biny);
 
 private:
+    /* Connect phases that are timed */
+    enum {
+        CONNECT_OPEN,
+        CONNECT_RESET,
+        CONNECT_MODE,
+        CONNECT_FEATURES,
+        CONNECT_CAPTURE,
+        CONNECT_THREADS,
+        CONNECT_TOTAL,
+        CONNECT_NPHASES
+    };
+
+    enum {
+        GUID_LEN = 17
+    };
+
+    /* Elements of EXPOSURE_TELEMETRY */
+    enum {
+        TELEMETRY_FLUSH,
+        TELEMETRY_WAIT,
+        TELEMETRY_WAIT_MAX,
+        TELEMETRY_STACK,
+        TELEMETRY_STACK_MAX,
+        TELEMETRY_DOWNLOAD,
+        TELEMETRY_DROPPED,
+        TELEMETRY_REPLACED,
+        TELEMETRY_RING_USED,
+        TELEMETRY_RING_DEPTH,
+        TELEMETRY_FITS,
+        TELEMETRY_BLOB,
+        TELEMETRY_LATENCY,
+        TELEMETRY_COMPRESS,
+        TELEMETRY_RATIO,
+        TELEMETRY_N
+    };
+
+    /* Camera state after the last successful connect */
+    struct KnownConfig {
+        bool valid;
+        uint64_t guid;
+        dc1394video_mode_t video_mode;
+        uint32_t max_width, max_height;
+        uint32_t unit_width, unit_height;
+        uint32_t unit_left, unit_top;
+    };
+
     // Utility functions
     float CalcTimeLeft();
     void  setupParams();
+    void  updateFrameBuffer();
     void  grabImage();
-    dc1394error_t writeMicronReg(unsigned int offset, unsigned int val);
-    dc1394error_t readMicronReg(unsigned int offset, unsigned int *val);
+    void  focusReady();
+    void  finishFrame(const FFMVCaptureResult &res, int64_t next_start);
+    void  publishTelemetry(const FFMVCaptureResult &res, int64_t done);
+    bool  openTrace(const char *path);
+    void  sendFrame();
+    bool  sendCompressed();
+    void  sendPreview();
+    void  publishFocus(const FFMVCaptureResult &res);
+    void  publishRegistration(const FFMVCaptureResult &res);
+    void  publishLucky(const FFMVCaptureResult &res);
+    bool  startRecording();
+    void  stopRecording();
+    void  finishRecording(const FFMVCaptureResult &res);
+    void  publishRecordStatus();
+    void  copyFrame(const FFMVCaptureResult &res);
+    float setupSubs(float duration, float max_sub = 0);
+    void  fillRequest(FFMVCaptureRequest *req, float sub_length);
+    long  framePeriod(float sub_length);
+    void  limitLucky(FFMVCaptureRequest *req);
+    bool  startGuiding();
+    void  stopGuiding();
+    void  guideFrame(const FFMVCaptureResult &res);
+    enum ffmv_stack_output stackOutput();
+    void  sizeRing(float sub_length, int subs);
+    FFMVCalibKey calibKey(enum ffmv_calib_type type, float sub_length);
+    bool findDark(float sub_length, const float **dark, int *stride);
+    bool findCalibration(float sub_length, FFMVCalibFrames *calib);
+    bool buildMaster(enum ffmv_calib_type type);
+    void saveMaster();
+    static void captureReadyCB(int fd, void *arg);
+    bool setGain();
+    void controlDone();
+    static void controlReadyCB(int fd, void *arg);
+
+    FFMVCamera *openCamera(bool *warm);
+    FFMVCamera *openSimulator();
+    dc1394error_t configureCamera(bool warm);
+    void connectPhase(int i, int64_t *t);
+    dc1394error_t setupFormat7();
+    dc1394error_t setROI(int x, int y, int w, int h);
+    dc1394error_t setCaptureMode(enum ffmv_pixel_format fmt);
 
-    dc1394error_t setGainVref(ISState iss);
-    dc1394error_t setDigitalGain(ISState state);
 
 
     // Are we exposing?
     bool InExposure;
     bool capturing;
-    // Struct to keep timing
-    struct timeval ExpStart;
+    // Start of the exposure on the monotonic clock
+    int64_t exp_start_us;
 
     float ExposureRequest;
     float TemperatureRequest;
     int   timerID;
+    float min_exposure;
     float max_exposure;
     float last_exposure_length;
     int sub_count;
+    /* Exposures of a sequence still to come after the current one, and
+     * whether StartExposure() is being called to re-arm the next of them */
+    int sequence_left;
+    bool sequence_next;
+    /* A frame copied into the frame buffer and held, along with the
+     * capture thread's result slot, until its focus metrics are in */
+    bool frame_waiting;
+    FFMVCaptureResult waiting_res;
+    int64_t waiting_next_start;
+    /* Streaming guide frames, and how many have come in */
+    bool guiding;
+    int guide_frames;
+    /* Streaming raw frames to a video file */
+    bool recording;
 
+    IText GuidT[1];
+    ITextVectorProperty GuidTP;
+    ISwitch ConnectModeS[2];
+    ISwitchVectorProperty ConnectModeSP;
     ISwitch GainS[2];
     ISwitchVectorProperty GainSP;
+    ISwitch CaptureModeS[2];
+    ISwitchVectorProperty CaptureModeSP;
+    ISwitch StackModeS[4];
+    ISwitchVectorProperty StackModeSP;
+    ISwitch StackOutputS[3];
+    ISwitchVectorProperty StackOutputSP;
+    INumber StackN[1];
+    INumberVectorProperty StackNP;
+    INumber ProgressN[1];
+    INumberVectorProperty ProgressNP;
+    ISwitch FastS[2];
+    ISwitchVectorProperty FastSP;
+    INumber FastCountN[1];
+    INumberVectorProperty FastCountNP;
+    ISwitch GuideS[2];
+    ISwitchVectorProperty GuideSP;
+    INumber GuideN[5];
+    INumberVectorProperty GuideNP;
+    ISwitch GuideFrameS[1];
+    ISwitchVectorProperty GuideFrameSP;
+    INumber GuideStarN[7];
+    INumberVectorProperty GuideStarNP;
+    ISwitch CalibS[2];
+    ISwitchVectorProperty CalibSP;
+    IText CalibDirT[1];
+    ITextVectorProperty CalibDirTP;
+    ISwitch CalibBuildS[3];
+    ISwitchVectorProperty CalibBuildSP;
+    INumber CalibBuildN[2];
+    INumberVectorProperty CalibBuildNP;
+    INumber ControlStatsN[3];
+    INumberVectorProperty ControlStatsNP;
+    INumber TelemetryN[TELEMETRY_N];
+    INumberVectorProperty TelemetryNP;
+    IText TraceT[1];
+    ITextVectorProperty TraceTP;
+    ISwitch CompressS[2];
+    ISwitchVectorProperty CompressSP;
+    INumber CompressN[1];
+    INumberVectorProperty CompressNP;
+    IBLOB CompressedB[1];
+    IBLOBVectorProperty CompressedBP;
+    ISwitch RegisterS[2];
+    ISwitchVectorProperty RegisterSP;
+    INumber RegisterN[1];
+    INumberVectorProperty RegisterNP;
+    INumber RegisterInfoN[6];
+    INumberVectorProperty RegisterInfoNP;
+    ISwitch LuckyS[2];
+    ISwitchVectorProperty LuckySP;
+    INumber LuckyN[3];
+    INumberVectorProperty LuckyNP;
+    ISwitch LuckyMetricS[2];
+    ISwitchVectorProperty LuckyMetricSP;
+    INumber LuckyInfoN[5];
+    INumberVectorProperty LuckyInfoNP;
+    ISwitch FocusS[2];
+    ISwitchVectorProperty FocusSP;
+    INumber FocusN[4];
+    INumberVectorProperty FocusNP;
+    INumber FrameStatsN[6];
+    INumberVectorProperty FrameStatsNP;
+    ISwitch PreviewS[2];
+    ISwitchVectorProperty PreviewSP;
+    INumber PreviewN[1];
+    INumberVectorProperty PreviewNP;
+    IBLOB PreviewB[1];
+    IBLOBVectorProperty PreviewBP;
+    ISwitch RecordS[2];
+    ISwitchVectorProperty RecordSP;
+    INumber RecordN[3];
+    INumberVectorProperty RecordNP;
+    IText RecordFileT[2];
+    ITextVectorProperty RecordFileTP;
+    ISwitch RecordDirectS[2];
+    ISwitchVectorProperty RecordDirectSP;
+    INumber RecordStatusN[7];
+    INumberVectorProperty RecordStatusNP;
+    INumber SimulatorN[9];
+    INumberVectorProperty SimulatorNP;
+    IText SimulatorReplayT[1];
+    ITextVectorProperty SimulatorReplayTP;
     // We declare the CCD temperature property
     INumber TemperatureN[1];
     INumberVectorProperty TemperatureNP;
 
     dc1394_t *dc1394;
-    dc1394camera_t *dcam;
+    FFMVCamera *camera;
+    dc1394video_mode_t video_mode;
+    enum ffmv_pixel_format pixel_format;
+    uint32_t max_width, max_height;
+    /* Format7 ROI granularity */
+    uint32_t unit_width, unit_height;
+    uint32_t unit_left, unit_top;
+    /* Camera this device is bound to, 0 for the first one found */
+    uint64_t guid;
+    char guid_text[GUID_LEN];
+    char name[MAXINDIDEVICE];
+    KnownConfig known_config;
+    double connect_ms[CONNECT_NPHASES];
 
     float last_duration;
+
+    FFMVCapture capture;
+    /* DMA ring depth, and how the last exposure used it */
+    int ring_depth;
+    long last_stack_max_us;
+    int last_ring_used;
+    int captureCB;
+    int subs_reported;
+
+    FILE *trace_file;
+    /* Encoding of the last frame; addFITSKeywords() works out its size */
+    int64_t fits_start_us;
+    size_t fits_bytes;
+    /* Compression of the last frame, for telemetry */
+    int64_t compress_us;
+    double compress_ratio;
+
+    /* Focus metrics of the frame being sent, for its FITS header */
+    bool focus_valid;
+    FFMVFocus focus;
+
+    /* Pixel statistics of the frame being sent, gathered as it is copied
+     * into the frame buffer */
+    bool stats_valid;
+    FFMVStats frame_stats;
+    std::vector<uint32_t> stats_scratch;
+
+    /* The last preview as a binary PGM */
+    std::vector<unsigned char> preview_pgm;
+
+    FFMVRecorder recorder;
+
+    /* Deflates the compressed BLOB on every core */
+    FFMVWorkPool encode_pool;
+    FFMVCompressor compressor;
+
+    FFMVControl control;
+    int controlCB;
+
+    FFMVCalibLibrary calib_library;
+    FFMVCalibBuilder calib_builder;
+    /* Type of master being built, or -1 */
+    int calib_building;
+    float calib_sub_length;
 };
 
 #endif // FFMVCCD_H
@@ -0,0 +1,132 @@
+/**
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <string.h>
+
+#include "ffmv_compress.h"
+
+/* Input per task. A full frame of 16 bit subs is about a dozen chunks. */
+const size_t CHUNK_BYTES = 64 * 1024;
+/* Deflate's window, and so how much input each chunk is primed with */
+const size_t WINDOW_BYTES = 32 * 1024;
+
+FFMVCompressor::FFMVCompressor(FFMVWorkPool *pool)
+{
+    this->pool = pool;
+    src = NULL;
+    len = 0;
+    level = Z_DEFAULT_COMPRESSION;
+}
+
+void FFMVCompressor::compressTask(void *ctx, int task)
+{
+    ((FFMVCompressor *) ctx)->compressChunk(task);
+}
+
+/**
+ * Deflate one chunk as raw deflate data. Only the last chunk closes the
+ * stream; the others end on a sync flush.
+ */
+void FFMVCompressor::compressChunk(int i)
+{
+    Chunk &c = chunks[i];
+    size_t start = i * CHUNK_BYTES;
+    size_t n = len - start < CHUNK_BYTES ? len - start : CHUNK_BYTES;
+    size_t dict = start < WINDOW_BYTES ? start : WINDOW_BYTES;
+    bool last = i == (int) chunks.size() - 1;
+    z_stream zs;
+    int ret;
+
+    c.ok = false;
+    c.adler = adler32(adler32(0L, Z_NULL, 0), src + start, n);
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return;
+    }
+    if (dict && deflateSetDictionary(&zs, src + start - dict, dict) != Z_OK) {
+        deflateEnd(&zs);
+        return;
+    }
+
+    /* deflateBound() covers the whole chunk in one call; the sync flush
+     * marker needs a few bytes more */
+    c.out.resize(deflateBound(&zs, n) + 16);
+    zs.next_in = (Bytef *) (src + start);
+    zs.avail_in = n;
+    zs.next_out = &c.out[0];
+    zs.avail_out = c.out.size();
+
+    ret = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (last) {
+        c.ok = ret == Z_STREAM_END;
+    } else {
+        c.ok = ret == Z_OK && zs.avail_in == 0 && zs.avail_out > 0;
+    }
+    c.out.resize(zs.total_out);
+    deflateEnd(&zs);
+}
+
+/**
+ * Compress len bytes at src with zlib level 1-9. The result is a standard
+ * zlib stream that uncompress() takes as is.
+ */
+const void *FFMVCompressor::compress(const void *src, size_t len, int level, size_t *out_len)
+{
+    uLong adler = adler32(0L, Z_NULL, 0);
+    size_t i, pos, total;
+    int nchunks;
+
+    this->src = (const unsigned char *) src;
+    this->len = len;
+    this->level = level;
+    nchunks = len ? (len + CHUNK_BYTES - 1) / CHUNK_BYTES : 1;
+    chunks.resize(nchunks);
+
+    pool->run(nchunks, compressTask, this);
+
+    total = 2 + 4;
+    for (i = 0; i < chunks.size(); ++i) {
+        if (!chunks[i].ok) {
+            return NULL;
+        }
+        total += chunks[i].out.size();
+    }
+
+    /* zlib header: 32 KiB window, with the level hint deflate would use */
+    out.resize(total);
+    out[0] = 0x78;
+    out[1] = level == 1 ? 0x01 : level < 6 && level >= 0 ? 0x5e : level > 6 ? 0xda : 0x9c;
+    pos = 2;
+    for (i = 0; i < chunks.size(); ++i) {
+        if (!chunks[i].out.empty()) {
+            memcpy(&out[pos], &chunks[i].out[0], chunks[i].out.size());
+        }
+        pos += chunks[i].out.size();
+        adler = adler32_combine(adler, chunks[i].adler,
+                len - i * CHUNK_BYTES < CHUNK_BYTES ? len - i * CHUNK_BYTES : CHUNK_BYTES);
+    }
+    out[pos++] = adler >> 24;
+    out[pos++] = adler >> 16;
+    out[pos++] = adler >> 8;
+    out[pos++] = adler;
+
+    *out_len = total;
+
+    return &out[0];
+}
@@ -0,0 +1,68 @@
+/**
+ * Parallel zlib compression for the Point Grey FireFly MV driver.
+ *
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef FFMV_COMPRESS_H
+#define FFMV_COMPRESS_H
+
+#include <stddef.h>
+#include <vector>
+#include <zlib.h>
+
+#include "ffmv_workpool.h"
+
+/**
+ * Deflates a buffer into a single zlib stream, the way INDI clients expect
+ * a ".z" BLOB, using every thread of a worker pool.
+ *
+ * The input is cut into fixed size chunks that are deflated independently.
+ * Each chunk is primed with the 32 KiB of input before it, so matches still
+ * reach back across chunk boundaries, and all but the last end on a byte
+ * aligned sync flush so their output can simply be concatenated. The
+ * Adler-32 of each chunk is combined into the stream trailer at the end.
+ */
+class FFMVCompressor
+{
+public:
+    explicit FFMVCompressor(FFMVWorkPool *pool);
+
+    /* Returns the compressed stream, valid until the next call, or NULL */
+    const void *compress(const void *src, size_t len, int level, size_t *out_len);
+
+private:
+    struct Chunk {
+        std::vector<unsigned char> out;
+        uLong adler;
+        bool ok;
+    };
+
+    static void compressTask(void *ctx, int task);
+    void compressChunk(int i);
+
+    FFMVWorkPool *pool;
+
+    /* Set up by compress() for the tasks */
+    const unsigned char *src;
+    size_t len;
+    int level;
+    std::vector<Chunk> chunks;
+
+    std::vector<unsigned char> out;
+};
+
+#endif // FFMV_COMPRESS_H
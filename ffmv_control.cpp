@@ -0,0 +1,398 @@
+/**
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ffmv_control.h"
+
+/* MT9V022 registers are reached by writing the register address to
+ * SENSOR_ADDR and then reading or writing SENSOR_DATA. */
+const uint32_t SENSOR_ADDR = 0x1A00;
+const uint32_t SENSOR_DATA = 0x1A04;
+
+static uint64_t shadowKey(enum ffmv_reg_space space, uint32_t offset)
+{
+    return ((uint64_t) space << 32) | offset;
+}
+
+/* Transactions needed to write a register without a shadow */
+static unsigned long writeCost(const FFMVRegWrite &op)
+{
+    return op.space == FFMV_REG_SENSOR ? 2 : 1;
+}
+
+FFMVControl::FFMVControl()
+{
+    camera = NULL;
+    running = false;
+    quit = false;
+    memset(&stats, 0, sizeof(stats));
+    memset(&round, 0, sizeof(round));
+    next_seq = 0;
+    applied_seq = 0;
+    applied_err = DC1394_SUCCESS;
+    notify_fd[0] = notify_fd[1] = -1;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+FFMVControl::~FFMVControl()
+{
+    stop();
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+}
+
+/**
+ * Spawn the control thread for a freshly opened camera. The shadow starts
+ * out empty, so the first write to each register always goes out.
+ */
+bool FFMVControl::start(FFMVCamera *cam)
+{
+    if (running) {
+        return true;
+    }
+
+    if (pipe(notify_fd) < 0) {
+        return false;
+    }
+    fcntl(notify_fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(notify_fd[1], F_SETFL, O_NONBLOCK);
+
+    camera = cam;
+    quit = false;
+    pending.clear();
+    done.clear();
+    shadow.clear();
+    memset(&stats, 0, sizeof(stats));
+
+    if (pthread_create(&thread, NULL, threadEntry, this)) {
+        close(notify_fd[0]);
+        close(notify_fd[1]);
+        notify_fd[0] = notify_fd[1] = -1;
+        return false;
+    }
+    running = true;
+
+    return true;
+}
+
+/**
+ * Join the control thread. Batches it has not started on are dropped.
+ */
+void FFMVControl::stop()
+{
+    if (!running) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    quit = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+
+    pthread_join(thread, NULL);
+    running = false;
+
+    close(notify_fd[0]);
+    close(notify_fd[1]);
+    notify_fd[0] = notify_fd[1] = -1;
+}
+
+/**
+ * Forget every shadowed value, e.g. after something else reset the camera.
+ */
+void FFMVControl::invalidate()
+{
+    pthread_mutex_lock(&lock);
+    shadow.clear();
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Tell the shadow what a register holds, e.g. after reading it back.
+ */
+void FFMVControl::seed(enum ffmv_reg_space space, uint32_t offset, uint32_t value)
+{
+    setShadow(space, offset, value);
+}
+
+void FFMVControl::enqueue(const FFMVRegWrite *ops, int n, int tag, unsigned long seq)
+{
+    Batch batch;
+
+    batch.ops.assign(ops, ops + n);
+    batch.tag = tag;
+    batch.seq = seq;
+    pending.push_back(batch);
+    pthread_cond_broadcast(&cond);
+}
+
+/**
+ * Queue a batch of writes. tag is handed back through takeDone() once the
+ * batch has been applied.
+ */
+bool FFMVControl::submit(const FFMVRegWrite *ops, int n, int tag)
+{
+    if (!running) {
+        return false;
+    }
+
+    pthread_mutex_lock(&lock);
+    enqueue(ops, n, tag, 0);
+    pthread_mutex_unlock(&lock);
+
+    return true;
+}
+
+/**
+ * Queue a batch of writes and wait for it to be applied.
+ */
+dc1394error_t FFMVControl::apply(const FFMVRegWrite *ops, int n)
+{
+    unsigned long seq;
+    dc1394error_t err;
+
+    if (!running) {
+        return DC1394_FAILURE;
+    }
+
+    pthread_mutex_lock(&lock);
+    seq = ++next_seq;
+    enqueue(ops, n, 0, seq);
+    while (applied_seq < seq) {
+        pthread_cond_wait(&cond, &lock);
+    }
+    err = applied_err;
+    pthread_mutex_unlock(&lock);
+
+    return err;
+}
+
+/**
+ * Look up the last value written to a register. Returns false if it is not
+ * known.
+ */
+bool FFMVControl::getShadow(enum ffmv_reg_space space, uint32_t offset, uint32_t *value)
+{
+    std::map<uint64_t, uint32_t>::iterator it;
+    bool found;
+
+    pthread_mutex_lock(&lock);
+    it = shadow.find(shadowKey(space, offset));
+    found = it != shadow.end();
+    if (found) {
+        *value = it->second;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return found;
+}
+
+void FFMVControl::getStats(FFMVControlStats *stats)
+{
+    pthread_mutex_lock(&lock);
+    *stats = this->stats;
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Called from the main loop once the notify fd is readable. Returns false
+ * once there are no finished batches left.
+ */
+bool FFMVControl::takeDone(FFMVControlDone *done)
+{
+    char buf[16];
+    bool found;
+
+    while (read(notify_fd[0], buf, sizeof(buf)) > 0)
+        ;
+
+    pthread_mutex_lock(&lock);
+    found = !this->done.empty();
+    if (found) {
+        *done = this->done.front();
+        this->done.erase(this->done.begin());
+    }
+    pthread_mutex_unlock(&lock);
+
+    return found;
+}
+
+bool FFMVControl::shadowed(enum ffmv_reg_space space, uint32_t offset, uint32_t value)
+{
+    uint32_t cur;
+
+    return getShadow(space, offset, &cur) && cur == value;
+}
+
+void FFMVControl::setShadow(enum ffmv_reg_space space, uint32_t offset, uint32_t value)
+{
+    pthread_mutex_lock(&lock);
+    shadow[shadowKey(space, offset)] = value;
+    pthread_mutex_unlock(&lock);
+}
+
+void FFMVControl::dropShadow(enum ffmv_reg_space space, uint32_t offset)
+{
+    pthread_mutex_lock(&lock);
+    shadow.erase(shadowKey(space, offset));
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Write a camera register unless the shadow says it already holds value.
+ * The sensor data window is never shadowed, as what it holds depends on the
+ * sensor address.
+ */
+dc1394error_t FFMVControl::writeCamera(uint32_t offset, uint32_t value)
+{
+    dc1394error_t err;
+
+    if (offset != SENSOR_DATA && shadowed(FFMV_REG_CAMERA, offset, value)) {
+        round.saved += 1;
+        return DC1394_SUCCESS;
+    }
+
+    err = camera->setControlRegister(offset, value);
+    ++round.bus_writes;
+    if (err != DC1394_SUCCESS) {
+        dropShadow(FFMV_REG_CAMERA, offset);
+        return err;
+    }
+    if (offset != SENSOR_DATA) {
+        setShadow(FFMV_REG_CAMERA, offset, value);
+    }
+
+    return DC1394_SUCCESS;
+}
+
+dc1394error_t FFMVControl::write(const FFMVRegWrite &op)
+{
+    dc1394error_t err;
+
+    if (op.space == FFMV_REG_CAMERA) {
+        return writeCamera(op.offset, op.value);
+    }
+
+    if (shadowed(FFMV_REG_SENSOR, op.offset, op.value)) {
+        round.saved += writeCost(op);
+        return DC1394_SUCCESS;
+    }
+
+    err = writeCamera(SENSOR_ADDR, op.offset);
+    if (err == DC1394_SUCCESS) {
+        err = writeCamera(SENSOR_DATA, op.value);
+    }
+    if (err != DC1394_SUCCESS) {
+        dropShadow(FFMV_REG_SENSOR, op.offset);
+        return err;
+    }
+    setShadow(FFMV_REG_SENSOR, op.offset, op.value);
+
+    return DC1394_SUCCESS;
+}
+
+void *FFMVControl::threadEntry(void *arg)
+{
+    ((FFMVControl *) arg)->run();
+    return NULL;
+}
+
+void FFMVControl::run()
+{
+    std::vector<Batch> batches;
+    std::vector<dc1394error_t> errs;
+    size_t b, c, i, j;
+    bool superseded;
+    bool notify;
+    dc1394error_t err;
+    char ch = 0;
+
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (!quit && pending.empty()) {
+            pthread_cond_wait(&cond, &lock);
+        }
+        if (quit) {
+            break;
+        }
+        batches.swap(pending);
+        pending.clear();
+        pthread_mutex_unlock(&lock);
+
+        /* Everything queued while the last round was on the bus is applied
+         * in one go, and a write that a later one overrides is skipped. */
+        errs.assign(batches.size(), DC1394_SUCCESS);
+        for (b = 0; b < batches.size(); ++b) {
+            for (i = 0; i < batches[b].ops.size(); ++i) {
+                const FFMVRegWrite &op = batches[b].ops[i];
+
+                superseded = false;
+                for (c = b; c < batches.size() && !superseded; ++c) {
+                    for (j = c == b ? i + 1 : 0; j < batches[c].ops.size(); ++j) {
+                        if (batches[c].ops[j].space == op.space &&
+                                batches[c].ops[j].offset == op.offset) {
+                            superseded = true;
+                            break;
+                        }
+                    }
+                }
+                if (superseded) {
+                    round.saved += writeCost(op);
+                    continue;
+                }
+
+                err = write(op);
+                if (err != DC1394_SUCCESS) {
+                    errs[b] = err;
+                }
+            }
+        }
+
+        pthread_mutex_lock(&lock);
+        stats.bus_writes += round.bus_writes;
+        stats.saved += round.saved;
+        memset(&round, 0, sizeof(round));
+        notify = false;
+        for (b = 0; b < batches.size(); ++b) {
+            ++stats.batches;
+            if (errs[b] != DC1394_SUCCESS) {
+                ++stats.errors;
+            }
+            if (batches[b].seq) {
+                applied_seq = batches[b].seq;
+                applied_err = errs[b];
+            } else {
+                FFMVControlDone d;
+                d.tag = batches[b].tag;
+                d.err = errs[b];
+                done.push_back(d);
+                notify = true;
+            }
+        }
+        batches.clear();
+        pthread_cond_broadcast(&cond);
+        if (notify && ::write(notify_fd[1], &ch, 1) < 0) {
+            /* The pipe is only full if the main loop is already due to wake */
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
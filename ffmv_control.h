@@ -0,0 +1,137 @@
+/**
+ * Camera control plane for the Point Grey FireFly MV driver.
+ *
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef FFMV_CONTROL_H
+#define FFMV_CONTROL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <map>
+#include <vector>
+#include <dc1394/dc1394.h>
+
+#include "ffmv_camera.h"
+
+enum ffmv_reg_space {
+    /* IIDC control and status registers */
+    FFMV_REG_CAMERA,
+    /* MT9V022 registers, reached through the camera's 0x1A00/0x1A04 window */
+    FFMV_REG_SENSOR
+};
+
+struct FFMVRegWrite {
+    enum ffmv_reg_space space;
+    uint32_t offset;
+    uint32_t value;
+};
+
+/**
+ * Bus traffic counters. saved counts the transactions a plain write of every
+ * register would have cost that were skipped because the shadow already
+ * held the value, a later write in the same batch replaced it, or the
+ * sensor address window already pointed at the register.
+ */
+struct FFMVControlStats {
+    unsigned long bus_writes;
+    unsigned long saved;
+    unsigned long batches;
+    unsigned long errors;
+};
+
+/**
+ * A finished asynchronous batch.
+ */
+struct FFMVControlDone {
+    int tag;
+    dc1394error_t err;
+};
+
+/**
+ * Owns register writes to the camera. Writes go through a shadow of the
+ * last value written to each register, so repeating a setting costs no bus
+ * traffic, and are applied on a worker thread so the main loop never waits
+ * on the bus.
+ *
+ * Batches queued with submit() while the worker is busy are merged, and
+ * only the last write to each register is sent. When a batch has been
+ * applied its tag is queued for takeDone() and a byte is written to
+ * getNotifyFd(). apply() queues a batch and waits for it, for use while
+ * connecting.
+ */
+class FFMVControl
+{
+public:
+    FFMVControl();
+    ~FFMVControl();
+
+    bool start(FFMVCamera *cam);
+    void stop();
+    void invalidate();
+    void seed(enum ffmv_reg_space space, uint32_t offset, uint32_t value);
+
+    bool submit(const FFMVRegWrite *ops, int n, int tag);
+    dc1394error_t apply(const FFMVRegWrite *ops, int n);
+
+    bool getShadow(enum ffmv_reg_space space, uint32_t offset, uint32_t *value);
+    void getStats(FFMVControlStats *stats);
+
+    int getNotifyFd() const { return notify_fd[0]; }
+    bool takeDone(FFMVControlDone *done);
+
+private:
+    struct Batch {
+        std::vector<FFMVRegWrite> ops;
+        int tag;
+        /* Non-zero for apply(), which waits for this sequence number */
+        unsigned long seq;
+    };
+
+    static void *threadEntry(void *arg);
+    void run();
+    dc1394error_t write(const FFMVRegWrite &op);
+    dc1394error_t writeCamera(uint32_t offset, uint32_t value);
+    bool shadowed(enum ffmv_reg_space space, uint32_t offset, uint32_t value);
+    void setShadow(enum ffmv_reg_space space, uint32_t offset, uint32_t value);
+    void dropShadow(enum ffmv_reg_space space, uint32_t offset);
+    void enqueue(const FFMVRegWrite *ops, int n, int tag, unsigned long seq);
+
+    FFMVCamera *camera;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool running;
+
+    /* Protected by lock */
+    bool quit;
+    std::vector<Batch> pending;
+    std::vector<FFMVControlDone> done;
+    std::map<uint64_t, uint32_t> shadow;
+    FFMVControlStats stats;
+    unsigned long next_seq;
+    unsigned long applied_seq;
+    dc1394error_t applied_err;
+
+    /* Counted by the control thread and folded into stats after each round */
+    FFMVControlStats round;
+
+    int notify_fd[2];
+};
+
+#endif // FFMV_CONTROL_H
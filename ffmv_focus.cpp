@@ -0,0 +1,246 @@
+/**
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <math.h>
+#include <algorithm>
+
+#include "ffmv_focus.h"
+
+/* Aperture radius stars are measured in */
+const int FOCUS_RADIUS = 10;
+/* A star's peak must stand this many standard deviations above the sky */
+const float FOCUS_DETECT_SIGMA = 5;
+/* and its eight neighbours together this many, so hot pixels are passed over */
+const float FOCUS_WINGS_SIGMA = 3;
+const float FOCUS_MIN_SNR = 10;
+/* Most candidates measured; beyond this only the brightest are */
+const size_t FOCUS_MAX_STARS = 1000;
+
+FFMVFocusMeter::FFMVFocusMeter(FFMVWorkPool *pool)
+{
+    this->pool = pool;
+    img.pixels = NULL;
+    img.bytes = 2;
+    img.width = img.height = 0;
+    saturation = 0;
+    bg = 0;
+    sigma = 1;
+    nbands = 1;
+}
+
+void FFMVFocusMeter::detectTask(void *ctx, int task)
+{
+    FFMVFocusMeter *f = (FFMVFocusMeter *) ctx;
+    int h = f->img.height;
+    int y0 = (int) ((long) h * task / f->nbands);
+    int y1 = (int) ((long) h * (task + 1) / f->nbands);
+
+    f->found[task].clear();
+    switch (f->img.bytes) {
+        case 1:
+            f->detectRows((const uint8_t *) f->img.pixels, y0, y1, f->found[task]);
+            break;
+        case 2:
+            f->detectRows((const uint16_t *) f->img.pixels, y0, y1, f->found[task]);
+            break;
+        default:
+            f->detectRows((const uint32_t *) f->img.pixels, y0, y1, f->found[task]);
+            break;
+    }
+}
+
+/**
+ * Collect the local maxima in rows y0 to y1 that are bright enough to be a
+ * star. Equal neighbours are broken in raster order, so a flat topped star
+ * gives one candidate.
+ */
+template <typename T>
+void FFMVFocusMeter::detectRows(const T *pixels, int y0, int y1, std::vector<Candidate> &found)
+{
+    int w = img.width;
+    float thr = bg + FOCUS_DETECT_SIGMA * sigma;
+    float wings = 8 * bg + FOCUS_WINGS_SIGMA * sqrtf(8) * sigma;
+    const T *p, *up, *down;
+    float v, sum;
+    Candidate c;
+    int x, y;
+
+    y0 = std::max(y0, 1);
+    y1 = std::min(y1, img.height - 1);
+    for (y = y0; y < y1; ++y) {
+        p = pixels + (size_t) y * w;
+        up = p - w;
+        down = p + w;
+        for (x = 1; x < w - 1; ++x) {
+            v = p[x];
+            if (v < thr) {
+                continue;
+            }
+            if (v <= up[x - 1] || v <= up[x] || v <= up[x + 1] || v <= p[x - 1] ||
+                    v < p[x + 1] || v < down[x - 1] || v < down[x] || v < down[x + 1]) {
+                continue;
+            }
+            sum = (float) up[x - 1] + up[x] + up[x + 1] + p[x - 1] + p[x + 1] +
+                    down[x - 1] + down[x] + down[x + 1];
+            if (sum < wings) {
+                continue;
+            }
+            c.x = x;
+            c.y = y;
+            c.peak = v;
+            found.push_back(c);
+        }
+    }
+}
+
+void FFMVFocusMeter::measureTask(void *ctx, int task)
+{
+    FFMVFocusMeter *f = (FFMVFocusMeter *) ctx;
+    size_t n = f->candidates.size();
+    size_t i = n * task / f->nbands;
+    size_t end = n * (task + 1) / f->nbands;
+
+    for (; i < end; ++i) {
+        f->measureStar(f->candidates[i], &f->results[i]);
+    }
+}
+
+void FFMVFocusMeter::measureStar(const Candidate &c, Measurement *m)
+{
+    const int r = FOCUS_RADIUS;
+    float r2 = (float) r * r;
+    float v, d2, f, sf = 0, sfr = 0, half;
+    int x, y, nhalf = 0;
+    FFMVStar star;
+
+    m->star = m->measured = false;
+
+    /* The core of a brighter star nearby, or a bump in its wings */
+    for (y = std::max(c.y - r / 2, 0); y <= std::min(c.y + r / 2, img.height - 1); ++y) {
+        for (x = std::max(c.x - r / 2, 0); x <= std::min(c.x + r / 2, img.width - 1); ++x) {
+            if (ffmv_image_pixel(img, x, y) > c.peak) {
+                return;
+            }
+        }
+    }
+
+    if (!ffmv_centroid(img, c.x, c.y, r, bg, sigma, &star) || star.snr < FOCUS_MIN_SNR) {
+        return;
+    }
+    m->star = true;
+
+    if (c.peak >= saturation || star.x < r || star.y < r ||
+            star.x > img.width - 1 - r || star.y > img.height - 1 - r) {
+        return;
+    }
+
+    /* Every pixel in the aperture counts, those below the sky too, so that
+     * the noise cancels out instead of pushing the radius outward */
+    half = (c.peak - bg) / 2;
+    for (y = (int) (star.y - r); y <= (int) (star.y + r) + 1; ++y) {
+        for (x = (int) (star.x - r); x <= (int) (star.x + r) + 1; ++x) {
+            d2 = (x - star.x) * (x - star.x) + (y - star.y) * (y - star.y);
+            if (d2 > r2) {
+                continue;
+            }
+            v = ffmv_image_pixel(img, x, y);
+            f = v - bg;
+            sf += f;
+            sfr += f * sqrtf(d2);
+            if (f >= half) {
+                ++nhalf;
+            }
+        }
+    }
+    if (sf <= 0) {
+        return;
+    }
+
+    m->hfr = std::min(std::max(sfr / sf, 0.0f), (float) r);
+    m->fwhm = 2 * sqrtf(nhalf / (float) M_PI);
+    m->measured = true;
+}
+
+bool FFMVFocusMeter::brighter(const Candidate &a, const Candidate &b)
+{
+    return a.peak > b.peak;
+}
+
+static float median(std::vector<float> &v)
+{
+    size_t mid = v.size() / 2;
+
+    if (v.empty()) {
+        return 0;
+    }
+    std::nth_element(v.begin(), v.begin() + mid, v.end());
+
+    return v[mid];
+}
+
+void FFMVFocusMeter::measure(const FFMVImage &img, float saturation, FFMVFocus *focus)
+{
+    std::vector<float> hfr, fwhm;
+    size_t i;
+    int band;
+
+    this->img = img;
+    this->saturation = saturation;
+    focus->stars = focus->measured = 0;
+    focus->hfr = focus->fwhm = 0;
+
+    ffmv_background(img, &bg, &sigma, scratch);
+    focus->bg = bg;
+    focus->sigma = sigma;
+    if (img.width < 3 || img.height < 3) {
+        return;
+    }
+
+    nbands = pool->size() * 2;
+    if (nbands > img.height) {
+        nbands = img.height;
+    }
+    found.resize(nbands);
+    pool->run(nbands, detectTask, this);
+
+    candidates.clear();
+    for (band = 0; band < nbands; ++band) {
+        candidates.insert(candidates.end(), found[band].begin(), found[band].end());
+    }
+    if (candidates.size() > FOCUS_MAX_STARS) {
+        std::nth_element(candidates.begin(), candidates.begin() + FOCUS_MAX_STARS,
+                candidates.end(), brighter);
+        candidates.resize(FOCUS_MAX_STARS);
+    }
+    results.resize(candidates.size());
+    pool->run(nbands, measureTask, this);
+
+    for (i = 0; i < results.size(); ++i) {
+        if (!results[i].star) {
+            continue;
+        }
+        ++focus->stars;
+        if (results[i].measured) {
+            hfr.push_back(results[i].hfr);
+            fwhm.push_back(results[i].fwhm);
+        }
+    }
+    focus->measured = hfr.size();
+    focus->hfr = median(hfr);
+    focus->fwhm = median(fwhm);
+}
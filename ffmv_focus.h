@@ -0,0 +1,95 @@
+/**
+ * Focus metrics for the Point Grey FireFly MV driver.
+ *
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef FFMV_FOCUS_H
+#define FFMV_FOCUS_H
+
+#include <vector>
+
+#include "ffmv_star.h"
+#include "ffmv_workpool.h"
+
+struct FFMVFocus {
+    /* Stars detected in the frame */
+    int stars;
+    /* Of those, the ones that were measured: unsaturated and clear of the
+     * edges */
+    int measured;
+    /* Medians over the measured stars, in pixels of the frame. 0 if no
+     * star could be measured. */
+    float hfr;
+    float fwhm;
+    /* Sky level and noise the stars were found against */
+    float bg;
+    float sigma;
+};
+
+/**
+ * Finds the stars in a finished frame and measures how well focused they
+ * are, spreading the work over a worker pool: first row bands are searched
+ * for local maxima, then the candidates are measured in batches.
+ *
+ * The half flux radius of a star is the flux weighted mean distance of the
+ * pixels in its aperture from the centroid. Its FWHM comes from the number
+ * of pixels above half of its peak, taken as the area of a disc.
+ */
+class FFMVFocusMeter
+{
+public:
+    explicit FFMVFocusMeter(FFMVWorkPool *pool);
+
+    /* Pixels at or above saturation are clipped, and stars that reach it
+     * are counted but not measured */
+    void measure(const FFMVImage &img, float saturation, FFMVFocus *focus);
+
+private:
+    struct Candidate {
+        int x;
+        int y;
+        float peak;
+    };
+
+    struct Measurement {
+        bool star;
+        bool measured;
+        float hfr;
+        float fwhm;
+    };
+
+    static void detectTask(void *ctx, int task);
+    static void measureTask(void *ctx, int task);
+    template <typename T> void detectRows(const T *pixels, int y0, int y1,
+            std::vector<Candidate> &found);
+    void measureStar(const Candidate &c, Measurement *m);
+    static bool brighter(const Candidate &a, const Candidate &b);
+
+    FFMVWorkPool *pool;
+
+    /* Set up by measure() for the tasks */
+    FFMVImage img;
+    float saturation;
+    float bg, sigma;
+    int nbands;
+    std::vector<std::vector<Candidate> > found;
+    std::vector<Candidate> candidates;
+    std::vector<Measurement> results;
+    std::vector<float> scratch;
+};
+
+#endif // FFMV_FOCUS_H
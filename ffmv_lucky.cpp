@@ -0,0 +1,393 @@
+/**
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "ffmv_lucky.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FFMV_LUCKY_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__arm__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+/* Most bands a sub is split into */
+const int LUCKY_MAX_BANDS = 64;
+
+static inline int lucky_px16(const uint16_t *p, int x)
+{
+    return ntohs(p[x]) >> FFMV_LUCKY_SHIFT16;
+}
+
+void ffmv_lucky_row16_scalar(const void *up, const void *row, const void *down, int w,
+        ffmv_lucky_sums *r)
+{
+    const uint16_t *n = (const uint16_t *) up;
+    const uint16_t *c = (const uint16_t *) row;
+    const uint16_t *s = (const uint16_t *) down;
+    int x, v, l;
+
+    for (x = 1; x < w - 1; ++x) {
+        v = lucky_px16(c, x);
+        l = 4 * v - lucky_px16(c, x - 1) - lucky_px16(c, x + 1) - lucky_px16(n, x) - lucky_px16(s, x);
+        r->sum += l;
+        r->sumsq += (uint32_t) (l * l);
+        r->peak = (uint32_t) v > r->peak ? v : r->peak;
+    }
+}
+
+void ffmv_lucky_row8_scalar(const void *up, const void *row, const void *down, int w,
+        ffmv_lucky_sums *r)
+{
+    const uint8_t *n = (const uint8_t *) up;
+    const uint8_t *c = (const uint8_t *) row;
+    const uint8_t *s = (const uint8_t *) down;
+    int x, l;
+
+    for (x = 1; x < w - 1; ++x) {
+        l = 4 * c[x] - c[x - 1] - c[x + 1] - n[x] - s[x];
+        r->sum += l;
+        r->sumsq += (uint32_t) (l * l);
+        r->peak = c[x] > r->peak ? c[x] : r->peak;
+    }
+}
+
+#ifdef FFMV_LUCKY_X86
+/* 8 big-endian MONO16 pixels, native and scaled down to 13 bits */
+__attribute__((target("sse2")))
+static inline __m128i lucky_load16(const uint16_t *p)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    return _mm_srli_epi16(v, FFMV_LUCKY_SHIFT16);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i lucky_load8(const uint8_t *p)
+{
+    return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) p), _mm_setzero_si128());
+}
+
+/**
+ * Accumulate the Laplacian of 8 pixels. Its sum goes into 32 bit lanes,
+ * which hold a row, and its square into 64 bit lanes.
+ */
+__attribute__((target("sse2")))
+static inline void lucky_lap_sse2(__m128i c, __m128i l, __m128i r, __m128i n, __m128i s,
+        __m128i *sum, __m128i *sumsq, __m128i *peak)
+{
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lap = _mm_sub_epi16(_mm_slli_epi16(c, 2),
+            _mm_add_epi16(_mm_add_epi16(l, r), _mm_add_epi16(n, s)));
+    __m128i sq = _mm_madd_epi16(lap, lap);
+
+    *sum = _mm_add_epi32(*sum, _mm_madd_epi16(lap, ones));
+    /* Each square pair is below 2^31, so it zero extends */
+    *sumsq = _mm_add_epi64(*sumsq, _mm_unpacklo_epi32(sq, zero));
+    *sumsq = _mm_add_epi64(*sumsq, _mm_unpackhi_epi32(sq, zero));
+    /* Pixels are at most 13 bits, so a signed max does */
+    *peak = _mm_max_epi16(*peak, c);
+}
+
+__attribute__((target("sse2")))
+static void lucky_fold_sse2(__m128i sum, __m128i sumsq, __m128i peak, ffmv_lucky_sums *r)
+{
+    int32_t s[4];
+    uint64_t q[2];
+    int16_t p[8];
+    int i;
+
+    _mm_storeu_si128((__m128i *) s, sum);
+    _mm_storeu_si128((__m128i *) q, sumsq);
+    _mm_storeu_si128((__m128i *) p, peak);
+    r->sum += (int64_t) s[0] + s[1] + s[2] + s[3];
+    r->sumsq += q[0] + q[1];
+    for (i = 0; i < 8; ++i) {
+        r->peak = (uint32_t) p[i] > r->peak ? p[i] : r->peak;
+    }
+}
+
+__attribute__((target("sse2")))
+static void ffmv_lucky_row16_sse2(const void *up, const void *row, const void *down, int w,
+        ffmv_lucky_sums *r)
+{
+    const uint16_t *n = (const uint16_t *) up;
+    const uint16_t *c = (const uint16_t *) row;
+    const uint16_t *s = (const uint16_t *) down;
+    __m128i sum = _mm_setzero_si128();
+    __m128i sumsq = _mm_setzero_si128();
+    __m128i peak = _mm_setzero_si128();
+    int x, v, l;
+
+    for (x = 1; x + 9 <= w; x += 8) {
+        lucky_lap_sse2(lucky_load16(c + x), lucky_load16(c + x - 1), lucky_load16(c + x + 1),
+                lucky_load16(n + x), lucky_load16(s + x), &sum, &sumsq, &peak);
+    }
+    lucky_fold_sse2(sum, sumsq, peak, r);
+
+    for (; x < w - 1; ++x) {
+        v = lucky_px16(c, x);
+        l = 4 * v - lucky_px16(c, x - 1) - lucky_px16(c, x + 1) - lucky_px16(n, x) - lucky_px16(s, x);
+        r->sum += l;
+        r->sumsq += (uint32_t) (l * l);
+        r->peak = (uint32_t) v > r->peak ? v : r->peak;
+    }
+}
+
+__attribute__((target("sse2")))
+static void ffmv_lucky_row8_sse2(const void *up, const void *row, const void *down, int w,
+        ffmv_lucky_sums *r)
+{
+    const uint8_t *n = (const uint8_t *) up;
+    const uint8_t *c = (const uint8_t *) row;
+    const uint8_t *s = (const uint8_t *) down;
+    __m128i sum = _mm_setzero_si128();
+    __m128i sumsq = _mm_setzero_si128();
+    __m128i peak = _mm_setzero_si128();
+    int x, l;
+
+    for (x = 1; x + 9 <= w; x += 8) {
+        lucky_lap_sse2(lucky_load8(c + x), lucky_load8(c + x - 1), lucky_load8(c + x + 1),
+                lucky_load8(n + x), lucky_load8(s + x), &sum, &sumsq, &peak);
+    }
+    lucky_fold_sse2(sum, sumsq, peak, r);
+
+    for (; x < w - 1; ++x) {
+        l = 4 * c[x] - c[x - 1] - c[x + 1] - n[x] - s[x];
+        r->sum += l;
+        r->sumsq += (uint32_t) (l * l);
+        r->peak = c[x] > r->peak ? c[x] : r->peak;
+    }
+}
+#endif
+
+const struct ffmv_lucky_kernel ffmv_lucky_scalar = {
+    "scalar", ffmv_lucky_row8_scalar, ffmv_lucky_row16_scalar
+};
+
+int ffmv_lucky_kernels(const struct ffmv_lucky_kernel **kernels)
+{
+    int nkernels = 0;
+
+#ifdef FFMV_LUCKY_X86
+    static const struct ffmv_lucky_kernel sse2_kernel = {
+        "sse2", ffmv_lucky_row8_sse2, ffmv_lucky_row16_sse2
+    };
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        kernels[nkernels++] = &sse2_kernel;
+    }
+#endif
+#ifdef FFMV_LUCKY_NEON
+    static const struct ffmv_lucky_kernel neon_kernel = {
+        "neon", ffmv_lucky_row8_neon, ffmv_lucky_row16_neon
+    };
+
+#if defined(__aarch64__)
+    kernels[nkernels++] = &neon_kernel;
+#else
+    if (getauxval(AT_HWCAP) & HWCAP_NEON) {
+        kernels[nkernels++] = &neon_kernel;
+    }
+#endif
+#endif
+
+    return nkernels;
+}
+
+static pthread_once_t lucky_once = PTHREAD_ONCE_INIT;
+static const struct ffmv_lucky_kernel *lucky_kernel = &ffmv_lucky_scalar;
+
+static void ffmv_lucky_init()
+{
+    const struct ffmv_lucky_kernel *kernels[FFMV_LUCKY_MAX_KERNELS];
+
+    if (ffmv_lucky_kernels(kernels) > 0) {
+        lucky_kernel = kernels[0];
+    }
+}
+
+static ffmv_lucky_row_fn ffmv_lucky_select(enum ffmv_pixel_format fmt)
+{
+    pthread_once(&lucky_once, ffmv_lucky_init);
+
+    return fmt == FFMV_MONO8 ? lucky_kernel->row8 : lucky_kernel->row16;
+}
+
+FFMVLucky::FFMVLucky(FFMVWorkPool *pool)
+{
+    this->pool = pool;
+    format = FFMV_MONO16;
+    metric = FFMV_LUCKY_LAPLACIAN;
+    row = ffmv_lucky_row16_scalar;
+    width = height = 0;
+    frame_bytes = 0;
+    frames = NULL;
+    frame_stride = 0;
+    frames_size = 0;
+    keep = kept = 0;
+    sub = NULL;
+    nbands = 1;
+}
+
+FFMVLucky::~FFMVLucky()
+{
+    free(frames);
+}
+
+/**
+ * Start a new exposure, keeping the best keep subs of width x height.
+ * Fails if they would not fit in the address space.
+ */
+bool FFMVLucky::reset(enum ffmv_pixel_format fmt, int width, int height,
+        enum ffmv_lucky_metric metric, int keep)
+{
+    size_t size;
+
+    format = fmt;
+    row = ffmv_lucky_select(fmt);
+    this->metric = metric;
+    this->width = width;
+    this->height = height;
+    this->keep = keep < 1 ? 1 : keep;
+    kept = 0;
+    frame_bytes = (size_t) width * height * ffmv_pixel_bytes(fmt);
+    frame_stride = ffmv_lucky_frame_stride(fmt, width, height);
+
+    if ((size_t) this->keep > SIZE_MAX / frame_stride) {
+        return false;
+    }
+    size = frame_stride * this->keep;
+    if (size > frames_size) {
+        free(frames);
+        if (posix_memalign((void **) &frames, 64, size)) {
+            frames = NULL;
+            frames_size = 0;
+            return false;
+        }
+        frames_size = size;
+    }
+    scores.resize(this->keep);
+    order.resize(this->keep);
+
+    nbands = std::min(std::min(pool->size() * 2, LUCKY_MAX_BANDS), std::max(height - 2, 1));
+    bands.resize(nbands);
+
+    return width >= 3 && height >= 3;
+}
+
+void FFMVLucky::scoreTask(void *ctx, int task)
+{
+    FFMVLucky *l = (FFMVLucky *) ctx;
+    size_t stride = (size_t) l->width * ffmv_pixel_bytes(l->format);
+    const uint8_t *base = (const uint8_t *) l->sub;
+    int y = 1 + (l->height - 2) * task / l->nbands;
+    int y1 = 1 + (l->height - 2) * (task + 1) / l->nbands;
+    ffmv_lucky_sums r;
+
+    r.sum = 0;
+    r.sumsq = 0;
+    r.peak = 0;
+    for (; y < y1; ++y) {
+        l->row(base + (y - 1) * stride, base + y * stride, base + (y + 1) * stride, l->width, &r);
+    }
+    l->bands[task].sum = r.sum;
+    l->bands[task].sumsq = r.sumsq;
+    l->bands[task].peak = r.peak;
+}
+
+double FFMVLucky::score(const void *sub)
+{
+    const int shift = format == FFMV_MONO8 ? 0 : FFMV_LUCKY_SHIFT16;
+    double n = (double) (width - 2) * (height - 2);
+    double mean, var;
+    int64_t sum = 0;
+    uint64_t sumsq = 0;
+    uint32_t peak = 0;
+    int i;
+
+    this->sub = sub;
+    pool->run(nbands, scoreTask, this);
+    for (i = 0; i < nbands; ++i) {
+        sum += bands[i].sum;
+        sumsq += bands[i].sumsq;
+        peak = std::max(peak, bands[i].peak);
+    }
+
+    if (metric == FFMV_LUCKY_PEAK) {
+        return (double) (peak << shift);
+    }
+    mean = sum / n;
+    var = sumsq / n - mean * mean;
+
+    return var * (1 << (2 * shift));
+}
+
+bool FFMVLucky::offer(const void *sub, double score)
+{
+    int i, slot = kept;
+
+    if (kept == keep) {
+        /* Replace the worst kept sub, if this one is better */
+        slot = 0;
+        for (i = 1; i < kept; ++i) {
+            if (scores[i] < scores[slot]) {
+                slot = i;
+            }
+        }
+        if (score <= scores[slot]) {
+            return false;
+        }
+    } else {
+        ++kept;
+    }
+
+    memcpy(frames + (size_t) slot * frame_stride, sub, frame_bytes);
+    scores[slot] = score;
+
+    return true;
+}
+
+/* Orders sub indices by descending score */
+struct ScoreGreater {
+    const std::vector<double> &scores;
+
+    explicit ScoreGreater(const std::vector<double> &s) : scores(s) {}
+    bool operator()(int a, int b) const { return scores[a] > scores[b]; }
+};
+
+void FFMVLucky::sort()
+{
+    int i;
+
+    for (i = 0; i < kept; ++i) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.begin() + kept, ScoreGreater(scores));
+}
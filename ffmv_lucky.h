@@ -0,0 +1,175 @@
+/**
+ * Lucky imaging frame selection for the Point Grey FireFly MV driver.
+ *
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef FFMV_LUCKY_H
+#define FFMV_LUCKY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "ffmv_accum.h"
+#include "ffmv_workpool.h"
+
+enum ffmv_lucky_metric {
+    /* Variance of the Laplacian: fine detail, for extended objects */
+    FFMV_LUCKY_LAPLACIAN,
+    /* Brightest pixel: how tightly a star's light is concentrated */
+    FFMV_LUCKY_PEAK
+};
+
+/* MONO16 pixels are scored at 13 bits, so the Laplacian of a pixel fits in
+ * 16 bit lanes. The camera only fills the top 10 bits. */
+const int FFMV_LUCKY_SHIFT16 = 3;
+
+struct ffmv_lucky_sums {
+    int64_t sum;
+    uint64_t sumsq;
+    uint32_t peak;
+};
+
+/**
+ * Add the 4 neighbour Laplacian of the interior pixels of a row, and its
+ * square, to r. up and down are the rows either side.
+ */
+typedef void (*ffmv_lucky_row_fn)(const void *up, const void *row, const void *down, int w,
+        ffmv_lucky_sums *r);
+
+struct ffmv_lucky_kernel {
+    const char *name;
+    ffmv_lucky_row_fn row8;
+    ffmv_lucky_row_fn row16;
+};
+
+/**
+ * Reference implementations. The vectorized kernels must produce exactly
+ * the same sums as these.
+ */
+void ffmv_lucky_row8_scalar(const void *up, const void *row, const void *down, int w,
+        ffmv_lucky_sums *r);
+void ffmv_lucky_row16_scalar(const void *up, const void *row, const void *down, int w,
+        ffmv_lucky_sums *r);
+extern const struct ffmv_lucky_kernel ffmv_lucky_scalar;
+
+#if defined(__aarch64__) || defined(__arm__)
+#define FFMV_LUCKY_NEON
+/**
+ * NEON kernels, from ffmv_lucky_neon.cpp. On 32 bit ARM only call them once
+ * the CPU is known to have NEON.
+ */
+void ffmv_lucky_row8_neon(const void *up, const void *row, const void *down, int w,
+        ffmv_lucky_sums *r);
+void ffmv_lucky_row16_neon(const void *up, const void *row, const void *down, int w,
+        ffmv_lucky_sums *r);
+#endif
+
+/* Most vectorized kernels built for any one CPU */
+const int FFMV_LUCKY_MAX_KERNELS = 2;
+
+/**
+ * List the vectorized kernels that the running CPU supports, fastest first.
+ * Returns how many there are. The first one, or the scalar one if there are
+ * none, is used for scoring.
+ */
+int ffmv_lucky_kernels(const struct ffmv_lucky_kernel **kernels);
+
+/**
+ * Bytes each kept sub takes, rounded up to a cache line.
+ */
+static inline size_t ffmv_lucky_frame_stride(enum ffmv_pixel_format fmt, int width, int height)
+{
+    return ((size_t) width * height * ffmv_pixel_bytes(fmt) + 63) & ~(size_t) 63;
+}
+
+/**
+ * Selection of the subs of one exposure, done before they are stacked.
+ */
+struct FFMVLuckyParams {
+    bool enabled;
+    enum ffmv_lucky_metric metric;
+    /* How many of the sharpest subs are stacked. They are all held in
+     * memory at once, so the caller bounds this. */
+    int keep;
+};
+
+/**
+ * Keeps the sharpest subs of an exposure in a fixed set of raw frame
+ * buffers, so only they are stacked once the exposure is over.
+ *
+ * Each sub is scored straight from the DMA buffer as it arrives, in row
+ * bands on a worker pool. If it beats the worst sub kept so far, it takes
+ * that sub's buffer. The buffers and per band sums are allocated by
+ * reset(), so scoring and keeping subs never allocate.
+ *
+ * Scores only rank the subs of one exposure: the Laplacian variance is in
+ * squared raw units, and the peak in raw units.
+ */
+class FFMVLucky
+{
+public:
+    explicit FFMVLucky(FFMVWorkPool *pool);
+    ~FFMVLucky();
+
+    bool reset(enum ffmv_pixel_format fmt, int width, int height, enum ffmv_lucky_metric metric,
+            int keep);
+    /* Sharpness of a raw sub, higher is better */
+    double score(const void *sub);
+    /* Copy sub in if it is among the best so far. Returns true if it was. */
+    bool offer(const void *sub, double score);
+    /* Order the kept subs best first */
+    void sort();
+
+    int getKept() const { return kept; }
+    const void *getSub(int i) const { return frames + (size_t) order[i] * frame_stride; }
+    double getScore(int i) const { return scores[order[i]]; }
+
+private:
+    static void scoreTask(void *ctx, int task);
+
+    FFMVWorkPool *pool;
+
+    enum ffmv_pixel_format format;
+    enum ffmv_lucky_metric metric;
+    /* Row kernel for format, picked by reset() */
+    ffmv_lucky_row_fn row;
+    int width, height;
+    size_t frame_bytes;
+
+    uint8_t *frames;
+    size_t frame_stride;
+    size_t frames_size;
+    int keep;
+    int kept;
+    std::vector<double> scores;
+    std::vector<int> order;
+
+    /* The sub being scored, and the sums of each band of it */
+    const void *sub;
+    int nbands;
+    struct BandSums {
+        int64_t sum;
+        uint64_t sumsq;
+        uint32_t peak;
+        /* Keep bands on their own cache lines */
+        char pad[44];
+    };
+    std::vector<BandSums> bands;
+};
+
+#endif // FFMV_LUCKY_H
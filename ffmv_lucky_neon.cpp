@@ -0,0 +1,118 @@
+/**
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* NEON sharpness scoring kernels. On 32 bit ARM this is the only file built
+ * with NEON enabled, so that nothing else picks up NEON instructions and
+ * ffmv_lucky_kernels() can leave these out on CPUs without it. */
+
+#include "ffmv_lucky.h"
+
+#if defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+
+/* 8 big-endian MONO16 pixels, native and scaled down to 13 bits */
+static inline int16x8_t lucky_load16_neon(const uint16_t *p)
+{
+    uint16x8_t v = vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8((const uint8_t *) p)));
+
+    return vreinterpretq_s16_u16(vshrq_n_u16(v, FFMV_LUCKY_SHIFT16));
+}
+
+static inline int16x8_t lucky_load8_neon(const uint8_t *p)
+{
+    return vreinterpretq_s16_u16(vmovl_u8(vld1_u8(p)));
+}
+
+/**
+ * Accumulate the Laplacian of 8 pixels, as lucky_lap_sse2() does.
+ */
+static inline void lucky_lap_neon(int16x8_t c, int16x8_t l, int16x8_t r, int16x8_t n,
+        int16x8_t s, int32x4_t *sum, uint64x2_t *sumsq, int16x8_t *peak)
+{
+    int16x8_t lap = vsubq_s16(vshlq_n_s16(c, 2), vaddq_s16(vaddq_s16(l, r), vaddq_s16(n, s)));
+    int32x4_t sq = vmull_s16(vget_low_s16(lap), vget_low_s16(lap));
+
+    /* Each square pair is below 2^31, so it fits before widening */
+    sq = vmlal_s16(sq, vget_high_s16(lap), vget_high_s16(lap));
+    *sum = vpadalq_s16(*sum, lap);
+    *sumsq = vpadalq_u32(*sumsq, vreinterpretq_u32_s32(sq));
+    *peak = vmaxq_s16(*peak, c);
+}
+
+static void lucky_fold_neon(int32x4_t sum, uint64x2_t sumsq, int16x8_t peak, ffmv_lucky_sums *r)
+{
+    int32_t s[4];
+    uint64_t q[2];
+    int16_t p[8];
+    int i;
+
+    vst1q_s32(s, sum);
+    vst1q_u64(q, sumsq);
+    vst1q_s16(p, peak);
+    r->sum += (int64_t) s[0] + s[1] + s[2] + s[3];
+    r->sumsq += q[0] + q[1];
+    for (i = 0; i < 8; ++i) {
+        r->peak = (uint32_t) p[i] > r->peak ? p[i] : r->peak;
+    }
+}
+
+void ffmv_lucky_row16_neon(const void *up, const void *row, const void *down, int w,
+        ffmv_lucky_sums *r)
+{
+    const uint16_t *n = (const uint16_t *) up;
+    const uint16_t *c = (const uint16_t *) row;
+    const uint16_t *s = (const uint16_t *) down;
+    int32x4_t sum = vdupq_n_s32(0);
+    uint64x2_t sumsq = vdupq_n_u64(0);
+    int16x8_t peak = vdupq_n_s16(0);
+    int x;
+
+    for (x = 1; x + 9 <= w; x += 8) {
+        lucky_lap_neon(lucky_load16_neon(c + x), lucky_load16_neon(c + x - 1),
+                lucky_load16_neon(c + x + 1), lucky_load16_neon(n + x), lucky_load16_neon(s + x),
+                &sum, &sumsq, &peak);
+    }
+    lucky_fold_neon(sum, sumsq, peak, r);
+
+    /* The scalar kernel does the interior pixels from x on */
+    ffmv_lucky_row16_scalar(n + x - 1, c + x - 1, s + x - 1, w - x + 1, r);
+}
+
+void ffmv_lucky_row8_neon(const void *up, const void *row, const void *down, int w,
+        ffmv_lucky_sums *r)
+{
+    const uint8_t *n = (const uint8_t *) up;
+    const uint8_t *c = (const uint8_t *) row;
+    const uint8_t *s = (const uint8_t *) down;
+    int32x4_t sum = vdupq_n_s32(0);
+    uint64x2_t sumsq = vdupq_n_u64(0);
+    int16x8_t peak = vdupq_n_s16(0);
+    int x;
+
+    for (x = 1; x + 9 <= w; x += 8) {
+        lucky_lap_neon(lucky_load8_neon(c + x), lucky_load8_neon(c + x - 1),
+                lucky_load8_neon(c + x + 1), lucky_load8_neon(n + x), lucky_load8_neon(s + x),
+                &sum, &sumsq, &peak);
+    }
+    lucky_fold_neon(sum, sumsq, peak, r);
+
+    ffmv_lucky_row8_scalar(n + x - 1, c + x - 1, s + x - 1, w - x + 1, r);
+}
+#elif defined(FFMV_LUCKY_NEON)
+#error "ffmv_lucky_neon.cpp has to be built with NEON enabled (-mfpu=neon)"
+#endif
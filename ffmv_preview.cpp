@@ -0,0 +1,161 @@
+/**
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "ffmv_preview.h"
+
+/* Sky background brightness the stretch aims for, as a fraction of white */
+const float PREVIEW_TARGET_BG = 0.25f;
+/* How far below the median the black point sits, in standard deviations */
+const float PREVIEW_SHADOW_CLIP = 2.8f;
+
+template <class Pixel>
+static void ffmv_preview_rows_t(uint16_t *dst, const typename Pixel::sample *src, int width,
+        int factor, int py0, int py1, uint32_t *hist, uint32_t *colsum)
+{
+    const typename Pixel::sample *row;
+    int pw = width / factor;
+    int n = pw * factor;
+    /* Average and scale to histogram bins in one multiply */
+    float scale = (Pixel::max == 0xFF ? 16.0f : 1.0f / 16) / (factor * factor);
+    uint32_t sum, v;
+    int py, x, j, k;
+
+    for (py = py0; py < py1; ++py) {
+        /* Sum down the columns first, a plain loop over whole rows that
+         * the compiler vectorizes, then across each block */
+        row = src + (size_t) py * factor * width;
+        for (x = 0; x < n; ++x) {
+            colsum[x] = Pixel::load(row[x]);
+        }
+        for (j = 1; j < factor; ++j) {
+            row += width;
+            for (x = 0; x < n; ++x) {
+                colsum[x] += Pixel::load(row[x]);
+            }
+        }
+
+        for (x = 0; x < pw; ++x) {
+            sum = 0;
+            for (k = 0; k < factor; ++k) {
+                sum += colsum[x * factor + k];
+            }
+            v = (uint32_t) (sum * scale);
+            if (v >= (uint32_t) FFMV_PREVIEW_BINS) {
+                v = FFMV_PREVIEW_BINS - 1;
+            }
+            *dst++ = v;
+            ++hist[v];
+        }
+    }
+}
+
+void ffmv_preview_rows(enum ffmv_pixel_format fmt, uint16_t *dst, const void *src, int width,
+        int factor, int py0, int py1, uint32_t *hist, uint32_t *colsum)
+{
+    if (fmt == FFMV_MONO8) {
+        ffmv_preview_rows_t<ffmv_mono8>(dst, (const uint8_t *) src, width, factor, py0, py1,
+                hist, colsum);
+    } else {
+        ffmv_preview_rows_t<ffmv_mono16>(dst, (const uint16_t *) src, width, factor, py0, py1,
+                hist, colsum);
+    }
+}
+
+/**
+ * Midtones transfer function: maps 0 to 0, 1 to 1 and m to 0.5.
+ */
+static inline float ffmv_mtf(float m, float x)
+{
+    if (x <= 0) {
+        return 0;
+    }
+    if (x >= 1) {
+        return 1;
+    }
+    return (m - 1) * x / ((2 * m - 1) * x - m);
+}
+
+void ffmv_preview_stretch(const uint32_t *hist, FFMVStretch *st)
+{
+    uint64_t total = 0, cum = 0;
+    int i, d, lo = -1, hi = 0, med = 0;
+    float sigma, mn;
+
+    for (i = 0; i < FFMV_PREVIEW_BINS; ++i) {
+        if (hist[i]) {
+            if (lo < 0) {
+                lo = i;
+            }
+            hi = i;
+        }
+        total += hist[i];
+    }
+    if (!total) {
+        st->black = st->median = 0;
+        st->white = FFMV_PREVIEW_BINS - 1;
+        st->midtone = 0.5f;
+        return;
+    }
+
+    for (i = 0; i < FFMV_PREVIEW_BINS; ++i) {
+        cum += hist[i];
+        if (2 * cum >= total) {
+            break;
+        }
+    }
+    med = i;
+
+    /* Median absolute deviation: widen a window around the median until
+     * it holds half of the samples */
+    cum = hist[med];
+    for (d = 0; 2 * cum < total; ) {
+        ++d;
+        if (med - d >= 0) {
+            cum += hist[med - d];
+        }
+        if (med + d < FFMV_PREVIEW_BINS) {
+            cum += hist[med + d];
+        }
+    }
+    sigma = 1.4826f * d;
+
+    st->median = med;
+    st->black = (int) (med - PREVIEW_SHADOW_CLIP * sigma);
+    if (st->black < lo) {
+        st->black = lo;
+    }
+    st->white = hi > st->black ? hi : st->black + 1;
+
+    mn = (float) (med - st->black) / (st->white - st->black);
+    if (mn <= 0 || mn >= 1) {
+        st->midtone = 0.5f;
+    } else {
+        /* The balance that takes the median to the target */
+        st->midtone = ffmv_mtf(PREVIEW_TARGET_BG, mn);
+    }
+}
+
+void ffmv_preview_lut(const FFMVStretch &st, uint8_t *lut)
+{
+    float scale = 1.0f / (st.white - st.black);
+    int i;
+
+    for (i = 0; i < FFMV_PREVIEW_BINS; ++i) {
+        lut[i] = (uint8_t) (ffmv_mtf(st.midtone, (i - st.black) * scale) * 255 + 0.5f);
+    }
+}
@@ -0,0 +1,65 @@
+/**
+ * Preview thumbnails for the Point Grey FireFly MV driver.
+ *
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef FFMV_PREVIEW_H
+#define FFMV_PREVIEW_H
+
+#include <stdint.h>
+
+#include "ffmv_accum.h"
+
+/* Preview samples keep the top 12 bits of a 16 bit sample, which is more
+ * than the sensor has; MONO8 samples are scaled up to the same range */
+const int FFMV_PREVIEW_BINS = 4096;
+
+/**
+ * Display stretch worked out from a preview histogram, in histogram bins.
+ * Samples at or below black go to 0 and at or above white to 255; midtone
+ * is the midtones balance that puts the median at a quarter brightness.
+ */
+struct FFMVStretch {
+    int black;
+    int median;
+    int white;
+    float midtone;
+};
+
+/**
+ * Average factor x factor blocks of preview rows py0 to py1 out of a raw
+ * sub of the given width, and count them into hist, which has
+ * FFMV_PREVIEW_BINS entries and is added to, not cleared. dst holds
+ * width / factor samples per preview row, starting at row py0. colsum is
+ * scratch space for width sums.
+ */
+void ffmv_preview_rows(enum ffmv_pixel_format fmt, uint16_t *dst, const void *src, int width,
+        int factor, int py0, int py1, uint32_t *hist, uint32_t *colsum);
+
+/**
+ * Pick black and white points around the histogram's median and spread,
+ * so the sky comes out dark grey and faint detail above it is visible.
+ */
+void ffmv_preview_stretch(const uint32_t *hist, FFMVStretch *st);
+
+/**
+ * Fill lut, with FFMV_PREVIEW_BINS entries, with the 8 bit output of each
+ * preview sample under the stretch.
+ */
+void ffmv_preview_lut(const FFMVStretch &st, uint8_t *lut);
+
+#endif // FFMV_PREVIEW_H
@@ -0,0 +1,430 @@
+/**
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "ffmv_record.h"
+#include "ffmv_time.h"
+
+const size_t SER_HEADER_BYTES = 178;
+/* .NET ticks (100 ns since 0001-01-01) at the Unix epoch */
+const uint64_t SER_EPOCH_TICKS = 621355968000000000ULL;
+/* O_DIRECT writes go out in chunks of this, at offsets that are multiples
+ * of it, from a buffer aligned to RECORD_ALIGN */
+const size_t RECORD_CHUNK = 4 << 20;
+const size_t RECORD_ALIGN = 4096;
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    int i;
+
+    for (i = 0; i < 4; ++i) {
+        p[i] = v >> (8 * i);
+    }
+}
+
+static void put64(uint8_t *p, uint64_t v)
+{
+    int i;
+
+    for (i = 0; i < 8; ++i) {
+        p[i] = v >> (8 * i);
+    }
+}
+
+static uint64_t ser_ticks(uint64_t us)
+{
+    return us * 10 + SER_EPOCH_TICKS;
+}
+
+FFMVRecorder::FFMVRecorder()
+{
+    fd = -1;
+    direct = false;
+    format = FFMV_MONO16;
+    width = height = 0;
+    frame_bytes = 0;
+    expected = 0;
+    slots = NULL;
+    slot_stride = 0;
+    stamps = NULL;
+    nslots = 0;
+    head = tail = 0;
+    dropped = 0;
+    queue_max = 0;
+    running = false;
+    closing = 0;
+    staging = NULL;
+    staged = 0;
+    written = 0;
+    write_error = 0;
+    bytes = 0;
+    write_us = 0;
+    open_us = close_us = 0;
+    sem_init(&ready, 0, 0);
+}
+
+FFMVRecorder::~FFMVRecorder()
+{
+    close();
+    sem_destroy(&ready);
+}
+
+bool FFMVRecorder::open(const char *path, enum ffmv_pixel_format fmt, int width, int height,
+        int frames, size_t queue_bytes, bool direct, const char *instrument)
+{
+    uint8_t zero[SER_HEADER_BYTES];
+    int err;
+
+    if (fd >= 0 || width <= 0 || height <= 0) {
+        return false;
+    }
+
+    this->path = path;
+    this->format = fmt;
+    this->width = width;
+    this->height = height;
+    this->instrument = instrument ? instrument : "";
+    frame_bytes = (size_t) width * height * ffmv_pixel_bytes(fmt);
+    expected = frames;
+
+    /* Cache line aligned slots, at least two of them */
+    slot_stride = (frame_bytes + 63) & ~(size_t) 63;
+    nslots = std::max((size_t) 2, queue_bytes / slot_stride);
+    stamps = (uint64_t *) malloc(nslots * sizeof(uint64_t));
+    if (posix_memalign((void **) &slots, RECORD_ALIGN, nslots * slot_stride)) {
+        slots = NULL;
+    }
+    if (!slots || !stamps) {
+        goto fail;
+    }
+    /* Touch the queue now, so the capture thread doesn't take the page
+     * faults */
+    memset(slots, 0, nslots * slot_stride);
+
+    this->direct = false;
+    if (direct) {
+        fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        if (fd >= 0 && posix_memalign((void **) &staging, RECORD_ALIGN, RECORD_CHUNK)) {
+            staging = NULL;
+            ::close(fd);
+            fd = -1;
+        }
+        this->direct = fd >= 0;
+    }
+    if (fd < 0) {
+        fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd < 0) {
+        goto fail;
+    }
+
+    if (frames > 0) {
+        /* Not every filesystem can; writing works all the same */
+        posix_fallocate(fd, 0, SER_HEADER_BYTES + (off_t) frames * (frame_bytes + 8));
+    }
+
+    head = tail = 0;
+    dropped = 0;
+    queue_max = 0;
+    closing = 0;
+    written = 0;
+    write_error = 0;
+    bytes = 0;
+    write_us = 0;
+    times.clear();
+    times.reserve(frames > 0 ? frames : 0);
+    while (!sem_trywait(&ready))
+        ;
+
+    /* The header is written last, once the frame count is known; until
+     * then its space is zeros */
+    if (this->direct) {
+        memset(staging, 0, SER_HEADER_BYTES);
+        staged = SER_HEADER_BYTES;
+    } else {
+        memset(zero, 0, sizeof(zero));
+        staged = 0;
+        if (!writeAll(zero, sizeof(zero))) {
+            goto fail;
+        }
+    }
+
+    open_us = ffmv_time_us();
+    close_us = 0;
+    if (pthread_create(&thread, NULL, threadEntry, this)) {
+        goto fail;
+    }
+    running = true;
+
+    return true;
+
+fail:
+    /* Leave nothing behind for the next open(), not even the file, but
+     * keep errno for the caller */
+    err = errno;
+    if (fd >= 0) {
+        ::close(fd);
+        unlink(path);
+        fd = -1;
+    }
+    free(slots);
+    slots = NULL;
+    free(stamps);
+    stamps = NULL;
+    free(staging);
+    staging = NULL;
+    this->direct = false;
+    errno = err;
+
+    return false;
+}
+
+/**
+ * Queue a frame for the writer. This is the only part of recording that
+ * runs on the capture thread: a copy, two atomic counters and a semaphore
+ * post.
+ */
+bool FFMVRecorder::push(const void *frame, uint64_t timestamp_us)
+{
+    uint64_t h = head;
+    int depth = h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+    size_t slot = h % nslots;
+    struct timeval tv;
+
+    if (depth >= nslots) {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    if (!timestamp_us) {
+        gettimeofday(&tv, NULL);
+        timestamp_us = (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+
+    memcpy(slots + slot * slot_stride, frame, frame_bytes);
+    stamps[slot] = timestamp_us;
+    __atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+    if (depth + 1 > queue_max) {
+        __atomic_store_n(&queue_max, depth + 1, __ATOMIC_RELAXED);
+    }
+    sem_post(&ready);
+
+    return true;
+}
+
+void *FFMVRecorder::threadEntry(void *arg)
+{
+    ((FFMVRecorder *) arg)->run();
+    return NULL;
+}
+
+void FFMVRecorder::run()
+{
+    uint64_t t = tail;
+    size_t slot;
+
+    while (1) {
+        while (sem_wait(&ready) < 0 && errno == EINTR)
+            ;
+        while (t < __atomic_load_n(&head, __ATOMIC_ACQUIRE)) {
+            slot = t % nslots;
+            if (write_error || !writeFrame(slots + slot * slot_stride)) {
+                /* Keep emptying the queue, so capture goes on */
+                __atomic_store_n(&write_error, 1, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            } else {
+                times.push_back(stamps[slot]);
+                __atomic_store_n(&written, written + 1, __ATOMIC_RELAXED);
+            }
+            __atomic_store_n(&tail, ++t, __ATOMIC_RELEASE);
+        }
+        if (__atomic_load_n(&closing, __ATOMIC_ACQUIRE) &&
+                t == __atomic_load_n(&head, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+}
+
+bool FFMVRecorder::writeAll(const void *buf, size_t n)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+    int64_t t = ffmv_time_us();
+    ssize_t r;
+
+    while (n) {
+        r = write(fd, p, n);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        p += r;
+        n -= r;
+        __atomic_store_n(&bytes, bytes + r, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&write_us, write_us + (ffmv_time_us() - t), __ATOMIC_RELAXED);
+
+    return true;
+}
+
+/**
+ * Write one frame: straight from its slot, or gathered into whole chunks
+ * for O_DIRECT.
+ */
+bool FFMVRecorder::writeFrame(const uint8_t *frame)
+{
+    size_t left = frame_bytes, n;
+
+    if (!direct) {
+        return writeAll(frame, frame_bytes);
+    }
+
+    while (left) {
+        n = std::min(left, RECORD_CHUNK - staged);
+        memcpy(staging + staged, frame, n);
+        staged += n;
+        frame += n;
+        left -= n;
+        if (staged == RECORD_CHUNK) {
+            if (!writeAll(staging, RECORD_CHUNK)) {
+                return false;
+            }
+            staged = 0;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Write what is left of the frames, the timestamp trailer and the header,
+ * and trim the preallocated space.
+ */
+bool FFMVRecorder::finish()
+{
+    uint8_t header[SER_HEADER_BYTES];
+    std::vector<uint8_t> trailer(times.size() * 8);
+    uint64_t first = times.empty() ? 0 : times[0];
+    struct tm tm;
+    time_t secs = first / 1000000;
+    long offset = 0;
+    bool ok = !write_error;
+    off_t end;
+    size_t i;
+
+    if (direct) {
+        /* The tail of the last chunk isn't a whole block */
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+        if (ok && staged && !writeAll(staging, staged)) {
+            ok = false;
+        }
+        staged = 0;
+    }
+
+    for (i = 0; i < times.size(); ++i) {
+        put64(&trailer[i * 8], ser_ticks(times[i]));
+    }
+    if (ok && !trailer.empty() && !writeAll(&trailer[0], trailer.size())) {
+        ok = false;
+    }
+    end = lseek(fd, 0, SEEK_CUR);
+    if (end > 0 && ftruncate(fd, end) < 0) {
+        ok = false;
+    }
+
+    if (localtime_r(&secs, &tm)) {
+        offset = tm.tm_gmtoff;
+    }
+    memset(header, 0, sizeof(header));
+    memcpy(header, "LUCAM-RECORDER", 14);
+    put32(header + 14, 0);
+    /* MONO */
+    put32(header + 18, 0);
+    /* 16 bit samples are big-endian */
+    put32(header + 22, 0);
+    put32(header + 26, width);
+    put32(header + 30, height);
+    put32(header + 34, format == FFMV_MONO8 ? 8 : 16);
+    put32(header + 38, times.size());
+    strncpy((char *) header + 82, instrument.c_str(), 40);
+    put64(header + 162, ser_ticks(first + (int64_t) offset * 1000000));
+    put64(header + 170, ser_ticks(first));
+    if (pwrite(fd, header, sizeof(header), 0) != (ssize_t) sizeof(header)) {
+        ok = false;
+    }
+
+    if (::close(fd) < 0) {
+        ok = false;
+    }
+    fd = -1;
+
+    return ok;
+}
+
+bool FFMVRecorder::close()
+{
+    bool ok;
+
+    if (fd < 0) {
+        return true;
+    }
+    if (running) {
+        __atomic_store_n(&closing, 1, __ATOMIC_RELEASE);
+        sem_post(&ready);
+        pthread_join(thread, NULL);
+        running = false;
+    }
+    close_us = ffmv_time_us();
+    ok = finish();
+
+    free(slots);
+    slots = NULL;
+    free(stamps);
+    stamps = NULL;
+    free(staging);
+    staging = NULL;
+
+    return ok;
+}
+
+void FFMVRecorder::getStats(FFMVRecordStats *st) const
+{
+    int64_t wus = __atomic_load_n(&write_us, __ATOMIC_RELAXED);
+    int64_t elapsed = (close_us ? close_us : ffmv_time_us()) - open_us;
+
+    st->written = __atomic_load_n(&written, __ATOMIC_RELAXED);
+    st->dropped = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    st->queue_size = nslots;
+    st->queue_max = __atomic_load_n(&queue_max, __ATOMIC_RELAXED);
+    st->bytes = __atomic_load_n(&bytes, __ATOMIC_RELAXED);
+    st->write_mb_s = wus > 0 ? st->bytes / (double) wus : 0;
+    st->avg_mb_s = elapsed > 0 ? st->bytes / (double) elapsed : 0;
+    st->direct = direct;
+    st->error = __atomic_load_n(&write_error, __ATOMIC_RELAXED);
+}
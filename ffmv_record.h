@@ -0,0 +1,129 @@
+/**
+ * Raw video recording for the Point Grey FireFly MV driver.
+ *
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef FFMV_RECORD_H
+#define FFMV_RECORD_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "ffmv_accum.h"
+
+struct FFMVRecordStats {
+    /* Frames on disk, and frames thrown away because the queue was full
+     * or the disk failed */
+    unsigned long written;
+    unsigned long dropped;
+    /* Queue depth in frames, and the most that were ever waiting */
+    int queue_size;
+    int queue_max;
+    uint64_t bytes;
+    /* Rate of the write calls alone, and over the whole recording */
+    double write_mb_s;
+    double avg_mb_s;
+    bool direct;
+    bool error;
+};
+
+/**
+ * Streams raw frames to a SER file.
+ *
+ * The capture thread copies each frame into a queue of buffers allocated
+ * up front, and a writer thread of the recorder's own empties it to disk.
+ * The queue is a single producer, single consumer ring indexed by two
+ * counters, so pushing a frame takes no locks and never waits: if the
+ * writer has fallen too far behind, the frame is dropped and counted. A
+ * semaphore, which never blocks its poster, wakes the writer.
+ *
+ * MONO16 frames are written as the camera sends them, big-endian, as the
+ * SER header says. Each frame's camera timestamp goes into the SER trailer.
+ * When the frame count is known, the file is preallocated. With direct on,
+ * the file is opened O_DIRECT and frames are gathered into aligned chunks,
+ * so a long recording does not fill the page cache; filesystems that don't
+ * support it fall back to buffered writes.
+ */
+class FFMVRecorder
+{
+public:
+    FFMVRecorder();
+    ~FFMVRecorder();
+
+    /* Create path and start the writer. frames is the number expected, or
+     * 0 if not known; queue_bytes is what the queue may take up. */
+    bool open(const char *path, enum ffmv_pixel_format fmt, int width, int height, int frames,
+            size_t queue_bytes, bool direct, const char *instrument);
+    /* From the capture thread. Returns false if the frame was dropped. */
+    bool push(const void *frame, uint64_t timestamp_us);
+    /* Wait for the queue to drain, then finish the file. Returns false if
+     * anything failed to be written. */
+    bool close();
+
+    bool isOpen() const { return fd >= 0; }
+    const std::string &getPath() const { return path; }
+    void getStats(FFMVRecordStats *st) const;
+
+private:
+    static void *threadEntry(void *arg);
+    void run();
+    bool writeFrame(const uint8_t *frame);
+    bool writeAll(const void *buf, size_t n);
+    bool finish();
+
+    int fd;
+    std::string path;
+    bool direct;
+    enum ffmv_pixel_format format;
+    int width, height;
+    size_t frame_bytes;
+    int expected;
+    std::string instrument;
+
+    /* The queue. head is only written by push() and tail by the writer. */
+    uint8_t *slots;
+    size_t slot_stride;
+    uint64_t *stamps;
+    int nslots;
+    uint64_t head;
+    uint64_t tail;
+    unsigned long dropped;
+    int queue_max;
+
+    pthread_t thread;
+    bool running;
+    sem_t ready;
+    int closing;
+
+    /* Written by the writer thread; the counters are also read by
+     * getStats() */
+    uint8_t *staging;
+    size_t staged;
+    std::vector<uint64_t> times;
+    unsigned long written;
+    int write_error;
+    uint64_t bytes;
+    int64_t write_us;
+    int64_t open_us;
+    int64_t close_us;
+};
+
+#endif // FFMV_RECORD_H
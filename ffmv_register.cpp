@@ -0,0 +1,206 @@
+/**
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#include "ffmv_register.h"
+
+/* The reference sub is searched in this many cells across and down */
+const int REGISTER_GRID = 4;
+/* Centroid aperture radius */
+const int REGISTER_RADIUS = 6;
+const float REGISTER_MIN_SNR = 10;
+
+FFMVRegister::FFMVRegister(FFMVWorkPool *pool)
+{
+    this->pool = pool;
+    format = FFMV_MONO16;
+    width = height = 0;
+    raw = NULL;
+    img.pixels = NULL;
+    img.bytes = 2;
+    img.width = img.height = 0;
+    native = NULL;
+    native_size = 0;
+    nbands = 1;
+    bg = 0;
+    sigma = 1;
+    last_dx = last_dy = 0;
+    search = 0;
+}
+
+FFMVRegister::~FFMVRegister()
+{
+    free(native);
+}
+
+void FFMVRegister::loadTask(void *ctx, int task)
+{
+    FFMVRegister *r = (FFMVRegister *) ctx;
+    size_t npix = (size_t) r->width * r->height;
+    size_t i = npix * task / r->nbands;
+    size_t end = npix * (task + 1) / r->nbands;
+    const uint16_t *src = (const uint16_t *) r->raw;
+
+    for (; i < end; ++i) {
+        r->native[i] = ntohs(src[i]);
+    }
+}
+
+/**
+ * Point img at a sub, byte swapping it first if it is MONO16.
+ */
+bool FFMVRegister::load(const void *sub)
+{
+    img.width = width;
+    img.height = height;
+    if (format == FFMV_MONO8) {
+        img.pixels = sub;
+        img.bytes = 1;
+        return true;
+    }
+
+    if ((size_t) width * height > native_size) {
+        free(native);
+        native_size = (size_t) width * height;
+        native = (uint16_t *) malloc(native_size * sizeof(uint16_t));
+        if (!native) {
+            native_size = 0;
+            return false;
+        }
+    }
+    raw = sub;
+    nbands = pool->size() * 2;
+    pool->run(nbands, loadTask, this);
+    img.pixels = native;
+    img.bytes = 2;
+
+    return true;
+}
+
+void FFMVRegister::referenceTask(void *ctx, int task)
+{
+    FFMVRegister *r = (FFMVRegister *) ctx;
+    int cx = task % REGISTER_GRID;
+    int cy = task / REGISTER_GRID;
+    /* Far enough from the edges for a whole aperture */
+    int m = REGISTER_RADIUS;
+    int x0 = m + (r->width - 2 * m) * cx / REGISTER_GRID;
+    int x1 = m + (r->width - 2 * m) * (cx + 1) / REGISTER_GRID - 1;
+    int y0 = m + (r->height - 2 * m) * cy / REGISTER_GRID;
+    int y1 = m + (r->height - 2 * m) * (cy + 1) / REGISTER_GRID - 1;
+
+    r->cell_found[task] = ffmv_find_star(r->img, x0, y0, x1, y1, REGISTER_RADIUS, r->bg,
+            r->sigma, REGISTER_MIN_SNR, &r->cells[task]);
+}
+
+int FFMVRegister::reference(enum ffmv_pixel_format fmt, const void *sub, int width, int height)
+{
+    const int ncells = REGISTER_GRID * REGISTER_GRID;
+    float d2, min_d2 = 4.0f * REGISTER_RADIUS * REGISTER_RADIUS;
+    size_t i, j;
+
+    format = fmt;
+    this->width = width;
+    this->height = height;
+    last_dx = last_dy = 0;
+    refs.clear();
+    if (width < 4 * REGISTER_RADIUS || height < 4 * REGISTER_RADIUS || !load(sub)) {
+        return 0;
+    }
+
+    ffmv_background(img, &bg, &sigma, scratch);
+    cells.resize(ncells);
+    cell_found.assign(ncells, 0);
+    pool->run(ncells, referenceTask, this);
+
+    /* A star on the border between cells can be picked by both */
+    for (i = 0; i < cells.size(); ++i) {
+        if (!cell_found[i]) {
+            continue;
+        }
+        for (j = 0; j < refs.size(); ++j) {
+            d2 = (refs[j].x - cells[i].x) * (refs[j].x - cells[i].x) +
+                    (refs[j].y - cells[i].y) * (refs[j].y - cells[i].y);
+            if (d2 < min_d2) {
+                break;
+            }
+        }
+        if (j == refs.size()) {
+            refs.push_back(cells[i]);
+        }
+    }
+    stars.resize(refs.size());
+    found.assign(refs.size(), 0);
+
+    return refs.size();
+}
+
+void FFMVRegister::measureTask(void *ctx, int task)
+{
+    FFMVRegister *r = (FFMVRegister *) ctx;
+    float x = r->refs[task].x + r->last_dx;
+    float y = r->refs[task].y + r->last_dy;
+
+    r->found[task] = ffmv_find_star(r->img, (int) (x - r->search), (int) (y - r->search),
+            (int) (x + r->search), (int) (y + r->search), REGISTER_RADIUS, r->bg, r->sigma,
+            REGISTER_MIN_SNR, &r->stars[task]);
+}
+
+static float median(std::vector<float> &v)
+{
+    size_t mid = v.size() / 2;
+
+    std::nth_element(v.begin(), v.begin() + mid, v.end());
+
+    return v[mid];
+}
+
+bool FFMVRegister::measure(const void *sub, int search, FFMVShift *shift)
+{
+    std::vector<float> dx, dy;
+    size_t i;
+
+    shift->dx = last_dx;
+    shift->dy = last_dy;
+    shift->stars = 0;
+    if (refs.empty() || !load(sub)) {
+        return false;
+    }
+
+    this->search = search;
+    pool->run(refs.size(), measureTask, this);
+
+    for (i = 0; i < refs.size(); ++i) {
+        if (found[i]) {
+            dx.push_back(stars[i].x - refs[i].x);
+            dy.push_back(stars[i].y - refs[i].y);
+        }
+    }
+    if (dx.empty()) {
+        return false;
+    }
+
+    last_dx = shift->dx = median(dx);
+    last_dy = shift->dy = median(dy);
+    shift->stars = dx.size();
+
+    return true;
+}
@@ -0,0 +1,110 @@
+/**
+ * Sub registration for the Point Grey FireFly MV driver.
+ *
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef FFMV_REGISTER_H
+#define FFMV_REGISTER_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "ffmv_accum.h"
+#include "ffmv_star.h"
+#include "ffmv_workpool.h"
+
+/**
+ * Registration of the subs of one exposure, done on each sub before it is
+ * stacked.
+ */
+struct FFMVRegisterParams {
+    bool enabled;
+    /* How far the stars may move between subs, in raw pixels */
+    int search;
+};
+
+/**
+ * Where a sub's stars are relative to the reference sub, in raw pixels.
+ */
+struct FFMVShift {
+    float dx;
+    float dy;
+    /* Reference stars found again */
+    int stars;
+};
+
+/**
+ * Measures how far each sub of an exposure has moved against its first
+ * one, so the stacker can shift it back before adding it.
+ *
+ * The reference sub is split into a grid of cells and the brightest star
+ * in each is centroided, which spreads the reference stars over the frame.
+ * Each later sub is searched for them again near where the last sub had
+ * them, and the median of their offsets is its shift, so a star that is
+ * lost or confused with another does not pull it off.
+ *
+ * The sky level of the reference is kept for the whole exposure. The byte
+ * swap of MONO16 subs is split into row bands, and the stars are found one
+ * per task, on a worker pool.
+ */
+class FFMVRegister
+{
+public:
+    explicit FFMVRegister(FFMVWorkPool *pool);
+    ~FFMVRegister();
+
+    /* Pick the reference stars out of the first sub. Returns how many were
+     * found; with none, measure() always fails. */
+    int reference(enum ffmv_pixel_format fmt, const void *sub, int width, int height);
+    /* Returns false if none of the reference stars could be found */
+    bool measure(const void *sub, int search, FFMVShift *shift);
+
+    int getStars() const { return refs.size(); }
+
+private:
+    static void loadTask(void *ctx, int task);
+    static void referenceTask(void *ctx, int task);
+    static void measureTask(void *ctx, int task);
+    bool load(const void *sub);
+
+    FFMVWorkPool *pool;
+
+    enum ffmv_pixel_format format;
+    int width, height;
+    const void *raw;
+    /* The sub being registered, native-endian */
+    FFMVImage img;
+    uint16_t *native;
+    size_t native_size;
+    int nbands;
+
+    float bg, sigma;
+    std::vector<float> scratch;
+
+    /* Reference stars, and where each was found in the current sub. cells
+     * are only used while picking the references. */
+    std::vector<FFMVStar> cells;
+    std::vector<char> cell_found;
+    std::vector<FFMVStar> refs;
+    std::vector<FFMVStar> stars;
+    std::vector<char> found;
+    /* Shift of the last sub, where the search starts */
+    float last_dx, last_dy;
+    int search;
+};
+
+#endif // FFMV_REGISTER_H
@@ -0,0 +1,1088 @@
+/**
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "ffmv_sim.h"
+#include "ffmv_time.h"
+
+/* Point Grey's OUI in the top bits, so the GUID looks like a FireFly's */
+const uint64_t SIM_GUID = 0x00b09d0100000001ULL;
+const uint64_t REPLAY_GUID = 0x00b09d0100000002ULL;
+
+/* MT9V022: 752x480, 26.6 MHz pixel clock, default blanking */
+const int SENSOR_WIDTH = 752;
+const int SENSOR_HEIGHT = 480;
+const double PIXEL_CLOCK_HZ = 26.6e6;
+const int H_BLANK = 94;
+const int V_BLANK = 45;
+/* S400 isochronous: a 4096 byte packet every 125 us */
+const double BUS_BYTES_PER_S = 4096 * 8000.0;
+const uint32_t MAX_PACKET = 4096;
+
+const uint32_t UNIT_WIDTH = 4;
+const uint32_t UNIT_HEIGHT = 2;
+const uint32_t UNIT_LEFT = 4;
+const uint32_t UNIT_TOP = 2;
+
+/* Longest sub with frame rate control off, and the shortest at all */
+const float EXTENDED_SHUTTER = 0.512f;
+const float MIN_SHUTTER = 0.00002f;
+const float MIN_FRAME_RATE = 1.875f;
+
+const uint32_t SENSOR_ADDR = 0x1A00;
+const uint32_t SENSOR_DATA = 0x1A04;
+const uint32_t GAIN_REG = 0x820;
+const uint32_t GAIN_UNITY = 0x40;
+const uint32_t SENSOR_VREF = 0x2C;
+const uint32_t SENSOR_DIGITAL_GAIN = 0x80;
+
+const int NOISE_TABLE = 4096;
+const float ADU_MAX = 1023;
+
+const size_t SER_HEADER_BYTES = 178;
+/* Largest recording replayed, each way; its frames are rendered as if it
+ * were the sensor */
+const uint32_t REPLAY_MAX_SIZE = 4096;
+
+void ffmv_sim_defaults(FFMVSimParams *params)
+{
+    params->stars = 40;
+    params->fwhm = 3;
+    params->seeing = 0.3f;
+    params->star_flux = 50000;
+    params->sky = 200;
+    params->read_noise = 2;
+    params->bias = 16;
+    params->drift_x = 0.05f;
+    params->drift_y = 0.02f;
+    params->seed = 1;
+}
+
+static uint64_t splitmix(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double uniform(uint64_t *state)
+{
+    return (splitmix(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double gaussian(uint64_t *state)
+{
+    double u = uniform(state);
+    double v = uniform(state);
+
+    return sqrt(-2 * log(u + 1e-300)) * cos(2 * M_PI * v);
+}
+
+static double frame_rate_fps(dc1394framerate_t rate)
+{
+    return MIN_FRAME_RATE * (1 << (rate - DC1394_FRAMERATE_1_875));
+}
+
+FFMVSimCamera::FFMVSimCamera(const FFMVSimParams &params)
+{
+    pthread_condattr_t attr;
+    uint64_t state;
+    Star s;
+    int i;
+
+    this->params = params;
+    guid = SIM_GUID;
+    sensor_width = SENSOR_WIDTH;
+    sensor_height = SENSOR_HEIGHT;
+
+    /* The field is the same every time for a seed. Brightest star first. */
+    state = params.seed;
+    for (i = 0; i < params.stars; ++i) {
+        s.x = uniform(&state) * sensor_width;
+        s.y = uniform(&state) * sensor_height;
+        s.flux = params.star_flux * exp(-4.0 * i / params.stars);
+        field.push_back(s);
+    }
+    noise.resize(NOISE_TABLE);
+    for (i = 0; i < NOISE_TABLE; ++i) {
+        noise[i] = gaussian(&state);
+    }
+
+    pthread_mutex_init(&lock, NULL);
+    /* The frame clock runs off the monotonic clock */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    wake_fd[0] = wake_fd[1] = -1;
+    lost = 0;
+    transmitting = false;
+    reset();
+}
+
+FFMVSimCamera::~FFMVSimCamera()
+{
+    captureStop();
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+}
+
+/**
+ * Back to the power on state: 640x480 MONO8 at 30 fps, automatic exposure
+ * and shutter, and unity gain.
+ */
+dc1394error_t FFMVSimCamera::reset()
+{
+    dc1394feature_info_t *f;
+    int i;
+
+    stopTransmission();
+
+    pthread_mutex_lock(&lock);
+    video_mode = DC1394_VIDEO_MODE_640x480_MONO8;
+    framerate = DC1394_FRAMERATE_30;
+    coding = DC1394_COLOR_CODING_MONO8;
+    roi_left = roi_top = 0;
+    roi_width = sensor_width;
+    roi_height = sensor_height;
+
+    features.assign(DC1394_FEATURE_NUM, dc1394feature_info_t());
+    for (i = 0; i < DC1394_FEATURE_NUM; ++i) {
+        memset(&features[i], 0, sizeof(features[i]));
+        features[i].id = (dc1394feature_t) (DC1394_FEATURE_MIN + i);
+    }
+    f = &features[DC1394_FEATURE_BRIGHTNESS - DC1394_FEATURE_MIN];
+    f->available = DC1394_TRUE;
+    f->current_mode = DC1394_FEATURE_MODE_MANUAL;
+    f->abs_min = 0;
+    f->abs_max = 6.24f;
+    f = &features[DC1394_FEATURE_EXPOSURE - DC1394_FEATURE_MIN];
+    f->available = DC1394_TRUE;
+    f->current_mode = DC1394_FEATURE_MODE_AUTO;
+    f->abs_min = -7.58f;
+    f->abs_max = 2.41f;
+    f = &features[DC1394_FEATURE_GAMMA - DC1394_FEATURE_MIN];
+    f->available = DC1394_TRUE;
+    f->current_mode = DC1394_FEATURE_MODE_MANUAL;
+    f->abs_min = 0.5f;
+    f->abs_max = 3.99f;
+    f->abs_value = 1;
+    f = &features[DC1394_FEATURE_SHUTTER - DC1394_FEATURE_MIN];
+    f->available = DC1394_TRUE;
+    f->current_mode = DC1394_FEATURE_MODE_AUTO;
+    f->abs_value = 1 / 60.0f;
+    f = &features[DC1394_FEATURE_GAIN - DC1394_FEATURE_MIN];
+    f->available = DC1394_TRUE;
+    f->current_mode = DC1394_FEATURE_MODE_MANUAL;
+    f->abs_min = 0;
+    f->abs_max = 12;
+    f = &features[DC1394_FEATURE_FRAME_RATE - DC1394_FEATURE_MIN];
+    f->available = DC1394_TRUE;
+    f->current_mode = DC1394_FEATURE_MODE_AUTO;
+    f->abs_value = frame_rate_fps(framerate);
+    for (i = 0; i < DC1394_FEATURE_NUM; ++i) {
+        f = &features[i];
+        if (f->available) {
+            f->absolute_capable = DC1394_TRUE;
+            f->readout_capable = DC1394_TRUE;
+            f->on_off_capable = DC1394_TRUE;
+            f->is_on = DC1394_ON;
+            f->max = 4095;
+        }
+    }
+    /* A monochrome camera, but the driver still turns it off */
+    f = &features[DC1394_FEATURE_WHITE_BALANCE - DC1394_FEATURE_MIN];
+    f->available = DC1394_TRUE;
+    f->on_off_capable = DC1394_TRUE;
+    f->is_on = DC1394_OFF;
+
+    regs.clear();
+    regs[GAIN_REG] = GAIN_UNITY;
+    sensor.clear();
+    sensor[SENSOR_VREF] = 4;
+    sensor[SENSOR_DIGITAL_GAIN] = 0xF4;
+    sensor_addr = 0;
+    pthread_mutex_unlock(&lock);
+
+    return DC1394_SUCCESS;
+}
+
+dc1394feature_info_t *FFMVSimCamera::feature(dc1394feature_t id)
+{
+    if (id < DC1394_FEATURE_MIN || id >= DC1394_FEATURE_MIN + DC1394_FEATURE_NUM ||
+            !features[id - DC1394_FEATURE_MIN].available) {
+        return NULL;
+    }
+
+    return &features[id - DC1394_FEATURE_MIN];
+}
+
+/**
+ * The window the next frame will be read out with.
+ */
+void FFMVSimCamera::frameSize(int *left, int *top, int *width, int *height, bool *mono16)
+{
+    if (video_mode == DC1394_VIDEO_MODE_FORMAT7_0) {
+        *left = roi_left;
+        *top = roi_top;
+        *width = roi_width;
+        *height = roi_height;
+        *mono16 = coding == DC1394_COLOR_CODING_MONO16;
+    } else {
+        *width = std::min(640, sensor_width);
+        *height = std::min(480, sensor_height);
+        *left = (sensor_width - *width) / 2;
+        *top = (sensor_height - *height) / 2;
+        *mono16 = video_mode == DC1394_VIDEO_MODE_640x480_MONO16;
+    }
+}
+
+/**
+ * The shortest frame period for the window: the slower of reading it off
+ * the sensor and sending it over the bus.
+ */
+double FFMVSimCamera::minPeriod()
+{
+    int left, top, width, height;
+    bool mono16;
+    double row, readout, bus;
+
+    frameSize(&left, &top, &width, &height, &mono16);
+    row = (width + H_BLANK) / PIXEL_CLOCK_HZ;
+    readout = (height + V_BLANK) * row;
+    bus = (double) width * height * (mono16 ? 2 : 1) / BUS_BYTES_PER_S;
+    if (video_mode != DC1394_VIDEO_MODE_FORMAT7_0) {
+        bus = std::max(bus, 1 / frame_rate_fps(framerate));
+    }
+
+    return std::max(readout, bus);
+}
+
+void FFMVSimCamera::limits(dc1394feature_t id, float *min, float *max)
+{
+    dc1394feature_info_t *rate = feature(DC1394_FEATURE_FRAME_RATE);
+    dc1394feature_info_t *f = feature(id);
+
+    if (id == DC1394_FEATURE_SHUTTER) {
+        *min = MIN_SHUTTER;
+        *max = rate->is_on ? 1 / rate->abs_value : EXTENDED_SHUTTER;
+    } else if (id == DC1394_FEATURE_FRAME_RATE) {
+        *min = MIN_FRAME_RATE;
+        *max = 1 / minPeriod();
+    } else {
+        *min = f->abs_min;
+        *max = f->abs_max;
+    }
+}
+
+/**
+ * Time from one frame to the next. With frame rate control on the camera
+ * runs at that rate; with it off the shutter sets the pace, so subs longer
+ * than a frame at the slowest rate can be taken.
+ */
+double FFMVSimCamera::period()
+{
+    dc1394feature_info_t *rate = feature(DC1394_FEATURE_FRAME_RATE);
+    dc1394feature_info_t *shutter = feature(DC1394_FEATURE_SHUTTER);
+    double p = minPeriod();
+
+    if (rate->is_on) {
+        return std::max(p, 1.0 / rate->abs_value);
+    }
+
+    return std::max(p, (double) shutter->abs_value);
+}
+
+/**
+ * Overall gain relative to the defaults: the camera's gain register, the
+ * sensor's tiled digital gain (4 is 1x) and its ADC reference, which is
+ * 1.0V plus 0.1V a step, 1.4V by default.
+ */
+float FFMVSimCamera::gain()
+{
+    float g = (regs[GAIN_REG] & 0xFFF) / (float) GAIN_UNITY;
+
+    g *= (sensor[SENSOR_DIGITAL_GAIN] & 0xF) / 4.0f;
+    g *= 1.4f / (1.0f + 0.1f * (sensor[SENSOR_VREF] & 0x7));
+
+    return g;
+}
+
+dc1394error_t FFMVSimCamera::setVideoMode(dc1394video_mode_t mode)
+{
+    if (mode != DC1394_VIDEO_MODE_FORMAT7_0 && mode != DC1394_VIDEO_MODE_640x480_MONO8 &&
+            mode != DC1394_VIDEO_MODE_640x480_MONO16) {
+        return DC1394_INVALID_VIDEO_MODE;
+    }
+    pthread_mutex_lock(&lock);
+    video_mode = mode;
+    pthread_mutex_unlock(&lock);
+
+    return DC1394_SUCCESS;
+}
+
+dc1394error_t FFMVSimCamera::getVideoMode(dc1394video_mode_t *mode)
+{
+    pthread_mutex_lock(&lock);
+    *mode = video_mode;
+    pthread_mutex_unlock(&lock);
+
+    return DC1394_SUCCESS;
+}
+
+dc1394error_t FFMVSimCamera::setFramerate(dc1394framerate_t rate)
+{
+    if (rate < DC1394_FRAMERATE_1_875 || rate > DC1394_FRAMERATE_60) {
+        return DC1394_INVALID_FRAMERATE;
+    }
+    pthread_mutex_lock(&lock);
+    framerate = rate;
+    pthread_mutex_unlock(&lock);
+
+    return DC1394_SUCCESS;
+}
+
+dc1394error_t FFMVSimCamera::getFramerate(dc1394framerate_t *rate)
+{
+    pthread_mutex_lock(&lock);
+    *rate = framerate;
+    pthread_mutex_unlock(&lock);
+
+    return DC1394_SUCCESS;
+}
+
+dc1394error_t FFMVSimCamera::getMaxImageSize(dc1394video_mode_t mode, uint32_t *width, uint32_t *height)
+{
+    if (mode != DC1394_VIDEO_MODE_FORMAT7_0) {
+        return DC1394_INVALID_VIDEO_MODE;
+    }
+    *width = sensor_width;
+    *height = sensor_height;
+
+    return DC1394_SUCCESS;
+}
+
+dc1394error_t FFMVSimCamera::getUnitSize(dc1394video_mode_t mode, uint32_t *width, uint32_t *height)
+{
+    if (mode != DC1394_VIDEO_MODE_FORMAT7_0) {
+        return DC1394_INVALID_VIDEO_MODE;
+    }
+    *width = UNIT_WIDTH;
+    *height = UNIT_HEIGHT;
+
+    return DC1394_SUCCESS;
+}
+
+dc1394error_t FFMVSimCamera::getUnitPosition(dc1394video_mode_t mode, uint32_t *left, uint32_t *top)
+{
+    if (mode != DC1394_VIDEO_MODE_FORMAT7_0) {
+        return DC1394_INVALID_VIDEO_MODE;
+    }
+    *left = UNIT_LEFT;
+    *top = UNIT_TOP;
+
+    return DC1394_SUCCESS;
+}
+
+/**
+ * Set the Format7 window. Like the camera, the window must be on the unit
+ * grid; the packet size is always the largest, whatever is asked for.
+ */
+dc1394error_t FFMVSimCamera::setROI(dc1394video_mode_t mode, dc1394color_coding_t coding, int32_t packet,
+        int32_t left, int32_t top, int32_t width, int32_t height)
+{
+    dc1394error_t err = DC1394_SUCCESS;
+
+    if (mode != DC1394_VIDEO_MODE_FORMAT7_0) {
+        return DC1394_INVALID_VIDEO_MODE;
+    }
+    if (coding != DC1394_COLOR_CODING_MONO8 && coding != DC1394_COLOR_CODING_MONO16) {
+        return DC1394_INVALID_COLOR_CODING;
+    }
+
+    pthread_mutex_lock(&lock);
+    left = left < 0 ? roi_left : left;
+    top = top < 0 ? roi_top : top;
+    if (width == DC1394_USE_MAX_AVAIL) {
+        width = sensor_width - left;
+    } else if (width < 0) {
+        width = roi_width;
+    }
+    if (height == DC1394_USE_MAX_AVAIL) {
+        height = sensor_height - top;
+    } else if (height < 0) {
+        height = roi_height;
+    }
+    if (left % UNIT_LEFT || top % UNIT_TOP || width % UNIT_WIDTH || height % UNIT_HEIGHT ||
+            !width || !height || left + width > sensor_width || top + height > sensor_height) {
+        err = DC1394_INVALID_ARGUMENT_VALUE;
+    } else {
+        this->coding = coding;
+        roi_left = left;
+        roi_top = top;
+        roi_width = width;
+        roi_height = height;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return err;
+}
+
+dc1394error_t FFMVSimCamera::getROI(dc1394video_mode_t mode, dc1394color_coding_t *coding, uint32_t *packet,
+        uint32_t *left, uint32_t *top, uint32_t *width, uint32_t *height)
+{
+    if (mode != DC1394_VIDEO_MODE_FORMAT7_0) {
+        return DC1394_INVALID_VIDEO_MODE;
+    }
+
+    pthread_mutex_lock(&lock);
+    *coding = this->coding;
+    *packet = MAX_PACKET;
+    *left = roi_left;
+    *top = roi_top;
+    *width = roi_width;
+    *height = roi_height;
+    pthread_mutex_unlock(&lock);
+
+    return DC1394_SUCCESS;
+}
+
+dc1394error_t FFMVSimCamera::getFeature(dc1394feature_info_t *info)
+{
+    dc1394feature_info_t *f;
+
+    pthread_mutex_lock(&lock);
+    f = feature(info->id);
+    if (!f) {
+        pthread_mutex_unlock(&lock);
+        return DC1394_FEATURE_NOT_AVAILABLE;
+    }
+    *info = *f;
+    if (f->absolute_capable) {
+        limits(f->id, &info->abs_min, &info->abs_max);
+        info->abs_value = std::min(std::max(info->abs_value, info->abs_min), info->abs_max);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return DC1394_SUCCESS;
+}
+
+dc1394error_t FFMVSimCamera::setFeaturePower(dc1394feature_t id, dc1394switch_t on)
+{
+    dc1394feature_info_t *f;
+
+    pthread_mutex_lock(&lock);
+    f = feature(id);
+    if (f) {
+        f->is_on = on;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return f ? DC1394_SUCCESS : DC1394_FEATURE_NOT_AVAILABLE;
+}
+
+dc1394error_t FFMVSimCamera::setFeatureMode(dc1394feature_t id, dc1394feature_mode_t mode)
+{
+    dc1394feature_info_t *f;
+
+    pthread_mutex_lock(&lock);
+    f = feature(id);
+    if (f) {
+        f->current_mode = mode;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return f ? DC1394_SUCCESS : DC1394_FEATURE_NOT_AVAILABLE;
+}
+
+dc1394error_t FFMVSimCamera::setAbsoluteControl(dc1394feature_t id, dc1394switch_t on)
+{
+    dc1394feature_info_t *f;
+
+    pthread_mutex_lock(&lock);
+    f = feature(id);
+    if (f && f->absolute_capable) {
+        f->abs_control = on;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return f && f->absolute_capable ? DC1394_SUCCESS : DC1394_FEATURE_NOT_AVAILABLE;
+}
+
+dc1394error_t FFMVSimCamera::getAbsoluteBoundaries(dc1394feature_t id, float *min, float *max)
+{
+    dc1394feature_info_t *f;
+
+    pthread_mutex_lock(&lock);
+    f = feature(id);
+    if (f && f->absolute_capable) {
+        limits(id, min, max);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return f && f->absolute_capable ? DC1394_SUCCESS : DC1394_FEATURE_NOT_AVAILABLE;
+}
+
+/**
+ * Values outside the feature's current limits are clamped to them, as the
+ * camera does.
+ */
+dc1394error_t FFMVSimCamera::setAbsoluteValue(dc1394feature_t id, float value)
+{
+    dc1394feature_info_t *f;
+    float min, max;
+
+    pthread_mutex_lock(&lock);
+    f = feature(id);
+    if (f && f->absolute_capable) {
+        limits(id, &min, &max);
+        f->abs_value = std::min(std::max(value, min), max);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return f && f->absolute_capable ? DC1394_SUCCESS : DC1394_FEATURE_NOT_AVAILABLE;
+}
+
+dc1394error_t FFMVSimCamera::getAbsoluteValue(dc1394feature_t id, float *value)
+{
+    dc1394feature_info_t *f;
+    float min, max;
+
+    pthread_mutex_lock(&lock);
+    f = feature(id);
+    if (f && f->absolute_capable) {
+        limits(id, &min, &max);
+        *value = std::min(std::max(f->abs_value, min), max);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return f && f->absolute_capable ? DC1394_SUCCESS : DC1394_FEATURE_NOT_AVAILABLE;
+}
+
+/**
+ * Camera registers hold whatever is written to them. Writing SENSOR_ADDR
+ * selects an MT9V022 register, which SENSOR_DATA then reads and writes.
+ */
+dc1394error_t FFMVSimCamera::setControlRegister(uint64_t offset, uint32_t value)
+{
+    pthread_mutex_lock(&lock);
+    if (offset == SENSOR_ADDR) {
+        sensor_addr = value & 0xFF;
+    } else if (offset == SENSOR_DATA) {
+        sensor[sensor_addr] = value & 0xFFFF;
+    } else {
+        regs[offset] = value;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return DC1394_SUCCESS;
+}
+
+dc1394error_t FFMVSimCamera::getControlRegister(uint64_t offset, uint32_t *value)
+{
+    pthread_mutex_lock(&lock);
+    if (offset == SENSOR_ADDR) {
+        *value = sensor_addr;
+    } else if (offset == SENSOR_DATA) {
+        *value = sensor[sensor_addr];
+    } else {
+        *value = regs[offset];
+    }
+    pthread_mutex_unlock(&lock);
+
+    return DC1394_SUCCESS;
+}
+
+/**
+ * Allocate a ring of buffers frames for the current window. As with the
+ * DMA ring, a change of window only takes effect at the next setup.
+ */
+dc1394error_t FFMVSimCamera::captureSetup(uint32_t buffers, uint32_t flags)
+{
+    dc1394video_frame_t *f;
+    int left, top, width, height;
+    bool mono16;
+    size_t bytes;
+    uint32_t i;
+
+    pthread_mutex_lock(&lock);
+    if (!frames.empty()) {
+        pthread_mutex_unlock(&lock);
+        return DC1394_CAPTURE_IS_RUNNING;
+    }
+    if (!buffers || pipe(wake_fd) < 0) {
+        pthread_mutex_unlock(&lock);
+        return DC1394_FAILURE;
+    }
+    fcntl(wake_fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_fd[1], F_SETFL, O_NONBLOCK);
+
+    frameSize(&left, &top, &width, &height, &mono16);
+    bytes = (size_t) width * height * (mono16 ? 2 : 1);
+    frames.resize(buffers);
+    for (i = 0; i < buffers; ++i) {
+        f = &frames[i];
+        memset(f, 0, sizeof(*f));
+        f->image = (unsigned char *) malloc(bytes);
+        f->size[0] = width;
+        f->size[1] = height;
+        f->position[0] = left;
+        f->position[1] = top;
+        f->color_coding = mono16 ? DC1394_COLOR_CODING_MONO16 : DC1394_COLOR_CODING_MONO8;
+        f->data_depth = mono16 ? 16 : 8;
+        f->stride = width * (mono16 ? 2 : 1);
+        f->video_mode = video_mode;
+        f->image_bytes = bytes;
+        f->total_bytes = bytes;
+        f->allocated_image_bytes = bytes;
+        f->packet_size = MAX_PACKET;
+        f->packets_per_frame = (bytes + MAX_PACKET - 1) / MAX_PACKET;
+        f->id = i;
+        f->little_endian = DC1394_FALSE;
+        free_frames.push_back(f);
+    }
+    filled.clear();
+    pthread_mutex_unlock(&lock);
+
+    return DC1394_SUCCESS;
+}
+
+dc1394error_t FFMVSimCamera::captureStop()
+{
+    size_t i;
+
+    stopTransmission();
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < frames.size(); ++i) {
+        free(frames[i].image);
+    }
+    frames.clear();
+    free_frames.clear();
+    filled.clear();
+    if (wake_fd[0] >= 0) {
+        close(wake_fd[0]);
+        close(wake_fd[1]);
+        wake_fd[0] = wake_fd[1] = -1;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return DC1394_SUCCESS;
+}
+
+int FFMVSimCamera::captureFileno()
+{
+    return wake_fd[0];
+}
+
+dc1394error_t FFMVSimCamera::dequeue(dc1394capture_policy_t policy, dc1394video_frame_t **frame)
+{
+    char c;
+
+    *frame = NULL;
+    pthread_mutex_lock(&lock);
+    if (frames.empty()) {
+        pthread_mutex_unlock(&lock);
+        return DC1394_CAPTURE_IS_NOT_SET;
+    }
+    while (policy == DC1394_CAPTURE_POLICY_WAIT && filled.empty() && transmitting) {
+        pthread_cond_wait(&cond, &lock);
+    }
+    if (!filled.empty()) {
+        *frame = filled.front();
+        filled.pop_front();
+        (*frame)->frames_behind = filled.size();
+        if (read(wake_fd[0], &c, 1) < 0) {
+            /* Every frame wrote a byte */
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return DC1394_SUCCESS;
+}
+
+dc1394error_t FFMVSimCamera::enqueue(dc1394video_frame_t *frame)
+{
+    pthread_mutex_lock(&lock);
+    free_frames.push_back(frame);
+    pthread_mutex_unlock(&lock);
+
+    return DC1394_SUCCESS;
+}
+
+bool FFMVSimCamera::isFrameCorrupt(dc1394video_frame_t *frame)
+{
+    return false;
+}
+
+unsigned long FFMVSimCamera::getLost()
+{
+    unsigned long n;
+
+    pthread_mutex_lock(&lock);
+    n = lost;
+    pthread_mutex_unlock(&lock);
+
+    return n;
+}
+
+dc1394error_t FFMVSimCamera::setTransmission(dc1394switch_t on)
+{
+    if (!on) {
+        stopTransmission();
+        return DC1394_SUCCESS;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (!transmitting) {
+        transmitting = true;
+        if (pthread_create(&thread, NULL, threadEntry, this)) {
+            transmitting = false;
+            pthread_mutex_unlock(&lock);
+            return DC1394_FAILURE;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return DC1394_SUCCESS;
+}
+
+void FFMVSimCamera::stopTransmission()
+{
+    pthread_mutex_lock(&lock);
+    if (!transmitting) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    transmitting = false;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+
+    pthread_join(thread, NULL);
+}
+
+void *FFMVSimCamera::threadEntry(void *arg)
+{
+    ((FFMVSimCamera *) arg)->run();
+    return NULL;
+}
+
+/**
+ * The camera's frame clock. Frame n ends at n + 1 periods after
+ * transmission went on; a deadline is never moved by how long the last
+ * frame took to render. If rendering falls more than a period behind, the
+ * frames it missed are counted lost, as a camera that can't get a frame out
+ * would lose them, and their numbers are skipped so that what is rendered
+ * still depends only on when. Frames are stamped with the wall clock time
+ * their exposure ended, as the camera's cycle timer would, not when the
+ * render happened to finish.
+ */
+void FFMVSimCamera::run()
+{
+    dc1394video_frame_t *frame;
+    Exposure e;
+    struct timespec ts;
+    struct timeval tv;
+    int64_t t0, next, now, p, behind, wall;
+    uint64_t n = 0;
+
+    pthread_mutex_lock(&lock);
+    t0 = next = ffmv_time_us();
+    gettimeofday(&tv, NULL);
+    wall = (int64_t) tv.tv_sec * 1000000 + tv.tv_usec - t0;
+    while (transmitting) {
+        p = (int64_t) (period() * 1000000);
+        next += p;
+        ts.tv_sec = next / 1000000;
+        ts.tv_nsec = next % 1000000 * 1000;
+        while (transmitting && pthread_cond_timedwait(&cond, &lock, &ts) != ETIMEDOUT) {
+        }
+        if (!transmitting) {
+            break;
+        }
+
+        now = ffmv_time_us();
+        behind = (now - next) / p;
+        if (behind > 0) {
+            n += behind;
+            lost += behind;
+            next += behind * p;
+        }
+        if (free_frames.empty()) {
+            ++n;
+            ++lost;
+            continue;
+        }
+        frame = free_frames.front();
+        free_frames.pop_front();
+
+        e.n = n++;
+        e.t = (next - t0) / 1000000.0;
+        e.left = frame->position[0];
+        e.top = frame->position[1];
+        e.width = frame->size[0];
+        e.height = frame->size[1];
+        e.mono16 = frame->color_coding == DC1394_COLOR_CODING_MONO16;
+        e.shutter = std::min((double) feature(DC1394_FEATURE_SHUTTER)->abs_value, p / 1000000.0);
+        e.gain = gain();
+        pthread_mutex_unlock(&lock);
+
+        render(e, frame->image);
+
+        pthread_mutex_lock(&lock);
+        frame->timestamp = next + wall;
+        filled.push_back(frame);
+        if (write(wake_fd[1], "", 1) < 0) {
+            /* The pipe holds more than any ring */
+        }
+        pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Sky and bias, then each star as a Gaussian, then read and shot noise.
+ * The frame's drift, seeing jitter and noise come from its own seed.
+ */
+void FFMVSimCamera::render(const Exposure &e, uint8_t *out)
+{
+    size_t npix = (size_t) e.width * e.height;
+    uint64_t state = params.seed ^ (e.n * 0x9e3779b97f4a7c15ULL);
+    float gx[64], gy[64];
+    float dx, dy, fwhm, sigma, amp, cx, cy, v;
+    float read2 = params.read_noise * params.read_noise;
+    int r, x0, x1, y0, y1, x, y;
+    uint32_t rnd;
+    size_t i, j;
+
+    scratch.assign(npix, params.bias + params.sky * e.shutter * e.gain);
+
+    dx = params.drift_x * e.t + params.seeing * gaussian(&state);
+    dy = params.drift_y * e.t + params.seeing * gaussian(&state);
+    fwhm = std::max(0.8, params.fwhm * (1 + 0.1 * gaussian(&state)));
+    sigma = fwhm / 2.3548f;
+    r = std::min(31, (int) ceil(3 * sigma));
+
+    for (i = 0; i < field.size(); ++i) {
+        cx = field[i].x + dx - e.left;
+        cy = field[i].y + dy - e.top;
+        x0 = std::max(0, (int) cx - r);
+        x1 = std::min(e.width - 1, (int) cx + r);
+        y0 = std::max(0, (int) cy - r);
+        y1 = std::min(e.height - 1, (int) cy + r);
+        if (x0 > x1 || y0 > y1) {
+            continue;
+        }
+        amp = field[i].flux * e.shutter * e.gain / (2 * M_PI * sigma * sigma);
+        for (x = x0; x <= x1; ++x) {
+            gx[x - x0] = expf(-(x - cx) * (x - cx) / (2 * sigma * sigma));
+        }
+        for (y = y0; y <= y1; ++y) {
+            gy[y - y0] = amp * expf(-(y - cy) * (y - cy) / (2 * sigma * sigma));
+        }
+        for (y = y0; y <= y1; ++y) {
+            j = (size_t) y * e.width;
+            for (x = x0; x <= x1; ++x) {
+                scratch[j + x] += gy[y - y0] * gx[x - x0];
+            }
+        }
+    }
+
+    rnd = (uint32_t) splitmix(&state) | 1;
+    for (i = 0; i < npix; ++i) {
+        rnd ^= rnd << 13;
+        rnd ^= rnd >> 17;
+        rnd ^= rnd << 5;
+        v = scratch[i];
+        scratch[i] = v + sqrtf(read2 + std::max(v - params.bias, 0.0f)) * noise[rnd % NOISE_TABLE];
+    }
+
+    store(&scratch[0], npix, e.mono16, out);
+}
+
+/**
+ * Quantise 10 bit values as the camera sends them: MONO16 MSB aligned and
+ * big-endian, MONO8 the top 8 bits.
+ */
+void FFMVSimCamera::store(const float *v, size_t n, bool mono16, uint8_t *out)
+{
+    float f;
+    uint16_t adu;
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        f = std::min(std::max(v[i] + 0.5f, 0.0f), ADU_MAX);
+        adu = (uint16_t) f;
+        if (mono16) {
+            adu <<= 6;
+            out[2 * i] = adu >> 8;
+            out[2 * i + 1] = adu & 0xFF;
+        } else {
+            out[i] = adu >> 2;
+        }
+    }
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+FFMVReplayCamera::FFMVReplayCamera(const FFMVSimParams &params) : FFMVSimCamera(params)
+{
+    guid = REPLAY_GUID;
+    map = NULL;
+    map_size = 0;
+    data = NULL;
+    src_width = src_height = 0;
+    count = 0;
+    depth = 8;
+    little_endian = false;
+}
+
+FFMVReplayCamera::~FFMVReplayCamera()
+{
+    /* The frame thread reads the mapping */
+    captureStop();
+    if (map) {
+        munmap((void *) map, map_size);
+    }
+}
+
+/**
+ * Map a monochrome SER file and make the sensor its size.
+ */
+bool FFMVReplayCamera::open(const char *path)
+{
+    struct stat st;
+    const uint8_t *h;
+    void *addr;
+    uint32_t width, height, frames;
+    uint64_t frame_bytes;
+    int fd;
+
+    fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    /* The whole file is mapped, so it has to fit in the address space */
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) SER_HEADER_BYTES ||
+            (uint64_t) st.st_size > SIZE_MAX) {
+        ::close(fd);
+        return false;
+    }
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+    h = (const uint8_t *) addr;
+    width = get32(h + 26);
+    height = get32(h + 30);
+    depth = get32(h + 34);
+    frames = get32(h + 38);
+    /* Colour ID 0 is monochrome. The size is bounded before it is used, and
+     * worked out in 64 bits, so a bad header can't make it wrap. */
+    frame_bytes = 0;
+    if (width <= REPLAY_MAX_SIZE && height <= REPLAY_MAX_SIZE) {
+        frame_bytes = (uint64_t) width * height * (depth > 8 ? 2 : 1);
+    }
+    if (memcmp(h, "LUCAM-RECORDER", 14) || get32(h + 18) != 0 || depth < 8 || depth > 16 ||
+            width < UNIT_WIDTH || height < UNIT_HEIGHT || !frame_bytes || !frames ||
+            (uint64_t) st.st_size - SER_HEADER_BYTES < (uint64_t) frames * frame_bytes) {
+        munmap(addr, st.st_size);
+        return false;
+    }
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+
+    if (map) {
+        captureStop();
+        munmap((void *) map, map_size);
+    }
+    map = h;
+    map_size = st.st_size;
+    data = h + SER_HEADER_BYTES;
+    count = frames;
+    little_endian = get32(h + 22) != 0;
+    /* Keep the window on the unit grid */
+    sensor_width = width - width % UNIT_WIDTH;
+    sensor_height = height - height % UNIT_HEIGHT;
+    src_width = width;
+    src_height = height;
+    reset();
+
+    return true;
+}
+
+/**
+ * Cut the window out of recorded frame n, converting to the pixel format
+ * the camera is set to.
+ */
+void FFMVReplayCamera::render(const Exposure &e, uint8_t *out)
+{
+    size_t bpp = depth > 8 ? 2 : 1;
+    size_t stride = (size_t) src_width * bpp;
+    const uint8_t *frame = data + (e.n % count) * stride * src_height;
+    const uint8_t *src;
+    uint8_t *dst;
+    /* Offsets of the big-endian high and low bytes of a 16 bit sample */
+    int hi = little_endian ? 1 : 0;
+    int lo = 1 - hi;
+    int x, y;
+
+    for (y = 0; y < e.height; ++y) {
+        src = frame + (e.top + y) * stride + e.left * bpp;
+        dst = out + (size_t) y * e.width * (e.mono16 ? 2 : 1);
+        if (bpp == 2 && e.mono16) {
+            if (!little_endian) {
+                memcpy(dst, src, e.width * 2);
+                continue;
+            }
+            for (x = 0; x < e.width; ++x) {
+                dst[2 * x] = src[2 * x + hi];
+                dst[2 * x + 1] = src[2 * x + lo];
+            }
+        } else if (bpp == 2) {
+            for (x = 0; x < e.width; ++x) {
+                dst[x] = src[2 * x + hi];
+            }
+        } else if (e.mono16) {
+            for (x = 0; x < e.width; ++x) {
+                dst[2 * x] = src[x];
+                dst[2 * x + 1] = 0;
+            }
+        } else {
+            memcpy(dst, src, e.width);
+        }
+    }
+}
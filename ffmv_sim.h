@@ -0,0 +1,208 @@
+/**
+ * Simulated and replayed cameras for the Point Grey FireFly MV driver.
+ *
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef FFMV_SIM_H
+#define FFMV_SIM_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <vector>
+
+#include "ffmv_camera.h"
+
+struct FFMVSimParams {
+    /* Stars in the field and their width in pixels; the seeing moves them
+     * by this rms each frame */
+    int stars;
+    float fwhm;
+    float seeing;
+    /* Brightest star and sky, in ADU per second at the default gain */
+    float star_flux;
+    float sky;
+    /* Read noise and the black level, in 10 bit ADU */
+    float read_noise;
+    float bias;
+    /* Tracking error, in pixels per second */
+    float drift_x;
+    float drift_y;
+    /* The field and every frame's noise follow from this */
+    uint32_t seed;
+};
+
+/* Reasonable defaults for a bright field */
+void ffmv_sim_defaults(FFMVSimParams *params);
+
+/**
+ * A FireFly MV that isn't there: an MT9V022 behind a 1394 interface, with
+ * the video modes, features and registers the driver uses, including the
+ * sensor window at 0x1A00/0x1A04, and the gain they set applied to the
+ * frames.
+ *
+ * Once transmission is on, a thread of the camera's own exposes frames at
+ * the period the shutter, frame rate and ROI give a real camera, rendering
+ * a star field with noise into the capture ring. As with the DMA ring, a
+ * frame that finds the ring full is lost, and the capture file descriptor
+ * is readable while frames are waiting. Frames carry wall clock timestamps.
+ *
+ * What is rendered depends only on the parameters, the settings and the
+ * frame's number since transmission started, so a run can be repeated
+ * exactly; only the timing is the machine's.
+ */
+class FFMVSimCamera : public FFMVCamera
+{
+public:
+    explicit FFMVSimCamera(const FFMVSimParams &params);
+    ~FFMVSimCamera();
+
+    uint64_t getGuid() const { return guid; }
+    dc1394error_t reset();
+
+    dc1394error_t setVideoMode(dc1394video_mode_t mode);
+    dc1394error_t getVideoMode(dc1394video_mode_t *mode);
+    dc1394error_t setFramerate(dc1394framerate_t rate);
+    dc1394error_t getFramerate(dc1394framerate_t *rate);
+    dc1394error_t setTransmission(dc1394switch_t on);
+
+    dc1394error_t getMaxImageSize(dc1394video_mode_t mode, uint32_t *width, uint32_t *height);
+    dc1394error_t getUnitSize(dc1394video_mode_t mode, uint32_t *width, uint32_t *height);
+    dc1394error_t getUnitPosition(dc1394video_mode_t mode, uint32_t *left, uint32_t *top);
+    dc1394error_t setROI(dc1394video_mode_t mode, dc1394color_coding_t coding, int32_t packet,
+            int32_t left, int32_t top, int32_t width, int32_t height);
+    dc1394error_t getROI(dc1394video_mode_t mode, dc1394color_coding_t *coding, uint32_t *packet,
+            uint32_t *left, uint32_t *top, uint32_t *width, uint32_t *height);
+
+    dc1394error_t getFeature(dc1394feature_info_t *feature);
+    dc1394error_t setFeaturePower(dc1394feature_t id, dc1394switch_t on);
+    dc1394error_t setFeatureMode(dc1394feature_t id, dc1394feature_mode_t mode);
+    dc1394error_t setAbsoluteControl(dc1394feature_t id, dc1394switch_t on);
+    dc1394error_t getAbsoluteBoundaries(dc1394feature_t id, float *min, float *max);
+    dc1394error_t setAbsoluteValue(dc1394feature_t id, float value);
+    dc1394error_t getAbsoluteValue(dc1394feature_t id, float *value);
+
+    dc1394error_t setControlRegister(uint64_t offset, uint32_t value);
+    dc1394error_t getControlRegister(uint64_t offset, uint32_t *value);
+
+    dc1394error_t captureSetup(uint32_t buffers, uint32_t flags);
+    dc1394error_t captureStop();
+    int captureFileno();
+    dc1394error_t dequeue(dc1394capture_policy_t policy, dc1394video_frame_t **frame);
+    dc1394error_t enqueue(dc1394video_frame_t *frame);
+    bool isFrameCorrupt(dc1394video_frame_t *frame);
+
+    /* Frames the camera exposed that found the ring full */
+    unsigned long getLost();
+
+protected:
+    /* What a frame is exposed with, taken when its exposure starts */
+    struct Exposure {
+        uint64_t n;
+        double t;
+        int left, top, width, height;
+        bool mono16;
+        float shutter;
+        float gain;
+    };
+
+    /* Fill out with frame e.n, in the camera's byte order */
+    virtual void render(const Exposure &e, uint8_t *out);
+    static void store(const float *v, size_t n, bool mono16, uint8_t *out);
+
+    uint64_t guid;
+    int sensor_width, sensor_height;
+
+private:
+    struct Star {
+        float x, y, flux;
+    };
+
+    static void *threadEntry(void *arg);
+    void run();
+    void stopTransmission();
+    dc1394feature_info_t *feature(dc1394feature_t id);
+    void limits(dc1394feature_t id, float *min, float *max);
+    double minPeriod();
+    double period();
+    void frameSize(int *left, int *top, int *width, int *height, bool *mono16);
+    float gain();
+
+    FFMVSimParams params;
+    std::vector<Star> field;
+    std::vector<float> noise;
+    std::vector<float> scratch;
+
+    /* Guards everything below; the capture calls come from the capture
+     * thread, register writes from the control thread and the rest from
+     * the main loop */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    dc1394video_mode_t video_mode;
+    dc1394framerate_t framerate;
+    dc1394color_coding_t coding;
+    int roi_left, roi_top, roi_width, roi_height;
+    std::vector<dc1394feature_info_t> features;
+    std::map<uint64_t, uint32_t> regs;
+    std::map<uint32_t, uint32_t> sensor;
+    uint32_t sensor_addr;
+
+    /* The capture ring */
+    std::vector<dc1394video_frame_t> frames;
+    std::deque<dc1394video_frame_t *> free_frames;
+    std::deque<dc1394video_frame_t *> filled;
+    int wake_fd[2];
+    unsigned long lost;
+
+    pthread_t thread;
+    bool transmitting;
+};
+
+/**
+ * Plays back a SER file, such as the driver's own recordings, through the
+ * simulated camera. The sensor is the size of the recording and the ROI is
+ * cut out of it; frames loop, and come at whatever rate the camera is set
+ * to rather than the recorded one. The file is mapped rather than read, so
+ * a recording larger than memory plays as fast as the page cache allows.
+ */
+class FFMVReplayCamera : public FFMVSimCamera
+{
+public:
+    explicit FFMVReplayCamera(const FFMVSimParams &params);
+    ~FFMVReplayCamera();
+
+    bool open(const char *path);
+    int getFrameCount() const { return count; }
+
+protected:
+    void render(const Exposure &e, uint8_t *out);
+
+private:
+    const uint8_t *map;
+    size_t map_size;
+    const uint8_t *data;
+    /* Recorded frame size, which the sensor may be trimmed from */
+    int src_width, src_height;
+    int count;
+    int depth;
+    bool little_endian;
+};
+
+#endif // FFMV_SIM_H
@@ -0,0 +1,664 @@
+/**
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "ffmv_stack.h"
+
+/* Subs used to seed the per pixel statistics */
+const int STACK_SEED_SUBS = 3;
+
+FFMVStacker::FFMVStacker(FFMVWorkPool *pool)
+{
+    this->pool = pool;
+    format = FFMV_MONO16;
+    width = height = 0;
+    binx = biny = 1;
+    out_w = out_h = 0;
+    params.mode = FFMV_STACK_SUM;
+    params.kappa = 3;
+    params.output = FFMV_OUTPUT_NATIVE;
+    out = NULL;
+    src = stack_src = NULL;
+    nsubs = 0;
+    nbands = 1;
+    acc = wide = NULL;
+    wide_size = 0;
+    mean = spread = NULL;
+    count = NULL;
+    stat_size = 0;
+    rowsums = NULL;
+    rowsums_size = 0;
+    calrows = NULL;
+    calrows_size = 0;
+    memset(&calib, 0, sizeof(calib));
+    calibrate = false;
+    rejected = NULL;
+    rejected_size = 0;
+    registration = false;
+    shift_x = shift_y = 0;
+    shifted = NULL;
+    shifted_size = 0;
+    preview_factor = 0;
+    preview_w = preview_h = 0;
+    preview = NULL;
+    preview_size = 0;
+    hists = NULL;
+    hists_size = 0;
+    colsums = NULL;
+    colsums_size = 0;
+}
+
+FFMVStacker::~FFMVStacker()
+{
+    free(wide);
+    free(mean);
+    free(spread);
+    free(count);
+    free(rowsums);
+    free(calrows);
+    free(rejected);
+    free(preview);
+    free(hists);
+    free(colsums);
+    free(shifted);
+}
+
+/**
+ * Start a new stack of width x height subs, binned into out. calib may be
+ * NULL. The output is cleared here. Buffers are only reallocated when they
+ * need to grow.
+ */
+bool FFMVStacker::reset(enum ffmv_pixel_format fmt, int width, int height, int binx, int biny,
+        const FFMVStackParams &params, const FFMVCalibFrames *calib, void *out)
+{
+    size_t npix;
+
+    this->format = fmt;
+    this->width = width;
+    this->height = height;
+    this->binx = binx;
+    this->biny = biny;
+    this->params = params;
+    this->out = out;
+    out_w = width / binx;
+    out_h = height / biny;
+    npix = (size_t) out_w * out_h;
+    nsubs = 0;
+    shift_x = shift_y = 0;
+
+    nbands = pool->size() * 2;
+    if (nbands > out_h) {
+        nbands = out_h > 0 ? out_h : 1;
+    }
+
+    if ((size_t) out_w * nbands > rowsums_size) {
+        free(rowsums);
+        rowsums = (uint32_t *) malloc((size_t) out_w * nbands * sizeof(uint32_t));
+        rowsums_size = rowsums ? (size_t) out_w * nbands : 0;
+        if (!rowsums) {
+            return false;
+        }
+    }
+    if (nbands > rejected_size) {
+        free(rejected);
+        rejected = (unsigned long *) malloc(nbands * sizeof(unsigned long));
+        rejected_size = rejected ? nbands : 0;
+        if (!rejected) {
+            return false;
+        }
+    }
+    memset(rejected, 0, nbands * sizeof(unsigned long));
+
+    preview_w = preview_h = 0;
+    if (preview_factor > 0 && width / preview_factor && height / preview_factor) {
+        if ((size_t) (width / preview_factor) * (height / preview_factor) > preview_size) {
+            free(preview);
+            preview_size = (size_t) (width / preview_factor) * (height / preview_factor);
+            preview = (uint16_t *) malloc(preview_size * sizeof(uint16_t));
+            if (!preview) {
+                preview_size = 0;
+                return false;
+            }
+        }
+        if (nbands > hists_size) {
+            free(hists);
+            hists = (uint32_t *) malloc((size_t) nbands * FFMV_PREVIEW_BINS * sizeof(uint32_t));
+            hists_size = hists ? nbands : 0;
+            if (!hists) {
+                return false;
+            }
+        }
+        if ((size_t) width * nbands > colsums_size) {
+            free(colsums);
+            colsums = (uint32_t *) malloc((size_t) width * nbands * sizeof(uint32_t));
+            colsums_size = colsums ? (size_t) width * nbands : 0;
+            if (!colsums) {
+                return false;
+            }
+        }
+        preview_w = width / preview_factor;
+        preview_h = height / preview_factor;
+    }
+
+    calibrate = calib && (calib->dark || calib->flat);
+    if (calibrate) {
+        this->calib = *calib;
+        if ((size_t) width * nbands > calrows_size) {
+            free(calrows);
+            calrows = (float *) malloc((size_t) width * nbands * sizeof(float));
+            calrows_size = calrows ? (size_t) width * nbands : 0;
+            if (!calrows) {
+                return false;
+            }
+        }
+    }
+
+    if (registration && !calibrate &&
+            (size_t) width * height * ffmv_pixel_bytes(fmt) > shifted_size) {
+        free(shifted);
+        shifted_size = (size_t) width * height * ffmv_pixel_bytes(fmt);
+        shifted = (uint8_t *) malloc(shifted_size);
+        if (!shifted) {
+            shifted_size = 0;
+            return false;
+        }
+    }
+
+    if (params.mode != FFMV_STACK_SUM && npix > stat_size) {
+        free(mean);
+        free(spread);
+        free(count);
+        mean = (float *) malloc(npix * sizeof(float));
+        spread = (float *) malloc(npix * sizeof(float));
+        count = (uint32_t *) malloc(npix * sizeof(uint32_t));
+        if (!mean || !spread || !count) {
+            free(mean);
+            free(spread);
+            free(count);
+            mean = spread = NULL;
+            count = NULL;
+            stat_size = 0;
+            return false;
+        }
+        stat_size = npix;
+    }
+
+    acc = NULL;
+    if (params.mode == FFMV_STACK_SUM && params.output == FFMV_OUTPUT_U32) {
+        acc = (uint32_t *) out;
+    } else if (params.mode == FFMV_STACK_SUM && params.output == FFMV_OUTPUT_MEAN16) {
+        if (npix > wide_size) {
+            free(wide);
+            if (posix_memalign((void **) &wide, 32, npix * sizeof(uint32_t))) {
+                wide = NULL;
+                wide_size = 0;
+                return false;
+            }
+            wide_size = npix;
+        }
+        acc = wide;
+        memset(acc, 0, npix * sizeof(uint32_t));
+    }
+
+    memset(out, 0, npix * ffmv_output_bytes(fmt, params.output));
+
+    return true;
+}
+
+void FFMVStacker::bandRows(int band, int *y0, int *y1) const
+{
+    *y0 = (int) ((long) out_h * band / nbands);
+    *y1 = (int) ((long) out_h * (band + 1) / nbands);
+}
+
+void FFMVStacker::setShift(int dx, int dy)
+{
+    if (!registration || !width || !height) {
+        return;
+    }
+    shift_x = std::max(std::min(dx, width - 1), 1 - width);
+    shift_y = std::max(std::min(dy, height - 1), 1 - height);
+}
+
+/**
+ * Add one sub from the camera to the stack.
+ */
+void FFMVStacker::add(const void *src)
+{
+    this->src = src;
+    stack_src = (shift_x || shift_y) && !calibrate ? shifted : src;
+    pool->run(nbands, addBand, this);
+    ++nsubs;
+}
+
+void FFMVStacker::addBand(void *ctx, int band)
+{
+    FFMVStacker *s = (FFMVStacker *) ctx;
+    int y0, y1;
+
+    s->bandRows(band, &y0, &y1);
+    s->addRows(band, y0, y1);
+}
+
+/**
+ * Kappa-sigma test for one sample against the running mean. The variance is
+ * floored at the mean, i.e. roughly shot noise, so that flat regions with a
+ * very small scatter don't reject everything.
+ */
+static inline bool ffmv_is_outlier(float x, float mean, float m2, int n, float kappa)
+{
+    float var = n > 1 ? m2 / (n - 1) : 0;
+    float d = x - mean;
+
+    if (var < mean) {
+        var = mean;
+    }
+    return d * d > kappa * kappa * var;
+}
+
+static inline float ffmv_winsorize(float x, float mean, float m2, int n, float kappa)
+{
+    float var = n > 1 ? m2 / (n - 1) : 0;
+    float thr;
+
+    if (var < mean) {
+        var = mean;
+    }
+    thr = kappa * sqrtf(var);
+    if (x > mean + thr) {
+        return mean + thr;
+    }
+    if (x < mean - thr) {
+        return mean - thr;
+    }
+    return x;
+}
+
+static inline void ffmv_welford(float x, float *mean, float *m2, uint32_t *n)
+{
+    float delta;
+
+    ++*n;
+    delta = x - *mean;
+    *mean += delta / *n;
+    *m2 += delta * (x - *mean);
+}
+
+/**
+ * Calibrate the source rows that make up binned row y and bin them into
+ * rowsum.
+ */
+void FFMVStacker::calibBinRow(int band, uint32_t *rowsum, int y)
+{
+    float *row = calrows + (size_t) band * width;
+    size_t bpp = ffmv_pixel_bytes(format);
+    int n = out_w * binx;
+    int k, x, j, sy;
+    float sum;
+
+    memset(rowsum, 0, out_w * sizeof(uint32_t));
+    for (k = 0; k < biny; ++k) {
+        sy = y * biny + k;
+        if (shift_x || shift_y) {
+            /* Calibrate the whole sensor row the shifted row comes from,
+             * then shift it */
+            sy = std::max(std::min(sy + shift_y, height - 1), 0);
+            n = width;
+        }
+        ffmv_calib_row(format, row, (const uint8_t *) src + (size_t) sy * width * bpp,
+                calib.dark ? calib.dark + (size_t) sy * calib.dark_stride : NULL,
+                calib.flat ? calib.flat + (size_t) sy * calib.flat_stride : NULL, n);
+        if (shift_x > 0) {
+            memmove(row, row + shift_x, (width - shift_x) * sizeof(float));
+            for (x = width - shift_x; x < width; ++x) {
+                row[x] = row[width - shift_x - 1];
+            }
+        } else if (shift_x < 0) {
+            memmove(row - shift_x, row, (width + shift_x) * sizeof(float));
+            for (x = 0; x < -shift_x; ++x) {
+                row[x] = row[-shift_x];
+            }
+        }
+        if (binx == 1) {
+            for (x = 0; x < out_w; ++x) {
+                rowsum[x] += (uint32_t) (row[x] + 0.5f);
+            }
+            continue;
+        }
+        for (x = 0; x < out_w; ++x) {
+            sum = 0;
+            for (j = 0; j < binx; ++j) {
+                sum += row[x * binx + j];
+            }
+            rowsum[x] += (uint32_t) (sum + 0.5f);
+        }
+    }
+}
+
+/**
+ * Copy source rows y0 to y1 of the sub into the shifted frame.
+ */
+void FFMVStacker::shiftRows(int y0, int y1)
+{
+    size_t bpp = ffmv_pixel_bytes(format);
+    size_t stride = (size_t) width * bpp;
+    int dx = abs(shift_x);
+    const uint8_t *in, *edge;
+    uint8_t *o;
+    int y, x;
+
+    for (y = y0; y < y1; ++y) {
+        in = (const uint8_t *) src + std::max(std::min(y + shift_y, height - 1), 0) * stride;
+        o = shifted + y * stride;
+        if (shift_x >= 0) {
+            memcpy(o, in + dx * bpp, (width - dx) * bpp);
+            o += (width - dx) * bpp;
+            edge = in + stride - bpp;
+        } else {
+            memcpy(o + dx * bpp, in, (width - dx) * bpp);
+            edge = in;
+        }
+        for (x = 0; x < dx; ++x) {
+            memcpy(o + x * bpp, edge, bpp);
+        }
+    }
+}
+
+void FFMVStacker::addRows(int band, int y0, int y1)
+{
+    uint32_t *rowsum = rowsums + (size_t) band * out_w;
+    size_t bpp = ffmv_pixel_bytes(format);
+    const float kappa = params.kappa;
+    unsigned long nrejected = 0;
+    float a, b, c, x, d, step, sigma, tmp;
+    size_t i;
+    int y, xi;
+
+    /* The thumbnail reads the same rows first, so they are in cache for
+     * the stack */
+    if (preview_h) {
+        previewRows(band, y0, y1);
+    }
+    if (stack_src != src) {
+        shiftRows(y0 * biny, y1 * biny);
+    }
+
+    if (params.mode == FFMV_STACK_SUM && !calibrate && acc) {
+        ffmv_accum_frame32(format, acc + (size_t) y0 * out_w,
+                (const uint8_t *) stack_src + (size_t) y0 * biny * width * bpp,
+                width, (y1 - y0) * biny, binx, biny, rowsum);
+        return;
+    }
+    if (params.mode == FFMV_STACK_SUM && !calibrate) {
+        ffmv_accum_frame(format, (uint8_t *) out + (size_t) y0 * out_w * bpp,
+                (const uint8_t *) stack_src + (size_t) y0 * biny * width * bpp,
+                width, (y1 - y0) * biny, binx, biny, rowsum);
+        return;
+    }
+
+    for (y = y0; y < y1; ++y) {
+        i = (size_t) y * out_w;
+        if (calibrate) {
+            calibBinRow(band, rowsum, y);
+        } else {
+            ffmv_accum_bin_row(format, rowsum, stack_src, width, y, binx, biny);
+        }
+
+        if (params.mode == FFMV_STACK_SUM) {
+            if (acc) {
+                ffmv_accum_add_row32(acc + i, rowsum, out_w);
+            } else {
+                ffmv_accum_add_row(format, (uint8_t *) out + i * bpp, rowsum, out_w);
+            }
+            continue;
+        }
+
+        for (xi = 0; xi < out_w; ++xi, ++i) {
+            x = rowsum[xi];
+
+            /* The first two subs are just remembered */
+            if (nsubs == 0) {
+                mean[i] = x;
+                continue;
+            }
+            if (nsubs == 1) {
+                spread[i] = x;
+                continue;
+            }
+
+            if (nsubs == 2) {
+                /* Seed from the median of the first three samples */
+                a = mean[i];
+                b = spread[i];
+                c = x;
+                if (a > b) { tmp = a; a = b; b = tmp; }
+                if (b > c) { tmp = b; b = c; c = tmp; }
+                if (a > b) { tmp = a; a = b; b = tmp; }
+
+                if (params.mode == FFMV_STACK_MEDIAN) {
+                    mean[i] = b;
+                    spread[i] = (c - a) / 3;
+                    if (spread[i] < 0.5f) {
+                        spread[i] = 0.5f;
+                    }
+                    continue;
+                }
+
+                /* Keep the pair closest to the median; test the other one */
+                if (b - a > c - b) {
+                    tmp = a; a = c; c = tmp;
+                }
+                mean[i] = (a + b) / 2;
+                spread[i] = (b - a) * (b - a) / 2;
+                count[i] = 2;
+                x = c;
+            }
+
+            switch (params.mode) {
+                case FFMV_STACK_SIGMA_CLIP:
+                    if (ffmv_is_outlier(x, mean[i], spread[i], count[i], kappa)) {
+                        ++nrejected;
+                    } else {
+                        ffmv_welford(x, &mean[i], &spread[i], &count[i]);
+                    }
+                    break;
+                case FFMV_STACK_WINSOR:
+                    if (ffmv_is_outlier(x, mean[i], spread[i], count[i], kappa)) {
+                        ++nrejected;
+                        x = ffmv_winsorize(x, mean[i], spread[i], count[i], kappa);
+                    }
+                    ffmv_welford(x, &mean[i], &spread[i], &count[i]);
+                    break;
+                case FFMV_STACK_MEDIAN:
+                    /* Step toward the sample by a shrinking multiple of the
+                     * mean absolute deviation */
+                    d = x - mean[i];
+                    sigma = 1.2533f * spread[i];
+                    step = 2.5f * sigma / (nsubs + 1);
+                    if (d > step) {
+                        mean[i] += step;
+                    } else if (d < -step) {
+                        mean[i] -= step;
+                    } else {
+                        mean[i] += d;
+                    }
+                    spread[i] += (fabsf(d) - spread[i]) / (nsubs + 1);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    rejected[band] += nrejected;
+}
+
+/**
+ * Thumbnail the preview rows whose first source row falls in binned rows y0
+ * to y1, so that each preview row belongs to exactly one band. The last band
+ * also takes any rows below the binned frame.
+ */
+void FFMVStacker::previewRows(int band, int y0, int y1)
+{
+    uint32_t *hist = hists + (size_t) band * FFMV_PREVIEW_BINS;
+    int f = preview_factor;
+    int py0 = (y0 * biny + f - 1) / f;
+    int py1 = band == nbands - 1 ? preview_h : (y1 * biny + f - 1) / f;
+
+    memset(hist, 0, FFMV_PREVIEW_BINS * sizeof(uint32_t));
+    if (py1 > preview_h) {
+        py1 = preview_h;
+    }
+    if (py0 >= py1) {
+        return;
+    }
+    ffmv_preview_rows(format, preview + (size_t) py0 * preview_w, src, width, f, py0, py1, hist,
+            colsums + (size_t) band * width);
+}
+
+/**
+ * Stretch the thumbnail of the last sub to 8 bits in dst, which holds
+ * getPreviewWidth() x getPreviewHeight() bytes. Call it at most once per
+ * sub, as it sums the band histograms in place. Returns false if previews
+ * are off or no sub has been added yet.
+ */
+bool FFMVStacker::renderPreview(uint8_t *dst, FFMVStretch *st)
+{
+    size_t i, n = (size_t) preview_w * preview_h;
+    int band, b;
+
+    if (!preview_h || !nsubs) {
+        return false;
+    }
+
+    for (band = 1; band < nbands; ++band) {
+        for (b = 0; b < FFMV_PREVIEW_BINS; ++b) {
+            hists[b] += hists[(size_t) band * FFMV_PREVIEW_BINS + b];
+        }
+    }
+    ffmv_preview_stretch(hists, st);
+    ffmv_preview_lut(*st, lut);
+
+    for (i = 0; i < n; ++i) {
+        dst[i] = lut[preview[i]];
+    }
+
+    return true;
+}
+
+/**
+ * Write the stack to the output buffer. A no-op for sums, which are built
+ * in place, except for the mean of a 32 bit sum.
+ */
+void FFMVStacker::finish()
+{
+    if (!nsubs || (params.mode == FFMV_STACK_SUM && params.output != FFMV_OUTPUT_MEAN16)) {
+        return;
+    }
+    pool->run(nbands, finishBand, this);
+}
+
+void FFMVStacker::finishBand(void *ctx, int band)
+{
+    FFMVStacker *s = (FFMVStacker *) ctx;
+    int y0, y1;
+
+    s->bandRows(band, &y0, &y1);
+    if (s->params.mode == FFMV_STACK_SUM) {
+        s->finishSumRows(y0, y1);
+    } else {
+        s->finishRows(y0, y1);
+    }
+}
+
+/**
+ * Divide the 32 bit sum down to the 16 bit mean.
+ */
+void FFMVStacker::finishSumRows(int y0, int y1)
+{
+    size_t i = (size_t) y0 * out_w;
+    size_t end = (size_t) y1 * out_w;
+    /* A multiply instead of a divide per pixel */
+    double k = (format == FFMV_MONO8 ? 257.0 : 1.0) / nsubs;
+    double v;
+
+    for (; i < end; ++i) {
+        v = acc[i] * k + 0.5;
+        ((uint16_t *) out)[i] = v > 0xFFFF ? 0xFFFF : (uint16_t) v;
+    }
+}
+
+void FFMVStacker::finishRows(int y0, int y1)
+{
+    size_t i = (size_t) y0 * out_w;
+    size_t end = (size_t) y1 * out_w;
+    double max = format == FFMV_MONO8 ? ffmv_mono8::max : ffmv_mono16::max;
+    double scale = nsubs;
+    double v;
+
+    if (params.output == FFMV_OUTPUT_U32) {
+        max = 4294967295.0;
+    } else if (params.output == FFMV_OUTPUT_MEAN16) {
+        max = 0xFFFF;
+        scale = format == FFMV_MONO8 ? 257 : 1;
+    }
+
+    for (; i < end; ++i) {
+        if (nsubs >= STACK_SEED_SUBS) {
+            v = mean[i];
+        } else if (nsubs == 2) {
+            v = (mean[i] + spread[i]) / 2;
+        } else {
+            v = mean[i];
+        }
+
+        /* Scale to the brightness of a plain sum, or of one sub */
+        v = v * scale + 0.5;
+        if (v > max) {
+            v = max;
+        } else if (v < 0) {
+            v = 0;
+        }
+
+        if (params.output == FFMV_OUTPUT_U32) {
+            ((uint32_t *) out)[i] = (uint32_t) v;
+        } else if (params.output == FFMV_OUTPUT_MEAN16) {
+            ((uint16_t *) out)[i] = (uint16_t) v;
+        } else if (format == FFMV_MONO8) {
+            ((uint8_t *) out)[i] = (uint8_t) v;
+        } else {
+            ((uint16_t *) out)[i] = (uint16_t) v;
+        }
+    }
+}
+
+unsigned long FFMVStacker::getRejected() const
+{
+    unsigned long total = 0;
+    int i;
+
+    for (i = 0; i < nbands && i < rejected_size; ++i) {
+        total += rejected[i];
+    }
+
+    return total;
+}
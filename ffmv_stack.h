@@ -0,0 +1,189 @@
+/**
+ * Sub stacking for the Point Grey FireFly MV driver.
+ *
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef FFMV_STACK_H
+#define FFMV_STACK_H
+
+#include <stdint.h>
+
+#include "ffmv_accum.h"
+#include "ffmv_calib.h"
+#include "ffmv_preview.h"
+#include "ffmv_workpool.h"
+
+enum ffmv_stack_mode {
+    FFMV_STACK_SUM,
+    FFMV_STACK_SIGMA_CLIP,
+    FFMV_STACK_WINSOR,
+    FFMV_STACK_MEDIAN
+};
+
+/**
+ * What the finished stack holds. FFMV_OUTPUT_NATIVE is a sum in the camera's
+ * format, which clips once a few subs add up past its range.
+ * FFMV_OUTPUT_U32 is the same sum kept in 32 bits. FFMV_OUTPUT_MEAN16 is the
+ * 16 bit mean of the subs, so it keeps one sub's range however many there
+ * are; MONO8 means are scaled up to fill 16 bits.
+ */
+enum ffmv_stack_output {
+    FFMV_OUTPUT_NATIVE,
+    FFMV_OUTPUT_U32,
+    FFMV_OUTPUT_MEAN16
+};
+
+static inline int ffmv_output_bytes(enum ffmv_pixel_format fmt, enum ffmv_stack_output output)
+{
+    return output == FFMV_OUTPUT_U32 ? 4 : output == FFMV_OUTPUT_MEAN16 ? 2 : ffmv_pixel_bytes(fmt);
+}
+
+struct FFMVStackParams {
+    enum ffmv_stack_mode mode;
+    /* Rejection threshold in standard deviations */
+    float kappa;
+    enum ffmv_stack_output output;
+};
+
+/**
+ * Combines subs into one frame as they arrive.
+ *
+ * FFMV_STACK_SUM adds each sub straight into the output. The other modes keep
+ * a few running statistics per pixel (a mean or median estimate, a spread and
+ * a count) so memory does not grow with the number of subs:
+ *  - FFMV_STACK_SIGMA_CLIP drops samples more than kappa sigma from the
+ *    running mean,
+ *  - FFMV_STACK_WINSOR clamps them to kappa sigma instead,
+ *  - FFMV_STACK_MEDIAN tracks a stochastic estimate of the median.
+ * The first three subs seed the statistics from their median, so a single
+ * outlier among them does not poison the estimate. The result is scaled by
+ * the number of subs so that every mode has the same brightness as a sum.
+ *
+ * If calibration frames are given, each source row is dark subtracted and
+ * flat fielded into a one row scratch buffer on its way into the bin, so
+ * calibration adds no extra pass over the frame.
+ *
+ * Wide outputs sum into 32 bit accumulators: the output itself for
+ * FFMV_OUTPUT_U32, or a buffer kept across stacks for FFMV_OUTPUT_MEAN16.
+ *
+ * Each sub is split into row bands that are processed on a worker pool.
+ *
+ * With registration on, each sub can be shifted by a whole number of raw
+ * pixels on its way in, so stars that drifted during the exposure land on
+ * top of each other. Each band first copies its own rows of the sub,
+ * shifted, into a scratch frame; pixels shifted in from outside the frame
+ * repeat its edge. Calibrated subs are shifted as each row is calibrated
+ * instead, so the masters still line up with the sensor.
+ *
+ * With a preview factor set, each band also averages its share of the raw
+ * sub down into a thumbnail and counts it into a histogram while the rows
+ * are in cache, so renderPreview() only has to look up the stretched value
+ * of each thumbnail pixel.
+ */
+class FFMVStacker
+{
+public:
+    explicit FFMVStacker(FFMVWorkPool *pool);
+    ~FFMVStacker();
+
+    bool reset(enum ffmv_pixel_format fmt, int width, int height, int binx, int biny,
+            const FFMVStackParams &params, const FFMVCalibFrames *calib, void *out);
+    void add(const void *src);
+    void finish();
+
+    /* 0 turns previews off. Takes effect at the next reset(). */
+    void setPreview(int factor) { preview_factor = factor; }
+    int getPreviewWidth() const { return preview_w; }
+    int getPreviewHeight() const { return preview_h; }
+    bool renderPreview(uint8_t *dst, FFMVStretch *st);
+
+    /* Takes effect at the next reset() */
+    void setRegistration(bool on) { registration = on; }
+    /* Stack the sub's pixel (x + dx, y + dy) at (x, y), for the subs added
+     * from now until the next reset() */
+    void setShift(int dx, int dy);
+
+    int getSubs() const { return nsubs; }
+    unsigned long getRejected() const;
+
+private:
+    static void addBand(void *ctx, int band);
+    static void finishBand(void *ctx, int band);
+    void addRows(int band, int y0, int y1);
+    void finishRows(int y0, int y1);
+    void finishSumRows(int y0, int y1);
+    void bandRows(int band, int *y0, int *y1) const;
+    void previewRows(int band, int y0, int y1);
+    void calibBinRow(int band, uint32_t *rowsum, int y);
+    void shiftRows(int y0, int y1);
+
+    FFMVWorkPool *pool;
+
+    enum ffmv_pixel_format format;
+    int width, height;
+    int binx, biny;
+    int out_w, out_h;
+    FFMVStackParams params;
+    FFMVCalibFrames calib;
+    bool calibrate;
+    void *out;
+    const void *src;
+    /* What is stacked: src, or its shifted copy */
+    const void *stack_src;
+    int nsubs;
+    int nbands;
+
+    /* 32 bit sums for the wide outputs. Points into out for
+     * FFMV_OUTPUT_U32, and at wide otherwise. */
+    uint32_t *acc;
+    uint32_t *wide;
+    size_t wide_size;
+
+    /* Per pixel statistics, unused when summing */
+    float *mean;
+    float *spread;
+    uint32_t *count;
+    size_t stat_size;
+
+    /* Per band scratch */
+    uint32_t *rowsums;
+    size_t rowsums_size;
+    float *calrows;
+    size_t calrows_size;
+    unsigned long *rejected;
+    int rejected_size;
+
+    /* Registration shift, and the shifted copy of the sub */
+    bool registration;
+    int shift_x, shift_y;
+    uint8_t *shifted;
+    size_t shifted_size;
+
+    /* Thumbnail of the last sub, in histogram bins, and a histogram of it
+     * per band */
+    int preview_factor;
+    int preview_w, preview_h;
+    uint16_t *preview;
+    size_t preview_size;
+    uint32_t *hists;
+    int hists_size;
+    uint32_t *colsums;
+    size_t colsums_size;
+    uint8_t lut[FFMV_PREVIEW_BINS];
+};
+
+#endif // FFMV_STACK_H
@@ -0,0 +1,180 @@
+/**
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <math.h>
+#include <algorithm>
+
+#include "ffmv_star.h"
+
+/* Samples taken for the background estimate */
+const int BACKGROUND_SAMPLES = 16384;
+/* Centroiding passes, each recentred on the last */
+const int CENTROID_PASSES = 3;
+
+void ffmv_background(const FFMVImage &img, float *bg, float *sigma, std::vector<float> &scratch)
+{
+    size_t npix = (size_t) img.width * img.height;
+    size_t step, i, mid;
+    float med;
+
+    scratch.clear();
+    step = npix / BACKGROUND_SAMPLES;
+    /* An odd stride, so the grid doesn't line up with the columns */
+    step = step < 1 ? 1 : step | 1;
+    for (i = 0; i < npix; i += step) {
+        scratch.push_back(ffmv_image_pixel(img, i % img.width, i / img.width));
+    }
+    if (scratch.empty()) {
+        *bg = 0;
+        *sigma = 1;
+        return;
+    }
+
+    mid = scratch.size() / 2;
+    std::nth_element(scratch.begin(), scratch.begin() + mid, scratch.end());
+    med = scratch[mid];
+    for (i = 0; i < scratch.size(); ++i) {
+        scratch[i] = fabsf(scratch[i] - med);
+    }
+    std::nth_element(scratch.begin(), scratch.begin() + mid, scratch.end());
+
+    *bg = med;
+    /* Quantized, noiseless frames have no spread; keep the SNR finite */
+    *sigma = std::max(1.4826f * scratch[mid], 0.5f);
+}
+
+bool ffmv_centroid(const FFMVImage &img, int px, int py, int radius, float bg, float sigma,
+        FFMVStar *star)
+{
+    float cx = px, cy = py;
+    float thr = bg + 2 * sigma;
+    float v, w, sw, swx, swy, flux, peak;
+    int pass, x, y, x0, x1, y0, y1, n;
+    float r2 = (float) radius * radius;
+
+    for (pass = 0; pass < CENTROID_PASSES; ++pass) {
+        x0 = std::max((int) (cx - radius), 0);
+        x1 = std::min((int) (cx + radius + 1), img.width - 1);
+        y0 = std::max((int) (cy - radius), 0);
+        y1 = std::min((int) (cy + radius + 1), img.height - 1);
+
+        /* Only pixels clearly above the sky weigh in, so noise in the
+         * aperture does not drag the centroid toward its centre */
+        sw = swx = swy = 0;
+        flux = peak = 0;
+        n = 0;
+        for (y = y0; y <= y1; ++y) {
+            for (x = x0; x <= x1; ++x) {
+                if ((x - cx) * (x - cx) + (y - cy) * (y - cy) > r2) {
+                    continue;
+                }
+                v = ffmv_image_pixel(img, x, y);
+                flux += v - bg;
+                ++n;
+                if (v > peak) {
+                    peak = v;
+                }
+                w = v - thr;
+                if (w > 0) {
+                    sw += w;
+                    swx += w * x;
+                    swy += w * y;
+                }
+            }
+        }
+        if (sw <= 0) {
+            return false;
+        }
+        cx = swx / sw;
+        cy = swy / sw;
+    }
+
+    if (flux <= 0) {
+        return false;
+    }
+
+    star->x = cx;
+    star->y = cy;
+    star->flux = flux;
+    /* Shot noise in ADU, as if the gain were one electron per ADU, plus
+     * the sky noise of every pixel in the aperture */
+    star->snr = flux / sqrtf(flux + n * sigma * sigma);
+    star->peak = peak;
+
+    return true;
+}
+
+bool ffmv_find_star(const FFMVImage &img, int x0, int y0, int x1, int y1, int radius, float bg,
+        float sigma, float min_snr, FFMVStar *star)
+{
+    float v, sum, hot, score, best = 0;
+    int x, y, i, j, bx = -1, by = -1;
+
+    x0 = std::max(x0, 1);
+    x1 = std::min(x1, img.width - 2);
+    y0 = std::max(y0, 1);
+    y1 = std::min(y1, img.height - 2);
+
+    /* Score each pixel by its 3x3 neighbourhood less the brightest pixel
+     * in it, which a star has plenty of and a hot pixel has none of */
+    for (y = y0; y <= y1; ++y) {
+        for (x = x0; x <= x1; ++x) {
+            sum = hot = 0;
+            for (j = -1; j <= 1; ++j) {
+                for (i = -1; i <= 1; ++i) {
+                    v = ffmv_image_pixel(img, x + i, y + j);
+                    sum += v;
+                    hot = std::max(hot, v);
+                }
+            }
+            score = sum - hot;
+            if (score > best) {
+                best = score;
+                bx = x;
+                by = y;
+            }
+        }
+    }
+
+    if (bx < 0 || best - 8 * bg < 8 * 3 * sigma) {
+        return false;
+    }
+    if (!ffmv_centroid(img, bx, by, radius, bg, sigma, star)) {
+        return false;
+    }
+
+    return star->snr >= min_snr;
+}
+
+bool ffmv_find_guide_star(const FFMVImage &img, float cx, float cy, int search, int radius,
+        float min_snr, FFMVStar *star, std::vector<float> &scratch)
+{
+    float bg, sigma;
+
+    if (img.width < 3 || img.height < 3) {
+        return false;
+    }
+    ffmv_background(img, &bg, &sigma, scratch);
+
+    if (search <= 0) {
+        return ffmv_find_star(img, 1, 1, img.width - 2, img.height - 2, radius, bg, sigma,
+                min_snr, star);
+    }
+    return ffmv_find_star(img, (int) (cx - search), (int) (cy - search), (int) (cx + search),
+            (int) (cy + search), radius, bg, sigma, min_snr, star);
+}
@@ -0,0 +1,90 @@
+/**
+ * Star finding for the Point Grey FireFly MV driver.
+ *
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef FFMV_STAR_H
+#define FFMV_STAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * A finished frame as the stacker leaves it: native-endian samples of 1, 2
+ * or 4 bytes.
+ */
+struct FFMVImage {
+    const void *pixels;
+    int bytes;
+    int width;
+    int height;
+};
+
+static inline float ffmv_image_pixel(const FFMVImage &img, int x, int y)
+{
+    size_t i = (size_t) y * img.width + x;
+
+    switch (img.bytes) {
+        case 1: return ((const uint8_t *) img.pixels)[i];
+        case 2: return ((const uint16_t *) img.pixels)[i];
+        default: return ((const uint32_t *) img.pixels)[i];
+    }
+}
+
+struct FFMVStar {
+    /* Centroid, in pixels from the top left corner of the frame */
+    float x;
+    float y;
+    /* Background subtracted sum over the aperture, in ADU */
+    float flux;
+    float snr;
+    float peak;
+};
+
+/**
+ * Estimate the sky level and its noise from a sparse grid of samples, as
+ * the median and the scaled median absolute deviation. scratch is reused
+ * between calls.
+ */
+void ffmv_background(const FFMVImage &img, float *bg, float *sigma, std::vector<float> &scratch);
+
+/**
+ * Refine a star near (px, py) to a sub-pixel centroid, with its flux and
+ * signal to noise ratio measured in a circular aperture of the given
+ * radius. Returns false if there is no signal there.
+ */
+bool ffmv_centroid(const FFMVImage &img, int px, int py, int radius, float bg, float sigma,
+        FFMVStar *star);
+
+/**
+ * Find the brightest star in the rectangle from (x0, y0) to (x1, y1)
+ * inclusive, against a known sky level, and centroid it. Single hot pixels
+ * are passed over. Returns false if nothing reaches min_snr.
+ */
+bool ffmv_find_star(const FFMVImage &img, int x0, int y0, int x1, int y1, int radius, float bg,
+        float sigma, float min_snr, FFMVStar *star);
+
+/**
+ * Find the brightest star within search pixels of (cx, cy), or anywhere in
+ * the frame if search <= 0, and centroid it. Single hot pixels are passed
+ * over. Returns false if nothing reaches min_snr.
+ */
+bool ffmv_find_guide_star(const FFMVImage &img, float cx, float cy, int search, int radius,
+        float min_snr, FFMVStar *star, std::vector<float> &scratch);
+
+#endif // FFMV_STAR_H
@@ -0,0 +1,496 @@
+/**
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include <algorithm>
+
+#include "ffmv_stats.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FFMV_STATS_X86
+#include <immintrin.h>
+#endif
+
+/* Pixels per block: the kernels keep their sums in 32 bit lanes, which hold
+ * a block without overflowing */
+const size_t STATS_BLOCK = 4096;
+/* Every this many pixels is sampled for the median */
+const size_t STATS_MEDIAN_STRIDE = 64;
+
+/**
+ * The same for native 8 bit frames. Block sums fit in 32 bits.
+ */
+struct ffmv_stats8 {
+    uint8_t min;
+    uint8_t max;
+    uint32_t sum;
+    uint32_t sumsq;
+    uint32_t saturated;
+};
+
+typedef void (*ffmv_stats8_fn)(uint8_t *dst, const uint8_t *src, size_t n, uint8_t clamp,
+        ffmv_stats8 *b);
+
+static void ffmv_stats8_scalar(uint8_t *dst, const uint8_t *src, size_t n, uint8_t clamp,
+        ffmv_stats8 *b)
+{
+    size_t i;
+    uint8_t v;
+
+    for (i = 0; i < n; ++i) {
+        v = src[i];
+        dst[i] = v;
+        b->min = v < b->min ? v : b->min;
+        b->max = v > b->max ? v : b->max;
+        b->sum += v;
+        b->sumsq += (uint32_t) v * v;
+        b->saturated += v == clamp;
+    }
+}
+
+#ifdef FFMV_STATS_X86
+__attribute__((target("sse2")))
+static void ffmv_stats8_sse2(uint8_t *dst, const uint8_t *src, size_t n, uint8_t clamp,
+        ffmv_stats8 *b)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c = _mm_set1_epi8((char) clamp);
+    __m128i vmin = _mm_set1_epi8((char) 0xFF);
+    __m128i vmax = zero;
+    __m128i sum = zero, sumsq = zero, sat = zero;
+    __m128i v, lo, hi;
+    uint32_t sums[4], sqs[4];
+    uint8_t mins[16], maxs[16];
+    uint32_t sats[4];
+    size_t i;
+    int k;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (src + i));
+        _mm_storeu_si128((__m128i *) (dst + i), v);
+        vmin = _mm_min_epu8(vmin, v);
+        vmax = _mm_max_epu8(vmax, v);
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(v, zero));
+        lo = _mm_unpacklo_epi8(v, zero);
+        hi = _mm_unpackhi_epi8(v, zero);
+        sumsq = _mm_add_epi32(sumsq, _mm_madd_epi16(lo, lo));
+        sumsq = _mm_add_epi32(sumsq, _mm_madd_epi16(hi, hi));
+        /* Matches are 0xFF, so the sum of absolute differences counts them
+         * 255 times */
+        sat = _mm_add_epi64(sat, _mm_sad_epu8(_mm_cmpeq_epi8(v, c), zero));
+    }
+
+    _mm_storeu_si128((__m128i *) sums, sum);
+    _mm_storeu_si128((__m128i *) sqs, sumsq);
+    _mm_storeu_si128((__m128i *) mins, vmin);
+    _mm_storeu_si128((__m128i *) maxs, vmax);
+    _mm_storeu_si128((__m128i *) sats, sat);
+    b->sum += sums[0] + sums[2];
+    b->saturated += (sats[0] + sats[2]) / 255;
+    for (k = 0; k < 4; ++k) {
+        b->sumsq += sqs[k];
+    }
+    for (k = 0; k < 16; ++k) {
+        b->min = std::min(b->min, mins[k]);
+        b->max = std::max(b->max, maxs[k]);
+    }
+    ffmv_stats8_scalar(dst + i, src + i, n - i, clamp, b);
+}
+#endif
+
+static ffmv_stats8_fn ffmv_stats8_select()
+{
+    ffmv_stats8_fn selected = ffmv_stats8_scalar;
+
+#ifdef FFMV_STATS_X86
+    if (__builtin_cpu_supports("sse2")) {
+        selected = ffmv_stats8_sse2;
+    }
+#endif
+
+    return selected;
+}
+
+/**
+ * Statistics of one block of 16 bit pixels, the common case of a MONO16 or
+ * mean stack. The kernels copy and reduce in the same loop and add to b.
+ */
+struct ffmv_stats16 {
+    uint16_t min;
+    uint16_t max;
+    uint64_t sum;
+    uint64_t sumsq;
+    uint32_t saturated;
+};
+
+typedef void (*ffmv_stats16_fn)(uint16_t *dst, const uint16_t *src, size_t n, uint16_t clamp,
+        ffmv_stats16 *b);
+
+static void ffmv_stats16_scalar(uint16_t *dst, const uint16_t *src, size_t n, uint16_t clamp,
+        ffmv_stats16 *b)
+{
+    size_t i;
+    uint16_t v;
+
+    for (i = 0; i < n; ++i) {
+        v = src[i];
+        dst[i] = v;
+        b->min = v < b->min ? v : b->min;
+        b->max = v > b->max ? v : b->max;
+        b->sum += v;
+        b->sumsq += (uint32_t) v * v;
+        b->saturated += v == clamp;
+    }
+}
+
+#ifdef FFMV_STATS_X86
+/**
+ * Fold the lanes of the vector kernels into b. Sums are over the pixels less
+ * 0x8000, so that _mm_madd_epi16() can square and add them as signed
+ * numbers; sum and sumsq are moved back to the unsigned pixels here.
+ */
+static void ffmv_stats16_fold(const int32_t *sum, int nsum, const uint64_t *sumsq, int nsq,
+        const int16_t *min, const int16_t *max, const uint16_t *sat, int nlanes, size_t n,
+        ffmv_stats16 *b)
+{
+    int64_t s = 0;
+    uint64_t q = 0;
+    int i;
+
+    for (i = 0; i < nsum; ++i) {
+        s += sum[i];
+    }
+    for (i = 0; i < nsq; ++i) {
+        q += sumsq[i];
+    }
+    for (i = 0; i < nlanes; ++i) {
+        b->min = std::min(b->min, (uint16_t) (min[i] ^ 0x8000));
+        b->max = std::max(b->max, (uint16_t) (max[i] ^ 0x8000));
+        b->saturated += sat[i];
+    }
+    /* v = s + 0x8000, so v * v = s * s + 0x10000 * s + 0x40000000 */
+    b->sum += s + (int64_t) n * 0x8000;
+    b->sumsq += q + 0x10000 * s + (uint64_t) n * 0x40000000;
+}
+
+__attribute__((target("sse2")))
+static void ffmv_stats16_sse2(uint16_t *dst, const uint16_t *src, size_t n, uint16_t clamp,
+        ffmv_stats16 *b)
+{
+    const __m128i bias = _mm_set1_epi16((short) 0x8000);
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c = _mm_set1_epi16((short) clamp);
+    __m128i vmin = _mm_set1_epi16(0x7FFF);
+    __m128i vmax = _mm_set1_epi16((short) 0x8000);
+    __m128i sum = zero, sumsq = zero, sat = zero;
+    __m128i v, s, q;
+    int32_t sums[4];
+    uint64_t sqs[2];
+    int16_t mins[8], maxs[8];
+    uint16_t sats[8];
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        v = _mm_loadu_si128((const __m128i *) (src + i));
+        _mm_storeu_si128((__m128i *) (dst + i), v);
+        s = _mm_xor_si128(v, bias);
+        vmin = _mm_min_epi16(vmin, s);
+        vmax = _mm_max_epi16(vmax, s);
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(s, ones));
+        /* Each pair of squares fits in 32 bits unsigned */
+        q = _mm_madd_epi16(s, s);
+        sumsq = _mm_add_epi64(sumsq, _mm_unpacklo_epi32(q, zero));
+        sumsq = _mm_add_epi64(sumsq, _mm_unpackhi_epi32(q, zero));
+        sat = _mm_sub_epi16(sat, _mm_cmpeq_epi16(v, c));
+    }
+
+    _mm_storeu_si128((__m128i *) sums, sum);
+    _mm_storeu_si128((__m128i *) sqs, sumsq);
+    _mm_storeu_si128((__m128i *) mins, vmin);
+    _mm_storeu_si128((__m128i *) maxs, vmax);
+    _mm_storeu_si128((__m128i *) sats, sat);
+    ffmv_stats16_fold(sums, 4, sqs, 2, mins, maxs, sats, 8, i, b);
+    ffmv_stats16_scalar(dst + i, src + i, n - i, clamp, b);
+}
+
+__attribute__((target("avx2")))
+static void ffmv_stats16_avx2(uint16_t *dst, const uint16_t *src, size_t n, uint16_t clamp,
+        ffmv_stats16 *b)
+{
+    const __m256i bias = _mm256_set1_epi16((short) 0x8000);
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i c = _mm256_set1_epi16((short) clamp);
+    __m256i vmin = _mm256_set1_epi16(0x7FFF);
+    __m256i vmax = _mm256_set1_epi16((short) 0x8000);
+    __m256i sum = zero, sumsq = zero, sat = zero;
+    __m256i v, s, q;
+    int32_t sums[8];
+    uint64_t sqs[4];
+    int16_t mins[16], maxs[16];
+    uint16_t sats[16];
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = _mm256_loadu_si256((const __m256i *) (src + i));
+        _mm256_storeu_si256((__m256i *) (dst + i), v);
+        s = _mm256_xor_si256(v, bias);
+        vmin = _mm256_min_epi16(vmin, s);
+        vmax = _mm256_max_epi16(vmax, s);
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(s, ones));
+        q = _mm256_madd_epi16(s, s);
+        sumsq = _mm256_add_epi64(sumsq, _mm256_unpacklo_epi32(q, zero));
+        sumsq = _mm256_add_epi64(sumsq, _mm256_unpackhi_epi32(q, zero));
+        sat = _mm256_sub_epi16(sat, _mm256_cmpeq_epi16(v, c));
+    }
+
+    _mm256_storeu_si256((__m256i *) sums, sum);
+    _mm256_storeu_si256((__m256i *) sqs, sumsq);
+    _mm256_storeu_si256((__m256i *) mins, vmin);
+    _mm256_storeu_si256((__m256i *) maxs, vmax);
+    _mm256_storeu_si256((__m256i *) sats, sat);
+    ffmv_stats16_fold(sums, 8, sqs, 4, mins, maxs, sats, 16, i, b);
+    ffmv_stats16_scalar(dst + i, src + i, n - i, clamp, b);
+}
+#endif
+
+static ffmv_stats16_fn ffmv_stats16_select()
+{
+    ffmv_stats16_fn selected = ffmv_stats16_scalar;
+
+#ifdef FFMV_STATS_X86
+    if (__builtin_cpu_supports("avx2")) {
+        selected = ffmv_stats16_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        selected = ffmv_stats16_sse2;
+    }
+#endif
+
+    return selected;
+}
+
+/**
+ * 32 bit sum stacks, whose sums of squares only fit in floating point.
+ */
+struct ffmv_stats32 {
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    double sumsq;
+    uint32_t saturated;
+};
+
+typedef void (*ffmv_stats32_fn)(uint32_t *dst, const uint32_t *src, size_t n, uint32_t clamp,
+        ffmv_stats32 *b);
+
+static void ffmv_stats32_scalar(uint32_t *dst, const uint32_t *src, size_t n, uint32_t clamp,
+        ffmv_stats32 *b)
+{
+    /* Four chains of squares, as floating point adds can't be reordered */
+    double sq[4] = {0, 0, 0, 0};
+    size_t i;
+    uint32_t v;
+    int k;
+
+    memcpy(dst, src, n * sizeof(*dst));
+    for (i = 0; i + 4 <= n; i += 4) {
+        for (k = 0; k < 4; ++k) {
+            v = dst[i + k];
+            b->min = v < b->min ? v : b->min;
+            b->max = v > b->max ? v : b->max;
+            b->sum += v;
+            sq[k] += (double) v * v;
+            b->saturated += v == clamp;
+        }
+    }
+    for (; i < n; ++i) {
+        v = dst[i];
+        b->min = v < b->min ? v : b->min;
+        b->max = v > b->max ? v : b->max;
+        b->sum += v;
+        sq[0] += (double) v * v;
+        b->saturated += v == clamp;
+    }
+    b->sumsq += (sq[0] + sq[1]) + (sq[2] + sq[3]);
+}
+
+#ifdef FFMV_STATS_X86
+/**
+ * Squares are taken exactly in 64 bits and summed as separate high and low
+ * 32 bit halves, which can't overflow a block. Unsigned 32 bit min and max
+ * need AVX2, so there is no SSE2 version.
+ */
+__attribute__((target("avx2")))
+static void ffmv_stats32_avx2(uint32_t *dst, const uint32_t *src, size_t n, uint32_t clamp,
+        ffmv_stats32 *b)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i low = _mm256_set1_epi64x(0xFFFFFFFF);
+    const __m256i c = _mm256_set1_epi32((int) clamp);
+    __m256i vmin = _mm256_set1_epi32(-1);
+    __m256i vmax = zero;
+    __m256i sum = zero, sqhi = zero, sqlo = zero, sat = zero;
+    __m256i v, odd, q;
+    uint64_t sums[4], his[4], los[4];
+    uint32_t mins[8], maxs[8], sats[8];
+    uint64_t hi = 0, lo = 0;
+    size_t i;
+    int k;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        v = _mm256_loadu_si256((const __m256i *) (src + i));
+        _mm256_storeu_si256((__m256i *) (dst + i), v);
+        vmin = _mm256_min_epu32(vmin, v);
+        vmax = _mm256_max_epu32(vmax, v);
+        sum = _mm256_add_epi64(sum, _mm256_unpacklo_epi32(v, zero));
+        sum = _mm256_add_epi64(sum, _mm256_unpackhi_epi32(v, zero));
+        /* Even lanes, then odd ones */
+        q = _mm256_mul_epu32(v, v);
+        sqhi = _mm256_add_epi64(sqhi, _mm256_srli_epi64(q, 32));
+        sqlo = _mm256_add_epi64(sqlo, _mm256_and_si256(q, low));
+        odd = _mm256_srli_epi64(v, 32);
+        q = _mm256_mul_epu32(odd, odd);
+        sqhi = _mm256_add_epi64(sqhi, _mm256_srli_epi64(q, 32));
+        sqlo = _mm256_add_epi64(sqlo, _mm256_and_si256(q, low));
+        sat = _mm256_sub_epi32(sat, _mm256_cmpeq_epi32(v, c));
+    }
+
+    _mm256_storeu_si256((__m256i *) sums, sum);
+    _mm256_storeu_si256((__m256i *) his, sqhi);
+    _mm256_storeu_si256((__m256i *) los, sqlo);
+    _mm256_storeu_si256((__m256i *) mins, vmin);
+    _mm256_storeu_si256((__m256i *) maxs, vmax);
+    _mm256_storeu_si256((__m256i *) sats, sat);
+    for (k = 0; k < 4; ++k) {
+        b->sum += sums[k];
+        hi += his[k];
+        lo += los[k];
+    }
+    for (k = 0; k < 8; ++k) {
+        b->min = std::min(b->min, mins[k]);
+        b->max = std::max(b->max, maxs[k]);
+        b->saturated += sats[k];
+    }
+    b->sumsq += hi * 4294967296.0 + lo;
+    ffmv_stats32_scalar(dst + i, src + i, n - i, clamp, b);
+}
+#endif
+
+static ffmv_stats32_fn ffmv_stats32_select()
+{
+    ffmv_stats32_fn selected = ffmv_stats32_scalar;
+
+#ifdef FFMV_STATS_X86
+    if (__builtin_cpu_supports("avx2")) {
+        selected = ffmv_stats32_avx2;
+    }
+#endif
+
+    return selected;
+}
+
+/**
+ * Run kernel over n pixels a block at a time, sample the median from each
+ * block while it is still in cache, and total the blocks up.
+ */
+template <typename T, typename B>
+static void ffmv_copy_stats_blocks(T *dst, const T *src, size_t n, T clamp,
+        void (*kernel)(T *, const T *, size_t, T, B *), FFMVStats *stats,
+        std::vector<uint32_t> &scratch)
+{
+    double sum = 0, sumsq = 0, var;
+    T lo = (T) ~0, hi = 0;
+    unsigned long saturated = 0;
+    size_t i, j, m;
+    B b;
+
+    memset(stats, 0, sizeof(*stats));
+    scratch.clear();
+    if (!n) {
+        return;
+    }
+
+    for (i = 0; i < n; i += m) {
+        m = std::min(STATS_BLOCK, n - i);
+        b.min = (T) ~0;
+        b.max = 0;
+        b.sum = 0;
+        b.sumsq = 0;
+        b.saturated = 0;
+        kernel(dst + i, src + i, m, clamp, &b);
+        lo = std::min(lo, b.min);
+        hi = std::max(hi, b.max);
+        sum += b.sum;
+        sumsq += b.sumsq;
+        saturated += b.saturated;
+        for (j = 0; j < m; j += STATS_MEDIAN_STRIDE) {
+            scratch.push_back(dst[i + j]);
+        }
+    }
+
+    stats->min = lo;
+    stats->max = hi;
+    stats->mean = sum / n;
+    var = sumsq / n - stats->mean * stats->mean;
+    stats->stddev = var > 0 ? sqrt(var) : 0;
+    stats->saturated = saturated;
+
+    std::nth_element(scratch.begin(), scratch.begin() + scratch.size() / 2, scratch.end());
+    stats->median = scratch[scratch.size() / 2];
+}
+
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static ffmv_stats8_fn stats8;
+static ffmv_stats16_fn stats16;
+static ffmv_stats32_fn stats32;
+
+/**
+ * Pick the kernels once; ffmv_copy_stats() is called from every pool band.
+ */
+static void ffmv_stats_init()
+{
+#ifdef FFMV_STATS_X86
+    __builtin_cpu_init();
+#endif
+    stats8 = ffmv_stats8_select();
+    stats16 = ffmv_stats16_select();
+    stats32 = ffmv_stats32_select();
+}
+
+void ffmv_copy_stats(void *dst, const void *src, size_t n, int bytes, uint32_t clamp,
+        FFMVStats *stats, std::vector<uint32_t> &scratch)
+{
+    pthread_once(&stats_once, ffmv_stats_init);
+    switch (bytes) {
+        case 1:
+            ffmv_copy_stats_blocks((uint8_t *) dst, (const uint8_t *) src, n, (uint8_t) clamp,
+                    stats8, stats, scratch);
+            break;
+        case 2:
+            ffmv_copy_stats_blocks((uint16_t *) dst, (const uint16_t *) src, n,
+                    (uint16_t) clamp, stats16, stats, scratch);
+            break;
+        default:
+            ffmv_copy_stats_blocks((uint32_t *) dst, (const uint32_t *) src, n, clamp,
+                    stats32, stats, scratch);
+            break;
+    }
+}
@@ -0,0 +1,47 @@
+/**
+ * Frame statistics for the Point Grey FireFly MV driver.
+ *
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef FFMV_STATS_H
+#define FFMV_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+struct FFMVStats {
+    uint32_t min;
+    uint32_t max;
+    double mean;
+    double stddev;
+    /* From a sparse sample of the pixels */
+    double median;
+    /* Pixels at the clamp value */
+    unsigned long saturated;
+};
+
+/**
+ * Copy n pixels of the given size (1, 2 or 4 bytes, native-endian) from src
+ * to dst and gather their statistics on the way, a block at a time so each
+ * block is only read from memory once. Pixels equal to clamp count as
+ * saturated. scratch holds the median samples and is reused between calls.
+ */
+void ffmv_copy_stats(void *dst, const void *src, size_t n, int bytes, uint32_t clamp,
+        FFMVStats *stats, std::vector<uint32_t> &scratch);
+
+#endif // FFMV_STATS_H
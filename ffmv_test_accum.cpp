@@ -0,0 +1,239 @@
+/**
+ * Accumulation kernel tests for the Point Grey FireFly MV driver.
+ *
+ * Checks every vectorized accumulation kernel the running CPU supports bit
+ * for bit against the scalar reference, and the binned and 32 bit stacking
+ * paths against a straightforward per pixel sum. Exits non-zero if anything
+ * disagrees. Needs neither INDI nor a camera.
+ *
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "ffmv_accum.h"
+
+/* Lengths around every vector width, so that the scalar tails get exercised */
+const size_t TEST_LENGTHS[] = { 0, 1, 2, 3, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 263, 4099 };
+const int TEST_ROUNDS = 8;
+/* Sub sizes that do not divide evenly by any of the bins */
+const int TEST_WIDTH = 37;
+const int TEST_HEIGHT = 23;
+const int TEST_MAX_BIN = 5;
+
+static uint32_t seed = 0x2468ace;
+
+static uint32_t test_rand()
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+/**
+ * A random 16 bit value, a third of them within a few counts of saturation.
+ */
+static uint16_t test_value16()
+{
+    switch (test_rand() % 6) {
+        case 0: return 0xFFFF - test_rand() % 4;
+        case 1: return 0xFFC0 - test_rand() % 0x80;
+        default: return test_rand();
+    }
+}
+
+static uint8_t test_value8()
+{
+    switch (test_rand() % 6) {
+        case 0: return 0xFF - test_rand() % 4;
+        case 1: return 0xC0 + test_rand() % 0x40;
+        default: return test_rand();
+    }
+}
+
+/**
+ * Big-endian MONO16 as the camera sends it: the top 10 bits, except for
+ * the odd fully set pixel.
+ */
+static void test_sub16(std::vector<uint16_t> &src)
+{
+    size_t i;
+
+    for (i = 0; i < src.size(); ++i) {
+        src[i] = htons(test_rand() % 8 ? test_value16() & 0xFFC0 : 0xFFFF);
+    }
+}
+
+static void test_sub8(std::vector<uint8_t> &src)
+{
+    size_t i;
+
+    for (i = 0; i < src.size(); ++i) {
+        src[i] = test_value8();
+    }
+}
+
+static int test_kernel(const struct ffmv_accum_kernel *kernel)
+{
+    std::vector<uint16_t> src, ref, out;
+    std::vector<uint8_t> src8, ref8, out8;
+    size_t n, i;
+    int failures = 0;
+    int l, r;
+
+    for (l = 0; l < (int) (sizeof(TEST_LENGTHS) / sizeof(TEST_LENGTHS[0])); ++l) {
+        n = TEST_LENGTHS[l];
+        /* One past the end, to catch kernels that write beyond n */
+        src.resize(n + 1);
+        ref.resize(n + 1);
+        src8.resize(n + 1);
+        ref8.resize(n + 1);
+        for (r = 0; r < TEST_ROUNDS; ++r) {
+            test_sub16(src);
+            test_sub8(src8);
+            for (i = 0; i <= n; ++i) {
+                ref[i] = test_value16();
+                ref8[i] = test_value8();
+            }
+            out = ref;
+            out8 = ref8;
+
+            ffmv_accum_scalar(&ref[0], &src[0], n);
+            kernel->accum(&out[0], &src[0], n);
+            if (ref != out) {
+                fprintf(stderr, "%s: mono16 mismatch at length %zu\n", kernel->name, n);
+                ++failures;
+            }
+
+            ffmv_accum8_scalar(&ref8[0], &src8[0], n);
+            kernel->accum8(&out8[0], &src8[0], n);
+            if (ref8 != out8) {
+                fprintf(stderr, "%s: mono8 mismatch at length %zu\n", kernel->name, n);
+                ++failures;
+            }
+        }
+    }
+
+    return failures;
+}
+
+/**
+ * Sum of the binx x biny block at (x, y) of the binned sub.
+ */
+template <class Pixel>
+static uint32_t test_bin(const std::vector<typename Pixel::sample> &src, int x, int y, int binx,
+        int biny)
+{
+    uint32_t sum = 0;
+    int i, j;
+
+    for (j = 0; j < biny; ++j) {
+        for (i = 0; i < binx; ++i) {
+            sum += Pixel::load(src[(size_t) (y * biny + j) * TEST_WIDTH + x * binx + i]);
+        }
+    }
+
+    return sum;
+}
+
+template <class Pixel>
+static int test_binned(const char *name, const std::vector<typename Pixel::sample> &src,
+        int binx, int biny)
+{
+    int out_w = TEST_WIDTH / binx;
+    int out_h = TEST_HEIGHT / biny;
+    std::vector<typename Pixel::sample> ref(out_w * out_h), out;
+    std::vector<uint32_t> ref32(out_w * out_h), out32;
+    std::vector<uint32_t> rowsum(out_w);
+    uint32_t s, val;
+    int failures = 0;
+    int x, y;
+
+    for (y = 0; y < out_h * out_w; ++y) {
+        ref[y] = Pixel::max - test_rand() % (Pixel::max / 4);
+        ref32[y] = test_rand() % 2 ? 0xFFFFFFFF - test_rand() % 0x40000 : test_rand();
+    }
+    out = ref;
+    out32 = ref32;
+
+    for (y = 0; y < out_h; ++y) {
+        for (x = 0; x < out_w; ++x) {
+            s = test_bin<Pixel>(src, x, y, binx, biny);
+            val = ref[y * out_w + x] + s;
+            ref[y * out_w + x] = val > Pixel::max ? Pixel::max : val;
+            val = ref32[y * out_w + x] + s;
+            ref32[y * out_w + x] = val < s ? 0xFFFFFFFF : val;
+        }
+    }
+
+    ffmv_accum_frame(sizeof(typename Pixel::sample) == 1 ? FFMV_MONO8 : FFMV_MONO16, &out[0],
+            &src[0], TEST_WIDTH, TEST_HEIGHT, binx, biny, &rowsum[0]);
+    if (ref != out) {
+        fprintf(stderr, "%s: binned %dx%d mismatch\n", name, binx, biny);
+        ++failures;
+    }
+
+    ffmv_accum_frame32(sizeof(typename Pixel::sample) == 1 ? FFMV_MONO8 : FFMV_MONO16, &out32[0],
+            &src[0], TEST_WIDTH, TEST_HEIGHT, binx, biny, &rowsum[0]);
+    if (ref32 != out32) {
+        fprintf(stderr, "%s: 32 bit binned %dx%d mismatch\n", name, binx, biny);
+        ++failures;
+    }
+
+    return failures;
+}
+
+int main()
+{
+    const struct ffmv_accum_kernel *kernels[FFMV_ACCUM_MAX_KERNELS];
+    struct ffmv_accum_kernel selected = *ffmv_accum_select();
+    std::vector<uint16_t> src((size_t) TEST_WIDTH * TEST_HEIGHT);
+    std::vector<uint8_t> src8((size_t) TEST_WIDTH * TEST_HEIGHT);
+    int nkernels = ffmv_accum_kernels(kernels);
+    int failures = 0;
+    int i, binx, biny;
+
+    for (i = 0; i < nkernels; ++i) {
+        printf("checking %s\n", kernels[i]->name);
+        failures += test_kernel(kernels[i]);
+    }
+
+    printf("checking selected (%s)\n", selected.name);
+    selected.name = "selected";
+    failures += test_kernel(&selected);
+
+    printf("checking binned stacks\n");
+    for (binx = 1; binx <= TEST_MAX_BIN; ++binx) {
+        for (biny = 1; biny <= TEST_MAX_BIN; ++biny) {
+            for (i = 0; i < TEST_ROUNDS; ++i) {
+                test_sub16(src);
+                test_sub8(src8);
+                failures += test_binned<ffmv_mono16>("mono16", src, binx, biny);
+                failures += test_binned<ffmv_mono8>("mono8", src8, binx, biny);
+            }
+        }
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d failures\n", failures);
+        return 1;
+    }
+    printf("all kernels match the scalar reference\n");
+
+    return 0;
+}
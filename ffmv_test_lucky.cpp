@@ -0,0 +1,123 @@
+/**
+ * Lucky imaging kernel tests for the Point Grey FireFly MV driver.
+ *
+ * Checks every vectorized sharpness scoring kernel the running CPU supports
+ * against the scalar reference, over row widths around the vector width and
+ * pixels near saturation. Exits non-zero if any sum disagrees. Needs neither
+ * INDI nor a camera.
+ *
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <vector>
+
+#include "ffmv_lucky.h"
+
+/* Every width up to a few vectors, then full sensor rows */
+const int TEST_MAX_NARROW = 40;
+const int TEST_WIDE[] = { 640, 752, 753 };
+const int TEST_ROUNDS = 16;
+
+static uint32_t seed = 0x13579bd;
+
+static uint32_t test_rand()
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+/**
+ * Three rows of w pixels, a third of them at or near the top of the range,
+ * so that the Laplacian reaches its extremes.
+ */
+static void test_rows(enum ffmv_pixel_format fmt, std::vector<uint8_t> &rows, int w)
+{
+    uint16_t *p16 = (uint16_t *) &rows[0];
+    uint32_t v;
+    int i;
+
+    for (i = 0; i < 3 * w; ++i) {
+        switch (test_rand() % 6) {
+            case 0: v = 0xFFFF; break;
+            case 1: v = 0; break;
+            default: v = test_rand(); break;
+        }
+        if (fmt == FFMV_MONO8) {
+            rows[i] = v >> 8;
+        } else {
+            p16[i] = htons(v);
+        }
+    }
+}
+
+static int test_kernel(const struct ffmv_lucky_kernel *kernel, enum ffmv_pixel_format fmt, int w)
+{
+    int bytes = ffmv_pixel_bytes(fmt);
+    std::vector<uint8_t> rows((size_t) 3 * w * bytes);
+    ffmv_lucky_sums ref, out;
+    ffmv_lucky_row_fn ref_fn = fmt == FFMV_MONO8 ? ffmv_lucky_scalar.row8 : ffmv_lucky_scalar.row16;
+    ffmv_lucky_row_fn fn = fmt == FFMV_MONO8 ? kernel->row8 : kernel->row16;
+    const uint8_t *base = &rows[0];
+    int failures = 0;
+    int r;
+
+    for (r = 0; r < TEST_ROUNDS; ++r) {
+        test_rows(fmt, rows, w);
+        /* Start from something, as a band does after its first row */
+        ref.sum = out.sum = -12345;
+        ref.sumsq = out.sumsq = 67890;
+        ref.peak = out.peak = r;
+
+        ref_fn(base, base + w * bytes, base + 2 * w * bytes, w, &ref);
+        fn(base, base + w * bytes, base + 2 * w * bytes, w, &out);
+        if (ref.sum != out.sum || ref.sumsq != out.sumsq || ref.peak != out.peak) {
+            fprintf(stderr, "%s: mono%d mismatch at width %d\n", kernel->name, bytes * 8, w);
+            ++failures;
+        }
+    }
+
+    return failures;
+}
+
+int main()
+{
+    const struct ffmv_lucky_kernel *kernels[FFMV_LUCKY_MAX_KERNELS];
+    int nkernels = ffmv_lucky_kernels(kernels);
+    int failures = 0;
+    int i, w;
+
+    for (i = 0; i < nkernels; ++i) {
+        printf("checking %s\n", kernels[i]->name);
+        for (w = 3; w <= TEST_MAX_NARROW; ++w) {
+            failures += test_kernel(kernels[i], FFMV_MONO16, w);
+            failures += test_kernel(kernels[i], FFMV_MONO8, w);
+        }
+        for (w = 0; w < (int) (sizeof(TEST_WIDE) / sizeof(TEST_WIDE[0])); ++w) {
+            failures += test_kernel(kernels[i], FFMV_MONO16, TEST_WIDE[w]);
+            failures += test_kernel(kernels[i], FFMV_MONO8, TEST_WIDE[w]);
+        }
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d failures\n", failures);
+        return 1;
+    }
+    printf("all kernels match the scalar reference\n");
+
+    return 0;
+}
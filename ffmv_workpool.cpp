@@ -0,0 +1,195 @@
+/**
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ffmv_workpool.h"
+
+int ffmv_cpu_count()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? n : 1;
+}
+
+bool ffmv_pin_thread(pthread_t thread, int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0) {
+        return true;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu % ffmv_cpu_count(), &set);
+
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+FFMVWorkPool::FFMVWorkPool(int nthreads, int first_cpu)
+{
+    int i;
+
+    if (nthreads <= 0) {
+        nthreads = ffmv_cpu_count();
+    }
+
+    quit = false;
+    generation = 0;
+    fn = NULL;
+    ctx = NULL;
+    ntasks = next = remaining = 0;
+    pthread_mutex_init(&lock, NULL);
+    pthread_mutex_init(&run_lock, NULL);
+    pthread_cond_init(&start_cond, NULL);
+    pthread_cond_init(&done_cond, NULL);
+
+    /* The thread calling run() is one of the workers */
+    nworkers = 0;
+    workers = (pthread_t *) calloc(nthreads - 1 > 0 ? nthreads - 1 : 1, sizeof(pthread_t));
+    for (i = 0; workers && i < nthreads - 1; ++i) {
+        if (pthread_create(&workers[i], NULL, threadEntry, this)) {
+            break;
+        }
+        if (first_cpu >= 0) {
+            ffmv_pin_thread(workers[i], first_cpu + 1 + i);
+        }
+        ++nworkers;
+    }
+}
+
+FFMVWorkPool::~FFMVWorkPool()
+{
+    int i;
+
+    pthread_mutex_lock(&lock);
+    quit = true;
+    pthread_cond_broadcast(&start_cond);
+    pthread_mutex_unlock(&lock);
+
+    for (i = 0; i < nworkers; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    pthread_cond_destroy(&done_cond);
+    pthread_cond_destroy(&start_cond);
+    pthread_mutex_destroy(&run_lock);
+    pthread_mutex_destroy(&lock);
+}
+
+/**
+ * Run fn(ctx, 0) ... fn(ctx, ntasks - 1) across the pool and wait for all of
+ * them to finish.
+ */
+void FFMVWorkPool::run(int ntasks, ffmv_task_fn fn, void *ctx)
+{
+    int task;
+
+    if (ntasks <= 0) {
+        return;
+    }
+    if (!nworkers || ntasks == 1) {
+        for (task = 0; task < ntasks; ++task) {
+            fn(ctx, task);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&run_lock);
+
+    pthread_mutex_lock(&lock);
+    this->fn = fn;
+    this->ctx = ctx;
+    this->ntasks = ntasks;
+    next = 0;
+    remaining = ntasks;
+    ++generation;
+    pthread_cond_broadcast(&start_cond);
+    pthread_mutex_unlock(&lock);
+
+    work();
+
+    pthread_mutex_lock(&lock);
+    while (remaining) {
+        pthread_cond_wait(&done_cond, &lock);
+    }
+    this->fn = NULL;
+    pthread_mutex_unlock(&lock);
+
+    pthread_mutex_unlock(&run_lock);
+}
+
+bool FFMVWorkPool::nextTask(int *task)
+{
+    bool ok;
+
+    pthread_mutex_lock(&lock);
+    ok = fn && next < ntasks;
+    if (ok) {
+        *task = next++;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return ok;
+}
+
+/**
+ * Take tasks from the current batch until there are none left.
+ */
+void FFMVWorkPool::work()
+{
+    int task;
+
+    while (nextTask(&task)) {
+        fn(ctx, task);
+
+        pthread_mutex_lock(&lock);
+        if (--remaining == 0) {
+            pthread_cond_broadcast(&done_cond);
+        }
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+void *FFMVWorkPool::threadEntry(void *arg)
+{
+    FFMVWorkPool *pool = (FFMVWorkPool *) arg;
+    unsigned int seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->quit && pool->generation == seen) {
+            pthread_cond_wait(&pool->start_cond, &pool->lock);
+        }
+        if (pool->quit) {
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->work();
+
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
@@ -0,0 +1,75 @@
+/**
+ * Worker pool for the Point Grey FireFly MV driver.
+ *
+ * Copyright (C) 2013 Ben Gilsrud
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef FFMV_WORKPOOL_H
+#define FFMV_WORKPOOL_H
+
+#include <pthread.h>
+
+typedef void (*ffmv_task_fn)(void *ctx, int task);
+
+/* Number of online CPUs, at least 1 */
+int ffmv_cpu_count();
+/* Restrict a thread to one CPU. Does nothing if cpu < 0. */
+bool ffmv_pin_thread(pthread_t thread, int cpu);
+
+/**
+ * A fixed set of threads that run a batch of independent tasks, e.g. one per
+ * row band of a frame. run() hands out tasks until the batch is exhausted;
+ * the calling thread works on the batch too and returns once every task is
+ * done. Only one batch runs at a time.
+ */
+class FFMVWorkPool
+{
+public:
+    /* nthreads <= 0 means one thread per online CPU. If first_cpu >= 0, the
+     * workers are pinned to the CPUs after it, leaving first_cpu for the
+     * thread that calls run(). */
+    explicit FFMVWorkPool(int nthreads = 0, int first_cpu = -1);
+    ~FFMVWorkPool();
+
+    /* Threads that run tasks, including the caller of run() */
+    int size() const { return nworkers + 1; }
+
+    void run(int ntasks, ffmv_task_fn fn, void *ctx);
+
+private:
+    static void *threadEntry(void *arg);
+    void work();
+    bool nextTask(int *task);
+
+    pthread_t *workers;
+    int nworkers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    pthread_mutex_t run_lock;
+
+    /* Protected by lock */
+    bool quit;
+    unsigned int generation;
+    ffmv_task_fn fn;
+    void *ctx;
+    int ntasks;
+    int next;
+    int remaining;
+};
+
+#endif // FFMV_WORKPOOL_H